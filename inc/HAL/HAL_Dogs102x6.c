@@ -42,6 +42,8 @@
 #include "msp430.h"
 #include "in430.h"
 #include "HAL_Dogs102x6.h"
+#include "HAL_SPIBus.h"
+#include <stdio.h>
 
 // Macros
 #ifndef abs
@@ -225,6 +227,10 @@ uint8_t backlight  = 8;
 uint8_t contrast = 0x0F;
 uint8_t drawmode = DOGS102x6_DRAW_IMMEDIATE;
 
+// Bit n is set when page n of the frame buffer has been changed since it was
+// last sent to the LCD (DOGS102x6_DRAW_ON_REFRESH mode only)
+static volatile uint8_t dirtyPages = 0;
+
 // Dog102-6 Initialization Commands
 uint8_t Dogs102x6_initMacro[] = {
     SET_SCROLL_LINE,
@@ -438,7 +444,13 @@ void Dogs102x6_writeData(uint8_t *sData, uint8_t i)
     {
       while (i)
       {
-          dogs102x6Memory[2 + (currentPage * 102) + currentColumn] = (uint8_t)*sData++;
+          // Only mark the page dirty if the LCD would actually change
+          if (dogs102x6Memory[2 + (currentPage * 102) + currentColumn] != *sData)
+          {
+              dogs102x6Memory[2 + (currentPage * 102) + currentColumn] = (uint8_t)*sData;
+              dirtyPages |= 1 << currentPage;
+          }
+          sData++;
           currentColumn++;
   
           // Boundary check
@@ -1442,6 +1454,56 @@ void Dogs102x6_refresh(uint8_t mode)
   Dogs102x6_imageDraw(dogs102x6Memory, 0, 0);
   //drawmode = savedmode;
   drawmode = mode;
+  dirtyPages = 0;
+}
+
+/***************************************************************************//**
+ * @brief   Sends the next changed page of the frame buffer to the LCD, when
+ *          drawing in DOGS102x6_DRAW_ON_REFRESH mode. Only one page is sent
+ *          per call so that the caller can keep each use of the SPI bus
+ *          short, and nothing is sent unless the SPI bus is free.
+ * @param   None
+ * @return  The pages which are still to be sent (bit n for page n)
+ ******************************************************************************/
+
+uint8_t Dogs102x6_flush(void)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    uint8_t p, mode;
+
+    if (!dirtyPages || !SPIBus_acquire(SPIBUS_LCD))
+    {
+        return dirtyPages;
+    }
+
+    for (p = 0; !(dirtyPages & (1 << p)); p++) ;
+
+    // Clear the flag first, so a page redrawn whilst it is being sent is sent
+    // again next time
+    __disable_interrupt();
+    dirtyPages &= ~(1 << p);
+    __bis_SR_register(gie);
+
+    mode = drawmode;
+    drawmode = DOGS102x6_DRAW_IMMEDIATE;
+    Dogs102x6_setAddress(p, 0);
+    Dogs102x6_writeData(dogs102x6Memory + 2 + p * 102, 102);
+    drawmode = mode;
+
+    SPIBus_release(SPIBUS_LCD);
+    return dirtyPages;
+}
+
+/***************************************************************************//**
+ * @brief   Gets the pages of the frame buffer which have been changed but not
+ *          yet sent to the LCD
+ * @param   None
+ * @return  The changed pages (bit n for page n)
+ ******************************************************************************/
+
+uint8_t Dogs102x6_dirty(void)
+{
+    return dirtyPages;
 }
 
 /************************************************************************
@@ -1455,8 +1517,24 @@ void Dogs102x6_refresh(uint8_t mode)
  */
 void lcd_debug(char *s)
 {
-    Dogs102x6_clearRow(7);
-    Dogs102x6_stringDraw(7, 0, s, DOGS102x6_DRAW_NORMAL);
+    lcd_row(7, s);
+}
+
+/**
+ * Replace the contents of a row of the LCD with a string, padded with spaces
+ * to the full width of the screen. Unlike clearing the row and drawing the
+ * string, this leaves the row unchanged (so not dirty, see Dogs102x6_flush())
+ * if it already showed the same string.
+ * \param row The row to draw on (0~7)
+ * \param s A pointer to the string (no longer than 17 chars)
+ * \return None
+ */
+void lcd_row(uint8_t row, char *s)
+{
+    char line[18];
+
+    sprintf(line, "%-17.17s", s);
+    Dogs102x6_stringDraw(row, 0, line, DOGS102x6_DRAW_NORMAL);
 }
 
 /***************************************************************************//**
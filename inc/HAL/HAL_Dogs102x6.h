@@ -82,8 +82,11 @@ extern void Dogs102x6_lineDraw(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2, u
 extern void Dogs102x6_circleDraw(uint8_t x, uint8_t y, uint8_t radius, uint8_t style);
 extern void Dogs102x6_imageDraw(const uint8_t IMAGE[], uint8_t row, uint8_t col);
 extern void Dogs102x6_clearImage(uint8_t height, uint8_t width, uint8_t row, uint8_t col);
+extern uint8_t Dogs102x6_flush(void);
+extern uint8_t Dogs102x6_dirty(void);
 
 // Custom things for EV logger
 void lcd_debug(char *s);
+void lcd_row(uint8_t row, char *s);
 
 #endif /* HAL_DOGS102x6_H */
@@ -42,6 +42,7 @@
 #include "msp430.h"
 #include <in430.h>
 #include "HAL_SDCard.h"
+#include "HAL_SPIBus.h"
 
 // Pins from MSP430 connected to the SD Card
 #define SPI_SIMO        BIT1
@@ -58,6 +59,21 @@
 #define SD_CS_OUT       P3OUT
 #define SD_CS_DIR       P3DIR
 
+// DMA channels used for SD Card transfers (DMA0 is used by the ADC). RX is
+// given the higher priority channel so that a received byte is always moved
+// out of UCB1RXBUF before the next one arrives.
+#define SD_DMA_RX_CTL   DMA1CTL
+#define SD_DMA_RX_SA    DMA1SA
+#define SD_DMA_RX_DA    DMA1DA
+#define SD_DMA_RX_SZ    DMA1SZ
+#define SD_DMA_TX_CTL   DMA2CTL
+#define SD_DMA_TX_SA    DMA2SA
+#define SD_DMA_TX_DA    DMA2DA
+#define SD_DMA_TX_SZ    DMA2SZ
+
+// Dummy byte clocked out while receiving a frame via DMA
+static const uint8_t dmaDummy = 0xff;
+
 /***************************************************************************//**
  * @brief   Initialize SD Card
  * @param   None
@@ -86,6 +102,10 @@ void SDCard_init(void)
     UCB1BR1 = 0;                                           // f_UCxCLK = 25MHz/63 = 397kHz
     UCB1CTL1 &= ~UCSWRST;                                  // Release USCI state machine
     UCB1IFG &= ~UCRXIFG;
+
+    // Trigger the RX channel from UCB1RXIFG and the TX channel from UCB1TXIFG
+    DMACTL0 = (DMACTL0 & ~DMA1TSEL_31) | DMA1TSEL_22;
+    DMACTL1 = (DMACTL1 & ~DMA2TSEL_31) | DMA2TSEL_23;
 }
 
 /***************************************************************************//**
@@ -160,7 +180,115 @@ void SDCard_sendFrame(uint8_t *pBuffer, uint16_t size)
 }
 
 /***************************************************************************//**
- * @brief   Set the SD Card's chip-select signal to high
+ * @brief   Start sending a frame of bytes via SPI using DMA. This function
+ *          returns as soon as the transfer has been started, interrupts stay
+ *          enabled while the frame is on the wire. Call SDCard_waitDMA()
+ *          before touching the SPI bus again.
+ * @param   pBuffer Place that holds the bytes to send, must remain valid
+ *          until the transfer has completed
+ * @param   size Indicator of how many bytes to send
+ * @return  None
+ ******************************************************************************/
+
+void SDCard_sendFrameDMA(uint8_t *pBuffer, uint16_t size)
+{
+    // Single transfers of bytes from the buffer into the (fixed) TX buffer,
+    // interrupt on completion so that a waiting CPU can be woken up
+    SD_DMA_TX_CTL = DMADT_0 + DMASRCINCR_3 + DMASRCBYTE + DMADSTBYTE + DMAIE;
+    SD_DMA_TX_SA = (uintptr_t)pBuffer;
+    SD_DMA_TX_DA = (uintptr_t)&UCB1TXBUF;
+    SD_DMA_TX_SZ = size;
+    SD_DMA_TX_CTL |= DMAEN;
+
+    // The DMA is triggered by a rising edge of UCTXIFG, which is already set
+    // since the USCI is idle, so toggle it to get the transfer going. As with
+    // SDCard_sendFrame() we don't read out the RX buffer during the frame,
+    // SDCard_waitDMA() clears the resulting overrun condition.
+    UCB1IFG &= ~UCTXIFG;
+    UCB1IFG |= UCTXIFG;
+}
+
+/***************************************************************************//**
+ * @brief   Start reading a frame of bytes via SPI using DMA. One channel
+ *          clocks out dummy bytes while the other moves the received bytes
+ *          into the buffer. This function returns as soon as the transfer has
+ *          been started, call SDCard_waitDMA() before using the data.
+ * @param   pBuffer Place to store the received bytes
+ * @param   size Indicator of how many bytes to receive
+ * @return  None
+ ******************************************************************************/
+
+void SDCard_readFrameDMA(uint8_t *pBuffer, uint16_t size)
+{
+    // RX: bytes from the (fixed) RX buffer into the incrementing buffer. The
+    // RX channel finishes last so it is the one that interrupts.
+    SD_DMA_RX_CTL = DMADT_0 + DMADSTINCR_3 + DMASRCBYTE + DMADSTBYTE + DMAIE;
+    SD_DMA_RX_SA = (uintptr_t)&UCB1RXBUF;
+    SD_DMA_RX_DA = (uintptr_t)pBuffer;
+    SD_DMA_RX_SZ = size;
+
+    // TX: the same dummy byte over and over
+    SD_DMA_TX_CTL = DMADT_0 + DMASRCBYTE + DMADSTBYTE;
+    SD_DMA_TX_SA = (uintptr_t)&dmaDummy;
+    SD_DMA_TX_DA = (uintptr_t)&UCB1TXBUF;
+    SD_DMA_TX_SZ = size;
+
+    UCB1RXBUF;                                             // Ensure RXIFG is clear
+    SD_DMA_RX_CTL |= DMAEN;
+    SD_DMA_TX_CTL |= DMAEN;
+
+    // Toggle UCTXIFG to generate the first TX trigger
+    UCB1IFG &= ~UCTXIFG;
+    UCB1IFG |= UCTXIFG;
+}
+
+/***************************************************************************//**
+ * @brief   Check whether a DMA frame transfer is still in progress
+ * @param   None
+ * @return  Non-zero while either SD Card DMA channel is still enabled
+ ******************************************************************************/
+
+uint8_t SDCard_busyDMA(void)
+{
+    // DMAEN is cleared by hardware once DMAxSZ reaches zero
+    return ((SD_DMA_RX_CTL | SD_DMA_TX_CTL) & DMAEN) ? 1 : 0;
+}
+
+/***************************************************************************//**
+ * @brief   Wait for a DMA frame transfer started by SDCard_sendFrameDMA() or
+ *          SDCard_readFrameDMA() to complete. If interrupts are enabled the
+ *          CPU sleeps in LPM0 until the DMA interrupt wakes it, otherwise it
+ *          polls the channels.
+ * @param   None
+ * @return  None
+ ******************************************************************************/
+
+void SDCard_waitDMA(void)
+{
+    uint16_t gie = __read_status_register() & GIE;              // Store current GIE state
+
+    __disable_interrupt();
+    while (SDCard_busyDMA())
+    {
+        if (gie)
+        {
+            // Enter LPM0 and enable interrupts in a single instruction so
+            // that the completion interrupt cannot be missed
+            __bis_SR_register(LPM0_bits + GIE);
+            __disable_interrupt();
+        }
+    }
+    __bis_SR_register(gie);                                // Restore original GIE state
+
+    while (UCB1STAT & UCBUSY) ;                            // Wait for all TX/RX to finish
+
+    UCB1RXBUF;                                             // Dummy read to empty RX buffer
+                                                           // and clear any overrun conditions
+}
+
+/***************************************************************************//**
+ * @brief   Set the SD Card's chip-select signal to high, releasing the shared
+ *          SPI bus
  * @param   None
  * @return  None
  ******************************************************************************/
@@ -168,16 +296,20 @@ void SDCard_sendFrame(uint8_t *pBuffer, uint16_t size)
 void SDCard_setCSHigh(void)
 {
     SD_CS_OUT |= SD_CS;
+    SPIBus_release(SPIBUS_SD);
 }
 
 /***************************************************************************//**
- * @brief   Set the SD Card's chip-select signal to low
+ * @brief   Set the SD Card's chip-select signal to low, acquiring the shared
+ *          SPI bus. The card is only driven from the foreground, where the
+ *          LCD never holds the bus, so the card always gets it.
  * @param   None
  * @return  None
  ******************************************************************************/
 
 void SDCard_setCSLow(void)
 {
+    SPIBus_acquire(SPIBUS_SD);
     SD_CS_OUT &= ~SD_CS;
 }
 
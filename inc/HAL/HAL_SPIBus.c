@@ -0,0 +1,75 @@
+/**
+ * Arbitrates between the users of the SPI bus (USCI_B1) which is shared by the
+ * SD card and the LCD panel on the MSP-EXP430F5529 board.
+ *
+ * The SD card holds the bus whilst its chip select is low, which covers every
+ * command and data block, and releases it again between sectors. The LCD only
+ * pushes its framebuffer out once it has acquired the bus (see
+ * Dogs102x6_flush()), so LCD traffic can never land in the middle of an SD
+ * transaction, even if it is requested from an interrupt.
+ *
+ * @file HAL_SPIBus.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup HAL_SPIBus
+ * @{
+ */
+
+#include "msp430.h"
+#include <in430.h>
+#include "HAL_SPIBus.h"
+
+/// The current user of the bus, SPIBUS_FREE if there is none
+static volatile uint8_t owner = SPIBUS_FREE;
+
+/**
+ * Try to acquire the bus for the given user.
+ *
+ * @param who The user wanting the bus (SPIBUS_SD or SPIBUS_LCD).
+ * @returns Non-zero if the bus is now held by who (including if it already
+ * was), zero if another user holds it.
+ */
+uint8_t SPIBus_acquire(uint8_t who)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    uint8_t ok = 0;
+
+    __disable_interrupt();
+    if(owner == SPIBUS_FREE || owner == who)
+    {
+        owner = who;
+        ok = 1;
+    }
+    __bis_SR_register(gie);
+
+    return ok;
+}
+
+/**
+ * Release the bus, if it is held by the given user.
+ *
+ * @param who The user giving up the bus.
+ */
+void SPIBus_release(uint8_t who)
+{
+    uint16_t gie = __read_status_register() & GIE;
+
+    __disable_interrupt();
+    if(owner == who)
+        owner = SPIBUS_FREE;
+    __bis_SR_register(gie);
+}
+
+/**
+ * Find which user currently holds the bus.
+ *
+ * @returns The user holding the bus, or SPIBUS_FREE.
+ */
+uint8_t SPIBus_owner(void)
+{
+    return owner;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,31 @@
+/**
+ * Shared SPI bus arbiter header.
+ *
+ * @file HAL_SPIBus.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup HAL_SPIBus
+ * @{
+ */
+
+#ifndef HAL_SPIBUS_H
+#define HAL_SPIBUS_H
+
+#include <stdint.h>
+
+/**
+ * The users of the shared SPI bus (USCI_B1).
+ */
+#define SPIBUS_FREE     0
+#define SPIBUS_SD       1
+#define SPIBUS_LCD      2
+
+extern uint8_t SPIBus_acquire(uint8_t owner);
+extern void SPIBus_release(uint8_t owner);
+extern uint8_t SPIBus_owner(void);
+
+#endif /* HAL_SPIBUS_H */
+
+/**
+ * @}
+ */
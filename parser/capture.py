@@ -0,0 +1,97 @@
+###############################
+# EV Datalogger Project
+# Jon Sowman 2014
+# University of Southampton
+# All Rights Reserved
+###############################
+
+# Saves the blocks that the logger mirrors to the UART (built with STORE_UART,
+# see store.c) into data files that parse.py and evlog can decode, one per
+# session as SSSS.LOG. Blocks are found by the bytes sent before each one and
+# are only kept if their CRC is right, so the debug output and any telemetry
+# mixed in with them are skipped. Give it the serial port (which needs
+# pyserial) and the baud rate, or a file of saved output such as from the
+# simulator's -u:
+#   python capture.py /dev/ttyUSB0 460800
+#   python capture.py uart.bin
+
+import binascii
+import struct
+import sys
+
+SYNC = b'\xeb\x91'
+block = 512
+magic = 0x5645
+FLAG_WALL = 0x04
+FLAG_CRC = 0x08
+
+def crc_ok(data):
+    """Check the CRC in a block's header, worked out with the CRC as 0"""
+    fmt = data[2]
+    if not fmt & FLAG_CRC:
+        return False
+    pos = 24 + (12 if fmt & FLAG_WALL else 0)
+    if len(data) < pos + 2:
+        return False
+    crc = struct.unpack_from('<H', data, pos)[0]
+    sealed = data[:pos] + b'\0\0' + data[pos + 2:]
+    return binascii.crc_hqx(sealed, 0xffff) == crc
+
+def blocks(read):
+    """Yield each good block"""
+    buf = b''
+    while True:
+        data = read(1024)
+        if not data:
+            return
+        buf += data
+        while True:
+            i = buf.find(SYNC)
+            if i < 0:
+                buf = buf[-1:]
+                break
+            if len(buf) < i + 4:
+                buf = buf[i:]
+                break
+            n = struct.unpack_from('<H', buf, i + 2)[0]
+            if n > block:
+                buf = buf[i + 1:]
+                continue
+            if len(buf) < i + 4 + n:
+                buf = buf[i:]
+                break
+            b = buf[i + 4:i + 4 + n]
+            if n < 4 or struct.unpack_from('<H', b)[0] != magic or \
+                    not crc_ok(b):
+                # Not a block after all, look again after the first byte
+                buf = buf[i + 1:]
+                continue
+            buf = buf[i + 4 + n:]
+            yield b
+
+if len(sys.argv) > 2:
+    import serial
+    port = serial.Serial(sys.argv[1], int(sys.argv[2]))
+    read = lambda n: port.read(max(1, min(n, port.in_waiting)))
+elif len(sys.argv) == 2:
+    f = open(sys.argv[1], 'rb')
+    read = f.read
+else:
+    print('Usage: capture.py port baud | capture.py file')
+    sys.exit(2)
+
+# Blocks go into the file for their session, and a short block is the last
+# of its session
+files = {}
+for b in blocks(read):
+    session = struct.unpack_from('<H', b, 20)[0]
+    if session not in files:
+        name = '%04d.LOG' % session
+        print('Session %d into %s' % (session, name))
+        files[session] = open(name, 'wb')
+    files[session].write(b)
+    files[session].flush()
+    if len(b) < block:
+        files.pop(session).close()
+for f in files.values():
+    f.close()
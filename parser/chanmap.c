@@ -0,0 +1,41 @@
+/**
+ * Writes out the channel map that the logger is built with (see channels.h)
+ * as a description of the channels for the host. evlog and parse.py take this
+ * with -m, to call each column by its name in the map rather than ADC0 and
+ * so on. It is built from the same header as the logger, with CHANNELS set
+ * to the same map, so the two can't disagree:
+ *   make channels.txt CHANNELS=van.h
+ *
+ * There is a line for each channel, in the order that they are logged:
+ *   kind name div bits source
+ * where kind is adc or accel, div is the rate divisor, bits the number of bits
+ * in each logged value and source the ADC input or accelerometer register
+ * that it comes from. Lines starting with # are comments.
+ *
+ * @file chanmap.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Parser
+ * @{
+ */
+
+#include <stdio.h>
+
+#include "channels.h"
+
+#define CH_ADC_LINE(name, input, div, osr, level, slope) \
+    printf("adc %s %d %d %s\n", #name, div, 12 + CH_LOG2(osr) / 2, #input);
+#define CH_ACCEL_LINE(name, reg, div) \
+    printf("accel ACCEL%s %d 8 %s\n", #name, div, #reg);
+
+int main(void)
+{
+    printf("# The channel map, from channels.h\n");
+    ADC_MAP(CH_ADC_LINE)
+    ACCEL_MAP(CH_ACCEL_LINE)
+    return 0;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,1248 @@
+/**
+ * A fast decoder for the data files written by the logger, for sessions that
+ * are too long for parse.py. It reads the same blocks and writes the same CSV
+ * file as parse.py, but can also write the frames as NumPy arrays (one .npy
+ * file per column), and scales each channel to real units unless asked not
+ * to.
+ *
+ * The data files are mapped into memory rather than read, and each block is
+ * decoded in one go into columns (a time and a value for each channel, for
+ * every frame in the block) which are then appended to the outputs, so a
+ * session of any length can be decoded in a fixed amount of memory.
+ *
+ * The block layout is described in logfmt.h and logfmt.c. Every field is read
+ * a byte at a time so that this works on a host of either endianness.
+ *
+ * Blocks written since the RTC was added also say when they were logged in
+ * wall clock time (see BlockHeader::wall), so that with -w the time column
+ * can be in seconds since 1970 UTC, to line up logs from several loggers.
+ *
+ * Blocks written since then also have a CRC (see BlockHeader::crc), and a
+ * block whose CRC is wrong is skipped, as a block without a valid header is.
+ * Every block stands on its own, so the blocks either side still decode.
+ *
+ * Newer blocks also have the accelerometer's range, which the default scaling
+ * of its axes follows, and its output data rate (see BlockHeader::accel_range).
+ *
+ * Data files written since then have an index block every so many sectors
+ * (see store.c), which is skipped when decoding. With -t or -x, only the
+ * blocks in a time window or in which a channel goes over (or under) a level
+ * are decoded, and these are found from the index blocks alone, so only the
+ * index and the blocks that are wanted are read from a file of any length.
+ * The index blocks of each segment are at fixed places from its start, so the
+ * segment files should be given as they are rather than joined together
+ * (any part that can't be found from an index is simply decoded).
+ *
+ * Data files written since then end with a summary block, holding statistics
+ * that the logger kept of the whole file (see stats.c). Its contents are
+ * printed, scaled as the channels are, so that a trip can be summed up
+ * without decoding it.
+ *
+ * The columns are called ADC0 and so on, or with -m by their names in the
+ * channel map that the logger was built with (see chanmap.c).
+ *
+ * Usage: evlog [-c file.csv] [-n dir] [-r] [-w] [-m channels.txt]
+ *        [-s NAME=gain[,offset]]... [-t from,to] [-x NAME>level]... files
+ *
+ * @file evlog.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Parser
+ * @{
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * The length of a block, being one sector
+ */
+#define BLOCK 512
+
+/**
+ * The block header, see BlockHeader in logfmt.h
+ */
+#define MAGIC       0x5645
+#define HEADER_MIN  24
+#define WALL_LEN    12
+#define CRC_LEN     2
+#define ACCEL_LEN   3
+#define FLAG_PACKED 0x01
+#define FLAG_WALL   0x04
+#define FLAG_CRC    0x08
+#define FLAG_ACCEL  0x10
+#define FLAG_INDEX  0x20
+#define FLAG_STATS  0x40
+#define TAG_PAD     0x00
+#define TAG_DELTA   0x02
+
+/**
+ * The most channels (ADC channels and accelerometer axes together) that a
+ * block can describe, and the most frames that a block can hold
+ */
+#define MAX_CH      32
+#define MAX_FRAMES  BLOCK
+
+/**
+ * The length of each entry of an index block, being the sequence number and
+ * time of a block and the least and greatest value of each ADC channel in it
+ * (see IndexEntry in logfmt.h)
+ */
+#define ENTRY_LEN(adcs) (8 + 4 * (adcs))
+
+/**
+ * The length of the statistics in a summary block, being the sums and counts
+ * followed by the least and greatest value of each channel (see StatsRecord
+ * in logfmt.h)
+ */
+#define STATS_LEN(adcs, accels) (38 + 4 * (adcs) + 2 * (accels))
+
+/**
+ * The default scaling: the ADC is referenced to AVCC, and the CMA3000 gives
+ * 56 counts per g in its 2g range and a quarter of that in its 8g range (see
+ * accel.c)
+ */
+#define ADC_VREF        3.3
+#define ACCEL_PER_G     56.0
+
+/**
+ * The length of the header of each .npy file, which is left room for the
+ * number of frames so that it can be filled in once they are all written
+ */
+#define NPY_HEADER  128
+
+/**
+ * @struct Header
+ * @brief A decoded block header, see BlockHeader in logfmt.h.
+ */
+typedef struct Header
+{
+    uint8_t valid, crc_bad;
+    uint8_t format, size;
+    uint32_t seq, time, frame;
+    uint16_t dropped, rate, session;
+    uint8_t adcs, accels;
+    uint16_t time_us, wall_us;
+    uint32_t wall, wall_time;
+    uint16_t accel_rate;
+    uint8_t accel_range;
+    uint8_t divs[MAX_CH], bits[MAX_CH];
+} Header;
+
+/**
+ * @struct Block
+ * @brief The frames of one block, decoded into columns. Bit c of present[n]
+ * is set if channel c was logged in frame n.
+ */
+typedef struct Block
+{
+    uint16_t n;
+    uint32_t frame[MAX_FRAMES];
+    double time[MAX_FRAMES];
+    uint32_t present[MAX_FRAMES];
+    uint16_t value[MAX_CH][MAX_FRAMES];
+} Block;
+
+/**
+ * @struct Npy
+ * @brief A column being written to a .npy file.
+ */
+typedef struct Npy
+{
+    FILE *f;
+    const char *descr;
+    uint32_t n;
+} Npy;
+
+/// The data files, mapped into memory, and where each one's blocks start
+static const uint8_t **map;
+static size_t *map_len;
+static uint32_t *map_first;
+static int nfiles;
+static uint32_t nblocks;
+
+/// The layout of the first valid block, which every other must match
+static Header layout;
+static uint8_t have_layout;
+
+/// How each channel is scaled, and whether channels are scaled at all
+static double gain[MAX_CH], offset[MAX_CH];
+static uint8_t gain_set[MAX_CH];
+static uint8_t raw;
+
+/// Whether the time column is in wall clock time, and the number of frames
+/// left out for want of it
+static uint8_t wall;
+static uint32_t no_wall;
+
+/// The name of each channel, as in parse.py, and the channel map to take
+/// them from instead, if any
+static char names[MAX_CH][32];
+static const char *chan_map;
+
+/// The outputs
+static FILE *csv;
+static const char *npy_dir;
+static Npy npy_time, npy_frame, npy_ch[MAX_CH];
+
+/// The requested scalings, applied once the channels are known
+static char **scales;
+static int nscales;
+
+/// The time window to decode, in the units of the time column, and whether
+/// there is one
+static double from = -INFINITY, to = INFINITY;
+static uint8_t window;
+
+/// The requested levels, and for each the channel, whether it is to go over
+/// (rather than under) the level, and the level in the units of the channel
+static char **levels;
+static int nlevels;
+static uint8_t *level_ch, *level_over;
+static double *level_at;
+
+/// Whether each block is to be decoded, or NULL if they all are
+static uint8_t *wanted;
+
+/**
+ * Say how to use the program and exit.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-c file.csv] [-n dir] [-r] [-w] [-m channels.txt]\n"
+            "       [-s NAME=gain[,offset]]... [-t from,to] [-x NAME>level]..."
+            " files...\n"
+            "  -c  write the frames to a CSV file, as parse.py does\n"
+            "  -n  write the frames to a directory of NumPy .npy files, one\n"
+            "      per column, with NaN where a channel wasn't logged\n"
+            "  -r  write the values as they were logged instead of scaling\n"
+            "      them (ADC channels to volts, accelerometer axes to g)\n"
+            "  -w  make the time column the wall clock time in seconds since\n"
+            "      1970 UTC, leaving out blocks logged before the RTC was set\n"
+            "  -m  name the channels as in the channel map that the logger\n"
+            "      was built with (make channels.txt)\n"
+            "  -s  scale channel NAME (ADC0..., ACCELX...) by gain, then add\n"
+            "      offset, applied to the logged value\n"
+            "  -t  only write the frames from time from to time to (in the\n"
+            "      units of the time column), either of which may be left out\n"
+            "  -x  only write the blocks in which ADC channel NAME goes over\n"
+            "      (NAME>level) or under (NAME<level) the level, in the units\n"
+            "      that it is written in, any of which will do\n"
+            "Segment files (SSSSNNNN.LOG) are joined in the order given, but\n"
+            "with -t or -x they are found from their index blocks, so the\n"
+            "segments should be given rather than a joined file.\n",
+            prog);
+    exit(2);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Work out the CRC of a block as the logger does (see crc.c), with the two
+ * bytes of the CRC itself taken as 0.
+ *
+ * @param b A pointer to the block.
+ * @param len The length of the block.
+ * @param at Where the CRC is in the block.
+ * @returns The CRC.
+ */
+static uint16_t block_crc(const uint8_t *b, uint16_t len, uint16_t at)
+{
+    static uint16_t table[256];
+    uint16_t crc = 0xFFFF, i, j;
+    uint8_t d;
+
+    if(!table[1])
+    {
+        for(i = 0; i < 256; i++)
+        {
+            table[i] = i << 8;
+            for(j = 0; j < 8; j++)
+                table[i] = table[i] & 0x8000 ? (table[i] << 1) ^ 0x1021
+                    : table[i] << 1;
+        }
+    }
+    for(i = 0; i < len; i++)
+    {
+        d = (i == at || i == at + 1) ? 0 : b[i];
+        crc = (crc << 8) ^ table[(crc >> 8) ^ d];
+    }
+    return crc;
+}
+
+/**
+ * Get a block of the data files by its number, counting across all of the
+ * files in the order they were given.
+ *
+ * @param n The number of the block.
+ * @param len The number of bytes in the block, which is less than BLOCK only
+ * at the end of a file.
+ * @returns A pointer to the block.
+ */
+static const uint8_t *block_get(uint32_t n, uint16_t *len)
+{
+    int f = nfiles - 1;
+    size_t off;
+
+    while(map_first[f] > n)
+        f--;
+    off = (size_t)(n - map_first[f]) * BLOCK;
+    *len = map_len[f] - off < BLOCK ? map_len[f] - off : BLOCK;
+    return map[f] + off;
+}
+
+/**
+ * Decode the header of a block.
+ *
+ * @param b A pointer to the block.
+ * @param len The length of the block.
+ * @param h The header, where valid is cleared if the block doesn't have a
+ * valid header, and crc_bad is set as well if that's because of its CRC.
+ */
+static void header_read(const uint8_t *b, uint16_t len, Header *h)
+{
+    uint8_t i, nch, pos = HEADER_MIN;
+
+    memset(h, 0, sizeof(*h));
+    if(len < HEADER_MIN || get16(b) != MAGIC)
+        return;
+    h->format = b[2];
+    h->size = b[3];
+    h->seq = get32(b + 4);
+    h->time = get32(b + 8);
+    h->frame = get32(b + 12);
+    h->dropped = get16(b + 16);
+    h->rate = get16(b + 18);
+    h->session = get16(b + 20);
+    h->adcs = b[22];
+    h->accels = b[23];
+    if(h->format & FLAG_WALL)
+    {
+        if(len < HEADER_MIN + WALL_LEN)
+            return;
+        h->time_us = get16(b + 24);
+        h->wall_us = get16(b + 26);
+        h->wall = get32(b + 28);
+        h->wall_time = get32(b + 32);
+        pos += WALL_LEN;
+    }
+    if(h->format & FLAG_CRC)
+    {
+        if(len < pos + CRC_LEN)
+            return;
+        if(block_crc(b, len, pos) != get16(b + pos))
+        {
+            h->crc_bad = 1;
+            return;
+        }
+        pos += CRC_LEN;
+    }
+    if(h->format & FLAG_ACCEL)
+    {
+        if(len < pos + ACCEL_LEN)
+            return;
+        h->accel_rate = get16(b + pos);
+        h->accel_range = b[pos + 2];
+        pos += ACCEL_LEN;
+    }
+
+    nch = h->adcs + h->accels;
+    if(nch > MAX_CH || h->rate == 0 || h->size > len
+            || h->size < pos + nch + h->adcs)
+        return;
+    for(i = 0; i < nch; i++)
+    {
+        h->divs[i] = b[pos + i];
+        if(!h->divs[i])
+            return;
+    }
+    for(i = 0; i < h->adcs; i++)
+        h->bits[i] = b[pos + nch + i];
+    h->valid = 1;
+}
+
+/**
+ * Check that a block has the same channels as the first, since the outputs
+ * have a column for each channel.
+ */
+static uint8_t layout_matches(const Header *h)
+{
+    return h->adcs == layout.adcs && h->accels == layout.accels
+        && h->rate == layout.rate
+        && !memcmp(h->divs, layout.divs, h->adcs + h->accels)
+        && !memcmp(h->bits, layout.bits, h->adcs);
+}
+
+/**
+ * Decode the frames of a block into columns, as parse.py does.
+ *
+ * @param b A pointer to the block.
+ * @param len The length of the block.
+ * @param h The header of the block.
+ * @param last The number of the frame after the last one in this block, from
+ * the header of the next block, or UINT32_MAX if that isn't known (so the
+ * frames run until the next would not fit).
+ * @param out The decoded frames.
+ */
+static void block_decode(const uint8_t *b, uint16_t len, const Header *h,
+        uint32_t last, Block *out)
+{
+    uint16_t prev[MAX_CH] = {0};
+    uint32_t frame = h->frame, mask;
+    uint16_t pos = h->size, need;
+    uint8_t nch = h->adcs + h->accels, c, nbits, tag, d, due;
+    uint32_t acc;
+    double start;
+
+    // The time of the first frame, in ms of system time or in seconds of wall
+    // clock time
+    if(wall)
+        start = h->wall + ((int32_t)(h->time - h->wall_time) * 1000.0
+                + h->time_us - h->wall_us) / 1e6;
+    else
+        start = h->time + h->time_us / 1000.0;
+
+    out->n = 0;
+    while(frame != last && out->n < MAX_FRAMES)
+    {
+        // The channels that are due in this frame
+        for(mask = 0, due = 0, c = 0; c < nch; c++)
+        {
+            if(frame % h->divs[c] == 0)
+            {
+                mask |= 1UL << c;
+                due++;
+            }
+        }
+
+        if(h->format & FLAG_PACKED)
+        {
+            if(pos >= len || b[pos] == TAG_PAD)
+                break;
+            tag = b[pos];
+            // Work out the length of the frame so that it can be checked
+            need = 1;
+            for(nbits = 0, c = 0; c < h->adcs; c++)
+                if(mask & (1UL << c))
+                    nbits += tag == TAG_DELTA ? 8 : h->bits[c];
+            need += (nbits + 7) / 8;
+            for(c = h->adcs; c < nch; c++)
+                if(mask & (1UL << c))
+                    need++;
+            if(pos + need > len)
+                break;
+
+            pos++;
+            acc = 0;
+            nbits = 0;
+            for(c = 0; c < h->adcs; c++)
+            {
+                if(!(mask & (1UL << c)))
+                    continue;
+                if(tag == TAG_DELTA)
+                {
+                    // A signed change since the last value in this block
+                    d = b[pos++];
+                    prev[c] = prev[c] + (int8_t)d;
+                } else {
+                    while(nbits < h->bits[c])
+                    {
+                        acc = (acc << 8) | b[pos++];
+                        nbits += 8;
+                    }
+                    nbits -= h->bits[c];
+                    prev[c] = (acc >> nbits) & ((1UL << h->bits[c]) - 1);
+                }
+                out->value[c][out->n] = prev[c];
+            }
+            for(c = h->adcs; c < nch; c++)
+                if(mask & (1UL << c))
+                    out->value[c][out->n] = b[pos++];
+        } else {
+            if(pos + 2 * due > len)
+                break;
+            for(c = 0; c < nch; c++)
+            {
+                if(mask & (1UL << c))
+                {
+                    out->value[c][out->n] = get16(b + pos);
+                    pos += 2;
+                }
+            }
+        }
+
+        // Frames are equally spaced from the start of the block
+        out->frame[out->n] = frame;
+        if(wall)
+            out->time[out->n] = start + (double)(frame - h->frame) / h->rate;
+        else
+            out->time[out->n] = start + (frame - h->frame) * 1000.0 / h->rate;
+        out->present[out->n] = mask;
+        out->n++;
+        frame++;
+    }
+}
+
+/**
+ * Get the value of a channel in real units, or as it was logged if the
+ * values aren't being scaled.
+ */
+static double scaled(uint8_t c, uint16_t v)
+{
+    if(raw)
+        return v;
+    // The accelerometer gives a two's complement byte
+    if(c >= layout.adcs)
+        return (int8_t)v * gain[c] + offset[c];
+    return v * gain[c] + offset[c];
+}
+
+/**
+ * Print the statistics in a summary block, scaled as the channels are. The
+ * current is about the level that the logger took as no current, so only its
+ * gain applies, as it does to the energy (which also takes the offset of the
+ * voltage).
+ */
+static void summary_print(const uint8_t *b, uint16_t len, const Header *h)
+{
+    const uint8_t *p = b + h->size, *a;
+    uint8_t c, v, i, nch = h->adcs + h->accels;
+    uint32_t n, samples;
+    int64_t sum, energy;
+    double dt;
+
+    if(len < h->size + STATS_LEN(h->adcs, h->accels))
+        return;
+    n = get32(p);
+    samples = get32(p + 4);
+    sum = (int64_t)((uint64_t)get32(p + 8) | (uint64_t)get32(p + 12) << 32);
+    energy = (int64_t)((uint64_t)get32(p + 24)
+            | (uint64_t)get32(p + 28) << 32);
+    v = p[36];
+    i = p[37];
+    printf("Summary of %lu frames:\n", (unsigned long)n);
+    for(c = 0; c < h->adcs; c++)
+        printf("  %s: %g to %g\n", names[c], scaled(c, get16(p + 38 + 2 * c)),
+                scaled(c, get16(p + 38 + 2 * (h->adcs + c))));
+    // The accelerometer's bounds are two's complement bytes
+    for(a = p + 38 + 4 * h->adcs; c < nch; c++, a++)
+        printf("  %s: %g to %g\n", names[c],
+                raw ? (int8_t)a[0] : scaled(c, a[0]),
+                raw ? (int8_t)a[h->accels] : scaled(c, a[h->accels]));
+    if(v >= h->adcs || i >= h->adcs || !samples)
+        return;
+
+    // Each current sample stands for its divisor's worth of frames
+    dt = (double)h->divs[i] / h->rate;
+    printf("  %s about %u: %g rms, %g mean\n", names[i], get16(p + 34),
+            get16(p + 32) * (raw ? 1 : gain[i]),
+            (double)sum / samples * (raw ? 1 : gain[i]));
+    printf("  Energy of %s times %s: %g\n", names[v], names[i],
+            raw ? energy * dt
+            : (energy * gain[v] + sum * offset[v]) * gain[i] * dt);
+}
+
+/**
+ * Find a channel by its name, once the channels are known.
+ *
+ * @param name The name, which needn't be terminated.
+ * @param len The length of the name.
+ * @returns The number of the channel, or the number of channels if there is
+ * no such channel.
+ */
+static uint8_t channel_find(const char *name, size_t len)
+{
+    uint8_t c, nch = layout.adcs + layout.accels;
+
+    for(c = 0; c < nch; c++)
+        if(len == strlen(names[c]) && !strncmp(name, names[c], len))
+            break;
+    return c;
+}
+
+/**
+ * Take the names of the channels from the channel map (see chanmap.c), which
+ * must have the same channels as the data file.
+ *
+ * @param h The header of the first valid block.
+ */
+static void chan_map_read(const Header *h)
+{
+    char line[256], kind[16], name[32];
+    unsigned div, bits;
+    uint8_t c = 0, adc, nch = h->adcs + h->accels;
+    FILE *f;
+
+    f = fopen(chan_map, "r");
+    if(!f)
+    {
+        fprintf(stderr, "Couldn't open %s: %s\n", chan_map, strerror(errno));
+        exit(2);
+    }
+    while(fgets(line, sizeof(line), f))
+    {
+        if(line[0] == '#' || sscanf(line, "%15s %31s %u %u", kind, name, &div,
+                    &bits) != 4)
+            continue;
+        // The ADC channels come first, as they are logged
+        adc = !strcmp(kind, "adc");
+        if(c == nch || adc != (c < h->adcs) || div != h->divs[c]
+                || (adc && bits != h->bits[c]))
+        {
+            c = 0;
+            break;
+        }
+        strcpy(names[c++], name);
+    }
+    fclose(f);
+    if(c != nch)
+    {
+        fprintf(stderr, "%s doesn't have the channels of the data file\n",
+                chan_map);
+        exit(2);
+    }
+}
+
+/**
+ * Set up the scaling and names of the channels from the first valid block.
+ */
+static void layout_set(const Header *h)
+{
+    uint8_t c, nch = h->adcs + h->accels;
+    char *eq, *comma, *op;
+    int s;
+
+    layout = *h;
+    have_layout = 1;
+
+    for(c = 0; c < nch; c++)
+    {
+        if(c < h->adcs)
+        {
+            sprintf(names[c], "ADC%u", c);
+            gain[c] = ADC_VREF / (1UL << h->bits[c]);
+        } else {
+            if(c - h->adcs < 3)
+                sprintf(names[c], "ACCEL%c", "XYZ"[c - h->adcs]);
+            else
+                sprintf(names[c], "ACCEL%u", c - h->adcs);
+            gain[c] = h->accel_range ? h->accel_range / (2 * ACCEL_PER_G)
+                : 1.0 / ACCEL_PER_G;
+        }
+        offset[c] = 0;
+    }
+    if(chan_map)
+        chan_map_read(h);
+
+    for(s = 0; s < nscales; s++)
+    {
+        eq = strchr(scales[s], '=');
+        c = eq ? channel_find(scales[s], eq - scales[s]) : nch;
+        if(c == nch)
+        {
+            fprintf(stderr, "No such channel to scale: %s\n", scales[s]);
+            exit(2);
+        }
+        gain[c] = strtod(eq + 1, &comma);
+        offset[c] = *comma == ',' ? strtod(comma + 1, NULL) : 0;
+        gain_set[c] = 1;
+    }
+
+    level_ch = calloc(nlevels + 1, sizeof(*level_ch));
+    level_over = calloc(nlevels + 1, sizeof(*level_over));
+    level_at = calloc(nlevels + 1, sizeof(*level_at));
+    for(s = 0; s < nlevels; s++)
+    {
+        op = strpbrk(levels[s], "<>");
+        c = op ? channel_find(levels[s], op - levels[s]) : nch;
+        if(c >= h->adcs)
+        {
+            fprintf(stderr, "No such ADC channel for a level: %s\n",
+                    levels[s]);
+            exit(2);
+        }
+        level_ch[s] = c;
+        level_over[s] = *op == '>';
+        level_at[s] = strtod(op + 1, NULL);
+    }
+}
+
+/**
+ * Start a .npy file holding a one dimensional array of the given type.
+ */
+static void npy_open(Npy *a, const char *name, const char *descr)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/%s.npy", npy_dir, name);
+    a->f = fopen(path, "wb");
+    if(!a->f)
+    {
+        fprintf(stderr, "Couldn't create %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    a->descr = descr;
+    a->n = 0;
+    // The header is written once the length is known
+    fseek(a->f, NPY_HEADER, SEEK_SET);
+}
+
+/**
+ * Finish a .npy file by writing its header, in version 1.0 of the format.
+ */
+static void npy_close(Npy *a)
+{
+    char h[NPY_HEADER];
+    int n;
+
+    if(!a->f)
+        return;
+    memset(h, ' ', sizeof(h));
+    memcpy(h, "\x93NUMPY\x01\x00", 8);
+    h[8] = (NPY_HEADER - 10) & 0xFF;
+    h[9] = (NPY_HEADER - 10) >> 8;
+    n = sprintf(h + 10, "{'descr': '%s', 'fortran_order': False, "
+            "'shape': (%lu,), }", a->descr, (unsigned long)a->n);
+    h[10 + n] = ' ';
+    h[NPY_HEADER - 1] = '\n';
+    fseek(a->f, 0, SEEK_SET);
+    fwrite(h, 1, sizeof(h), a->f);
+    fclose(a->f);
+    a->f = NULL;
+}
+
+/**
+ * Format a number as Python's str() does for a float, being the shortest
+ * form that reads back the same (the numbers here are never large or small
+ * enough to need an exponent).
+ */
+static const char *pyfloat(double v)
+{
+    static char s[32];
+    int prec;
+
+    if(v == floor(v) && fabs(v) < 1e16)
+    {
+        snprintf(s, sizeof(s), "%.1f", v);
+        return s;
+    }
+    for(prec = 1; prec < 17; prec++)
+    {
+        snprintf(s, sizeof(s), "%.*g", prec, v);
+        if(strtod(s, NULL) == v)
+            break;
+    }
+    return s;
+}
+
+/**
+ * Write the header of the CSV file, as parse.py does.
+ */
+static void csv_header(void)
+{
+    uint8_t c, nch = layout.adcs + layout.accels;
+    time_t now = time(NULL);
+    char date[64];
+    int64_t us;
+
+    strftime(date, sizeof(date), "%c", localtime(&now));
+    fprintf(csv, "EV Logger Parsed Log\n");
+    fprintf(csv, "Generated: %s\n", date);
+    if(layout.wall)
+    {
+        // The wall clock time when the system time was 0
+        us = layout.wall * 1000000LL - layout.wall_time * 1000LL
+            - layout.wall_us;
+        now = us / 1000000;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", gmtime(&now));
+        fprintf(csv, "Wall clock at 0ms: %s.%06d UTC\n", date,
+                (int)(us % 1000000));
+    }
+    fprintf(csv, "Frequency: %uHz\n", layout.rate);
+    fprintf(csv, "Channel rates: ");
+    for(c = 0; c < nch; c++)
+        fprintf(csv, "%s%sHz", c ? ", " : "",
+                pyfloat((double)layout.rate / layout.divs[c]));
+    fprintf(csv, "\nADC resolution: ");
+    for(c = 0; c < layout.adcs; c++)
+        fprintf(csv, "%s%u bits", c ? ", " : "", layout.bits[c]);
+    if(layout.accel_rate)
+        fprintf(csv, "\nAccelerometer: %ug, %uHz", layout.accel_range,
+                layout.accel_rate);
+    fprintf(csv, wall ? "\nTIME(s)" : "\nTIME(ms)");
+    for(c = 0; c < nch; c++)
+    {
+        if(raw || gain_set[c])
+            fprintf(csv, ", %s", names[c]);
+        else
+            fprintf(csv, ", %s(%s)", names[c], c < layout.adcs ? "V" : "g");
+    }
+    fprintf(csv, "\n\n");
+}
+
+/**
+ * Start the outputs, once the channels are known.
+ */
+static void outputs_open(void)
+{
+    uint8_t c, nch = layout.adcs + layout.accels;
+
+    if(csv)
+        csv_header();
+    if(npy_dir)
+    {
+        if(mkdir(npy_dir, 0777) && errno != EEXIST)
+        {
+            fprintf(stderr, "Couldn't create %s: %s\n", npy_dir,
+                    strerror(errno));
+            exit(2);
+        }
+        npy_open(&npy_time, "time", "<f8");
+        npy_open(&npy_frame, "frame", "<u4");
+        for(c = 0; c < nch; c++)
+            npy_open(&npy_ch[c], names[c], "<f4");
+    }
+}
+
+/**
+ * Append a decoded block to the outputs.
+ */
+static void outputs_write(const Block *blk)
+{
+    uint8_t c, nch = layout.adcs + layout.accels;
+    uint16_t i;
+    float f[MAX_FRAMES];
+
+    if(csv)
+    {
+        for(i = 0; i < blk->n; i++)
+        {
+            fprintf(csv, wall ? "%.6f" : "%.3f", blk->time[i]);
+            for(c = 0; c < nch; c++)
+            {
+                if(!(blk->present[i] & (1UL << c)))
+                    fputs(", ", csv);
+                else if(raw)
+                    fprintf(csv, ", %u", blk->value[c][i]);
+                else
+                    fprintf(csv, ", %.5g", scaled(c, blk->value[c][i]));
+            }
+            fputc('\n', csv);
+        }
+    }
+
+    if(npy_dir)
+    {
+        fwrite(blk->time, sizeof(double), blk->n, npy_time.f);
+        fwrite(blk->frame, sizeof(uint32_t), blk->n, npy_frame.f);
+        npy_time.n += blk->n;
+        npy_frame.n += blk->n;
+        for(c = 0; c < nch; c++)
+        {
+            for(i = 0; i < blk->n; i++)
+                f[i] = (blk->present[i] & (1UL << c)) ?
+                    (float)scaled(c, blk->value[c][i]) : NAN;
+            fwrite(f, sizeof(float), blk->n, npy_ch[c].f);
+            npy_ch[c].n += blk->n;
+        }
+    }
+}
+
+/**
+ * Leave out the frames of a decoded block that are outside the time window.
+ */
+static void window_apply(Block *blk)
+{
+    uint8_t c, nch = layout.adcs + layout.accels;
+    uint16_t i, n;
+
+    for(i = 0, n = 0; i < blk->n; i++)
+    {
+        if(blk->time[i] < from || blk->time[i] > to)
+            continue;
+        blk->frame[n] = blk->frame[i];
+        blk->time[n] = blk->time[i];
+        blk->present[n] = blk->present[i];
+        for(c = 0; c < nch; c++)
+            blk->value[c][n] = blk->value[c][i];
+        n++;
+    }
+    blk->n = n;
+}
+
+/**
+ * Turn the time of a block in ms, as in an index entry, into the units of
+ * the time column, using the wall clock fields of the index block's header.
+ */
+static double entry_time(const Header *ih, uint32_t t)
+{
+    if(wall)
+        return ih->wall + ((int32_t)(t - ih->wall_time) * 1000.0
+                - ih->wall_us) / 1e6;
+    return t;
+}
+
+/**
+ * Check whether a block is wanted, from its entry in an index block. It is
+ * wanted if it overlaps the time window, and if any level was asked for, also
+ * if one of its ADC channels goes past a level.
+ *
+ * @param e A pointer to the entry.
+ * @param ih The header of the index block.
+ * @param end The latest time (in ms) that the block's frames can run to, or
+ * UINT32_MAX if that isn't known.
+ * @returns Non-zero if the block is wanted.
+ */
+static uint8_t entry_wanted(const uint8_t *e, const Header *ih, uint32_t end)
+{
+    uint16_t lo, hi;
+    double a, b, t;
+    int l;
+
+    if(window)
+    {
+        // A block from before the RTC was set has to be decoded to find out
+        // whether it has wall clock time
+        if(wall && !ih->wall)
+            return 1;
+        if(entry_time(ih, get32(e + 4)) > to)
+            return 0;
+        if(end != UINT32_MAX && entry_time(ih, end) < from)
+            return 0;
+    }
+    if(!nlevels)
+        return 1;
+
+    for(l = 0; l < nlevels; l++)
+    {
+        lo = get16(e + 8 + 2 * level_ch[l]);
+        hi = get16(e + 8 + 2 * (ih->adcs + level_ch[l]));
+        // The channel wasn't logged in this block
+        if(lo > hi)
+            continue;
+        a = scaled(level_ch[l], lo);
+        b = scaled(level_ch[l], hi);
+        if(a > b)
+        {
+            t = a;
+            a = b;
+            b = t;
+        }
+        if(level_over[l] ? b > level_at[l] : a < level_at[l])
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Work out which blocks are to be decoded, from the index blocks alone. The
+ * index blocks of a segment are every so many sectors from its start (see
+ * store.c), with one fewer entries than that. Blocks that aren't covered by
+ * an index block, such as those after the last one in a segment, are always
+ * decoded. The channels must be known.
+ */
+static void blocks_select(void)
+{
+    Header ih, nh;
+    const uint8_t *b, *e;
+    uint16_t len;
+    uint32_t first, count, period, g, j, end;
+    int f;
+
+    wanted = malloc(nblocks);
+    memset(wanted, 1, nblocks);
+    period = (BLOCK - layout.size) / ENTRY_LEN(layout.adcs) + 1;
+    for(f = 0; f < nfiles; f++)
+    {
+        first = map_first[f];
+        count = (f + 1 < nfiles ? map_first[f + 1] : nblocks) - first;
+        for(g = 0; g + period <= count; g += period)
+        {
+            b = block_get(first + g + period - 1, &len);
+            header_read(b, len, &ih);
+            if(!ih.valid || !(ih.format & FLAG_INDEX)
+                    || ih.size != layout.size || ih.adcs != layout.adcs)
+                continue;
+            // The last block that it covers ends when the block after the
+            // index block starts, if that follows on
+            nh.valid = 0;
+            if(g + period < count)
+            {
+                e = block_get(first + g + period, &len);
+                header_read(e, len, &nh);
+            }
+            for(j = 0; j + 1 < period; j++)
+            {
+                // Each block ends by the time the next one starts
+                e = b + ih.size + j * ENTRY_LEN(ih.adcs);
+                if(j + 2 < period)
+                    end = get32(e + ENTRY_LEN(ih.adcs) + 4) + 1;
+                else if(nh.valid && nh.seq == get32(e) + 1)
+                    end = nh.time + 1;
+                else
+                    end = UINT32_MAX;
+                wanted[first + g + j] = entry_wanted(e, &ih, end);
+            }
+        }
+    }
+}
+
+/**
+ * Map the data files into memory.
+ */
+static void files_map(char **files, int n)
+{
+    struct stat st;
+    int i, fd;
+
+    nfiles = n;
+    map = calloc(n, sizeof(*map));
+    map_len = calloc(n, sizeof(*map_len));
+    map_first = calloc(n, sizeof(*map_first));
+    for(i = 0; i < n; i++)
+    {
+        fd = open(files[i], O_RDONLY);
+        if(fd < 0 || fstat(fd, &st))
+        {
+            fprintf(stderr, "Couldn't open %s: %s\n", files[i],
+                    strerror(errno));
+            exit(2);
+        }
+        map_len[i] = st.st_size;
+        map_first[i] = nblocks;
+        nblocks += (st.st_size + BLOCK - 1) / BLOCK;
+        if(st.st_size)
+        {
+            map[i] = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map[i] == MAP_FAILED)
+            {
+                fprintf(stderr, "Couldn't map %s: %s\n", files[i],
+                        strerror(errno));
+                exit(2);
+            }
+            madvise((void *)map[i], st.st_size,
+                    (window || nlevels) ? MADV_RANDOM : MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static Block blk;
+    Header h, next;
+    const uint8_t *b, *nb;
+    uint16_t len, nlen;
+    uint32_t n, m, next_n = UINT32_MAX, seq = 0, last, frames = 0;
+    uint32_t dropped = 0, bad = 0, decoded = 0;
+    uint8_t have_seq = 0;
+    char *csv_name = NULL, *comma;
+    int c, i;
+
+    while((c = getopt(argc, argv, "c:n:rwm:s:t:x:h")) != -1)
+    {
+        switch(c)
+        {
+            case 'c':
+                csv_name = optarg;
+                break;
+            case 'n':
+                npy_dir = optarg;
+                break;
+            case 'r':
+                raw = 1;
+                break;
+            case 'w':
+                wall = 1;
+                break;
+            case 'm':
+                chan_map = optarg;
+                break;
+            case 's':
+                scales = realloc(scales, (nscales + 1) * sizeof(*scales));
+                scales[nscales++] = optarg;
+                break;
+            case 't':
+                comma = strchr(optarg, ',');
+                if(!comma)
+                    usage(argv[0]);
+                if(comma != optarg)
+                    from = strtod(optarg, NULL);
+                if(comma[1])
+                    to = strtod(comma + 1, NULL);
+                window = 1;
+                break;
+            case 'x':
+                if(!strpbrk(optarg, "<>"))
+                    usage(argv[0]);
+                levels = realloc(levels, (nlevels + 1) * sizeof(*levels));
+                levels[nlevels++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind == argc || (!csv_name && !npy_dir))
+        usage(argv[0]);
+
+    if(csv_name)
+    {
+        csv = fopen(csv_name, "w");
+        if(!csv)
+        {
+            fprintf(stderr, "Couldn't create %s: %s\n", csv_name,
+                    strerror(errno));
+            return 2;
+        }
+        setvbuf(csv, NULL, _IOFBF, 1 << 20);
+    }
+    files_map(argv + optind, argc - optind);
+
+    // To seek, the channels are needed from the first block before the
+    // index blocks can be read
+    if(window || nlevels)
+    {
+        for(n = 0; n < nblocks && !have_layout; n++)
+        {
+            b = block_get(n, &len);
+            header_read(b, len, &h);
+            if(h.valid && !(h.format & FLAG_INDEX))
+            {
+                layout_set(&h);
+                outputs_open();
+            }
+        }
+        if(have_layout)
+            blocks_select();
+    }
+
+    // Decode every block in turn, looking ahead to the next block's header
+    // (other than an index block) to see where the frames of this one end
+    for(n = 0; n < nblocks; n++)
+    {
+        if(wanted && !wanted[n])
+        {
+            have_seq = 0;
+            continue;
+        }
+        b = block_get(n, &len);
+        if(n == next_n)
+            h = next;
+        else
+            header_read(b, len, &h);
+        if(h.format & FLAG_INDEX)
+            continue;
+        for(m = n + 1; m < nblocks; m++)
+        {
+            nb = block_get(m, &nlen);
+            header_read(nb, nlen, &next);
+            if(!(next.format & FLAG_INDEX))
+                break;
+        }
+        if(m == nblocks)
+            next.valid = 0;
+        next_n = m;
+
+        if(h.crc_bad)
+        {
+            fprintf(stderr, "Skipping block at offset %lu, bad CRC\n",
+                    (unsigned long)n * BLOCK);
+            // Its header can't be trusted, but it was logged
+            seq++;
+            bad++;
+            continue;
+        }
+        if(!h.valid)
+        {
+            fprintf(stderr, "Skipping bad block at offset %lu\n",
+                    (unsigned long)n * BLOCK);
+            bad++;
+            continue;
+        }
+        if(!have_layout)
+        {
+            layout_set(&h);
+            outputs_open();
+        } else if(!layout_matches(&h)) {
+            fprintf(stderr, "Skipping block %lu, its channels have changed\n",
+                    (unsigned long)h.seq);
+            bad++;
+            continue;
+        }
+
+        if(h.format & FLAG_STATS)
+        {
+            summary_print(b, len, &h);
+            continue;
+        }
+
+        // The block is padded out after a frame is dropped, so if the next
+        // block follows on then its header says where this block's frames end
+        last = UINT32_MAX;
+        if(next.valid && next.seq == h.seq + 1)
+            last = next.frame - next.dropped;
+        // In trigger mode, blocks between captures are never written
+        if(have_seq && h.seq != seq + 1)
+            fprintf(stderr, "Block %lu: %ld blocks not logged\n",
+                    (unsigned long)h.seq, (long)h.seq - (long)seq - 1);
+        seq = h.seq;
+        have_seq = 1;
+        if(h.dropped)
+            fprintf(stderr, "Block %lu: %u frames dropped\n",
+                    (unsigned long)h.seq, h.dropped);
+        dropped += h.dropped;
+
+        block_decode(b, len, &h, last, &blk);
+        decoded++;
+        if(wall && !h.wall)
+        {
+            no_wall += blk.n;
+            continue;
+        }
+        if(window)
+            window_apply(&blk);
+        outputs_write(&blk);
+        frames += blk.n;
+    }
+
+    if(csv)
+        fclose(csv);
+    npy_close(&npy_time);
+    npy_close(&npy_frame);
+    for(i = 0; i < MAX_CH; i++)
+        npy_close(&npy_ch[i]);
+
+    fprintf(stderr, "%lu frames from %lu blocks, %lu bad blocks, "
+            "%lu frames dropped\n", (unsigned long)frames,
+            (unsigned long)nblocks, (unsigned long)bad,
+            (unsigned long)dropped);
+    if(wanted)
+        fprintf(stderr, "%lu blocks decoded, found from the index\n",
+                (unsigned long)decoded);
+    if(no_wall)
+        fprintf(stderr, "%lu frames left out since the RTC hadn't been set\n",
+                (unsigned long)no_wall);
+    return 0;
+}
+
+/**
+ * @}
+ */
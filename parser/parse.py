@@ -5,35 +5,238 @@
 # All Rights Reserved
 ###############################
 
+# For long sessions, evlog (see evlog.c, build it with make) is much faster,
+# writes the same CSV file and can also write NumPy arrays and scaled values.
+# As with evlog, -m channels.txt names the columns from the channel map that
+# the logger was built with (see chanmap.c):
+#   python parse.py -m channels.txt 00010000.LOG 00010001.LOG
+
+import binascii
 import struct
+import sys
 import time
 
-# How many channels
-channels = 10
+# The data file is made up of blocks of one sector each. Every block starts
+# with a header (BlockHeader in logfmt.h) that describes the channels and the
+# format of its frames, and frames never span two blocks (see logfmt.c).
+block = 512
+magic = 0x5645
+header = struct.Struct('<HBBIIIHHHBB')
+FLAG_PACKED = 0x01
+# Newer headers have the wall clock fields next, before the channel divisors
+wall_header = struct.Struct('<HHII')
+FLAG_WALL = 0x04
+# Then a CRC of the block (CRC-16-CCITT from 0xffff, worked out with the CRC
+# itself as 0), and a block whose CRC is wrong is skipped
+crc_header = struct.Struct('<H')
+FLAG_CRC = 0x08
+# Then the accelerometer's output data rate (Hz) and range (g)
+accel_header = struct.Struct('<HB')
+FLAG_ACCEL = 0x10
+# An index block holds no frames, just a summary of the blocks before it for
+# tools that seek through the file (see store.c), so it is skipped here
+FLAG_INDEX = 0x20
+FLAG_STATS = 0x40
+TAG_PAD = 0
+TAG_DELTA = 2
+
+def unpack_raw(data, pos, present, layout):
+    """Decode a raw frame, each channel present is a little endian word"""
+    row = []
+    for p in present:
+        if p:
+            row.append(str(struct.unpack('<H', bytes(data[pos:pos + 2]))[0]))
+            pos += 2
+        else:
+            row.append('')
+    return row, pos
+
+def unpack_packed(data, pos, present, layout, prev):
+    """Decode a packed frame, updating the last value of each ADC channel"""
+    adcs, bits = layout['adcs'], layout['bits']
+    tag = data[pos]
+    pos += 1
+    row = []
+    acc = 0
+    nbits = 0
+    for i in range(adcs):
+        if not present[i]:
+            row.append('')
+            continue
+        if tag == TAG_DELTA:
+            # A signed change since the last value in this block
+            d = data[pos]
+            pos += 1
+            prev[i] = (prev[i] + (d - 256 if d > 127 else d)) & 0xffff
+        else:
+            while nbits < bits[i]:
+                acc = (acc << 8) | data[pos]
+                pos += 1
+                nbits += 8
+            nbits -= bits[i]
+            prev[i] = (acc >> nbits) & ((1 << bits[i]) - 1)
+        row.append(str(prev[i]))
+    for i in range(adcs, len(present)):
+        if present[i]:
+            row.append(str(data[pos]))
+            pos += 1
+        else:
+            row.append('')
+    return row, pos
+
+def read_header(data, start):
+    """Decode the header of the block at start, None if it isn't valid"""
+    if len(data) - start < header.size:
+        return None
+    (m, fmt, size, seq, t, frame, dropped, rate, session, adcs, accels) = \
+            header.unpack_from(bytes(data[start:start + header.size]))
+    pos = start + header.size
+    time_us = wall_us = wall = wall_time = 0
+    if fmt & FLAG_WALL:
+        if len(data) - pos < wall_header.size:
+            return None
+        (time_us, wall_us, wall, wall_time) = \
+                wall_header.unpack_from(bytes(data[pos:pos + wall_header.size]))
+        pos += wall_header.size
+    crc_ok = True
+    if fmt & FLAG_CRC:
+        if len(data) - pos < crc_header.size:
+            return None
+        crc = crc_header.unpack_from(bytes(data[pos:pos + crc_header.size]))[0]
+        sealed = bytearray(data[start:start + block])
+        sealed[pos - start:pos - start + crc_header.size] = b'\0\0'
+        crc_ok = binascii.crc_hqx(bytes(sealed), 0xffff) == crc
+        pos += crc_header.size
+    accel_rate = accel_range = 0
+    if fmt & FLAG_ACCEL:
+        if len(data) - pos < accel_header.size:
+            return None
+        (accel_rate, accel_range) = accel_header.unpack_from(
+                bytes(data[pos:pos + accel_header.size]))
+        pos += accel_header.size
+    if m != magic or size < pos - start + adcs * 2 + accels or rate == 0:
+        return None
+    divs = list(data[pos:pos + adcs + accels])
+    bits = list(data[pos + adcs + accels:pos + 2 * adcs + accels])
+    if 0 in divs:
+        return None
+    return {'format': fmt, 'size': size, 'seq': seq,
+            'time': t + time_us / 1000.0, 'frame': frame, 'dropped': dropped,
+            'rate': rate, 'session': session, 'adcs': adcs, 'accels': accels,
+            'divs': divs, 'bits': bits, 'wall': wall, 'crc_ok': crc_ok,
+            'accel_rate': accel_rate, 'accel_range': accel_range,
+            'wall_us': wall * 1000000 - wall_time * 1000 - wall_us}
+
+# Decode every block in turn. Channel i is only present in every divs[i]-th
+# frame, counting from the start of the file, and channels that are not
+# present are left empty. A block without a valid header, or whose CRC is
+# wrong, is skipped without upsetting the blocks either side of it.
+rows = []
+layout = None
+first = None
+seq = None
+# A session is written as numbered segment files (SSSSNNNN.LOG), which are
+# joined back together in the order given on the command line.
+args = sys.argv[1:]
+chan_map = None
+if args[:1] == ['-m'] and len(args) > 1:
+    chan_map = args[1]
+    args = args[2:]
+data = bytearray()
+for name in args or ['sample.log']:
+    with open(name, "rb") as f:
+        data += f.read()
+starts = range(0, len(data), block)
+hdrs = [read_header(data, start) for start in starts]
+for n, start in enumerate(starts):
+    hdr = hdrs[n]
+    if hdr is None:
+        print('Skipping bad block at offset ' + str(start))
+        continue
+    # Index blocks and the summary block at the end (see evlog) hold no
+    # frames, though the summary block still says where the frames before it
+    # end
+    if hdr['format'] & (FLAG_INDEX | FLAG_STATS):
+        continue
+    if not hdr['crc_ok']:
+        print('Skipping block at offset ' + str(start) + ', bad CRC')
+        # Its header can't be trusted, but it was logged
+        if seq is not None:
+            seq += 1
+        continue
+    # The block is padded out after a frame is dropped, so if the next
+    # block follows on then its header says where this block's frames end
+    last = None
+    m = n + 1
+    while m < len(hdrs) and hdrs[m] and hdrs[m]['format'] & FLAG_INDEX:
+        m += 1
+    nxt = hdrs[m] if m < len(hdrs) else None
+    if nxt and nxt['crc_ok'] and nxt['seq'] == hdr['seq'] + 1:
+        last = nxt['frame'] - nxt['dropped']
+    # In trigger mode, blocks between captures are never written
+    if seq is not None and hdr['seq'] != seq + 1:
+        print('Block ' + str(hdr['seq']) + ': ' +
+                str(hdr['seq'] - seq - 1) + ' blocks not logged')
+    seq = hdr['seq']
+    if hdr['dropped']:
+        print('Block ' + str(hdr['seq']) + ': ' + str(hdr['dropped']) +
+                ' frames dropped')
+    layout = hdr
+    if first is None:
+        first = hdr
+    end = min(start + block, len(data))
+    pos = start + hdr['size']
+    frame = hdr['frame']
+    prev = [0] * hdr['adcs']
+    while frame != last:
+        present = [frame % d == 0 for d in hdr['divs']]
+        if hdr['format'] & FLAG_PACKED:
+            if pos >= end or data[pos] == TAG_PAD:
+                break
+            row, pos = unpack_packed(data, pos, present, hdr, prev)
+        else:
+            if pos + 2 * sum(present) > end:
+                break
+            row, pos = unpack_raw(data, pos, present, hdr)
+        # Frames are equally spaced from the start of the block
+        t = hdr['time'] + (frame - hdr['frame']) * 1000.0 / hdr['rate']
+        rows.append('%.3f, ' % t + ', '.join(row))
+        frame += 1
 
 # Open the output file and write the header
 w = open('parsed.log', 'w+')
 w.write("EV Logger Parsed Log\n")
 w.write('Generated: ' + time.strftime("%c") + '\n')
-w.write('Frequency: 1kHz\n')
-w.write('ADC0, ADC1, ADC2, ADC3, ADC4, ADC5, ADC6, ACCELX, ACCELY, ACCELZ\n')
+# The wall clock time (from the RTC) when TIME was 0, if it had been set
+if first and first['wall']:
+    us = first['wall_us']
+    w.write('Wall clock at 0ms: ' + time.strftime("%Y-%m-%d %H:%M:%S",
+        time.gmtime(us // 1000000)) + '.%06d UTC\n' % (us % 1000000))
+if layout:
+    names = ['ADC' + str(i) for i in range(layout['adcs'])] + \
+            ['ACCEL' + 'XYZ'[i] if i < 3 else 'ACCEL' + str(i)
+                    for i in range(layout['accels'])]
+    if chan_map:
+        # Each line is kind name div bits source, in the order logged
+        lines = [l.split() for l in open(chan_map)
+                if l.strip() and not l.startswith('#')]
+        kinds = ['adc'] * layout['adcs'] + ['accel'] * layout['accels']
+        if [l[0] for l in lines] != kinds or \
+                [int(l[2]) for l in lines] != layout['divs']:
+            print(chan_map + " doesn't have the channels of the data file")
+            sys.exit(2)
+        names = [l[1] for l in lines]
+    w.write('Frequency: ' + str(layout['rate']) + 'Hz\n')
+    w.write('Channel rates: ' + ', '.join(
+        [str(float(layout['rate']) / d) + 'Hz' for d in layout['divs']]) +
+        '\n')
+    w.write('ADC resolution: ' + ', '.join(
+        [str(b) + ' bits' for b in layout['bits']]) + '\n')
+    if layout['accel_rate']:
+        w.write('Accelerometer: ' + str(layout['accel_range']) + 'g, ' +
+                str(layout['accel_rate']) + 'Hz\n')
+    w.write('TIME(ms), ' + ', '.join(names) + '\n')
 w.write('\n')
-
-done = False
-
-with open("sample.log", "r") as f:
-    byte = f.read(2)
-    while 1:
-        for i in range(channels):
-            # Swap the byte order here
-            a = struct.pack('<h', *struct.unpack('>h', byte))
-            w.write(str(int(a.encode("hex"), 16)))
-            if i < (channels - 1):
-                w.write(', ')
-            byte = f.read(2)
-            if not byte:
-                done = True
-        if done:
-            break
-        w.write('\n')
-    w.close()
+for row in rows:
+    w.write(row + '\n')
+w.close()
@@ -0,0 +1,102 @@
+###############################
+# EV Datalogger Project
+# Jon Sowman 2014
+# University of Southampton
+# All Rights Reserved
+###############################
+
+# Decodes the live telemetry that the logger streams out over the UART whilst
+# it is logging (see telemetry.c), and prints a line per packet in the same
+# layout as parse.py. Give it the serial port (which needs pyserial) and the
+# baud rate, or a file of saved telemetry such as from the simulator's -u:
+#   python telemetry.py /dev/ttyUSB0 460800
+#   python telemetry.py telem.bin
+# The debug output is mixed in with the packets and is printed as it comes.
+
+import struct
+import sys
+
+SYNC = b'\xeb\x90'
+START = 0x01
+FRAME = 0x02
+
+def fletcher16(data):
+    """The checksum at the end of each packet"""
+    a = b = 0
+    for c in data:
+        a = (a + c) % 255
+        b = (b + a) % 255
+    return a | (b << 8)
+
+def packets(read):
+    """Yield each good packet as (type, seq, payload), and each line of debug
+    text between them as (None, None, text)"""
+    buf = b''
+    while True:
+        data = read(256)
+        if not data:
+            return
+        buf += data
+        while True:
+            i = buf.find(SYNC)
+            # Whole lines of text before the next packet are debug output
+            text = buf if i < 0 else buf[:i]
+            end = text.rfind(b'\n')
+            if end >= 0:
+                for line in text[:end].split(b'\n'):
+                    line = line.strip(b'\r')
+                    if line:
+                        yield None, None, line.decode('ascii', 'replace')
+                buf = buf[end + 1:]
+                continue
+            if i < 0 or len(buf) < i + 5:
+                break
+            n = buf[i + 2]
+            if len(buf) < i + n + 7:
+                break
+            pkt = buf[i + 2:i + n + 5]
+            if struct.unpack('<H', buf[i + n + 5:i + n + 7])[0] != \
+                    fletcher16(pkt):
+                # Not a packet after all, look again after the first byte
+                buf = buf[i + 1:]
+                continue
+            buf = buf[i + n + 7:]
+            yield pkt[1], pkt[2], pkt[3:]
+
+if len(sys.argv) > 2:
+    import serial
+    port = serial.Serial(sys.argv[1], int(sys.argv[2]))
+    read = lambda n: port.read(max(1, min(n, port.in_waiting)))
+elif len(sys.argv) == 2:
+    f = open(sys.argv[1], 'rb')
+    read = f.read
+else:
+    print('Usage: telemetry.py port baud | telemetry.py file')
+    sys.exit(2)
+
+layout = None
+last = None
+for (kind, seq, payload) in packets(read):
+    if kind is None:
+        print('# ' + payload)
+        continue
+    if last is not None and seq != (last + 1) & 0xFF:
+        print('# %d packets lost' % ((seq - last - 1) & 0xFF))
+    last = seq
+    if kind == START:
+        (session, rate, div, adcs, accels) = struct.unpack('<HIHBB',
+                payload[:10])
+        if layout != (session, rate, adcs, accels):
+            layout = (session, rate, adcs, accels)
+            print('# Session %d, %dHz, every %d frames' % (session, rate, div))
+            print('TIME(ms), ' + ', '.join(
+                ['ADC' + str(i) for i in range(adcs)] +
+                ['ACCEL' + 'XYZ'[i] if i < 3 else 'ACCEL' + str(i)
+                    for i in range(accels)]))
+    elif kind == FRAME and layout:
+        (session, rate, adcs, accels) = layout
+        (frame, fresh_adc, fresh_accel) = struct.unpack('<IHB', payload[:7])
+        adc = struct.unpack('<%dH' % adcs, payload[7:7 + 2 * adcs])
+        accel = struct.unpack('<%db' % accels, payload[7 + 2 * adcs:])
+        print('%.3f, ' % (frame * 1000.0 / rate) +
+                ', '.join([str(v) for v in adc + accel]))
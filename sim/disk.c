@@ -0,0 +1,264 @@
+/**
+ * A simulated SD card for the simulator (see sim.c), which stands in for the
+ * disk I/O layer in mmc.c.
+ *
+ * The card is held in memory, and every operation takes as long as it would
+ * over the SPI bus at SIM_SPI_HZ plus however long the card stays busy, which
+ * comes from a card profile (see CardProfile). The profiles below are rough
+ * figures for a good, a typical and a poor card; a card can be added from the
+ * results of the benchmark firmware (see bench.c). As in mmc.c, sequential
+ * writes carry on an open-ended multiple block write whilst CTRL_STREAM is
+ * set.
+ *
+ * Waiting for the card is timed against PROF_WAIT_READY and disk_write()
+ * against PROF_DISK_WRITE, just as in mmc.c.
+ *
+ * @file disk.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "diskio.h"
+#include "mmc.h"
+#include "profile.h"
+
+/**
+ * The time to send a command and get its response, in microseconds
+ */
+#define CMD_US 20
+
+/**
+ * The bytes sent over the bus for each sector, being the data along with the
+ * token, CRC and data response
+ */
+#define SECTOR_BYTES (512 + 4)
+
+/// The card profiles to choose from
+static const CardProfile cards[] = {
+    // name     busy single read stall   min     max   gc     min     max
+    {"good",     250,   500, 300,  50,  2000,   5000,  2,  20000,  50000},
+    {"typical",  400,  1000, 500, 100,  5000,  20000,  5,  50000, 150000},
+    {"poor",     800,  2000, 800, 200, 10000,  50000, 10, 100000, 250000},
+};
+
+/// The profile of the card being simulated
+static const CardProfile *card;
+
+/// The contents of the card
+static BYTE *image;
+
+/// Set whilst sequential writes carry on a multiple block write, see mmc.c
+static BYTE stream_mode, stream_open;
+
+/// The next sector of the multiple block write
+static DWORD stream_next;
+
+/**
+ * Make a blank card of SIM_DISK_SECTORS sectors.
+ *
+ * @param profile The card profile, from disk_card().
+ */
+void disk_create(const CardProfile *profile)
+{
+    card = profile;
+    image = calloc(SIM_DISK_SECTORS, 512);
+    if(!image)
+    {
+        fprintf(stderr, "Couldn't allocate the simulated card\n");
+        exit(2);
+    }
+}
+
+/**
+ * Find a card profile by its name.
+ *
+ * @param name The name of the profile.
+ * @returns The profile, or NULL if there isn't one with that name.
+ */
+const CardProfile *disk_card(const char *name)
+{
+    uint8_t i;
+
+    for(i = 0; i < sizeof(cards) / sizeof(cards[0]); i++)
+        if(!strcmp(cards[i].name, name))
+            return &cards[i];
+    return NULL;
+}
+
+/**
+ * List the card profiles on stdout.
+ */
+void disk_list(void)
+{
+    uint8_t i;
+
+    printf("Card profiles:\n");
+    for(i = 0; i < sizeof(cards) / sizeof(cards[0]); i++)
+        printf("  %-8s %lu us per sector, up to %lu us stalls\n",
+                cards[i].name, (unsigned long)cards[i].busy_us,
+                (unsigned long)cards[i].gc_max_us);
+}
+
+/**
+ * Pick a time between min and max microseconds.
+ */
+static uint32_t pick(uint32_t min, uint32_t max)
+{
+    return min + sim_random() % (max - min + 1);
+}
+
+/**
+ * Wait for the card to program a sector that has just been written.
+ *
+ * @param single Non-zero if the sector was written on its own (CMD24).
+ */
+static void card_busy(uint8_t single)
+{
+    uint32_t us = card->busy_us;
+    uint32_t r = sim_random() % 10000;
+    PROFILE_START(t);
+
+    if(single)
+        us += card->single_us;
+    if(r < card->gc_per)
+        us += pick(card->gc_min_us, card->gc_max_us);
+    else if(r < card->gc_per + card->stall_per)
+        us += pick(card->stall_min_us, card->stall_max_us);
+
+    sim_run(SIM_US(us));
+    PROFILE_END(PROF_WAIT_READY, t);
+}
+
+/**
+ * Send or receive bytes over the SPI bus.
+ */
+static void xfer(uint32_t bytes)
+{
+    sim_run(bytes * 8ULL * F_CPU / SIM_SPI_HZ);
+}
+
+/**
+ * End an open multiple block write with the stop token, after which the
+ * card is busy for a little while.
+ */
+static void stream_stop(void)
+{
+    if(stream_open)
+    {
+        stream_open = 0;
+        xfer(1);
+        card_busy(0);
+    }
+}
+
+DSTATUS disk_initialize(BYTE drv)
+{
+    return drv ? STA_NOINIT : 0;
+}
+
+DSTATUS disk_status(BYTE drv)
+{
+    return drv ? STA_NOINIT : 0;
+}
+
+DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+    if(drv || !count || sector + count > SIM_DISK_SECTORS)
+        return RES_PARERR;
+
+    stream_stop();
+    sim_run(SIM_US(CMD_US + card->read_us));
+    while(count--)
+    {
+        memcpy(buff, image + (uint64_t)sector * 512, 512);
+        xfer(SECTOR_BYTES);
+        buff += 512;
+        sector++;
+    }
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE drv, const BYTE *buff, DWORD sector, BYTE count)
+{
+    uint8_t single;
+    PROFILE_START(t);
+
+    if(drv || !count || sector + count > SIM_DISK_SECTORS)
+        return RES_PARERR;
+
+    // Carry on the multiple block write if this follows on, otherwise start
+    // a new one (or write a single block)
+    single = !stream_mode && count == 1;
+    if(!(stream_mode && stream_open && sector == stream_next))
+    {
+        stream_stop();
+        sim_run(SIM_US(CMD_US));
+        stream_open = !single;
+    }
+
+    while(count--)
+    {
+        memcpy(image + (uint64_t)sector * 512, buff, 512);
+        xfer(SECTOR_BYTES);
+        card_busy(single);
+        buff += 512;
+        sector++;
+    }
+    if(!stream_mode)
+        stream_stop();
+    stream_next = sector;
+
+    PROFILE_END(PROF_DISK_WRITE, t);
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+    if(drv)
+        return RES_PARERR;
+
+    switch(ctrl)
+    {
+        case CTRL_SYNC:
+            stream_stop();
+            return RES_OK;
+        case GET_SECTOR_COUNT:
+            *(DWORD *)buff = SIM_DISK_SECTORS;
+            return RES_OK;
+        case GET_BLOCK_SIZE:
+            *(DWORD *)buff = 128;
+            return RES_OK;
+        case CTRL_STREAM:
+            stream_mode = *(BYTE *)buff;
+            if(!stream_mode)
+                stream_stop();
+            return RES_OK;
+        case CTRL_STATUS:
+            stream_stop();
+            return RES_OK;
+        default:
+            return RES_PARERR;
+    }
+}
+
+DWORD get_fattime(void)
+{
+    // 1st January 2014, midnight
+    return ((DWORD)(2014 - 1980) << 25) | ((DWORD)1 << 21) | ((DWORD)1 << 16);
+}
+
+uint8_t detectCard(void)
+{
+    return 1;
+}
+
+/**
+ * @}
+ */
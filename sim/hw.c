@@ -0,0 +1,328 @@
+/**
+ * Stand-ins for the peripherals and their drivers in the simulator (see
+ * sim.c), being the special function registers, the ADC and accelerometer,
+ * the UART, the RTC, the CRC module and the LCD.
+ *
+ * The ADC channels are slow sine waves of different frequencies with a little
+ * noise, and the accelerometer axes wander slowly, so that the packed format
+ * compresses about as well as it does on real signals. The axes take a new
+ * reading at ACCEL_RATE, as if on the data ready interrupt. The results of a
+ * conversion run are written to where adc_arm() was told, at the end of each
+ * frame period (see hw_frame()). Oversampling isn't simulated as such, an
+ * oversampled channel is just given the extra bits that it would have (see
+ * channels.h) by scaling up a single conversion.
+ *
+ * UART output goes to stdout, as do messages shown on the debug row of the
+ * LCD. The binary telemetry (see telemetry.c) isn't mixed in with it, it goes
+ * to a file of its own if one was given (hw_uart) so that it can be decoded.
+ * Nothing is ever received.
+ *
+ * The RTC was set to RTC_DEFAULT when the simulation started, and ticks on
+ * every second of simulated time. The CRC16 module is done in software, but
+ * takes as long as the module would. Sending a changed row to the LCD takes
+ * about as long as it does on the board, since it holds up the SD card.
+ *
+ * @file hw.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "HAL_Dogs102x6.h"
+#include "HAL_PMM.h"
+#include "accel.h"
+#include "adc.h"
+#include "uart.h"
+#include "rtc.h"
+#include "crc.h"
+
+FILE *hw_uart;
+
+// The special function registers
+volatile uint8_t P1DIR, P1OUT, P1REN, P1IES, P1IE, P1IFG, P1SEL;
+volatile uint8_t P2DIR, P2OUT, P2REN, P2IES, P2IE, P2IFG, P2SEL;
+volatile uint8_t P5SEL, P6SEL, P8DIR, P8OUT;
+volatile uint16_t P1IV, P2IV;
+volatile uint16_t TA0CTL, TA0CCTL1, TA0CCR0, TA0CCR1;
+volatile uint16_t TA1CTL, TA1CCTL0, TA1CCR0;
+volatile uint16_t TA2CTL, TA2IV;
+volatile uint16_t UCSCTL0, UCSCTL1, UCSCTL2, UCSCTL3, UCSCTL4;
+volatile uint16_t UCSCTL6, UCSCTL7;
+volatile uint16_t DMAIV;
+
+/**
+ * The time taken to send one row (page) of the LCD, 102 bytes over the SPI
+ * bus plus setting the address
+ */
+#define LCD_ROW_US 100
+
+/// The sample buffer, for the accelerometer readings
+static volatile SampleBuffer *samples;
+
+/// When the accelerometer next has new data
+static uint64_t accel_next;
+
+/// Where the results of the next conversion run go, and which channels
+static volatile uint16_t *adc_dest;
+static uint16_t adc_mask;
+
+/// The bits logged for each channel, from the channel map
+static const uint8_t adc_logged_bits[ADC_CHANNELS] = LOG_ADC_BITS;
+
+/// The text on each row of the LCD, and the rows that haven't been sent
+static char lcd[8][18];
+static uint8_t lcd_dirty;
+
+/**
+ * Get the simulated signal on an ADC channel at the current time.
+ *
+ * @param ch The ADC channel.
+ * @returns The conversion result, in the bits logged for the channel.
+ */
+static uint16_t adc_signal(uint8_t ch)
+{
+    double t = (double)sim_cycles / F_CPU;
+    int32_t v;
+
+    v = 2048 + (int32_t)(1500 * sin(2 * M_PI * (ch + 1) * 0.5 * t))
+        + (int32_t)(sim_random() % 9) - 4;
+    if(v < 0)
+        v = 0;
+    if(v > 4095)
+        v = 4095;
+    return (uint16_t)(v << (adc_logged_bits[ch] - 12));
+}
+
+/**
+ * Finish the conversion run that adc_arm() set up, putting the results where
+ * it was told to, as the DMA would.
+ */
+void hw_frame(void)
+{
+    volatile uint16_t *p = adc_dest;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+        if(adc_mask & _BV(i))
+            *p++ = adc_signal(i);
+
+    // Any accelerometer readings since the last frame
+    while(accel_next <= sim_cycles)
+    {
+        accel_next += F_CPU / ACCEL_RATE;
+        Cma3000_readAccelFSM();
+    }
+}
+
+void adc_init(volatile SampleBuffer *sb)
+{
+    adc_dest = NULL;
+    adc_mask = 0;
+}
+
+uint8_t adc_arm(volatile uint16_t *dest, uint16_t mask)
+{
+    uint8_t i, n = 0;
+
+    adc_dest = dest;
+    adc_mask = mask;
+    for(i = 0; i < ADC_CHANNELS; i++)
+        if(mask & _BV(i))
+            n++;
+    return n;
+}
+
+void adc_collect(void)
+{
+}
+
+uint8_t adc_bits(uint8_t ch)
+{
+    return adc_logged_bits[ch];
+}
+
+uint8_t Cma3000_init(volatile SampleBuffer *sb)
+{
+    samples = sb;
+    accel_next = sim_cycles;
+    return 0;
+}
+
+void Cma3000_getMode(uint8_t *range, uint16_t *rate)
+{
+    *range = ACCEL_RANGE;
+    *rate = ACCEL_RATE;
+}
+
+uint8_t Cma3000_command(char *line, uint8_t busy)
+{
+    return 0;
+}
+
+/**
+ * Take a new reading from the accelerometer, which is there straight away
+ * rather than in a few interrupts' time.
+ */
+void Cma3000_readAccelFSM(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        samples->accel[i] = (samples->accel[i] + sim_random() % 3 - 1) & 0xFF;
+}
+
+uint16_t SetVCore(uint8_t level)
+{
+    return 0;
+}
+
+void uart_init(void)
+{
+}
+
+void uart_debug(char *string)
+{
+    printf("%10.3f uart: %s\n", (double)sim_cycles / F_CPU, string);
+}
+
+uint8_t uart_write(char *data, uint16_t n)
+{
+    if(hw_uart)
+        fwrite(data, 1, n, hw_uart);
+    return 0;
+}
+
+uint8_t uart_write_pair(char *head, uint16_t hn, const char *data,
+        uint16_t n)
+{
+    if(hw_uart)
+    {
+        fwrite(head, 1, hn, hw_uart);
+        fwrite(data, 1, n, hw_uart);
+    }
+    return 0;
+}
+
+void uart_flush(void)
+{
+}
+
+uint8_t uart_getline(char *line)
+{
+    return 0;
+}
+
+void rtc_stamp(RtcStamp *stamp)
+{
+    uint32_t s = sim_cycles / F_CPU;
+
+    stamp->wall = RTC_DEFAULT + s;
+    stamp->time = s * 1000;
+    stamp->us = 0;
+}
+
+uint8_t rtc_command(char *line)
+{
+    return 0;
+}
+
+void rtc_service(void)
+{
+}
+
+/**
+ * Work out a CRC as the CRC16 module does (see crc.c), without taking any
+ * simulated time.
+ */
+uint16_t hw_crc(const char *data, uint16_t n)
+{
+    uint16_t crc = CRC_SEED;
+    uint8_t i;
+
+    while(n--)
+    {
+        crc ^= (uint8_t)*data++ << 8;
+        for(i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+uint16_t crc16(const char *data, uint16_t n)
+{
+    // A byte goes into the module in a loop of about 6 cycles
+    sim_run(6UL * n);
+    return hw_crc(data, n);
+}
+
+void Dogs102x6_refresh(uint8_t mode)
+{
+}
+
+void Dogs102x6_clearRow(uint8_t row)
+{
+    lcd_row(row, "");
+}
+
+void Dogs102x6_stringDraw(uint8_t row, uint8_t col, char *word, uint8_t style)
+{
+    lcd_row(row, word);
+}
+
+/**
+ * Send the next changed row to the LCD.
+ *
+ * @returns Non-zero if a row was sent.
+ */
+uint8_t Dogs102x6_flush(void)
+{
+    uint8_t row;
+
+    for(row = 0; row < 8; row++)
+    {
+        if(lcd_dirty & _BV(row))
+        {
+            lcd_dirty &= ~_BV(row);
+            sim_run(SIM_US(LCD_ROW_US));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t Dogs102x6_dirty(void)
+{
+    return lcd_dirty != 0;
+}
+
+/**
+ * Show a message on the debug row, which is also printed when it changes.
+ */
+void lcd_debug(char *s)
+{
+    if(s[0] && strncmp(lcd[7], s, 17))
+        printf("%10.3f lcd: %s\n", (double)sim_cycles / F_CPU, s);
+    lcd_row(7, s);
+}
+
+void lcd_row(uint8_t row, char *s)
+{
+    char line[18];
+
+    snprintf(line, sizeof(line), "%-17.17s", s);
+    if(strcmp(lcd[row], line))
+    {
+        strcpy(lcd[row], line);
+        lcd_dirty |= _BV(row);
+    }
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,20 @@
+/**
+ * A host stand-in for the mspgcc header of the same name, see msp430.h.
+ *
+ * @file in430.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#ifndef __SIM_IN430_H__
+#define __SIM_IN430_H__
+
+#include "msp430.h"
+
+#endif /* __SIM_IN430_H__ */
+
+/**
+ * @}
+ */
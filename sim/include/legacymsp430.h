@@ -0,0 +1,28 @@
+/**
+ * A host stand-in for the mspgcc legacy intrinsics, see msp430.h.
+ *
+ * @file legacymsp430.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#ifndef __SIM_LEGACYMSP430_H__
+#define __SIM_LEGACYMSP430_H__
+
+#include "msp430.h"
+
+/**
+ * An interrupt handler is an ordinary function, which the simulator calls
+ */
+#define interrupt(vector) void
+
+#define dint() sim_dint()
+#define eint() sim_eint()
+
+#endif /* __SIM_LEGACYMSP430_H__ */
+
+/**
+ * @}
+ */
@@ -0,0 +1,112 @@
+/**
+ * A host stand-in for the mspgcc device header, so that the logger sources
+ * can be built by the simulator (see sim.c).
+ *
+ * The special function registers that the logger sources touch are plain
+ * variables (defined in hw.c), apart from the ones that the simulator has to
+ * drive itself. The intrinsics that control interrupts and the low power
+ * modes hand over to the simulator, which is where time passes and the
+ * interrupt handlers are run.
+ *
+ * @file msp430.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#ifndef __SIM_MSP430_H__
+#define __SIM_MSP430_H__
+
+#include <stdint.h>
+
+/**
+ * The number of CPU (MCLK) cycles since the simulation started
+ */
+extern uint64_t sim_cycles;
+
+void sim_dint(void);
+void sim_eint(void);
+void sim_sleep(uint16_t bits);
+uint16_t sim_sr(void);
+void sim_wake(void);
+void sim_run(uint64_t cycles);
+
+// Status register bits
+#define GIE             0x0008
+#define CPUOFF          0x0010
+#define OSCOFF          0x0020
+#define SCG0            0x0040
+#define LPM0_bits       CPUOFF
+
+// Intrinsics (see legacymsp430.h for the mspgcc names)
+#define __bis_SR_register(x)            sim_sleep(x)
+#define __read_status_register()        sim_sr()
+#define __bic_SR_register_on_exit(x)    sim_wake()
+#define __bis_status_register(x)        do { } while(0)
+#define __bic_status_register(x)        do { } while(0)
+#define _BIS_SR(x)                      do { } while(0)
+#define __delay_cycles(n)               sim_run(n)
+#define __disable_interrupt()           sim_dint()
+#define __enable_interrupt()            sim_eint()
+#define __no_operation()                do { } while(0)
+
+// Ports
+extern volatile uint8_t P1DIR, P1OUT, P1REN, P1IES, P1IE, P1IFG, P1SEL;
+extern volatile uint8_t P2DIR, P2OUT, P2REN, P2IES, P2IE, P2IFG, P2SEL;
+extern volatile uint8_t P5SEL, P6SEL, P8DIR, P8OUT;
+
+/// The port interrupt vector registers, set by the simulator for the ISR
+extern volatile uint16_t P1IV, P2IV;
+#define P1IV_P1IFG7     0x0010
+#define P2IV_P2IFG2     0x0006
+#define P2IV_P2IFG5     0x000C
+
+// Timer A
+extern volatile uint16_t TA0CTL, TA0CCTL1, TA0CCR0, TA0CCR1;
+extern volatile uint16_t TA1CTL, TA1CCTL0, TA1CCR0;
+extern volatile uint16_t TA2CTL, TA2IV;
+
+/// Timer A1 counts SMCLK up to each system tick, which are on every
+/// millisecond of simulated time (see sim.c)
+#define TA1R            ((uint16_t)(sim_cycles % (F_CPU / 1000)))
+
+/// Timer A2 runs freely from SMCLK / 8, see profile.c
+#define TA2R            ((uint16_t)(sim_cycles >> 3))
+
+#define TASSEL_2        0x0200
+#define ID_3            0x00C0
+#define MC_1            0x0010
+#define MC_2            0x0020
+#define MC_3            0x0030
+#define TACLR           0x0004
+#define TAIE            0x0002
+#define TAIFG           0x0001
+#define CCIFG           0x0001
+#define CCIE            0x0010
+#define OUTMOD_7        0x00E0
+#define TA2IV_TAIFG     0x000E
+
+// Unified clock system, which is only ever written
+extern volatile uint16_t UCSCTL0, UCSCTL1, UCSCTL2, UCSCTL3, UCSCTL4;
+extern volatile uint16_t UCSCTL6, UCSCTL7;
+#define XT1OFF          0x0001
+#define XT2OFF          0x0100
+#define XT2OFFG         0x0008
+#define DCOFFG          0x0001
+#define SELREF__XT2CLK  0x0050
+#define FLLREFDIV__4    0x0003
+#define FLLD__1         0x1000
+#define DCORSEL_6       0x0060
+#define SELS_3          0x0030
+#define SELM_3          0x0003
+
+/// The DMA interrupt vector register, set by the simulator for the ISR
+extern volatile uint16_t DMAIV;
+#define DMAIV_DMA0IFG   0x0002
+
+#endif /* __SIM_MSP430_H__ */
+
+/**
+ * @}
+ */
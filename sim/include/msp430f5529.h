@@ -0,0 +1,20 @@
+/**
+ * A host stand-in for the mspgcc header of the same name, see msp430.h.
+ *
+ * @file msp430f5529.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#ifndef __SIM_MSP430F5529_H__
+#define __SIM_MSP430F5529_H__
+
+#include "msp430.h"
+
+#endif /* __SIM_MSP430F5529_H__ */
+
+/**
+ * @}
+ */
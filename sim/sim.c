@@ -0,0 +1,436 @@
+/**
+ * A host simulation of the logger, which runs the real logger, log format,
+ * data file, FatFs and profiling code on a PC so that a configuration (frame
+ * rate, SD buffer size, log format) can be tried against a range of SD cards
+ * before it is flashed.
+ *
+ * The peripherals are replaced: the ADC and accelerometer produce simulated
+ * signals (see hw.c), and the SD card is a RAM disk whose every operation
+ * takes time according to a card profile, including the occasional long
+ * stall that real cards have (see disk.c). The card is formatted when the
+ * simulation starts.
+ *
+ * Time is counted in CPU cycles and only passes when the logger waits, either
+ * for the SD card, in _delay_ms() or asleep in LPM0. As it passes, the
+ * interrupt handlers that would have run in the meantime are called in
+ * order: the system tick, the profiling timer overflow, and the end of each
+ * conversion run (through DMA_ISR(), just as the DMA would). The logger's own
+ * processing takes no time at all, so this is about the card rather than the
+ * CPU. Since every interrupt handler is run from the code that waits, they
+ * are always run with interrupts enabled, and never whilst another is
+ * running.
+ *
+ * Logging starts at power up (unless LOG_AUTOSTART is 0, when it is started
+ * with button S1) and is stopped with S1 (PORT1_ISR()). Once it has
+ * stopped, the data files are read back from the RAM disk and the frames that
+ * were dropped (from the block headers), the high water mark of the SD buffer
+ * (from the Profile module) and the longest writes are reported. The exit
+ * status is 1 if any frames were dropped.
+ *
+ * The telemetry that would have been streamed out over the UART (see
+ * telemetry.c) can be saved to a file with -u, to try a dashboard against.
+ *
+ * @file sim.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "datafile.h"
+#include "ff.h"
+#include "logfmt.h"
+#include "profile.h"
+#include "system.h"
+
+#if !PROFILE
+#error "The simulator reports from the Profile module, so needs PROFILE set"
+#endif
+
+uint64_t sim_cycles;
+
+/// Whether interrupts are enabled
+static uint8_t gie;
+
+/// Set by an interrupt handler that wakes the CPU from LPM0
+static uint8_t woken;
+
+/// Set whilst an interrupt handler is running
+static uint8_t in_isr;
+
+/// The times of the next of each event, in cycles
+static uint64_t next_tick, next_wrap, next_frame, next_press;
+
+/// The time at which the simulation ends, after logging has stopped
+static uint64_t end_time;
+
+/// The time for which to log, in ms
+static uint32_t run_ms = 10000;
+
+/// The number of presses of S1 so far, the first starts logging and the
+/// second stops it
+static uint8_t presses;
+
+/// The number of conversion runs done whilst logging
+static uint32_t frames;
+
+/// The card being simulated
+static const CardProfile *card;
+
+/// The state of the random number generator
+static uint32_t seed = 1;
+
+static uint64_t next_event(void);
+static void fire(void);
+static void finish(void);
+
+/**
+ * Run the logger against a simulated card, see usage() for the options.
+ */
+int main(int argc, char **argv)
+{
+    FATFS fs;
+    int c;
+
+    card = disk_card("typical");
+    while((c = getopt(argc, argv, "c:t:s:u:lh")) != -1)
+    {
+        switch(c)
+        {
+            case 'c':
+                card = disk_card(optarg);
+                if(!card)
+                {
+                    fprintf(stderr, "Unknown card profile: %s\n", optarg);
+                    disk_list();
+                    return 2;
+                }
+                break;
+            case 't':
+                run_ms = (uint32_t)(atof(optarg) * 1000);
+                break;
+            case 's':
+                seed = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                hw_uart = fopen(optarg, "wb");
+                if(!hw_uart)
+                {
+                    perror(optarg);
+                    return 2;
+                }
+                break;
+            case 'l':
+                disk_list();
+                return 0;
+            default:
+                fprintf(stderr, "Usage: %s [-c card] [-t seconds] [-s seed]"
+                        " [-u file] [-l]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    // Make a blank card and format it
+    disk_create(card);
+    f_mount(0, &fs);
+    if(f_mkfs(0, 0, 0) != FR_OK)
+    {
+        fprintf(stderr, "Couldn't format the simulated card\n");
+        return 2;
+    }
+    f_mount(0, NULL);
+
+    // The card was formatted before the logger was powered up. The events that
+    // happen from then on start now. Logging starts at power up, or else S1
+    // is pressed once the button debounce time has passed
+    sim_cycles = 0;
+    next_tick = F_CPU / 1000;
+    next_wrap = 65536UL * 8;
+    next_frame = LOG_TIMER_PERIOD;
+#if LOG_AUTOSTART
+    presses = 1;
+    next_press = SIM_US(run_ms * 1000ULL);
+#else
+    next_press = SIM_US(300000);
+#endif
+    end_time = UINT64_MAX;
+
+    clock_init();
+    profile_init();
+    logger_init();
+
+    // logger_init() never returns, finish() ends the simulation
+    return 0;
+}
+
+/**
+ * Get a pseudo-random number, the same sequence every run for a given seed.
+ *
+ * @returns A number from 0 to 2^31 - 1.
+ */
+uint32_t sim_random(void)
+{
+    seed = seed * 1103515245UL + 12345;
+    return (seed >> 1) & 0x7FFFFFFF;
+}
+
+/**
+ * Disable interrupts, as dint().
+ */
+void sim_dint(void)
+{
+    gie = 0;
+}
+
+/**
+ * Enable interrupts, as eint(), running any handlers that became due whilst
+ * they were disabled.
+ */
+void sim_eint(void)
+{
+    gie = 1;
+    while(!in_isr && next_event() <= sim_cycles)
+        fire();
+}
+
+/**
+ * Let the given number of cycles pass, running any interrupt handlers that
+ * become due in the meantime (if interrupts are enabled).
+ *
+ * @param cycles The number of CPU cycles.
+ */
+void sim_run(uint64_t cycles)
+{
+    uint64_t t, end = sim_cycles + cycles;
+
+    while(gie && !in_isr && (t = next_event()) <= end)
+    {
+        if(t > sim_cycles)
+            sim_cycles = t;
+        fire();
+    }
+    sim_cycles = end;
+
+    if(sim_cycles > end_time && sim_cycles - end_time > SIM_US(10000000))
+    {
+        fprintf(stderr, "The logger never settled after stopping\n");
+        exit(2);
+    }
+}
+
+/**
+ * Read the status register, as __read_status_register(), of which only GIE
+ * is simulated.
+ *
+ * @returns The status register.
+ */
+uint16_t sim_sr(void)
+{
+    return gie ? GIE : 0;
+}
+
+/**
+ * Set bits in the status register, as __bis_SR_register(). Setting GIE alone
+ * is the same as eint(). Setting LPM0 puts the CPU to sleep, so time passes
+ * until an interrupt handler wakes it. This is also where the simulation ends,
+ * since the logger is idle.
+ *
+ * @param bits The status register bits to set.
+ */
+void sim_sleep(uint16_t bits)
+{
+    uint64_t t;
+
+    if(!(bits & CPUOFF))
+    {
+        if(bits & GIE)
+            sim_eint();
+        return;
+    }
+    if(bits & GIE)
+        gie = 1;
+
+    woken = 0;
+    while(!woken)
+    {
+        t = next_event();
+        if(t >= end_time)
+        {
+            sim_cycles = end_time;
+            finish();
+        }
+        if(t > sim_cycles)
+            sim_cycles = t;
+        fire();
+    }
+}
+
+/**
+ * Wake the CPU once the current interrupt handler returns, as
+ * __bic_SR_register_on_exit().
+ */
+void sim_wake(void)
+{
+    woken = 1;
+}
+
+/**
+ * Find the time of the next event.
+ *
+ * @returns The time of the next event in cycles.
+ */
+static uint64_t next_event(void)
+{
+    uint64_t t = next_tick;
+
+    if(next_wrap < t)
+        t = next_wrap;
+    if(next_frame < t)
+        t = next_frame;
+    if(next_press < t)
+        t = next_press;
+    return t;
+}
+
+/**
+ * Run the interrupt handler for the next event, which must be due. The
+ * handler runs with interrupts disabled, as it would on the MSP430.
+ */
+static void fire(void)
+{
+    uint64_t t = next_event();
+    uint8_t saved = gie;
+
+    gie = 0;
+    in_isr = 1;
+    if(t == next_tick)
+    {
+        next_tick += F_CPU / 1000;
+        TIMER1_A0_ISR();
+    } else if(t == next_wrap) {
+        next_wrap += 65536UL * 8;
+        TA2IV = TA2IV_TAIFG;
+        TIMER2_A1_ISR();
+    } else if(t == next_frame) {
+        // The sampling timer only starts conversion runs whilst it's running
+        next_frame += LOG_TIMER_PERIOD;
+        if(TA0CTL & MC_3)
+        {
+            frames++;
+            hw_frame();
+            DMAIV = DMAIV_DMA0IFG;
+            DMA_ISR();
+        }
+    } else if(t == next_press) {
+        // Press S1 to start logging, and again once run_ms has passed to stop
+        P1IV = P1IV_P1IFG7;
+        PORT1_ISR();
+        if(++presses == 1)
+        {
+            next_press += SIM_US(run_ms * 1000ULL);
+        } else {
+            next_press = UINT64_MAX;
+            end_time = sim_cycles + SIM_US(2000000);
+        }
+    }
+    in_isr = 0;
+    gie = saved;
+}
+
+/**
+ * Read back the data files and report how the logger did, then exit.
+ */
+static void finish(void)
+{
+    static char buf[DATAFILE_SECTOR];
+    FIL fil;
+    BlockHeader h;
+    UINT br;
+    Probe p;
+    uint32_t blocks = 0, bad = 0, gaps = 0, dropped = 0, seq = 0;
+    uint32_t indexes = 0;
+    StatsRecord rec;
+    uint8_t summaries = 0;
+    uint16_t files = 0, session = datafile_session();
+    char name[13];
+
+    // Every segment of the session, in order by number (the directory may
+    // not have them in order, since the entries of segments that were
+    // deleted whilst recovering the last session are used again)
+    for(;; files++)
+    {
+        sprintf(name, "%04u%04u.LOG", session, files);
+        if(f_open(&fil, name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+            break;
+        while(f_read(&fil, buf, sizeof(buf), &br) == FR_OK && br)
+        {
+            if(!logfmt_check(buf, session))
+            {
+                bad++;
+                continue;
+            }
+            memcpy(&h, buf, sizeof(h));
+            ((BlockHeader *)buf)->crc = 0;
+            if(hw_crc(buf, br) != h.crc)
+            {
+                bad++;
+                continue;
+            }
+            if(h.format & LOGFMT_FLAG_INDEX)
+            {
+                indexes++;
+                continue;
+            }
+            if(h.format & LOGFMT_FLAG_STATS)
+            {
+                memcpy(&rec, buf + LOGFMT_HEADER_LEN, sizeof(rec));
+                summaries++;
+                continue;
+            }
+            if(blocks && h.seq != seq + 1)
+                gaps++;
+            seq = h.seq;
+            dropped += h.dropped;
+            blocks++;
+        }
+        f_close(&fil);
+    }
+
+    printf("\n");
+    printf("Card profile:    %s\n", card->name);
+    printf("Frame rate:      %lu Hz, %s format\n", (unsigned long)LOG_RATE,
+            LOG_PACKED ? "packed" : "raw");
+    printf("SD buffer:       %u bytes\n", SD_RINGBUF_LEN);
+    printf("Logged for:      %.1f s, %lu frames\n", run_ms / 1000.0,
+            (unsigned long)frames);
+    printf("Dropped frames:  %lu (%.3f%%)\n", (unsigned long)dropped,
+            frames ? 100.0 * dropped / frames : 0.0);
+    printf("Buffer peak:     %u bytes (%lu%%)\n", profile_peak(),
+            100UL * profile_peak() / SD_RINGBUF_LEN);
+    profile_get(PROF_SD_WRITE, &p);
+    printf("Longest write:   %lu us\n", (unsigned long)PROF_US(p.max));
+    profile_get(PROF_WAIT_READY, &p);
+    printf("Longest stall:   %lu us\n", (unsigned long)PROF_US(p.max));
+    printf("Blocks:          %lu in %u files, %lu bad, %lu gaps\n",
+            (unsigned long)blocks, files, (unsigned long)bad,
+            (unsigned long)gaps);
+    printf("Index blocks:    %lu\n", (unsigned long)indexes);
+    if(summaries)
+        printf("Summary:         %lu frames, current %u rms, energy %lld\n",
+                (unsigned long)rec.frames, rec.current_rms,
+                (long long)rec.energy);
+    else
+        printf("Summary:         none\n");
+
+    exit(dropped ? 1 : 0);
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,84 @@
+/**
+ * Sim header.
+ *
+ * @file sim.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Sim
+ * @{
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "logger.h"
+
+/**
+ * Convert a time in microseconds to CPU cycles
+ */
+#define SIM_US(us) ((uint64_t)(us) * (F_CPU / 1000000UL))
+
+/**
+ * The SPI clock for the SD card once it has been initialised, see
+ * SDCard_fastMode()
+ */
+#define SIM_SPI_HZ 12500000UL
+
+/**
+ * The size of the simulated card in sectors, which must hold two
+ * preallocated data files (see DATAFILE_PREALLOC)
+ */
+#ifndef SIM_DISK_SECTORS
+#define SIM_DISK_SECTORS (256UL * 2048UL)
+#endif
+
+/**
+ * @struct CardProfile
+ * @brief How long a simulated SD card takes to do things.
+ *
+ * Each sector written keeps the card busy for busy_us, plus single_us if it
+ * was written on its own (CMD24) rather than as part of a multiple block
+ * write. On top of that, a sector has a stall_per in 10000 chance of
+ * stalling the card for between stall_min_us and stall_max_us (such as when
+ * the card moves on to a new erase block), and a gc_per in 10000 chance of a
+ * much longer stall of gc_min_us to gc_max_us (the card's own garbage
+ * collection). Reading a sector takes read_us before the data comes back.
+ *
+ * @var CardProfile::name
+ * The name to select the profile with.
+ */
+typedef struct CardProfile
+{
+    const char *name;
+    uint32_t busy_us, single_us, read_us;
+    uint16_t stall_per;
+    uint32_t stall_min_us, stall_max_us;
+    uint16_t gc_per;
+    uint32_t gc_min_us, gc_max_us;
+} CardProfile;
+
+/// Where the binary data sent with uart_write() goes, if anywhere (see hw.c)
+extern FILE *hw_uart;
+
+uint32_t sim_random(void);
+
+void disk_create(const CardProfile *card);
+const CardProfile *disk_card(const char *name);
+void disk_list(void);
+
+void hw_frame(void);
+uint16_t hw_crc(const char *data, uint16_t n);
+
+// The interrupt handlers, which the simulator calls
+void TIMER1_A0_ISR(void);
+void TIMER2_A1_ISR(void);
+void DMA_ISR(void);
+void PORT1_ISR(void);
+
+#endif /* __SIM_H__ */
+
+/**
+ * @}
+ */
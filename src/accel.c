@@ -7,6 +7,19 @@
  * approach to getting data from the accelerometer such that very little CPU
  * time is required (since the logger is typically busy with other things).
  *
+ * The sensor is read when it says that it has new data, on its data ready
+ * line (ACCEL_INT), rather than once per frame, so it is read at its output
+ * data rate however fast the frames are and every frame takes the latest
+ * reading. Each read is a burst of all of the axes in the channel map (see
+ * channels.h) in one chip select window, clocked out by USCI_A0_ISR() from a
+ * table of the bytes to send. The DMA channels are all in use (by the ADC and
+ * the SD card), so this costs an interrupt per byte, which is short. The
+ * readings go into the SampleBuffer together at the end of the burst, so a
+ * frame never gets axes from two different readings.
+ *
+ * The range and output data rate can be changed at run time (see
+ * Cma3000_setMode()), and are in the header of every block logged.
+ *
  *  HAL_Cma3000.c - Code for using the CMA3000-D01 3-Axis Ultra Low Power
  *                  Accelerometer
  *
@@ -47,9 +60,11 @@
  */
 
 #include <inttypes.h>
+#include <stdlib.h>
 #include "msp430.h"
 #include "accel.h"
 #include "system.h"
+#include "profile.h"
 #include "uart.h"
 
 static int8_t accelData;
@@ -68,14 +83,37 @@ static volatile SampleBuffer *sb;
  */
 static volatile accel_state_t accel_state;
 
+/// Set once the sensor has started, it is never read otherwise
+static uint8_t present;
+
+/// The range (in g) and output data rate (in Hz) that the sensor is in
+static uint8_t mode_range = ACCEL_RANGE;
+static uint16_t mode_rate = ACCEL_RATE;
+
+/// The bytes sent in a burst read, being the address of each axis in the
+/// channel map followed by a dummy byte to clock its data in
+static const uint8_t burst[2 * ACCEL_CHANNELS] = LOG_ACCEL_BURST;
+
+/// The next byte of burst[] to send, and the axes read so far in this burst
+static volatile uint8_t burst_pos;
+static uint8_t burst_data[ACCEL_CHANNELS];
+
+static uint8_t ctrl_bits(uint8_t range, uint16_t rate);
+static void ready_enable(void);
+
 /**
- * Configures the CMA3000-D01 3-Axis Ultra Low Power Accelerometer
+ * Configures the CMA3000-D01 3-Axis Ultra Low Power Accelerometer, in
+ * ACCEL_RANGE and at ACCEL_RATE. If it hasn't started after
+ * CMA3000_INIT_TRIES goes, which take about 1ms each, we give up on it rather
+ * than hold up logging the other channels, and its axes are logged as 0.
+ * Otherwise it is read from then on whenever it has new data.
  * @param samplebuffer The SampleBuffer in which to place accelerometer data
  * samples.
+ * @returns 0 for success, non-0 if the sensor didn't start.
  */
-void Cma3000_init(volatile SampleBuffer *samplebuffer)
+uint8_t Cma3000_init(volatile SampleBuffer *samplebuffer)
 {
-    uint8_t i;
+    uint8_t i, tries = 0;
     sb = samplebuffer;
     
     do
@@ -121,8 +159,9 @@ void Cma3000_init(volatile SampleBuffer *samplebuffer)
         RevID = Cma3000_readRegister(REVID);
         __delay_cycles(50 * TICKSPERUS);
 
-        // Activate measurement mode: 2g/400Hz
-        accelData = Cma3000_writeRegister(CTRL, G_RANGE_2 | I2C_DIS | MODE_400);
+        // Activate measurement mode
+        accelData = Cma3000_writeRegister(CTRL,
+                ctrl_bits(mode_range, mode_rate));
 
         // Settling time per DS = 10ms
         __delay_cycles(1000 * TICKSPERUS);
@@ -131,14 +170,150 @@ void Cma3000_init(volatile SampleBuffer *samplebuffer)
         ACCEL_INT_IE  &= ~ACCEL_INT;
 
         // Repeat till interrupt Flag is set to show sensor is working
-    } while (!(ACCEL_INT_IN & ACCEL_INT));
+        present = (ACCEL_INT_IN & ACCEL_INT) ? 1 : 0;
+    } while (!present && ++tries < CMA3000_INIT_TRIES);
 
     // Clear the sample buffer accelerometer data
     for(i=0; i < ACCEL_CHANNELS; i++)
         sb->accel[i] = 0;
+    if(!present)
+        return 1;
 
-    // Fire an interrupt when we get a new char
+    // Fire an interrupt when we get a new char, and start reading
     UCA0IE |= UCRXIE;
+    ready_enable();
+    return 0;
+}
+
+/**
+ * Change the range and output data rate of the accelerometer. Any read that
+ * is under way is let finish first, since the SPI bus is shared with it. This
+ * must only be called from the foreground.
+ *
+ * @param range The range in g, 2 or 8.
+ * @param rate The output data rate in Hz, 40, 100 or 400.
+ * @returns 0 for success, non-0 if the mode isn't valid or there is no sensor.
+ */
+uint8_t Cma3000_setMode(uint8_t range, uint16_t rate)
+{
+    uint8_t ctrl = ctrl_bits(range, rate);
+
+    if(!ctrl || !present)
+        return 1;
+
+    // Stop starting reads, then wait for the last one to finish
+    ACCEL_INT_IE &= ~ACCEL_INT;
+    while(accel_state == STATE_ACCEL_BUSY);
+
+    // The register is written by polling, so the ISR must keep out of it
+    UCA0IE &= ~UCRXIE;
+    Cma3000_writeRegister(CTRL, ctrl);
+    mode_range = range;
+    mode_rate = rate;
+    UCA0IE |= UCRXIE;
+
+    ready_enable();
+    return 0;
+}
+
+/**
+ * Get the range and output data rate that the accelerometer is in. This may be
+ * called from an ISR.
+ *
+ * @param range Where to put the range in g.
+ * @param rate Where to put the output data rate in Hz.
+ */
+void Cma3000_getMode(uint8_t *range, uint16_t *rate)
+{
+    *range = mode_range;
+    *rate = mode_rate;
+}
+
+/**
+ * Handle a line received over the UART if it sets the accelerometer mode,
+ * being 'A' then the range and the rate, for example "A8,100" for 8g at
+ * 100Hz. The mode is in every block header, so it can't be changed whilst a
+ * data file is being logged.
+ *
+ * @param line The line, without its terminator.
+ * @param busy Non-zero if a data file is being logged.
+ * @returns Non-zero if the line set the mode.
+ */
+uint8_t Cma3000_command(char *line, uint8_t busy)
+{
+    char *end;
+    uint8_t range;
+    uint16_t rate;
+
+    if(line[0] != 'A')
+        return 0;
+    if(busy)
+    {
+        uart_debug("[WARN] Can't change accel mode whilst logging");
+        return 0;
+    }
+    range = strtoul(line + 1, &end, 10);
+    if(*end != ',')
+    {
+        uart_debug("[WARN] Bad accel mode");
+        return 0;
+    }
+    rate = strtoul(end + 1, &end, 10);
+    if(*end || Cma3000_setMode(range, rate))
+    {
+        uart_debug("[WARN] Bad accel mode");
+        return 0;
+    }
+    uart_debug("Accel mode set");
+    return 1;
+}
+
+/**
+ * Work out the CTRL register value for a mode.
+ *
+ * @param range The range in g.
+ * @param rate The output data rate in Hz.
+ * @returns The value, or 0 if the mode isn't valid.
+ */
+static uint8_t ctrl_bits(uint8_t range, uint16_t rate)
+{
+    uint8_t ctrl = I2C_DIS;
+
+    if(range == 2)
+        ctrl |= G_RANGE_2;
+    else if(range == 8)
+        ctrl |= G_RANGE_8;
+    else
+        return 0;
+
+    switch(rate)
+    {
+        case 40:
+            return ctrl | MODE_40;
+        case 100:
+            return ctrl | MODE_100;
+        case 400:
+            return ctrl | MODE_400;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Enable the data ready interrupt, on the rising edge of ACCEL_INT. If the
+ * line went high before then the edge has been missed, so the data that is
+ * waiting is read straight away instead.
+ */
+static void ready_enable(void)
+{
+    uint16_t gie = __read_status_register() & GIE;
+
+    __disable_interrupt();
+    ACCEL_INT_IFG &= ~ACCEL_INT;
+    ACCEL_INT_IE |= ACCEL_INT;
+    if(ACCEL_INT_IN & ACCEL_INT)
+        Cma3000_readAccelFSM();
+    __bis_SR_register(gie);
 }
 
 /**
@@ -238,20 +413,22 @@ int8_t Cma3000_readRegister(uint8_t Address)
 }
 
 /**
- * Commence reading of data into the SampleBuffer
+ * Commence a burst read of the axes into the SampleBuffer, unless one is
+ * already under way. This is called from the data ready interrupt (see
+ * PORT2_ISR() in logger.c) with interrupts disabled.
  */
 void Cma3000_readAccelFSM(void)
 {
-    accel_state = STATE_ACCEL_NONE;
+    if(!present || accel_state == STATE_ACCEL_BUSY)
+        return;
 
     // Assert CS
     ACCEL_OUT &= ~ACCEL_CS;
 
-    // Transmit the first byte (the FSM will handle from here on)
-    UCA0TXBUF = DOUTX << 2;
-
-    // Move into the first state
-    accel_state = STATE_ACCEL_XREQ;
+    // Transmit the first byte (the ISR will handle from here on)
+    burst_pos = 1;
+    accel_state = STATE_ACCEL_BUSY;
+    UCA0TXBUF = burst[0];
 }
 
 /**
@@ -319,60 +496,42 @@ int8_t Cma3000_writeRegister(uint8_t Address, int8_t accelData)
 }
 
 /**
- * Interrupt whenever we get a new byte from the accelerometer. We should
- * update the state machine and process the byte accordingly.
+ * Interrupt whenever we get a new byte from the accelerometer. Every second
+ * byte of a burst is the data of an axis, after which we send the next byte of
+ * the burst, until it has all been sent and the readings are stored.
  */
 interrupt(USCI_A0_VECTOR) USCI_A0_ISR(void)
 {
+    uint8_t d, i;
+    PROFILE_START(t);
+
     switch(UCA0IV)
     {
         case USCI_UCRXIFG:
-            // Process depending on current accel state
-            switch(accel_state)
+            d = UCA0RXBUF;
+            if(accel_state != STATE_ACCEL_BUSY)
+                break;
+
+            // The byte that has just been clocked in followed burst_pos - 1
+            if(!(burst_pos & 1))
+                burst_data[burst_pos / 2 - 1] = d;
+            if(burst_pos < sizeof(burst))
             {
-                case STATE_ACCEL_NONE:
-                    // What are we doing here?
-                    break;
-                case STATE_ACCEL_XREQ:
-                    // Transmit a dummy to get data x
-                    UCA0TXBUF = 0;
-                    accel_state = STATE_ACCEL_XRDY;
-                    break;
-                case STATE_ACCEL_XRDY:
-                    // We've got data x, store it and move to y
-                    sb->accel[0] = UCA0RXBUF;
-                    UCA0TXBUF = DOUTY << 2;
-                    accel_state = STATE_ACCEL_YREQ;
-                    break;
-                case STATE_ACCEL_YREQ:
-                    // Transmit a dummy to get Y
-                    UCA0TXBUF = 0;
-                    accel_state = STATE_ACCEL_YRDY;
-                    break;
-                case STATE_ACCEL_YRDY:
-                    // We've got y, store it and move to z
-                    sb->accel[1] = UCA0RXBUF;
-                    UCA0TXBUF = DOUTZ << 2;
-                    accel_state = STATE_ACCEL_ZREQ;
-                    break;
-                case STATE_ACCEL_ZREQ:
-                    // Transmit a dummy to get z
-                    UCA0TXBUF = 0;
-                    accel_state = STATE_ACCEL_ZRDY;
-                    break;
-                case STATE_ACCEL_ZRDY:
-                    // We've got z, store it and finish
-                    sb->accel[2] = UCA0RXBUF;
-                    accel_state = STATE_ACCEL_DONE;
-                    // Deselect acceleration sensor
-                    ACCEL_OUT |= ACCEL_CS;
-                    break;
-                default: break;
+                UCA0TXBUF = burst[burst_pos++];
+                break;
             }
+
+            // Deselect acceleration sensor and store the axes together
+            ACCEL_OUT |= ACCEL_CS;
+            for(i = 0; i < ACCEL_CHANNELS; i++)
+                sb->accel[i] = burst_data[i];
+            accel_state = STATE_ACCEL_DONE;
             break;
         default:
             break;
     }
+
+    PROFILE_END(PROF_ACCEL_ISR, t);
 }
 
 /**
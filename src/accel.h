@@ -77,13 +77,31 @@
 // ACCELEROMETER REGISTER DEFINITIONS
 #define REVID                   0x01
 #define CTRL                    0x02
+#define MODE_100                0x02        // Measurement mode 100 Hz ODR
 #define MODE_400                0x04        // Measurement mode 400 Hz ODR
+#define MODE_40                 0x06        // Measurement mode 40 Hz ODR
 #define DOUTX                   0x06
 #define DOUTY                   0x07
 #define DOUTZ                   0x08
 #define G_RANGE_2               0x80        // 2g range
+#define G_RANGE_8               0x00        // 8g range
 #define I2C_DIS                 0x10        // I2C disabled
 
+// The number of times to try starting the sensor before giving up on it
+#define CMA3000_INIT_TRIES      10
+
+/**
+ * The measurement range in g (2 or 8) and output data rate in Hz (40, 100 or
+ * 400) that the accelerometer starts in. These can be changed between data
+ * files with a command over the UART, see Cma3000_command().
+ */
+#ifndef ACCEL_RANGE
+#define ACCEL_RANGE 2
+#endif
+#ifndef ACCEL_RATE
+#define ACCEL_RATE 400
+#endif
+
 /**
  * @var Cma3000_xAccel
  * Data value x from the accelerometer.
@@ -103,29 +121,22 @@ typedef enum accel_state_t
 {
     /// We have no or invalid data in the SampleBuffer
     STATE_ACCEL_NONE,
-    /// We have requested the data value for X
-    STATE_ACCEL_XREQ,
-    /// A data value for X is ready
-    STATE_ACCEL_XRDY,
-    /// We have requested the data value for Y
-    STATE_ACCEL_YREQ,
-    /// A data value for Y is ready
-    STATE_ACCEL_YRDY,
-    /// We have requested the data value for Z
-    STATE_ACCEL_ZREQ,
-    /// A data value for Z is ready
-    STATE_ACCEL_ZRDY,
+    /// A burst read of the axes is under way
+    STATE_ACCEL_BUSY,
     /// We have completed, there is a full set of valid data in the
     /// SampleBuffer
     STATE_ACCEL_DONE
 } accel_state_t;
 
-extern void Cma3000_init(volatile SampleBuffer *samplebuffer);
+extern uint8_t Cma3000_init(volatile SampleBuffer *samplebuffer);
 extern void Cma3000_disable(void);
 extern void Cma3000_readAccel(void);
 extern int8_t Cma3000_readRegister(uint8_t Address);
 void Cma3000_readAccelFSM(void);
 accel_state_t Cma3000_getState(void);
+uint8_t Cma3000_setMode(uint8_t range, uint16_t rate);
+void Cma3000_getMode(uint8_t *range, uint16_t *rate);
+uint8_t Cma3000_command(char *line, uint8_t busy);
 extern int8_t Cma3000_writeRegister(uint8_t Address, int8_t Data);
 
 #endif /* HAL_MENU_H */
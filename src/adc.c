@@ -3,10 +3,21 @@
  * converter unit, plus starting conversions and post-handling the conversion
  * results.
  *
- * We use DMA channel 0 to move results from the ADC conversion memory into a
- * SampleBuffer once the conversion has completed, such that the CPU need only
- * request the beginning of a conversion run and some time later, the results
- * will appear in the SampleBuffer that the CPU specified.
+ * Conversion runs are triggered in hardware by the sampling timer (the TA0.1
+ * output, see logger_init()) and we use DMA channel 0 to move results from the
+ * ADC conversion memory into a SampleBuffer once the conversion has completed.
+ * The CPU need only re-arm the ADC and DMA with adc_arm() once each run has
+ * finished, typically pointing the DMA straight at the next frame in the SD
+ * ring buffer. Each run converts only the channels asked for, so channels that
+ * are logged at a lower rate don't cost conversion time or DMA transfers. The
+ * sequence of conversions is only rewritten when the channels in a run
+ * change, so if every channel is logged in every frame it is written once.
+ *
+ * Channels can also be oversampled (see channels.h), in which case they are
+ * converted several times in a row in each run. All of the conversions of an
+ * oversampled run are moved by the DMA into a small accumulation buffer
+ * instead, and adc_collect() then sums them into the frame. All of this is
+ * left out if no channel in the channel map is oversampled.
  *
  * @file adc.c
  * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
@@ -19,11 +30,44 @@
 #include "adc.h"
 #include "system.h"
 
+#if ADC_MEMORIES_USED > ADC_MEMORIES
+#error "The oversampling ratios in the channel map need too many memories"
+#endif
+
+/// The analogue input for each ADC channel, in the order of SampleBuffer::adc
+static const uint8_t adc_inputs[ADC_CHANNELS] = LOG_ADC_INPUTS;
+
+/// The oversampling ratio for each ADC channel, the number of bits its sum is
+/// shifted down by, and the number of bits in its logged value
+static const uint8_t adc_osr[ADC_CHANNELS] = LOG_ADC_OSR;
+static const uint8_t adc_logged_bits[ADC_CHANNELS] = LOG_ADC_BITS;
+
+/// The channels in the current run, the number of them and the number of
+/// conversions that they take
+static uint16_t adc_mask;
+static uint8_t adc_count, adc_words;
+
+#if ADC_OVERSAMPLED
+static const uint8_t adc_shift[ADC_CHANNELS] = LOG_ADC_SHIFTS;
+
+/// The conversion results of an oversampled run, before they are summed
+static uint16_t adc_acc[ADC_MEMORIES];
+
+/// Whether the current run is oversampled
+static uint8_t adc_over;
+
+/// Where the summed results of the current run should go, or NULL if the run
+/// isn't oversampled and the DMA is putting the results there directly
+static volatile uint16_t *adc_dest;
+#endif
+
 /**
  * Set up the ADC clock and configure resolution, then enable the ADC
- * unit. Configure the memory channels to physical inputs. Configure the DMA
- * unit on DMA channel 0 to automatically move data from the ADC conversion
- * memory into the sample buffer at the end of each conversion run.
+ * unit. Configure the memory channels to physical inputs and have each
+ * conversion run triggered by a rising edge of the TA0.1 output. Configure the
+ * DMA unit on DMA channel 0 to automatically move data from the ADC conversion
+ * memory into the sample buffer at the end of each conversion run, and to
+ * interrupt once it has done so.
  *
  * @param sb A pointer to the sample buffer into which we will put ADC
  * readings.
@@ -36,6 +80,9 @@ void adc_init(volatile SampleBuffer *sb)
     for(i = 0; i < ADC_CHANNELS; i++)
         sb->adc[i] = 0;
 
+    // The sequence is written by the first adc_arm()
+    adc_mask = 0;
+
     // Be sure that conversions are disabled
     ADC12CTL0 &= ~ADC12ENC;
 
@@ -46,22 +93,13 @@ void adc_init(volatile SampleBuffer *sb)
 
     // If using external reference or AVCC then we can have 5MHz maximum
     // ADC12CLK, so divide by 5 to get 5MHz from 25MHz SMCLK
-    // Use the sampling timer (SHP) and sequential conversion mode
-    ADC12CTL1 |= ADC12DIV_4 | ADC12SSEL_3 | ADC12SHP | ADC12CONSEQ_1;
-
-    // A6, A7, A12, A13, A14, A15 are broken out, set these as sources for
-    // ADC12MEM0-5 with AVCC as +ve and AVSS as -ve
-    ADC12MCTL0 = ADC12INCH_6;
-    ADC12MCTL1 = ADC12INCH_7;
-    ADC12MCTL2 = ADC12INCH_12;
-    ADC12MCTL3 = ADC12INCH_13;
-    ADC12MCTL4 = ADC12INCH_14;
-    ADC12MCTL5 = ADC12INCH_15;
-    // Set end of sequence (EOS) for final channel
-    ADC12MCTL6 = ADC12INCH_5 | ADC12EOS;
-
-    // Enable conversions last, can't modify ADC12ON whilst ADC12ENC=1
-    ADC12CTL0 |= ADC12ENC;
+    // Use the sampling timer (SHP) and sequential conversion mode, with each
+    // sequence started by the TA0 CCR1 output (ADC12SHS_1)
+    ADC12CTL1 |= ADC12DIV_4 | ADC12SSEL_3 | ADC12SHP | ADC12CONSEQ_1
+        | ADC12SHS_1;
+
+    // Conversions are enabled by adc_arm() once the sequence of channels
+    // is set up, ADC12ON can't be modified whilst ADC12ENC=1
 
     // Now set up DMA to transfer ADC readings to the ADC buffer
     // Set DMA channel 0 trigger to ADC12IFGx
@@ -73,25 +111,124 @@ void adc_init(volatile SampleBuffer *sb)
     // Select block transfer, increment both source and dest addresses
     DMA0CTL |= DMADT_1 | DMADSTINCR_3 | DMASRCINCR_3;
 
-    // Set source address to first ADC conversion memory, destination to ADC
-    // buffer, transfer 6 words (6 channels)
+    // Set source address to first ADC conversion memory, the destination and
+    // number of words are set for each run by adc_arm()
     DMA0SA = (uintptr_t)&ADC12MEM0;
-    DMA0DA = (uintptr_t)(sb->adc);
-    DMA0SZ = ADC_CHANNELS;
+
+    // Interrupt at the end of each block so that the logger can re-arm us
+    DMA0CTL |= DMAIE;
 }
 
 /**
- * Enable DMA on channel 0 which will move data to the sample buffer
- * after the ADC conversion run has completed, then begin the conversion
- * run.
+ * Arm the ADC and DMA channel 0 for the next conversion run, which will begin
+ * on the next rising edge of the sampling timer output. The run converts only
+ * the channels in mask and their results are transferred to dest by the DMA,
+ * in channel order, which interrupts once they are there.
+ *
+ * If any of the channels are oversampled, the DMA transfers the conversions
+ * into the accumulation buffer instead and adc_collect() must be called once
+ * the run has completed to put the results in dest.
+ *
+ * @note This must only be called whilst no conversion run is in progress,
+ * typically from the DMA interrupt at the end of the previous run.
+ *
+ * @param dest A pointer to enough words to receive the results.
+ * @param mask The channels to convert, bit n set for SampleBuffer::adc[n].
+ * This must have at least one bit set.
+ * @returns The number of channels in the run.
  */
-void adc_convert(void)
+uint8_t adc_arm(volatile uint16_t *dest, uint16_t mask)
 {
-    // Enable DMA on Channel 0
+    volatile uint8_t *mctl = &ADC12MCTL0;
+    uint8_t i, j, n = 0, m = 0;
+
+    // With a trigger source other than ADC12SC, ADC12ENC must be toggled
+    // between each conversion sequence. Whilst it's clear, we can also
+    // rewrite the sequence of channels.
+    ADC12CTL0 &= ~ADC12ENC;
+
+    // Put the requested channels into consecutive conversion memories with
+    // AVCC as +ve and AVSS as -ve, once for each time they're oversampled,
+    // and set end of sequence (EOS) for the last. The memories keep the
+    // sequence, so this is only done when the channels change.
+    if(mask != adc_mask)
+    {
+#if ADC_OVERSAMPLED
+        adc_over = 0;
+#endif
+        for(i = 0; i < ADC_CHANNELS; i++)
+        {
+            if(mask & _BV(i))
+            {
+                for(j = 0; j < adc_osr[i]; j++)
+                    mctl[m++] = adc_inputs[i];
+#if ADC_OVERSAMPLED
+                if(adc_osr[i] > 1)
+                    adc_over = 1;
+#endif
+                n++;
+            }
+        }
+        mctl[m - 1] |= ADC12EOS;
+        adc_mask = mask;
+        adc_count = n;
+        adc_words = m;
+    }
+
+    // Point DMA channel 0 at the destination and enable it
+#if ADC_OVERSAMPLED
+    adc_dest = adc_over ? dest : NULL;
+    DMA0DA = adc_over ? (uintptr_t)adc_acc : (uintptr_t)dest;
+#else
+    DMA0DA = (uintptr_t)dest;
+#endif
+    DMA0SZ = adc_words;
     DMA0CTL |= DMAEN;
 
-    // Start conversion and wait until the DMA transfer completes
-    ADC12CTL0 |= ADC12SC;
+    ADC12CTL0 |= ADC12ENC;
+    return adc_count;
+}
+
+/**
+ * Once an oversampled conversion run has completed, sum the conversions of
+ * each channel in the accumulation buffer and put the results in the
+ * destination given to adc_arm(). This does nothing if the run was not
+ * oversampled.
+ *
+ * @note A sum of up to 16 12 bit conversions always fits in 16 bits.
+ */
+void adc_collect(void)
+{
+#if ADC_OVERSAMPLED
+    uint16_t *res = adc_acc;
+    uint16_t sum;
+    uint8_t i, j, n = 0;
+
+    if(!adc_dest)
+        return;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(adc_mask & _BV(i))
+        {
+            for(sum = 0, j = 0; j < adc_osr[i]; j++)
+                sum += *res++;
+            adc_dest[n++] = sum >> adc_shift[i];
+        }
+    }
+#endif
+}
+
+/**
+ * Get the number of bits in the logged value of an ADC channel, which is more
+ * than the 12 bits of the converter if it is oversampled.
+ *
+ * @param ch The channel, as an index into SampleBuffer::adc.
+ * @returns The number of bits in the logged value of the channel.
+ */
+uint8_t adc_bits(uint8_t ch)
+{
+    return adc_logged_bits[ch];
 }
 
 /**
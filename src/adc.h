@@ -14,8 +14,16 @@
 #include "typedefs.h"
 #include "logger.h"
 
+/**
+ * The number of conversion memories in the ADC12, which is the most
+ * conversions that can be made in one run.
+ */
+#define ADC_MEMORIES 16
+
 void adc_init(volatile SampleBuffer *sb);
-void adc_convert(void);
+uint8_t adc_arm(volatile uint16_t *dest, uint16_t mask);
+void adc_collect(void);
+uint8_t adc_bits(uint8_t ch);
 
 #endif /* __ADC_H__ */
 
@@ -0,0 +1,304 @@
+/**
+ * A benchmark for qualifying SD cards at the bench, built with 'make bench'
+ * in place of the logger (see BENCH).
+ *
+ * Each test times BENCH_OPS operations through the same FatFs, mmc.c and
+ * HAL_SDCard.c code that the logger uses, and reports the throughput along
+ * with the minimum, median, 90th and 99th percentile and maximum time per
+ * operation over the UART. The tests are:
+ *
+ * - single write: one sector per disk_write() (CMD24), as FatFs does.
+ * - multi write: BENCH_MULTI sectors per disk_write() (CMD25 and ACMD23).
+ * - stream write: one sector per disk_write() within an open-ended multiple
+ *   block write (see CTRL_STREAM), as the logger does.
+ * - busy: the time for the card to program a single sector write, that is
+ *   how long it stays busy afterwards.
+ * - random read: one sector per disk_read() from anywhere in the test area.
+ * - f_write: one sector per f_write() to a new file, so including the FatFs
+ *   cluster allocation that the logger avoids by preallocating.
+ *
+ * The raw tests use the sectors of a contiguous BENCH_AREA byte scratch file,
+ * so that nothing else on the card is touched, and the scratch files are
+ * deleted afterwards. Finally the histograms from the Profile module are
+ * dumped, which give the spread of the disk_write() and wait_ready() times
+ * over all of the tests. The slowest operation is usually what matters, since
+ * that is what the SD buffer has to ride out whilst logging.
+ *
+ * @file bench.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Bench
+ * @{
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "HAL_Dogs102x6.h"
+#include "bench.h"
+#include "diskio.h"
+#include "ff.h"
+#include "mmc.h"
+#include "profile.h"
+#include "system.h"
+#include "uart.h"
+
+#if BENCH
+
+#if !PROFILE
+#error "The benchmark is timed by the Profile module, so needs PROFILE set"
+#endif
+
+/**
+ * A timed operation, given the number of the operation within the test
+ */
+typedef uint8_t (*BenchOp)(uint16_t i);
+
+/// The data written to the card, and read back into
+static char buf[BENCH_MULTI * 512];
+
+/// The time taken by each operation in the current test, in timer ticks
+static prof_time_t lat[BENCH_OPS];
+
+/// The filesystem and the scratch file
+static FATFS fs;
+static FIL fil;
+
+/// The first sector of the contiguous scratch file
+static DWORD start;
+
+/// The state of the random sector generator
+static uint32_t seed;
+
+/// A string buffer for the UART
+static char s[UART_BUF_LEN];
+
+static const BYTE stream_on = 1, stream_off = 0;
+
+static void bench_test(const char *name, BenchOp op, BenchOp pre,
+        uint32_t bytes);
+static void bench_report(const char *name, prof_time_t total,
+        uint32_t bytes, uint16_t fails);
+static uint8_t op_write(uint16_t i);
+static uint8_t op_multi(uint16_t i);
+static uint8_t op_sync(uint16_t i);
+static uint8_t op_read(uint16_t i);
+static uint8_t op_fwrite(uint16_t i);
+
+/**
+ * Run each of the tests in turn and report the results over the UART. This
+ * waits for an SD card to be inserted, and returns once the tests are done.
+ */
+void bench_run(void)
+{
+    FRESULT fr;
+    DWORD nsect;
+    uint16_t i;
+
+    // Wait for an SD card to be inserted
+    while(!detectCard())
+    {
+        _delay_ms(250);
+        lcd_debug("Insert SD Card");
+    }
+    lcd_debug("Benchmarking...");
+
+    fr = f_mount(0, &fs);
+    while(fr != FR_OK)
+    {
+        sprintf(s, "Mount fail: %d", fr);
+        uart_debug(s);
+        _delay_ms(100);
+        fr = f_mount(0, &fs);
+    }
+
+    // Make a contiguous scratch file for the raw tests, in the same way as
+    // the logger preallocates its data files
+    fr = f_open(&fil, "BENCH.TMP", FA_CREATE_ALWAYS | FA_WRITE);
+    if(fr == FR_OK)
+        fr = f_expand(&fil, BENCH_AREA);
+    if(fr == FR_OK)
+        fr = f_sync(&fil);
+    if(fr != FR_OK)
+    {
+        sprintf(s, "Scratch file fail: %d", fr);
+        uart_debug(s);
+        lcd_debug(s);
+        return;
+    }
+    start = fs.database + (fil.sclust - 2) * fs.csize;
+
+    // Fill the buffer with something other than all 0s or 1s, which some
+    // cards may treat specially
+    for(i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)(i * 37 + 11);
+    seed = 1;
+
+    uart_debug("SD card benchmark");
+    if(disk_ioctl(0, GET_SECTOR_COUNT, &nsect) == RES_OK)
+    {
+        sprintf(s, "Card: %lu sectors", nsect);
+        uart_debug(s);
+    }
+    sprintf(s, "%u ops per test", BENCH_OPS);
+    uart_debug(s);
+    profile_reset();
+
+    bench_test("single write", op_write, NULL, 512);
+    bench_test("multi write", op_multi, NULL, BENCH_MULTI * 512UL);
+    disk_ioctl(0, CTRL_STREAM, (void *)&stream_on);
+    bench_test("stream write", op_write, NULL, 512);
+    disk_ioctl(0, CTRL_STREAM, (void *)&stream_off);
+    bench_test("busy", op_sync, op_write, 0);
+    bench_test("random read", op_read, NULL, 512);
+
+    f_close(&fil);
+    f_unlink("BENCH.TMP");
+
+    // Now through FatFs, allocating the clusters as we go
+    fr = f_open(&fil, "BENCH2.TMP", FA_CREATE_ALWAYS | FA_WRITE);
+    if(fr == FR_OK)
+    {
+        bench_test("f_write", op_fwrite, NULL, 512);
+        f_close(&fil);
+        f_unlink("BENCH2.TMP");
+    }
+
+    // The spread of the card operations over all of the tests
+    profile_dump();
+
+    uart_debug("Benchmark done");
+    lcd_debug("Benchmark done");
+}
+
+/**
+ * Time BENCH_OPS runs of an operation, then report the results.
+ *
+ * @param name The name of the test for the report.
+ * @param op The operation to be timed.
+ * @param pre An operation to run before each timed one without being timed,
+ * or NULL for none.
+ * @param bytes The number of bytes that each operation transfers, to find the
+ * throughput, or 0 for none.
+ */
+static void bench_test(const char *name, BenchOp op, BenchOp pre,
+        uint32_t bytes)
+{
+    uint16_t i, fails = 0;
+    prof_time_t t, total = 0;
+
+    lcd_debug((char *)name);
+
+    for(i = 0; i < BENCH_OPS; i++)
+    {
+        // Make every sector different
+        buf[0] = (char)i;
+        buf[1] = (char)(i >> 8);
+
+        if(pre && pre(i))
+            fails++;
+        t = profile_now();
+        if(op(i))
+            fails++;
+        lat[i] = profile_now() - t;
+        total += lat[i];
+    }
+
+    bench_report(name, total, bytes * BENCH_OPS, fails);
+}
+
+/**
+ * Sort the times from a test and report the throughput and percentiles over
+ * the UART.
+ *
+ * @param name The name of the test.
+ * @param total The total time taken by the operations in timer ticks.
+ * @param bytes The total number of bytes transferred, or 0 to not report the
+ * throughput.
+ * @param fails The number of operations that failed.
+ */
+static void bench_report(const char *name, prof_time_t total,
+        uint32_t bytes, uint16_t fails)
+{
+    uint16_t i, j;
+    prof_time_t t;
+    uint32_t ms;
+
+    // Insertion sort, there aren't many times and we're in no hurry
+    for(i = 1; i < BENCH_OPS; i++)
+    {
+        t = lat[i];
+        for(j = i; j > 0 && lat[j - 1] > t; j--)
+            lat[j] = lat[j - 1];
+        lat[j] = t;
+    }
+
+    sprintf(s, "%s: %u failed", name, fails);
+    uart_debug(s);
+    ms = PROF_US(total) / 1000;
+    if(bytes && ms)
+    {
+        sprintf(s, "  %lu KB/s", (bytes / 1024) * 1000 / ms);
+        uart_debug(s);
+    }
+    sprintf(s, "  min %luus p50 %luus", PROF_US(lat[0]),
+            PROF_US(lat[BENCH_OPS / 2]));
+    uart_debug(s);
+    sprintf(s, "  p90 %luus p99 %luus",
+            PROF_US(lat[(BENCH_OPS - 1) * 90UL / 100]),
+            PROF_US(lat[(BENCH_OPS - 1) * 99UL / 100]));
+    uart_debug(s);
+    sprintf(s, "  max %luus", PROF_US(lat[BENCH_OPS - 1]));
+    uart_debug(s);
+}
+
+/**
+ * Write the i-th sector of the scratch file.
+ */
+static uint8_t op_write(uint16_t i)
+{
+    return disk_write(0, (BYTE *)buf, start + i, 1) != RES_OK;
+}
+
+/**
+ * Write the i-th group of BENCH_MULTI sectors of the scratch file.
+ */
+static uint8_t op_multi(uint16_t i)
+{
+    return disk_write(0, (BYTE *)buf, start + (DWORD)i * BENCH_MULTI,
+            BENCH_MULTI) != RES_OK;
+}
+
+/**
+ * Wait for the card to finish programming the last write.
+ */
+static uint8_t op_sync(uint16_t i)
+{
+    return disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK;
+}
+
+/**
+ * Read a sector from anywhere in the scratch file.
+ */
+static uint8_t op_read(uint16_t i)
+{
+    seed = seed * 1103515245UL + 12345;
+    return disk_read(0, (BYTE *)buf, start + (seed >> 8) % (BENCH_AREA / 512),
+            1) != RES_OK;
+}
+
+/**
+ * Append a sector to the end of the open file with f_write().
+ */
+static uint8_t op_fwrite(uint16_t i)
+{
+    UINT bw;
+
+    return f_write(&fil, buf, 512, &bw) != FR_OK || bw != 512;
+}
+
+#endif /* BENCH */
+
+/**
+ * @}
+ */
@@ -0,0 +1,58 @@
+/**
+ * Bench header.
+ *
+ * @file bench.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Bench
+ * @{
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "typedefs.h"
+
+/**
+ * Set non-zero (see 'make bench') to build the SD card benchmark firmware,
+ * which runs bench_run() instead of the logger.
+ */
+#ifndef BENCH
+#define BENCH 0
+#endif
+
+/**
+ * The number of timed operations in each test. The time of every operation
+ * is kept (4 bytes each) to find the percentiles.
+ */
+#ifndef BENCH_OPS
+#define BENCH_OPS 256
+#endif
+
+/**
+ * The number of sectors written by each call in the multiple block write
+ * test. A buffer of this many sectors is needed.
+ */
+#ifndef BENCH_MULTI
+#define BENCH_MULTI 4
+#endif
+
+/**
+ * The size in bytes of the contiguous scratch file that the tests write
+ * into and read from. This must hold BENCH_OPS * BENCH_MULTI sectors.
+ */
+#ifndef BENCH_AREA
+#define BENCH_AREA (1024UL * 1024UL)
+#endif
+
+#if BENCH_AREA < (BENCH_OPS * BENCH_MULTI * 512UL)
+#error "BENCH_AREA is too small for BENCH_OPS * BENCH_MULTI sectors"
+#endif
+
+void bench_run(void);
+
+#endif /* __BENCH_H__ */
+
+/**
+ * @}
+ */
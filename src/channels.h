@@ -0,0 +1,177 @@
+/**
+ * The channel map, being the one place where the channels that are logged
+ * are listed. Everything else that depends on the channels is generated from
+ * it when building: the number of channels, the ADC input that each is
+ * converted from (and so the conversion sequences, see adc_arm()), the rate
+ * divisors and oversampling ratios, the trigger settings, the accelerometer
+ * registers read in each burst and the description of the channels for the
+ * host (see chanmap.c in the parser). Since these are all constants, the
+ * sampling path drops whatever a map doesn't need, such as the decimation
+ * scheduler when every channel is logged in every frame, or the summing of
+ * conversions when no channel is oversampled.
+ *
+ * The map below is for the development board. Another map (say for a
+ * vehicle) can be kept in a header of its own which defines ADC_MAP and
+ * ACCEL_MAP in the same way, and built with CHANNELS set to its name, for
+ * example
+ *   make clean all CHANNELS=van.h
+ *
+ * ADC_MAP has a line for each ADC channel, in the order of SampleBuffer::adc
+ * and of the frames on the card:
+ *   CH(name, input, div, osr, level, slope)
+ * - name is what the host calls the channel, which must be a C identifier.
+ * - input is the ADC12INCH_x that it is converted from.
+ * - div is its rate divisor. A channel with a divisor of d is only logged in
+ *   every d-th frame, that is at LOG_RATE/d. For example with a LOG_RATE of
+ *   10kHz, divisors of 2 and 100 would log a channel at 5kHz and 100Hz
+ *   respectively. Divisors must be between 1 and 255.
+ * - osr is its oversampling ratio. A channel with a ratio of r is converted r
+ *   times in a row in each frame it is due in, and the sum of the
+ *   conversions is logged with floor(log2(r)/2) extra bits of resolution: a
+ *   ratio of 4 gives a 13 bit value and a ratio of 16 gives a 14 bit value.
+ *   Ratios must be powers of 2 and the ratios of all channels must add up to
+ *   no more than ADC_MEMORIES.
+ * - level is the level at or above which a frame will cause a trigger in
+ *   trigger mode (see LOG_TRIGGER), in the units logged for the channel (so
+ *   scaled up with oversampling), or 0 for no level trigger.
+ * - slope is the change which will cause a trigger if the channel moves by
+ *   at least this much (up or down) from one logged value to the next, or 0
+ *   for no slope trigger.
+ *
+ * ACCEL_MAP has a line for each accelerometer axis, in the order of
+ * SampleBuffer::accel:
+ *   CH(name, reg, div)
+ * - name is what the host calls the axis, after "ACCEL".
+ * - reg is the CMA3000 register that it is read from (see accel.h).
+ * - div is its rate divisor, as for the ADC channels. The CMA3000 only
+ *   produces new data at its output data rate (400Hz by default, see
+ *   ACCEL_RATE), so there is no point logging an axis faster than that.
+ *
+ * @file channels.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Channels
+ * @{
+ */
+
+#ifndef __CHANNELS_H__
+#define __CHANNELS_H__
+
+#ifdef CHANNEL_MAP
+#include CHANNEL_MAP
+#else
+/// A6, A7, A12, A13, A14, A15 are broken out, A5 is the potentiometer
+#define ADC_MAP(CH) \
+    CH(A6,   ADC12INCH_6,  1, 1, 0, 0) \
+    CH(A7,   ADC12INCH_7,  1, 1, 0, 0) \
+    CH(A12,  ADC12INCH_12, 1, 1, 0, 0) \
+    CH(A13,  ADC12INCH_13, 1, 1, 0, 0) \
+    CH(A14,  ADC12INCH_14, 1, 1, 0, 0) \
+    CH(A15,  ADC12INCH_15, 1, 1, 0, 0) \
+    CH(POT,  ADC12INCH_5,  1, 1, 0, 0)
+
+#define ACCEL_MAP(CH) \
+    CH(X, DOUTX, 1) \
+    CH(Y, DOUTY, 1) \
+    CH(Z, DOUTZ, 1)
+#endif
+
+// The columns of each map, one macro for each thing that is generated.
+// Summing r conversions gives log2(r) more bits, but only half of those are
+// real resolution, so the sum is shifted down by the rest (CH_ADC_SHIFT).
+#define CH_ADC_ONE(name, input, div, osr, level, slope) + 1
+#define CH_ADC_INPUT(name, input, div, osr, level, slope) input,
+#define CH_ADC_DIV(name, input, div, osr, level, slope) div,
+#define CH_ADC_OSR(name, input, div, osr, level, slope) osr,
+#define CH_ADC_LEVEL(name, input, div, osr, level, slope) level,
+#define CH_ADC_SLOPE(name, input, div, osr, level, slope) slope,
+#define CH_ADC_SHIFT(name, input, div, osr, level, slope) \
+    CH_LOG2(osr) - CH_LOG2(osr) / 2,
+#define CH_ADC_BITS(name, input, div, osr, level, slope) \
+    12 + CH_LOG2(osr) / 2,
+#define CH_ADC_MEMORIES(name, input, div, osr, level, slope) + (osr)
+#define CH_ADC_DECIMATED(name, input, div, osr, level, slope) + ((div) > 1)
+#define CH_ADC_OVERSAMPLED(name, input, div, osr, level, slope) + ((osr) > 1)
+#define CH_ADC_BAD(name, input, div, osr, level, slope) \
+    + ((div) < 1 || (div) > 255 || (osr) < 1 || (osr) > 16 \
+            || ((osr) & ((osr) - 1)))
+#define CH_ADC_INDEX(name, input, div, osr, level, slope) ADC_CH_##name,
+#define CH_ACCEL_ONE(name, reg, div) + 1
+#define CH_ACCEL_BURST(name, reg, div) (reg) << 2, 0,
+#define CH_ACCEL_DIV(name, reg, div) div,
+#define CH_ACCEL_DECIMATED(name, reg, div) + ((div) > 1)
+#define CH_ACCEL_BAD(name, reg, div) + ((div) < 1 || (div) > 255)
+#define CH_ACCEL_INDEX(name, reg, div) ACCEL_CH_##name,
+
+/// log2 of an oversampling ratio, which is a power of 2 up to 16
+#define CH_LOG2(r) ((r) >= 16 ? 4 : (r) >= 8 ? 3 : (r) >= 4 ? 2 : (r) >= 2)
+
+/**
+ * The number of ADC channels and accelerometer axes in the map.
+ */
+#define ADC_CHANNELS (0 ADC_MAP(CH_ADC_ONE))
+#define ACCEL_CHANNELS (0 ACCEL_MAP(CH_ACCEL_ONE))
+
+/**
+ * The number of each channel in SampleBuffer::adc and SampleBuffer::accel
+ * (and so in the masks of due channels), by name, such as ADC_CH_POT and
+ * ACCEL_CH_X.
+ */
+enum { ADC_MAP(CH_ADC_INDEX) };
+enum { ACCEL_MAP(CH_ACCEL_INDEX) };
+
+#if defined(LOG_ADC_INPUTS) || defined(LOG_ADC_DIVS) || defined(LOG_ADC_OSR) \
+    || defined(LOG_TRIG_LEVELS) || defined(LOG_TRIG_SLOPES) \
+    || defined(LOG_ACCEL_DIVS)
+#error "The channel settings come from the channel map, set CHANNELS instead"
+#endif
+
+/**
+ * The columns of the map as initialisers for arrays, in channel order.
+ */
+#define LOG_ADC_INPUTS   {ADC_MAP(CH_ADC_INPUT)}
+#define LOG_ADC_DIVS     {ADC_MAP(CH_ADC_DIV)}
+#define LOG_ADC_OSR      {ADC_MAP(CH_ADC_OSR)}
+#define LOG_ADC_SHIFTS   {ADC_MAP(CH_ADC_SHIFT)}
+#define LOG_ADC_BITS     {ADC_MAP(CH_ADC_BITS)}
+#define LOG_TRIG_LEVELS  {ADC_MAP(CH_ADC_LEVEL)}
+#define LOG_TRIG_SLOPES  {ADC_MAP(CH_ADC_SLOPE)}
+#define LOG_ACCEL_DIVS   {ACCEL_MAP(CH_ACCEL_DIV)}
+#define LOG_ACCEL_BURST  {ACCEL_MAP(CH_ACCEL_BURST)}
+
+/**
+ * The number of ADC conversion memories taken when every channel is due.
+ */
+#define ADC_MEMORIES_USED (0 ADC_MAP(CH_ADC_MEMORIES))
+
+/**
+ * The number of channels that aren't logged in every frame, or that are
+ * oversampled. When these are 0, the code for them is left out.
+ */
+#define ADC_DECIMATED (0 ADC_MAP(CH_ADC_DECIMATED))
+#define ACCEL_DECIMATED (0 ACCEL_MAP(CH_ACCEL_DECIMATED))
+#define ADC_OVERSAMPLED (0 ADC_MAP(CH_ADC_OVERSAMPLED))
+
+/**
+ * Every ADC channel and every accelerometer axis, as masks of due channels.
+ */
+#define ADC_MASK_ALL ((uint16_t)((1UL << ADC_CHANNELS) - 1))
+#define ACCEL_MASK_ALL ((uint8_t)((1U << ACCEL_CHANNELS) - 1))
+
+#if ADC_CHANNELS < 1 || ADC_CHANNELS > 16
+#error "The channel map must have from 1 to 16 ADC channels"
+#endif
+
+#if ACCEL_CHANNELS < 1 || ACCEL_CHANNELS > 8
+#error "The channel map must have from 1 to 8 accelerometer axes"
+#endif
+
+#if (0 ADC_MAP(CH_ADC_BAD)) || (0 ACCEL_MAP(CH_ACCEL_BAD))
+#error "The channel map has a divisor or oversampling ratio out of range"
+#endif
+
+#endif /* __CHANNELS_H__ */
+
+/**
+ * @}
+ */
@@ -0,0 +1,40 @@
+/**
+ * Works out CRCs with the CRC16 module, which takes a byte in a single write
+ * so that checking a whole sector costs little more than reading it.
+ *
+ * The CRC is CRC-16-CCITT (polynomial 0x1021, from CRC_SEED, MSB first and
+ * with nothing XORed into the result), as Python's binascii.crc_hqx() works
+ * out. The module shifts each byte in LSB first, so bytes are written through
+ * CRCDIRB (which reverses their bits on the way in) to get the standard
+ * result out of CRCINIRES.
+ *
+ * @file crc.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup CRC
+ * @{
+ */
+
+#include <msp430.h>
+
+#include "crc.h"
+
+/**
+ * Work out the CRC of n bytes. The module isn't shared, so this must not be
+ * called from an ISR.
+ *
+ * @param data A pointer to the bytes.
+ * @param n The number of bytes.
+ * @returns The CRC.
+ */
+uint16_t crc16(const char *data, uint16_t n)
+{
+    CRCINIRES = CRC_SEED;
+    while(n--)
+        CRCDIRB_L = *data++;
+    return CRCINIRES;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,27 @@
+/**
+ * CRC header.
+ *
+ * @file crc.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup CRC
+ * @{
+ */
+
+#ifndef __CRC_H__
+#define __CRC_H__
+
+#include "typedefs.h"
+
+/**
+ * The value that every CRC starts from.
+ */
+#define CRC_SEED 0xFFFF
+
+uint16_t crc16(const char *data, uint16_t n);
+
+#endif /* __CRC_H__ */
+
+/**
+ * @}
+ */
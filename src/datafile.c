@@ -0,0 +1,1109 @@
+/**
+ * Handles the data files on the SD card that the logger writes into.
+ *
+ * Each logging session is written into a numbered series of segment files,
+ * named SSSSNNNN.LOG where SSSS is the session number and NNNN the segment
+ * number, so that a session never overwrites an earlier one. A new segment is
+ * started once the current one reaches DATAFILE_SEGMENT bytes or has been open
+ * for DATAFILE_SEGMENT_TIME milliseconds. Since every sector of the data is a
+ * self-describing block (see logfmt.c), each segment can be decoded on its
+ * own, or the segments of a session can simply be joined back together.
+ *
+ * Each segment is given a single contiguous cluster chain of DATAFILE_PREALLOC
+ * bytes, much as f_expand() would. Once the first sector of that chain is
+ * known, writing the file is simply a case of writing consecutive sectors to
+ * the card through disk_write(), so none of the FatFs cluster allocation
+ * (create_chain() and friends) happens in the middle of a logging session and
+ * the write latency is deterministic. Since the sectors are consecutive, they
+ * also all go out in a single streaming multiple block write (see
+ * CTRL_STREAM in mmc.c).
+ *
+ * The next segment is created and preallocated in the background whilst the
+ * current one is being written, a step at a time from datafile_service(), so
+ * switching segments is just a case of writing the next sector somewhere
+ * else. The old segment is then closed in the background in the same way. If
+ * the next segment isn't ready in time, the current one carries on growing
+ * until it is. Finding a free block for the chain, linking it together and
+ * giving back the unused end of the old one would each take tens of
+ * milliseconds in one go, so these are done straight on the FAT (see
+ * seg_grow() and seg_trim()), going through no more than DATAFILE_FAT_STEP
+ * sectors of it in each step. The FAT always holds a whole chain for the
+ * file, ending in an end of chain mark, so that losing the power part way
+ * through leaves nothing worse than a chain that is longer than it needs to
+ * be, or at most a step's worth of lost clusters.
+ *
+ * The directory entry is brought up to date every DATAFILE_SYNC_PERIOD
+ * milliseconds, again in the background. Since the cluster chain is already
+ * in the FAT, a sync only rewrites the sector holding the directory entry and
+ * restarts the streaming write, so it costs about as much as a sector of
+ * data. On closing, any of the preallocated chain that was not used is handed
+ * back to the filesystem.
+ *
+ * If the power is lost whilst logging, the last segments of the session are
+ * left with the size from their last sync and their whole preallocated chain.
+ * When the card is next mounted, they are recovered in the background (see
+ * seg_recover()) by finding the end of the data in each of them from the
+ * block headers, which carry the session number, setting the size to match
+ * and giving back the rest of the chain.
+ *
+ * Should there be no contiguous block large enough, or a segment outgrow the
+ * preallocated chain, we fall back to writing the file through f_write().
+ *
+ * Mounting the card only reads the directory, so that a session can be
+ * started straight away, with its first segment being preallocated whilst
+ * the frames wait in the SD buffer. Unless the FAT32 FSInfo sector has it,
+ * the number of free clusters on the volume is then counted in the
+ * background as well (see free_count()). From then on FatFs keeps it up to
+ * date as clusters are allocated and freed, and the unused part of each
+ * preallocated chain is added back on, so asking for it (see datafile_free())
+ * never touches the card.
+ *
+ * @file datafile.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Datafile
+ * @{
+ */
+
+#include <stdio.h>
+
+#include "datafile.h"
+#include "diskio.h"
+#include "logfmt.h"
+#include "system.h"
+
+/**
+ * @struct Segment
+ * @brief One segment file of a logging session.
+ * @var Segment::fil
+ * The FatFs file object.
+ * @var Segment::start_sect
+ * The first sector (LBA) of the preallocated chain.
+ * @var Segment::written
+ * The number of bytes written to the segment so far.
+ * @var Segment::nclst
+ * The number of clusters in the preallocated chain so far, or whilst looking
+ * for a block for it, the number of free clusters in a row found so far.
+ * Whilst a segment is being recovered, this is the length of its chain.
+ * @var Segment::clst
+ * The next cluster to look at whilst looking for the block, linking it or
+ * following the chain of a segment being recovered.
+ * @var Segment::mark
+ * The cluster that the search for the block started from.
+ * @var Segment::step
+ * What seg_grow() or seg_recover() has left to do (one of SEG_*).
+ * @var Segment::raw
+ * Set whilst we're writing sectors directly into the preallocated chain.
+ * @var Segment::open
+ * Set whilst the file is open.
+ */
+typedef struct Segment
+{
+    FIL fil;
+    DWORD start_sect;
+    DWORD written;
+    DWORD nclst;
+    DWORD clst;
+    DWORD mark;
+    uint8_t step;
+    uint8_t raw;
+    uint8_t open;
+} Segment;
+
+/**
+ * Where a segment's preallocated chain is up to.
+ */
+#define SEG_IDLE        0   ///< Nothing is being done to the chain
+#define SEG_FIND        1   ///< Looking for a free block for the chain
+#define SEG_LINK        2   ///< Linking the block together in the FAT
+#define SEG_WALK        3   ///< Following the chain of a segment to recover
+#define SEG_PROBE       4   ///< Looking for the end of its data
+#define SEG_TRIM        5   ///< Giving back the end of its chain
+
+/// The end of chain mark, as put_fat() takes it for any type of FAT
+#define FAT_EOC 0x0FFFFFFF
+
+/// What the free cluster count in the FATFS is set to whilst it's counted
+#define FREE_COUNTING 0x80000000
+
+/**
+ * What the segment that isn't being written to (the spare) is waiting for
+ * datafile_service() to do next.
+ */
+#define SPARE_NONE      0   ///< Nothing, no rotation is going to happen
+#define SPARE_RECOVER   1   ///< The last session is being recovered
+#define SPARE_CLOSE     2   ///< The old segment is being closed
+#define SPARE_CREATE    3   ///< The next segment is to be created
+#define SPARE_EXPAND    4   ///< The next segment is being preallocated
+#define SPARE_READY     5   ///< The next segment is ready to write
+
+/// The segment being written to and the spare segment
+static Segment seg[2];
+static Segment *cur, *spare;
+
+/// What the spare segment is waiting for (one of SPARE_*)
+static uint8_t spare_state;
+
+/// The session number, and the number of the segment being written to
+static uint16_t session, segment;
+
+/// The clock time at which the current segment was started
+static clock_time_t seg_time;
+
+/// The clock time at which the current segment was last synced
+static clock_time_t sync_time;
+
+/// The volume that the data files are on
+static FATFS *vol;
+
+/// The session being recovered, and the segments of it left to recover
+static uint16_t rec_session, rec_next, rec_end;
+
+/// The session before it, if that needs recovering as well (or 0), and its
+/// last segment
+static uint16_t rec_older, rec_older_last;
+
+/// The blocks of the segment being recovered before rec_lo hold data, and
+/// those from rec_hi onwards don't
+static DWORD rec_lo, rec_hi;
+
+/// The next FAT entry to count whilst counting the free clusters, or 0
+static DWORD count_clst;
+
+/// The number of free clusters counted so far
+static DWORD count_free;
+
+static const BYTE stream_on = 1, stream_off = 0;
+
+static void seg_name(char *name, uint16_t sn, uint16_t n);
+static FRESULT seg_create(Segment *sg, uint16_t n);
+static void seg_expand(Segment *sg);
+static uint8_t seg_grow(Segment *sg, DWORD n);
+static uint8_t seg_trim(Segment *sg, DWORD n);
+static FRESULT seg_close(Segment *sg);
+static DWORD seg_room(Segment *sg);
+static void seg_rotate(void);
+static uint8_t seg_recover(Segment *sg);
+static void seg_leave(Segment *sg);
+static void rec_start(uint16_t sn, uint16_t last);
+static void free_start(void);
+static uint8_t free_count(DWORD n);
+static DWORD clusters(DWORD n);
+static DWORD fat_step(void);
+static void fat_count(DWORD clst, int32_t n);
+
+/**
+ * Find the number of the last session on the volume, which must have been
+ * registered with f_mount(), so that the next session carries on from it.
+ * This should be called once the card has been mounted, and before a data
+ * file is opened. It only reads the directory; the last segments of that
+ * session are recovered (in case it was cut short by a loss of power) and
+ * the free clusters are counted afterwards, in the background (see
+ * datafile_service()).
+ *
+ * @returns The FatFs result of reading the directory.
+ */
+FRESULT datafile_init(void)
+{
+    FRESULT fr;
+    DIRS dir;
+    FILINFO fno;
+    char name[13];
+    uint16_t n, sn, last = 0, older = 0, older_last = 0;
+    uint8_t i;
+
+    cur = &seg[0];
+    spare = &seg[1];
+    seg[0].open = seg[1].open = 0;
+    seg[0].step = seg[1].step = SEG_IDLE;
+    spare_state = SPARE_NONE;
+    rec_next = rec_end = 0;
+    rec_older = 0;
+    count_clst = 0;
+
+    // Opening the directory is what mounts the volume
+    fr = f_opendir(&dir, "");
+    if(fr)
+        return fr;
+    vol = dir.fs;
+    if(vol->free_clust > vol->n_fatent - 2)
+        free_start();
+
+    // Carry on from the highest numbered session on the card, and keep track
+    // of the one before it
+    session = 0;
+    while(f_readdir(&dir, &fno) == FR_OK && fno.fname[0])
+    {
+        for(i = 0, n = 0, sn = 0; i < 8; i++)
+        {
+            if(fno.fname[i] < '0' || fno.fname[i] > '9')
+                break;
+            if(i < 4)
+                n = n * 10 + (fno.fname[i] - '0');
+            else
+                sn = sn * 10 + (fno.fname[i] - '0');
+        }
+        if(i != 8 || fno.fname[8] != '.' || fno.fname[9] != 'L'
+                || fno.fname[10] != 'O' || fno.fname[11] != 'G')
+            continue;
+        if(n > session)
+        {
+            older = session;
+            older_last = last;
+            session = n;
+            last = sn;
+        } else if(n == session) {
+            if(sn > last)
+                last = sn;
+        } else if(n > older || (n == older && sn > older_last)) {
+            older = n;
+            older_last = sn;
+        }
+    }
+    if(!session)
+        return FR_OK;
+
+    // FatFs looks for free clusters from the start of the volume after
+    // mounting, so have the next session start looking from the end of the
+    // data in the last one instead (the rest of its chain is given back once
+    // it has been recovered)
+    seg_name(name, session, last);
+    if(f_open(&cur->fil, name, FA_READ | FA_OPEN_EXISTING) == FR_OK)
+    {
+        if(cur->fil.sclust)
+            vol->last_clust = cur->fil.sclust + (cur->fil.fsize
+                    ? clusters(cur->fil.fsize) - 1 : 0);
+        f_close(&cur->fil);
+    }
+
+    // The spare segment is used for recovering, so a session that was cut
+    // short whilst the one before it was still being recovered never got past
+    // its first segment
+    rec_start(session, last);
+    if(!last)
+    {
+        rec_older = older;
+        rec_older_last = older_last;
+    }
+    spare_state = SPARE_RECOVER;
+
+    return FR_OK;
+}
+
+/**
+ * Take the next step in recovering the segments of the last session (and of
+ * the one before it, if need be) which may not have been closed, by finding
+ * the end of the data in each of them and setting its size to match. The rest
+ * of its preallocated chain is given back to the filesystem, and if it turns
+ * out to hold no data at all it is deleted. A segment that was closed cleanly
+ * is left as it is.
+ *
+ * Everything up to the size from the last sync is known to be good. The
+ * blocks after that are from the session up to the point at which the power
+ * was lost, and anything after that is left over from an earlier session, so
+ * the end can be found with a binary search of the block headers, reading
+ * one of them into the FatFs window in each step. The chain is followed
+ * through the FAT first, DATAFILE_FAT_STEP sectors at a time, to find how long
+ * it is. A segment that was closed cleanly might end part way through a
+ * sector, which a sync never leaves, and one whose chain isn't contiguous
+ * went through f_write(), so these are left as they are.
+ *
+ * @param sg The segment to recover them with (the spare).
+ * @returns Non-zero if there is more to do.
+ */
+static uint8_t seg_recover(Segment *sg)
+{
+    char name[13];
+    DWORD n, stat = 0, mid;
+
+    switch(sg->step)
+    {
+        case SEG_IDLE:
+            if(rec_next >= rec_end)
+            {
+                if(!rec_older)
+                    return 0;
+                rec_start(rec_older, rec_older_last);
+                rec_older = 0;
+            }
+            seg_name(name, rec_session, rec_next);
+            sg->raw = 0;
+            sg->nclst = 0;
+            if(f_open(&sg->fil, name, FA_READ | FA_WRITE | FA_OPEN_EXISTING))
+            {
+                rec_next++;
+                break;
+            }
+            sg->open = 1;
+            sg->written = sg->fil.fsize;
+            if(sg->written % DATAFILE_SECTOR)
+            {
+                seg_leave(sg);
+                break;
+            }
+
+            // A segment that never got a chain is empty, so is just deleted
+            if(!sg->fil.sclust)
+            {
+                sg->step = SEG_TRIM;
+                break;
+            }
+            sg->clst = sg->fil.sclust;
+            sg->step = SEG_WALK;
+            break;
+
+        case SEG_WALK:
+            for(n = fat_step(); n; n--)
+            {
+                stat = get_fat(vol, sg->clst);
+                sg->nclst++;
+                if(stat != sg->clst + 1)
+                    break;
+                sg->clst++;
+            }
+            if(!n)
+                break;
+            if(stat < vol->n_fatent || stat == 0xFFFFFFFF)
+            {
+                seg_leave(sg);
+                break;
+            }
+            sg->start_sect = vol->database + (sg->fil.sclust - 2) * vol->csize;
+            rec_lo = sg->written / DATAFILE_SECTOR;
+            rec_hi = sg->nclst * vol->csize;
+            sg->step = SEG_PROBE;
+            break;
+
+        case SEG_PROBE:
+            if(rec_lo < rec_hi)
+            {
+                mid = rec_lo + (rec_hi - rec_lo) / 2;
+                if(move_window(vol, sg->start_sect + mid) != FR_OK)
+                    seg_leave(sg);
+                else if(logfmt_check((const char *)vol->win, rec_session))
+                    rec_lo = mid + 1;
+                else
+                    rec_hi = mid;
+                break;
+            }
+            sg->written = rec_lo * DATAFILE_SECTOR;
+            if(sg->written && sg->written == sg->fil.fsize
+                    && sg->nclst == clusters(sg->written))
+            {
+                seg_leave(sg);
+                break;
+            }
+            sg->raw = 1;
+            sg->step = SEG_TRIM;
+            break;
+
+        case SEG_TRIM:
+            if(seg_trim(sg, fat_step()))
+                break;
+            n = sg->written;
+            seg_close(sg);
+            if(!n)
+            {
+                seg_name(name, rec_session, rec_next);
+                f_unlink(name);
+            }
+            rec_next++;
+            break;
+
+        default:
+            seg_leave(sg);
+            break;
+    }
+
+    return 1;
+}
+
+/**
+ * Start recovering the segments of a session that can have been left open,
+ * being the segment being written, the one before it (which may not have been
+ * closed yet) and the next one.
+ *
+ * @param sn The session number.
+ * @param last The last segment of the session.
+ */
+static void rec_start(uint16_t sn, uint16_t last)
+{
+    rec_session = sn;
+    rec_next = (last > 2) ? last - 2 : 0;
+    rec_end = last + 1;
+}
+
+/**
+ * Leave a segment that is being recovered as it is, and move on to the next.
+ *
+ * @param sg The segment being recovered.
+ */
+static void seg_leave(Segment *sg)
+{
+    sg->raw = 0;
+    sg->step = SEG_IDLE;
+    f_close(&sg->fil);
+    sg->open = 0;
+    rec_next++;
+}
+
+/**
+ * Get the number of clusters taken by n bytes of a segment.
+ */
+static DWORD clusters(DWORD n)
+{
+    DWORD csize = (DWORD)vol->csize * DATAFILE_SECTOR;
+    return (n + csize - 1) / csize;
+}
+
+/**
+ * Build the name of a segment.
+ *
+ * @param name Somewhere to put the name, at least 13 characters long.
+ * @param sn The session number.
+ * @param n The segment number.
+ */
+static void seg_name(char *name, uint16_t sn, uint16_t n)
+{
+    sprintf(name, "%04u%04u.LOG", sn % 10000, n % 10000);
+}
+
+/**
+ * Create (or truncate) a segment file.
+ *
+ * @param sg The segment to use.
+ * @param n The segment number.
+ * @returns The FatFs result of creating the file.
+ */
+static FRESULT seg_create(Segment *sg, uint16_t n)
+{
+    FRESULT fr;
+    char name[13];
+
+    seg_name(name, session, n);
+    sg->raw = 0;
+    sg->written = 0;
+    sg->nclst = 0;
+    sg->step = SEG_IDLE;
+    fr = f_open(&sg->fil, name, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+    sg->open = (fr == FR_OK);
+    return fr;
+}
+
+/**
+ * Get the number of FAT entries in DATAFILE_FAT_STEP sectors of the FAT, which
+ * is as many as a step of seg_grow() or seg_trim() goes through in the
+ * background.
+ */
+static DWORD fat_step(void)
+{
+    return (DWORD)DATAFILE_FAT_STEP * DATAFILE_SECTOR
+        / ((vol->fs_type == FS_FAT32) ? 4 : 2);
+}
+
+/**
+ * Keep the number of free clusters on the volume up to date as clusters are
+ * allocated or freed behind the back of FatFs, as it does itself. Whilst the
+ * free clusters are being counted, only those that have been counted already
+ * make any difference.
+ *
+ * @param clst The first of the clusters.
+ * @param n The number of clusters freed, negative if they were allocated.
+ */
+static void fat_count(DWORD clst, int32_t n)
+{
+    DWORD k;
+
+    if(vol->free_clust == FREE_COUNTING)
+    {
+        k = (n < 0) ? -n : n;
+        if(clst + k > count_clst)
+            k = (clst < count_clst) ? count_clst - clst : 0;
+        count_free += (n < 0) ? -(int32_t)k : (int32_t)k;
+    } else if(vol->free_clust != 0xFFFFFFFF) {
+        vol->free_clust += n;
+        vol->fsi_flag = 1;
+    }
+}
+
+/**
+ * Start counting the free clusters on the volume, which free_count() does a
+ * step at a time. In the meantime FatFs is given a count that it can't take
+ * for a real one, so that it goes on updating it whenever it allocates or
+ * frees a cluster itself and we can tell that it has.
+ */
+static void free_start(void)
+{
+    count_clst = 2;
+    count_free = 0;
+    vol->free_clust = FREE_COUNTING;
+}
+
+/**
+ * Take the next step in counting the free clusters on the volume, as
+ * f_getfree() would in one go. Should FatFs allocate or free any clusters
+ * itself in the meantime, we don't know which, so the count starts again.
+ *
+ * @param n The most FAT entries to go through, fat_step() in the background.
+ * @returns Non-zero if there is more to do.
+ */
+static uint8_t free_count(DWORD n)
+{
+    DWORD stat;
+
+    if(!count_clst)
+        return 0;
+    if(vol->free_clust != FREE_COUNTING)
+        free_start();
+
+    for(; n && count_clst < vol->n_fatent; n--, count_clst++)
+    {
+        stat = get_fat(vol, count_clst);
+        if(stat == 1 || stat == 0xFFFFFFFF)
+        {
+            // The FAT couldn't be read, leave the count unknown
+            vol->free_clust = 0xFFFFFFFF;
+            count_clst = 0;
+            return 0;
+        }
+        if(!stat)
+            count_free++;
+    }
+    if(count_clst < vol->n_fatent)
+        return 1;
+
+    vol->free_clust = count_free;
+    vol->fsi_flag = 1;
+    count_clst = 0;
+    return 0;
+}
+
+/**
+ * Start preallocating DATAFILE_PREALLOC bytes for a segment which has just
+ * been created, as a single contiguous cluster chain. This is done by
+ * seg_grow(), a step at a time.
+ *
+ * @param sg The segment to preallocate.
+ */
+static void seg_expand(Segment *sg)
+{
+    sg->clst = vol->last_clust;
+    if(sg->clst < 2 || sg->clst >= vol->n_fatent)
+        sg->clst = 2;
+    sg->mark = sg->clst;
+    sg->nclst = 0;
+    sg->step = SEG_FIND;
+}
+
+/**
+ * Take the next step in preallocating a segment.
+ *
+ * A free block that is big enough is looked for from where FatFs last
+ * allocated a cluster, as f_expand() does. It is then linked together from the
+ * start, with each step ending its part of the chain with an end of chain mark
+ * before joining it onto the chain so far, and then writing the FAT sector in
+ * the window back to the card. The first step puts the chain into the
+ * directory entry straight away so that it is never lost. Should a cluster in
+ * the block have been taken by FatFs in the meantime (by the current segment
+ * outgrowing its chain), the chain simply ends before it.
+ *
+ * Failing to preallocate is not an error, since data is then written through
+ * FatFs instead.
+ *
+ * @param sg The segment being preallocated.
+ * @param n The most FAT entries to go through, fat_step() in the background.
+ * @returns Non-zero if there is more to do.
+ */
+static uint8_t seg_grow(Segment *sg, DWORD n)
+{
+    DWORD want = clusters(DATAFILE_PREALLOC), c, end, stat;
+
+    if(sg->step == SEG_FIND)
+    {
+        for(; n; n--)
+        {
+            stat = get_fat(vol, sg->clst);
+            if(stat == 1 || stat == 0xFFFFFFFF)
+                break;
+            sg->nclst = stat ? 0 : sg->nclst + 1;
+            if(sg->nclst == want)
+            {
+                // Link the block from its start, and keep FatFs out of it
+                // in the meantime
+                sg->clst -= want - 1;
+                sg->nclst = 0;
+                vol->last_clust = sg->clst + want - 1;
+                sg->step = SEG_LINK;
+                return 1;
+            }
+
+            // A block can't wrap around the end of the FAT
+            if(++sg->clst >= vol->n_fatent)
+            {
+                sg->clst = 2;
+                sg->nclst = 0;
+            }
+            if(sg->clst == sg->mark)
+                break;
+        }
+        if(!n)
+            return 1;
+
+        // There's no block big enough, or the FAT couldn't be read
+        sg->step = SEG_IDLE;
+        return 0;
+    }
+
+    if(sg->step != SEG_LINK)
+        return 0;
+
+    // Link as much of the block as this step covers
+    end = sg->clst - sg->nclst + want;
+    if(end > sg->clst + n)
+        end = sg->clst + n;
+    for(c = sg->clst; c < end; c++)
+    {
+        if(get_fat(vol, c))
+            break;
+        if(put_fat(vol, c, (c + 1 < end) ? c + 1 : FAT_EOC))
+        {
+            sg->step = SEG_IDLE;
+            return 0;
+        }
+    }
+    if(c < end && c > sg->clst && put_fat(vol, c - 1, FAT_EOC))
+        c = sg->clst;
+
+    if(c > sg->clst)
+    {
+        if(sg->nclst)
+        {
+            if(put_fat(vol, sg->clst - 1, sg->clst) || move_window(vol, 0))
+            {
+                sg->step = SEG_IDLE;
+                return 0;
+            }
+        } else {
+            sg->fil.sclust = sg->clst;
+            sg->fil.flag |= FA__WRITTEN;
+            sg->start_sect = vol->database + (sg->clst - 2) * vol->csize;
+            sg->raw = 1;
+            f_sync(&sg->fil);
+        }
+        fat_count(sg->clst, -(int32_t)(c - sg->clst));
+        sg->nclst += c - sg->clst;
+    }
+
+    // Carry on unless the chain is done or has run into a cluster in use
+    sg->clst = c;
+    if(c == end && sg->nclst < want)
+        return 1;
+    sg->step = SEG_IDLE;
+    return 0;
+}
+
+/**
+ * Take the next step in giving back the part of a segment's preallocated
+ * chain that hasn't been written to. The chain is given back from its end,
+ * and each step first moves the end of chain mark to before the clusters that
+ * it frees, and writes the FAT sector in the window back to the card once it
+ * has freed them.
+ *
+ * @param sg The segment, whose written size is final.
+ * @param n The most FAT entries to go through, fat_step() in the background.
+ * @returns Non-zero if there is more to do.
+ */
+static uint8_t seg_trim(Segment *sg, DWORD n)
+{
+    DWORD keep, c, end;
+
+    // An empty segment keeps its first cluster, since the directory entry
+    // still points at it
+    keep = sg->written ? clusters(sg->written) : 1;
+    if(!sg->raw || sg->nclst <= keep)
+        return 0;
+
+    if(n > sg->nclst - keep)
+        n = sg->nclst - keep;
+    end = sg->fil.sclust + sg->nclst;
+    if(put_fat(vol, end - n - 1, FAT_EOC))
+        return 0;
+    for(c = end - n; c < end; c++)
+        if(put_fat(vol, c, 0))
+            return 0;
+    if(move_window(vol, 0))
+        return 0;
+    sg->nclst -= n;
+    fat_count(end - n, n);
+    return sg->nclst > keep;
+}
+
+/**
+ * Close a segment, first giving back any of the preallocated cluster chain
+ * that was not used (if that hasn't been done in the background already).
+ *
+ * @param sg The segment to close.
+ * @returns The FatFs result code for closing the file.
+ */
+static FRESULT seg_close(Segment *sg)
+{
+    FRESULT fr;
+
+    seg_trim(sg, sg->nclst);
+    sg->step = SEG_IDLE;
+    if(sg->raw)
+    {
+        sg->raw = 0;
+        sg->fil.fsize = sg->written;
+        sg->fil.flag |= FA__WRITTEN;
+    }
+
+    fr = f_close(&sg->fil);
+    if(fr == FR_OK)
+        sg->open = 0;
+    return fr;
+}
+
+/**
+ * Get the number of bytes that can be written straight into a segment's
+ * preallocated chain.
+ */
+static DWORD seg_room(Segment *sg)
+{
+    DWORD n = sg->nclst * vol->csize * DATAFILE_SECTOR;
+
+    if(!sg->raw)
+        return 0;
+    return (n < DATAFILE_PREALLOC) ? n : DATAFILE_PREALLOC;
+}
+
+/**
+ * Move on to the next segment if the current one is full (or old enough) and
+ * the next one is ready. The old segment is then closed in the background.
+ */
+static void seg_rotate(void)
+{
+    Segment *sg;
+
+    if(spare_state == SPARE_READY && (cur->written >= DATAFILE_SEGMENT
+                || (DATAFILE_SEGMENT_TIME
+                    && clock_time() - seg_time >= DATAFILE_SEGMENT_TIME)))
+    {
+        sg = cur;
+        cur = spare;
+        spare = sg;
+        spare_state = SPARE_CLOSE;
+        segment++;
+        seg_time = clock_time();
+    }
+}
+
+/**
+ * Start a new logging session, by creating its first segment. The segment is
+ * preallocated in the background, with datafile_write() waiting for the first
+ * step of linking its chain, and the second segment is then prepared once
+ * the last session has been recovered.
+ *
+ * @returns The FatFs result of creating the file.
+ */
+FRESULT datafile_open(void)
+{
+    FRESULT fr;
+
+    session++;
+    segment = 0;
+
+    fr = seg_create(cur, segment);
+    if(fr)
+        return fr;
+    seg_expand(cur);
+    seg_time = sync_time = clock_time();
+    if(spare_state == SPARE_NONE)
+        spare_state = SPARE_CREATE;
+
+    // Keep a single open-ended multiple block write running from one sector
+    // of the data file to the next, it is only stopped when the file is
+    // synced or closed (or when FatFs needs the card for something else).
+    disk_ioctl(0, CTRL_STREAM, (void *)&stream_on);
+
+    return FR_OK;
+}
+
+/**
+ * Do the next step of the background work, being either syncing the current
+ * segment if DATAFILE_SYNC_PERIOD has passed, preallocating the current
+ * segment if it's new, or else recovering the last session, closing the
+ * segment that we've just finished with or creating or preallocating the next
+ * one. Once there's nothing else to do, the free clusters are counted if
+ * need be. Each step is a single FatFs operation, reads a single sector or
+ * goes through no more than DATAFILE_FAT_STEP sectors of the FAT, so this
+ * should be called whenever the card is mounted and the logger has nothing
+ * more urgent to do. If a step on the spare segment fails, the current
+ * segment simply isn't rotated.
+ *
+ * @returns Non-zero if there is more background work to do.
+ */
+uint8_t datafile_service(void)
+{
+    if(cur->open && clock_time() - sync_time >= DATAFILE_SYNC_PERIOD)
+    {
+        sync_time = clock_time();
+        datafile_sync();
+        return datafile_busy();
+    }
+
+    // The spare can't look for a block until the current segment has one
+    if(cur->open && cur->step != SEG_IDLE)
+    {
+        seg_grow(cur, fat_step());
+        return datafile_busy();
+    }
+
+    switch(spare_state)
+    {
+        case SPARE_RECOVER:
+            if(!seg_recover(spare))
+                spare_state = cur->open ? SPARE_CREATE : SPARE_NONE;
+            break;
+        case SPARE_CLOSE:
+            if(!seg_trim(spare, fat_step()))
+                spare_state = seg_close(spare) ? SPARE_NONE : SPARE_CREATE;
+            break;
+        case SPARE_CREATE:
+            if(seg_create(spare, segment + 1))
+            {
+                spare_state = SPARE_NONE;
+                break;
+            }
+            seg_expand(spare);
+            spare_state = SPARE_EXPAND;
+            break;
+        case SPARE_EXPAND:
+            if(!seg_grow(spare, fat_step()))
+                spare_state = SPARE_READY;
+            break;
+        default:
+            free_count(fat_step());
+            break;
+    }
+
+    return datafile_busy();
+}
+
+/**
+ * Find out whether datafile_service() has any background work to do.
+ *
+ * @returns Non-zero if there is more background work to do.
+ */
+uint8_t datafile_busy(void)
+{
+    if(cur->open && (cur->step != SEG_IDLE
+                || clock_time() - sync_time >= DATAFILE_SYNC_PERIOD))
+        return 1;
+    if((spare_state != SPARE_NONE) && (spare_state != SPARE_READY))
+        return 1;
+    return count_clst != 0;
+}
+
+/**
+ * Write n bytes to the end of the data file, first moving on to the next
+ * segment if the current one is full (or old enough) and the next one is
+ * ready. Several sectors may be written at once, and whilst they fit in the
+ * preallocated chain they go to the card in a single disk_write(), so a
+ * segment can end up a few sectors over DATAFILE_SEGMENT. Whilst the chain of
+ * a new segment is still being built, this waits for it to get far enough,
+ * which at the start of a session means until a block for it has been found
+ * (or not) and the first step of linking it has been taken.
+ *
+ * @note buf must always point to whole sectors, and n should be a multiple
+ * of DATAFILE_SECTOR for all but the final write to the file. A short write
+ * is still written as a full sector to the card, the size in the directory
+ * entry means that the remainder is ignored.
+ *
+ * @param buf A pointer to the sectors to be written.
+ * @param n The number of bytes in the sectors that are valid.
+ * @returns The FatFs result code for the write.
+ */
+FRESULT datafile_write(const char *buf, uint16_t n)
+{
+    FRESULT fr;
+    UINT bw;
+    DWORD room;
+    uint16_t k;
+
+    seg_rotate();
+
+    while(cur->step != SEG_IDLE && seg_room(cur) < cur->written + n)
+        seg_grow(cur, fat_step());
+
+    if(cur->raw)
+    {
+        // Write as much as fits in what's left of the chain
+        room = seg_room(cur) - cur->written;
+        k = (n < room) ? n : room;
+        if(k)
+        {
+            if(disk_write(0, (const BYTE *)buf,
+                        cur->start_sect + cur->written / DATAFILE_SECTOR,
+                        (k + DATAFILE_SECTOR - 1) / DATAFILE_SECTOR) != RES_OK)
+                return FR_DISK_ERR;
+            cur->written += k;
+            buf += k;
+            n -= k;
+            if(!n)
+                return FR_OK;
+        }
+
+        // We have outgrown the preallocated chain, put the FatFs file pointer
+        // at the end of what we wrote and let FatFs extend the file from here
+        cur->raw = 0;
+        cur->fil.fsize = cur->written;
+        fr = f_lseek(&cur->fil, cur->written);
+        if(fr)
+            return fr;
+    }
+
+    fr = f_write(&cur->fil, buf, n, &bw);
+    cur->written += bw;
+    return fr;
+}
+
+/**
+ * Get the position in its segment of the next sector to be written, first
+ * moving on to the next segment if datafile_write() would, so that the next
+ * write really does go there.
+ *
+ * @returns The number of sectors before the next one in the segment.
+ */
+DWORD datafile_position(void)
+{
+    seg_rotate();
+    return cur->written / DATAFILE_SECTOR;
+}
+
+/**
+ * Flush the current segment to the card, updating the size in the directory
+ * entry to reflect everything written so far. Nothing is written if the size
+ * hasn't changed since the last sync.
+ *
+ * @returns The FatFs result code for the sync.
+ */
+FRESULT datafile_sync(void)
+{
+    if(cur->raw && cur->fil.fsize != cur->written)
+    {
+        cur->fil.fsize = cur->written;
+        cur->fil.flag |= FA__WRITTEN;
+    }
+    return f_sync(&cur->fil);
+}
+
+/**
+ * End the logging session by closing the current segment, as well as the
+ * spare segment. A next segment that was prepared but never written to is
+ * deleted. If the last session is still being recovered, that carries on in
+ * the background.
+ *
+ * @returns The FatFs result code for closing the current segment.
+ */
+FRESULT datafile_close(void)
+{
+    FRESULT fr;
+    char name[13];
+
+    if(spare_state != SPARE_RECOVER)
+    {
+        if(spare->open)
+        {
+            if(spare_state == SPARE_CLOSE)
+            {
+                seg_close(spare);
+            } else {
+                spare->written = 0;
+                if(seg_close(spare) == FR_OK)
+                {
+                    seg_name(name, session, segment + 1);
+                    f_unlink(name);
+                }
+            }
+        }
+        spare_state = SPARE_NONE;
+    }
+
+    fr = seg_close(cur);
+    disk_ioctl(0, CTRL_STREAM, (void *)&stream_off);
+    return fr;
+}
+
+/**
+ * Forget about the data file after the card has been taken out or stopped
+ * working, without waiting on the card. Its segments are left as they are, to
+ * be recovered by datafile_init() when the card is next mounted.
+ */
+void datafile_abandon(void)
+{
+    seg[0].open = seg[1].open = 0;
+    seg[0].step = seg[1].step = SEG_IDLE;
+    spare_state = SPARE_NONE;
+    rec_next = rec_end = 0;
+    rec_older = 0;
+    count_clst = 0;
+    disk_ioctl(0, CTRL_STREAM, (void *)&stream_off);
+}
+
+/**
+ * Get the number of bytes written to the current segment so far.
+ *
+ * @returns The current size of the segment in bytes.
+ */
+DWORD datafile_size(void)
+{
+    return cur ? cur->written : 0;
+}
+
+/**
+ * Get the number of the current logging session.
+ *
+ * @returns The session number, which is in the name of each of its segments.
+ */
+uint16_t datafile_session(void)
+{
+    return session;
+}
+
+/**
+ * Get the number of the segment being written to.
+ *
+ * @returns The segment number, counting from 0 in each session.
+ */
+uint16_t datafile_segment(void)
+{
+    return segment;
+}
+
+/**
+ * Get the number of free clusters on the volume without reading the card.
+ * The preallocated chains of open segments are counted as free other than the
+ * clusters that have been written to.
+ *
+ * @returns The number of free clusters, or 0xFFFFFFFF if they haven't been
+ * counted yet.
+ */
+DWORD datafile_free(void)
+{
+    DWORD n;
+    uint8_t i;
+
+    if(vol->free_clust > vol->n_fatent - 2)
+        return 0xFFFFFFFF;
+
+    n = vol->free_clust;
+    for(i = 0; i < 2; i++)
+        if(seg[i].open && seg[i].raw)
+            n += seg[i].nclst - clusters(seg[i].written);
+    return n;
+}
+
+/**
+ * @}
+ */
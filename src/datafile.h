@@ -0,0 +1,88 @@
+/**
+ * Data file header.
+ *
+ * @file datafile.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Datafile
+ * @{
+ */
+
+#ifndef __DATAFILE_H__
+#define __DATAFILE_H__
+
+#include "typedefs.h"
+#include "ff.h"
+
+/**
+ * The number of bytes to preallocate (as a single contiguous cluster chain)
+ * for each segment of the data file when it is opened. Whilst the segment is
+ * within this size, sectors are written straight to the card. This may be
+ * overridden from the Makefile.
+ */
+#ifndef DATAFILE_PREALLOC
+#define DATAFILE_PREALLOC (32UL * 1024UL * 1024UL)
+#endif
+
+/**
+ * The size in bytes at which a new segment of the data file is started. This
+ * must be a whole number of sectors and no more than DATAFILE_PREALLOC.
+ */
+#ifndef DATAFILE_SEGMENT
+#define DATAFILE_SEGMENT DATAFILE_PREALLOC
+#endif
+
+#if (DATAFILE_SEGMENT > DATAFILE_PREALLOC) || (DATAFILE_SEGMENT % 512)
+#error "DATAFILE_SEGMENT must be a number of sectors within DATAFILE_PREALLOC"
+#endif
+
+/**
+ * The time in milliseconds after which a new segment of the data file is
+ * started, or 0 to only start new segments based on their size.
+ */
+#ifndef DATAFILE_SEGMENT_TIME
+#define DATAFILE_SEGMENT_TIME 0
+#endif
+
+/**
+ * The period in milliseconds at which the size of the data file is updated in
+ * its directory entry, which bounds how much data a loss of power can cost
+ * (though see datafile.c for how it is recovered).
+ */
+#ifndef DATAFILE_SYNC_PERIOD
+#define DATAFILE_SYNC_PERIOD 1000
+#endif
+
+/**
+ * The most sectors of the FAT that each step of preallocating a segment, or
+ * of giving back the end of its chain, goes through (see datafile_service()).
+ * Each sector covers 128 or 256 clusters.
+ */
+#ifndef DATAFILE_FAT_STEP
+#define DATAFILE_FAT_STEP 2
+#endif
+
+/**
+ * The sector size of the card, all raw writes are in units of this.
+ */
+#define DATAFILE_SECTOR 512
+
+FRESULT datafile_init(void);
+FRESULT datafile_open(void);
+uint8_t datafile_service(void);
+uint8_t datafile_busy(void);
+FRESULT datafile_write(const char *buf, uint16_t n);
+DWORD datafile_position(void);
+FRESULT datafile_sync(void);
+FRESULT datafile_close(void);
+void datafile_abandon(void);
+DWORD datafile_size(void);
+uint16_t datafile_session(void);
+uint16_t datafile_segment(void);
+DWORD datafile_free(void);
+
+#endif /* __DATAFILE_H__ */
+
+/**
+ * @}
+ */
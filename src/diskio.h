@@ -48,4 +48,8 @@ DRESULT disk_ioctl (BYTE, BYTE, void*);
 #define GET_SECTOR_SIZE		2	/* Get sector size (for multiple sector size (_MAX_SS >= 1024)) */
 #define GET_BLOCK_SIZE		3	/* Get erase block size (for only f_mkfs()) */
 
+/* MMC/SDC specific command */
+#define CTRL_STREAM			10	/* Enable/disable open-ended multiple block writes (BYTE) */
+#define CTRL_STATUS			11	/* Wait for the last write and check the card status */
+
 #endif
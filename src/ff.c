@@ -709,7 +709,6 @@ void clear_lock (	/* Clear lock entries of the volume */
 /* Change window offset                                                  */
 /*-----------------------------------------------------------------------*/
 
-static
 FRESULT move_window (
 	FATFS *fs,		/* File system object */
 	DWORD sector	/* Sector number to make appearance in the fs->win[] */
@@ -3177,6 +3176,78 @@ FRESULT f_truncate (
 
 
 
+#if _USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Cluster Block to the File                       */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand (
+	FIL *fp,	/* Pointer to the file object (must be empty) */
+	DWORD fsz	/* File size to be expanded to */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl;
+
+
+	res = validate(fp->fs, fp->id);		/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->flag & FA__ERROR)			/* Check abort flag */
+		LEAVE_FF(fp->fs, FR_INT_ERR);
+	if (fsz == 0 || fp->sclust != 0 || !(fp->flag & FA_WRITE))
+		LEAVE_FF(fp->fs, FR_DENIED);
+
+	fs = fp->fs;
+	n = (DWORD)fs->csize * SS(fs);		/* Cluster size (byte) */
+	tcl = fsz / n + ((fsz % n) ? 1 : 0);	/* Number of clusters required */
+	stcl = fs->last_clust;				/* Start the search at the allocation hint */
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+
+	scl = clst = stcl; ncl = 0;
+	for (;;) {							/* Find a contiguous free cluster block */
+		n = get_fat(fs, clst);
+		if (n == 1) { res = FR_INT_ERR; break; }
+		if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (n == 0) {					/* Free cluster, extend the block */
+			if (++ncl == tcl) break;
+		} else {
+			ncl = 0;
+		}
+		if (++clst >= fs->n_fatent) {	/* A block cannot wrap around the end of the FAT */
+			clst = 2; ncl = 0;
+		}
+		if (!ncl) scl = clst;			/* Candidate start of the next block */
+		if (clst == stcl) { res = FR_DENIED; break; }	/* No block large enough */
+	}
+
+	if (res == FR_OK) {					/* Create the cluster chain on the FAT */
+		for (clst = scl, n = tcl; n; clst++, n--) {
+			res = put_fat(fs, clst, (n == 1) ? 0x0FFFFFFF : clst + 1);
+			if (res != FR_OK) break;
+		}
+	}
+
+	if (res == FR_OK) {
+		fs->last_clust = scl + tcl - 1;	/* Update FSINFO */
+		if (fs->free_clust != 0xFFFFFFFF) {
+			fs->free_clust -= tcl;
+			fs->fsi_flag = 1;
+		}
+		fp->sclust = fp->clust = scl;	/* Update the file object */
+		fp->fsize = fsz;
+		fp->flag |= FA__WRITTEN;
+	} else if (res != FR_DENIED) {		/* Not having enough space is not fatal */
+		fp->flag |= FA__ERROR;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif /* _USE_EXPAND */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
 /*-----------------------------------------------------------------------*/
@@ -212,6 +212,7 @@ FRESULT f_stat (const TCHAR*, FILINFO*);			/* Get file status */
 FRESULT f_write (FIL*, const void*, UINT, UINT*);	/* Write data to a file */
 FRESULT f_getfree (const TCHAR*, DWORD*, FATFS**);	/* Get number of free clusters on the drive */
 FRESULT f_truncate (FIL*);							/* Truncate file */
+FRESULT f_expand (FIL*, DWORD);						/* Allocate a contiguous block to the file */
 FRESULT f_sync (FIL*);								/* Flush cached data of a writing file */
 FRESULT f_unlink (const TCHAR*);					/* Delete an existing file or directory */
 FRESULT	f_mkdir (const TCHAR*);						/* Create a new directory */
@@ -232,6 +233,14 @@ TCHAR* f_gets (TCHAR*, int, FIL*);					/* Get a string from the file */
 #define EOF (-1)
 #endif
 
+/* Window and FAT access, for working on cluster chains a few FAT sectors */
+/* at a time (see datafile.c) */
+FRESULT move_window (FATFS*, DWORD);				/* Read a sector into the window */
+DWORD get_fat (FATFS*, DWORD);						/* Read a FAT entry */
+#if !_FS_READONLY
+FRESULT put_fat (FATFS*, DWORD, DWORD);				/* Change a FAT entry */
+#endif
+
 #define f_eof(fp) (((fp)->fptr == (fp)->fsize) ? 1 : 0)
 #define f_error(fp) (((fp)->flag & FA__ERROR) ? 1 : 0)
 #define f_tell(fp) ((fp)->fptr)
@@ -10,6 +10,23 @@
 #include <windows.h>
 #include <tchar.h>
 
+#elif !defined(__MSP430__)    /* Host builds, such as the simulator (sim/) */
+
+#include <stdint.h>
+
+typedef int             INT;
+typedef unsigned int    UINT;
+typedef char            CHAR;
+typedef unsigned char   UCHAR;
+typedef unsigned char   BYTE;
+typedef int16_t         SHORT;
+typedef uint16_t        USHORT;
+typedef uint16_t        WORD;
+typedef uint16_t        WCHAR;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint32_t        DWORD;
+
 #else            /* Embedded platform */
 
 // Surpress warning for multiple defs of the same type.
@@ -0,0 +1,635 @@
+/**
+ * Handles the layout of frames in the data file.
+ *
+ * The data file is made up of blocks which are exactly one sector long, and
+ * which start on a sector boundary in the SD ring buffer (and so in the file).
+ * Each block starts with a BlockHeader which describes the channels and the
+ * format of the frames, and says where the block's frames are in time, so the
+ * host can start decoding at any block and can see where frames have been
+ * dropped. The time is the system time to the microsecond, along with the
+ * wall clock time from the RTC at a known system time, so the host can also
+ * place each block in wall clock time. Frames are never split across blocks,
+ * if the next frame won't fit in the rest of a block then the rest of the
+ * block is filled with zeros and the frame starts the next block.
+ *
+ * With STORE_INDEX set, the least and greatest value of each ADC channel in
+ * each block are also kept as its frames are put in, for the index blocks
+ * that store.c writes among the blocks on the card. There is a summary for
+ * each block that fits in the SD ring buffer, so that a block's summary is
+ * still there when it is written out.
+ *
+ * The number of frames in each block in the ring buffer is kept as well, so
+ * that the consumer can go back through the frames of a block that is being
+ * written out (see logfmt_frames()), which for the raw format isn't known
+ * from the block alone. The data file ends with a summary block once the
+ * last frames are in (see logfmt_summary() and stats.c).
+ *
+ * Each header also has a CRC of its block, filled in by logfmt_seal() just
+ * before the block goes to the card, so the host can tell a block that has
+ * been corrupted and skip just that one. The session number is filled in at
+ * the same time, since frames are put into blocks from power up, before the
+ * card has been mounted and the session is known.
+ *
+ * There are two ways of writing a frame, chosen with LOG_PACKED:
+ *
+ * The raw format has each channel that is due as a 16 bit word, in the order
+ * of the SampleBuffer. This is what the DMA produces, so frames are converted
+ * straight into their place in the block. The length of each frame is known
+ * from the decimation schedule (starting from BlockHeader::frame), so the
+ * padding at the end of a block is wherever the next frame would not have
+ * fitted, or else where the next block's header says its frames carry on
+ * from (a block is padded out whenever a frame is dropped).
+ *
+ * The packed format starts each frame with a tag. An absolute frame
+ * (LOGFMT_TAG_ABS) then has the due ADC channels packed into as many bits as
+ * they need (12 bits, or more if oversampled), MSB first and padded to a whole
+ * byte, followed by a byte for each due accelerometer axis. If LOG_DELTA is
+ * set, each frame after the first in a block is instead a delta frame
+ * (LOGFMT_TAG_DELTA) if it can be: every due ADC channel is then a signed byte
+ * holding the change since the channel was last logged in this block. A delta
+ * frame is used only if every due channel has already been logged in this
+ * block and has changed by no more than a byte can hold. A padding tag
+ * (LOGFMT_TAG_PAD) ends the block.
+ *
+ * @file logfmt.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup LogFormat
+ * @{
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "logfmt.h"
+#include "adc.h"
+#include "datafile.h"
+#include "system.h"
+#include "rtc.h"
+#include "crc.h"
+#include "accel.h"
+#include "profile.h"
+#include "store.h"
+
+/// The header for the next block, the layout is filled in by logfmt_reset()
+static BlockHeader header;
+
+/// The number of frames put into the data file so far, including dropped ones
+static uint32_t frames;
+
+/// The number of frames dropped since the last block was started
+static uint16_t dropped;
+
+/// Set when a frame has been dropped, so that the next frame starts a new
+/// block whose header tells the host where it is
+static uint8_t resync;
+
+/// The number of blocks that fit in the SD ring buffer, each of which has a
+/// summary
+#define SUMMARIES (SD_RINGBUF_LEN / DATAFILE_SECTOR)
+
+/// The number of frames in each block in the SD ring buffer, by
+/// BlockHeader::seq modulo SUMMARIES
+static uint16_t block_frames[SUMMARIES];
+
+#if STORE_INDEX
+/// The least and greatest value of each ADC channel in each block in the SD
+/// ring buffer, by BlockHeader::seq modulo SUMMARIES
+static uint16_t sum_min[SUMMARIES][ADC_CHANNELS];
+static uint16_t sum_max[SUMMARIES][ADC_CHANNELS];
+
+static void summarise(volatile uint16_t *frame, uint16_t adc_mask);
+#endif
+
+#if LOG_PACKED
+/// The last value logged for each ADC channel in the current block
+static uint16_t prev[ADC_CHANNELS];
+
+/// Bit n is set once ADC channel n has been logged in the current block
+static uint16_t prev_valid;
+
+static uint8_t pack(RingBuffer *rb, volatile uint16_t *frame,
+        uint16_t adc_mask, uint8_t accel_mask);
+#endif
+
+/**
+ * Get ready to start a new data file, such that the first block written will
+ * be block 0 and its first frame will be frame 0. This must only be called
+ * whilst the producer is not putting frames into the SD ring buffer.
+ */
+void logfmt_reset(void)
+{
+    static const uint8_t adc_divs[ADC_CHANNELS] = LOG_ADC_DIVS;
+    static const uint8_t accel_divs[ACCEL_CHANNELS] = LOG_ACCEL_DIVS;
+    uint8_t i;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = LOGFMT_MAGIC;
+    header.format = (LOG_PACKED ? LOGFMT_FLAG_PACKED : 0)
+        | ((LOG_PACKED && LOG_DELTA) ? LOGFMT_FLAG_DELTA : 0)
+        | LOGFMT_FLAG_WALL | LOGFMT_FLAG_CRC | LOGFMT_FLAG_ACCEL;
+    header.size = LOGFMT_HEADER_LEN;
+    header.rate = LOG_RATE;
+    header.adc_channels = ADC_CHANNELS;
+    header.accel_channels = ACCEL_CHANNELS;
+    Cma3000_getMode(&header.accel_range, &header.accel_rate);
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        header.divs[i] = adc_divs[i];
+        header.bits[i] = adc_bits(i);
+    }
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        header.divs[ADC_CHANNELS + i] = accel_divs[i];
+
+    frames = 0;
+    dropped = 0;
+    resync = 0;
+}
+
+/**
+ * Check whether a sector read back from the card is a block written by the
+ * given logging session, by looking at its header.
+ *
+ * @param block A pointer to the sector.
+ * @param session The logging session that the block should belong to.
+ * @returns Non-zero if the block has a valid header from the session.
+ */
+uint8_t logfmt_check(const char *block, uint16_t session)
+{
+    BlockHeader h;
+
+    memcpy(&h, block, sizeof(h));
+    return h.magic == LOGFMT_MAGIC && h.size == LOGFMT_HEADER_LEN
+        && h.session == session;
+}
+
+/**
+ * Fill in the session number and the CRC in the header of a block that is
+ * about to be written to the card. This is done by the consumer, once the
+ * producer has finished with the block, and takes about 125us for a whole
+ * sector.
+ *
+ * @param block A pointer to the block, which starts with its header.
+ * @param n The number of bytes of the block that are written.
+ * @param session The logging session that the block belongs to.
+ */
+void logfmt_seal(char *block, uint16_t n, uint16_t session)
+{
+    BlockHeader *h = (BlockHeader *)block;
+    PROFILE_START(t);
+
+    h->session = session;
+    h->crc = 0;
+    h->crc = crc16(block, n);
+    PROFILE_END(PROF_BLOCK_CRC, t);
+}
+
+/**
+ * Start a new block by writing its header into the SD ring buffer. The header
+ * is only written if there is also room for the first frame after it, so that
+ * a block is never left holding a header which is out of date.
+ *
+ * @param rb A pointer to the SD ring buffer, whose head is at the start of a
+ * block.
+ * @param n The number of bytes in the first frame of the block.
+ * @returns 0 for success, non-0 if there isn't room for the header and frame.
+ */
+static uint8_t block_start(RingBuffer *rb, uint16_t n)
+{
+    char *p;
+    RtcStamp stamp;
+
+    if(!ringbuf_reserve(rb, LOGFMT_HEADER_LEN + n))
+        return 1;
+    p = ringbuf_reserve(rb, LOGFMT_HEADER_LEN);
+
+    header.time = clock_time_us(&header.time_us);
+    rtc_stamp(&stamp);
+    header.wall = stamp.wall;
+    header.wall_time = stamp.time;
+    header.wall_us = stamp.us;
+    header.frame = frames;
+    header.dropped = dropped;
+    memset(p, 0, LOGFMT_HEADER_LEN);
+    memcpy(p, &header, sizeof(header));
+    ringbuf_commit(rb, LOGFMT_HEADER_LEN);
+
+    block_frames[header.seq % SUMMARIES] = 0;
+#if STORE_INDEX
+    memset(sum_min[header.seq % SUMMARIES], 0xFF, sizeof(sum_min[0]));
+    memset(sum_max[header.seq % SUMMARIES], 0, sizeof(sum_max[0]));
+#endif
+    header.seq++;
+    dropped = 0;
+    resync = 0;
+#if LOG_PACKED
+    // Delta frames never refer back past the start of a block
+    prev_valid = 0;
+#endif
+    return 0;
+}
+
+/**
+ * Get a pointer to room for n bytes of a frame in the current block of the
+ * ring buffer, first padding out the block and starting the next one if the
+ * frame would not fit. After a frame has been dropped the block is always
+ * padded out, since the frames in a block must follow on from one another.
+ * This must only be called by the producer.
+ *
+ * Since the ring buffer is a whole number of blocks long, the room is always
+ * contiguous. The frame is published with ringbuf_commit() as usual.
+ *
+ * @param rb A pointer to the SD ring buffer.
+ * @param n The number of bytes in the frame, no more than a block less its
+ * header.
+ * @returns A pointer to the room for the frame, or NULL if the ring buffer
+ * does not have enough free space.
+ */
+char* logfmt_reserve(RingBuffer *rb, uint16_t n)
+{
+    uint16_t rem;
+    char *p;
+
+    rem = DATAFILE_SECTOR - (rb->head & (DATAFILE_SECTOR - 1));
+    if(rem < n || (resync && rem < DATAFILE_SECTOR))
+    {
+        p = ringbuf_reserve(rb, rem);
+        if(!p)
+            return NULL;
+        memset(p, LOGFMT_TAG_PAD, rem);
+        ringbuf_commit(rb, rem);
+    }
+
+    if(!(rb->head & (DATAFILE_SECTOR - 1)) && block_start(rb, n))
+        return NULL;
+
+    return ringbuf_reserve(rb, n);
+}
+
+/**
+ * Put a completed frame into the SD ring buffer, in the format chosen by
+ * LOG_PACKED. This must only be called by the producer.
+ *
+ * In the raw format, a frame that was converted in place (into room from
+ * logfmt_reserve()) just needs publishing, otherwise it is copied in.
+ *
+ * @param rb A pointer to the SD ring buffer.
+ * @param frame The frame, being the due ADC channels followed by the due
+ * accelerometer axes, one word each.
+ * @param staged Zero if the frame is already in place in the ring buffer.
+ * @param adc_mask The ADC channels in the frame, bit n for
+ * SampleBuffer::adc[n].
+ * @param accel_mask The accelerometer axes in the frame, bit n for
+ * SampleBuffer::accel[n].
+ * @param len The number of words in the frame.
+ * @returns 0 for success, non-0 if the frame was dropped since the ring buffer
+ * was full, in which case the overflow flag is also set and the frame is
+ * counted in the header of the next block.
+ */
+uint8_t logfmt_put(RingBuffer *rb, volatile uint16_t *frame, uint8_t staged,
+        uint16_t adc_mask, uint8_t accel_mask, uint8_t len)
+{
+    uint8_t fail;
+#if LOG_PACKED
+    fail = pack(rb, frame, adc_mask, accel_mask);
+#else
+    uint16_t n = len * sizeof(uint16_t);
+    char *p;
+
+    fail = 0;
+    if(staged)
+    {
+        p = logfmt_reserve(rb, n);
+        if(p)
+            memcpy(p, (char *)frame, n);
+        else
+            fail = 1;
+    }
+    if(!fail)
+        ringbuf_commit(rb, n);
+#endif
+
+    if(!fail)
+    {
+        block_frames[(header.seq - 1) % SUMMARIES]++;
+#if STORE_INDEX
+        summarise(frame, adc_mask);
+#endif
+    }
+    frames++;
+    if(fail)
+    {
+        rb->overflow = 1;
+        dropped++;
+        resync = 1;
+    }
+    return fail;
+}
+
+/**
+ * Pad out the current block once the last frame of the data file is in, so
+ * that the ring buffer holds whole blocks. This must only be called by the
+ * producer, or once the frame ISR has stopped putting frames into the ring
+ * buffer.
+ *
+ * @param rb A pointer to the SD ring buffer.
+ */
+void logfmt_finish(RingBuffer *rb)
+{
+    uint16_t rem;
+    char *p;
+
+    rem = DATAFILE_SECTOR - (rb->head & (DATAFILE_SECTOR - 1));
+    if(rem == DATAFILE_SECTOR)
+        return;
+    p = ringbuf_reserve(rb, rem);
+    if(p)
+    {
+        memset(p, LOGFMT_TAG_PAD, rem);
+        ringbuf_commit(rb, rem);
+    }
+}
+
+/**
+ * Put a summary block, holding the statistics of the data file, into the SD
+ * ring buffer after the last frame, as for logfmt_finish(). Its header is
+ * that of the block that would have come next, with LOGFMT_FLAG_STATS set, so
+ * that the host can still tell where the frames of the block before it end.
+ *
+ * @param rb A pointer to the SD ring buffer.
+ * @param rec The statistics.
+ * @returns 0 for success, non-0 if there wasn't room for the block.
+ */
+uint8_t logfmt_summary(RingBuffer *rb, const StatsRecord *rec)
+{
+    const uint16_t n = DATAFILE_SECTOR - LOGFMT_HEADER_LEN;
+    char *p;
+
+    header.format |= LOGFMT_FLAG_STATS;
+    p = logfmt_reserve(rb, n);
+    header.format &= ~LOGFMT_FLAG_STATS;
+    if(!p)
+        return 1;
+
+    memset(p, 0, n);
+    memcpy(p, rec, sizeof(*rec));
+    ringbuf_commit(rb, n);
+    return 0;
+}
+
+/**
+ * Go through the frames of a block that is still in the SD ring buffer, such
+ * as one that is being written out, handing each one to a function. Each
+ * frame is given as it was to logfmt_put(), so packed frames are unpacked
+ * first. The channels that are due in each frame are worked out from the
+ * block's first frame number, as the host does (see frame_arm() in logger.c).
+ *
+ * This is done by the consumer, and only once the producer has finished with
+ * the block. Index and summary blocks have no frames.
+ *
+ * @param block A pointer to the block, which starts with its header.
+ * @param fn The function to hand each frame to.
+ * @returns The number of frames in the block.
+ */
+uint16_t logfmt_frames(const char *block, LogfmtFrameFn fn)
+{
+    const BlockHeader *h = (const BlockHeader *)block;
+    const uint8_t *p = (const uint8_t *)block + LOGFMT_HEADER_LEN;
+    uint16_t n, k, adc_mask;
+    uint8_t accel_mask, len;
+#if ADC_DECIMATED || ACCEL_DECIMATED || LOG_PACKED
+    uint8_t i;
+#endif
+#if ADC_DECIMATED || ACCEL_DECIMATED
+    uint8_t wait[ADC_CHANNELS + ACCEL_CHANNELS], r;
+#endif
+#if LOG_PACKED
+    static const uint8_t nbits[ADC_CHANNELS] = LOG_ADC_BITS;
+    uint16_t f[ADC_CHANNELS + ACCEL_CHANNELS], last[ADC_CHANNELS];
+    uint32_t acc;
+    uint8_t tag, bits;
+#endif
+
+    if(h->format & (LOGFMT_FLAG_INDEX | LOGFMT_FLAG_STATS))
+        return 0;
+    n = block_frames[h->seq % SUMMARIES];
+
+#if ADC_DECIMATED || ACCEL_DECIMATED
+    // The number of frames until each channel is next due
+    for(i = 0; i < ADC_CHANNELS + ACCEL_CHANNELS; i++)
+    {
+        r = h->frame % h->divs[i];
+        wait[i] = r ? h->divs[i] - r : 0;
+    }
+#endif
+
+    for(k = 0; k < n; k++)
+    {
+#if ADC_DECIMATED || ACCEL_DECIMATED
+        adc_mask = accel_mask = len = 0;
+        for(i = 0; i < ADC_CHANNELS + ACCEL_CHANNELS; i++)
+        {
+            if(!wait[i])
+            {
+                if(i < ADC_CHANNELS)
+                    adc_mask |= _BV(i);
+                else
+                    accel_mask |= 1 << (i - ADC_CHANNELS);
+                wait[i] = h->divs[i];
+                len++;
+            }
+            wait[i]--;
+        }
+#else
+        adc_mask = ADC_MASK_ALL;
+        accel_mask = ACCEL_MASK_ALL;
+        len = ADC_CHANNELS + ACCEL_CHANNELS;
+#endif
+
+#if LOG_PACKED
+        // The reverse of pack()
+        tag = *p++;
+        if(tag == LOGFMT_TAG_PAD)
+            break;
+        acc = 0;
+        bits = 0;
+        len = 0;
+        for(i = 0; i < ADC_CHANNELS; i++)
+        {
+            if(!(adc_mask & _BV(i)))
+                continue;
+            if(tag == LOGFMT_TAG_DELTA)
+            {
+                last[i] += (int8_t)*p++;
+            } else {
+                while(bits < nbits[i])
+                {
+                    acc = (acc << 8) | *p++;
+                    bits += 8;
+                }
+                bits -= nbits[i];
+                last[i] = (acc >> bits) & ((1UL << nbits[i]) - 1);
+            }
+            f[len++] = last[i];
+        }
+        for(i = 0; i < ACCEL_CHANNELS; i++)
+            if(accel_mask & _BV(i))
+                f[len++] = *p++;
+        fn(f, adc_mask, accel_mask);
+#else
+        fn((const uint16_t *)p, adc_mask, accel_mask);
+        p += len * sizeof(uint16_t);
+#endif
+    }
+    return k;
+}
+
+#if STORE_INDEX
+/**
+ * Start an index block, whose header is a copy of that of the first block
+ * that it summarises (but with LOGFMT_FLAG_INDEX set).
+ *
+ * @param index A pointer to the sector to build the index block in.
+ * @param block A pointer to the first block, which has been sealed.
+ */
+void logfmt_index_start(char *index, const char *block)
+{
+    BlockHeader *h = (BlockHeader *)index;
+
+    memset(index, 0, DATAFILE_SECTOR);
+    memcpy(index, block, LOGFMT_HEADER_LEN);
+    h->format |= LOGFMT_FLAG_INDEX;
+    h->crc = 0;
+}
+
+/**
+ * Fill in the entry of an index block that summarises a block, which must
+ * still be in the SD ring buffer (so that its summary is still kept).
+ *
+ * @param index A pointer to the index block.
+ * @param i The number of the entry, from 0 to LOGFMT_INDEX_ENTRIES - 1.
+ * @param block A pointer to the block.
+ */
+void logfmt_index_add(char *index, uint8_t i, const char *block)
+{
+    const BlockHeader *h = (const BlockHeader *)block;
+    IndexEntry *e = (IndexEntry *)(index + LOGFMT_HEADER_LEN) + i;
+    uint8_t s = h->seq % SUMMARIES;
+
+    e->seq = h->seq;
+    e->time = h->time;
+    memcpy(e->min, sum_min[s], sizeof(e->min));
+    memcpy(e->max, sum_max[s], sizeof(e->max));
+}
+
+/**
+ * Take the ADC channels of a frame that has been put into the current block
+ * into the block's summary.
+ *
+ * @param frame The frame, as for logfmt_put().
+ * @param adc_mask The ADC channels in the frame.
+ */
+static void summarise(volatile uint16_t *frame, uint16_t adc_mask)
+{
+    uint16_t *lo = sum_min[(header.seq - 1) % SUMMARIES];
+    uint16_t *hi = sum_max[(header.seq - 1) % SUMMARIES];
+    uint16_t v;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(adc_mask & _BV(i))
+        {
+            v = *frame++;
+            if(v < lo[i])
+                lo[i] = v;
+            if(v > hi[i])
+                hi[i] = v;
+        }
+    }
+}
+#endif
+
+#if LOG_PACKED
+/**
+ * Encode a frame in the packed format straight into the current block of the
+ * ring buffer.
+ *
+ * @param rb A pointer to the SD ring buffer.
+ * @param frame The frame, as for logfmt_put().
+ * @param adc_mask The ADC channels in the frame.
+ * @param accel_mask The accelerometer axes in the frame.
+ * @returns 0 for success, non-0 if there was no room for the frame.
+ */
+static uint8_t pack(RingBuffer *rb, volatile uint16_t *frame,
+        uint16_t adc_mask, uint8_t accel_mask)
+{
+    // The bits in each channel, from the channel map rather than adc_bits()
+    // so that they are known when this is compiled
+    static const uint8_t nbits[ADC_CHANNELS] = LOG_ADC_BITS;
+    volatile uint16_t *w;
+    uint8_t *p, *start;
+    uint8_t i, tag, bits = 0;
+    uint32_t acc = 0;
+    int16_t d;
+
+    p = start = (uint8_t *)logfmt_reserve(rb, LOGFMT_PACKED_MAX);
+    if(!p)
+        return 1;
+
+    // See whether every due channel can be sent as a delta
+    tag = LOGFMT_TAG_ABS;
+#if LOG_DELTA
+    tag = LOGFMT_TAG_DELTA;
+    for(i = 0, w = frame; i < ADC_CHANNELS; i++)
+    {
+        if(adc_mask & _BV(i))
+        {
+            d = *w++ - prev[i];
+            if(!(prev_valid & _BV(i)) || d < -128 || d > 127)
+            {
+                tag = LOGFMT_TAG_ABS;
+                break;
+            }
+        }
+    }
+#endif
+    *p++ = tag;
+
+    for(i = 0, w = frame; i < ADC_CHANNELS; i++)
+    {
+        if(adc_mask & _BV(i))
+        {
+            if(tag == LOGFMT_TAG_DELTA)
+            {
+                *p++ = (uint8_t)(*w - prev[i]);
+            } else {
+                // Shift the value in below what's waiting to go out, then
+                // write out as many whole bytes as we have
+                acc = (acc << nbits[i]) | *w;
+                bits += nbits[i];
+                while(bits >= 8)
+                {
+                    bits -= 8;
+                    *p++ = (uint8_t)(acc >> bits);
+                }
+            }
+            prev[i] = *w++;
+            prev_valid |= _BV(i);
+        }
+    }
+    if(bits)
+        *p++ = (uint8_t)(acc << (8 - bits));
+
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        if(accel_mask & _BV(i))
+            *p++ = (uint8_t)*w++;
+
+    ringbuf_commit(rb, p - start);
+    return 0;
+}
+#endif
+
+/**
+ * @}
+ */
@@ -0,0 +1,269 @@
+/**
+ * Log format header.
+ *
+ * @file logfmt.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup LogFormat
+ * @{
+ */
+
+#ifndef __LOGFMT_H__
+#define __LOGFMT_H__
+
+#include "typedefs.h"
+#include "logger.h"
+#include "datafile.h"
+
+/**
+ * The magic number at the start of every block header ("EV", little endian).
+ */
+#define LOGFMT_MAGIC        0x5645
+
+/**
+ * Flags in BlockHeader::format, describing how the frames are written.
+ */
+#define LOGFMT_FLAG_PACKED  0x01
+#define LOGFMT_FLAG_DELTA   0x02
+
+/**
+ * Set in BlockHeader::format when the header has the wall clock fields
+ * (BlockHeader::time_us to BlockHeader::wall_time), which headers written
+ * before they were added don't have. The channel divisors follow them.
+ */
+#define LOGFMT_FLAG_WALL    0x04
+
+/**
+ * Set in BlockHeader::format when the header has BlockHeader::crc, after the
+ * wall clock fields and before the channel divisors.
+ */
+#define LOGFMT_FLAG_CRC     0x08
+
+/**
+ * Set in BlockHeader::format when the header has the accelerometer mode
+ * (BlockHeader::accel_rate and BlockHeader::accel_range), after the CRC and
+ * before the channel divisors.
+ */
+#define LOGFMT_FLAG_ACCEL   0x10
+
+/**
+ * Set in BlockHeader::format for an index block, which holds no frames but an
+ * IndexEntry for each of the blocks before it (see store.c). Its header is a
+ * copy of the header of the first of those blocks.
+ */
+#define LOGFMT_FLAG_INDEX   0x20
+
+/**
+ * Set in BlockHeader::format for a summary block, which holds no frames but a
+ * StatsRecord of the whole data file (see stats.c). It is the last block of
+ * the file, so its header also says where the frames of the block before it
+ * end.
+ */
+#define LOGFMT_FLAG_STATS   0x40
+
+/**
+ * @struct BlockHeader
+ * @brief The header at the start of every block in the data file. All fields
+ * are little endian.
+ * @var BlockHeader::magic
+ * Always LOGFMT_MAGIC, so that the host can find blocks.
+ * @var BlockHeader::format
+ * LOGFMT_FLAG_* describing how the frames in this block are written.
+ * @var BlockHeader::size
+ * The size of this header in bytes, the frames start straight after it.
+ * @var BlockHeader::seq
+ * The number of blocks before this one in the data file.
+ * @var BlockHeader::time
+ * The clock_time() when the block was started, in milliseconds.
+ * @var BlockHeader::frame
+ * The number of the first frame in this block, counting from the start of the
+ * data file and including any dropped frames. This is the position of the
+ * frame in the decimation schedule.
+ * @var BlockHeader::dropped
+ * The number of frames dropped since the previous block, because the SD ring
+ * buffer was full.
+ * @var BlockHeader::rate
+ * The frame rate (LOG_RATE) in Hz.
+ * @var BlockHeader::session
+ * The logging session that the block belongs to (see datafile.c), so that
+ * blocks left on the card by an earlier session can be told apart.
+ * @var BlockHeader::adc_channels
+ * The number of ADC channels (ADC_CHANNELS).
+ * @var BlockHeader::accel_channels
+ * The number of accelerometer axes (ACCEL_CHANNELS).
+ * @var BlockHeader::time_us
+ * The microseconds into the millisecond of BlockHeader::time.
+ * @var BlockHeader::wall_us
+ * The microseconds into the millisecond of BlockHeader::wall_time.
+ * @var BlockHeader::wall
+ * The wall clock time of the last RTC tick before the block was started, in
+ * seconds since 1970 UTC, or 0 if the RTC hadn't been set (see rtc.c).
+ * @var BlockHeader::wall_time
+ * The clock_time() at that tick, in milliseconds, so that the block was
+ * started at (time - wall_time) ms and (time_us - wall_us) us after wall.
+ * @var BlockHeader::crc
+ * The CRC (see crc.c) of the block as it was written to the card, which is a
+ * whole sector other than at the end of the file, worked out with this field
+ * as 0.
+ * @var BlockHeader::accel_rate
+ * The output data rate of the accelerometer in Hz, so that the host knows how
+ * often its axes really change.
+ * @var BlockHeader::accel_range
+ * The range of the accelerometer in g, which sets the scale of its axes.
+ * @var BlockHeader::divs
+ * The rate divisor of each ADC channel then each accelerometer axis.
+ * @var BlockHeader::bits
+ * The number of bits in the logged value of each ADC channel.
+ */
+typedef struct BlockHeader
+{
+    uint16_t magic;
+    uint8_t format;
+    uint8_t size;
+    uint32_t seq;
+    uint32_t time;
+    uint32_t frame;
+    uint16_t dropped;
+    uint16_t rate;
+    uint16_t session;
+    uint8_t adc_channels;
+    uint8_t accel_channels;
+    uint16_t time_us;
+    uint16_t wall_us;
+    uint32_t wall;
+    uint32_t wall_time;
+    uint16_t crc;
+    uint16_t accel_rate;
+    uint8_t accel_range;
+    uint8_t divs[ADC_CHANNELS + ACCEL_CHANNELS];
+    uint8_t bits[ADC_CHANNELS];
+} BlockHeader;
+
+/**
+ * The number of bytes taken by a BlockHeader at the start of a block. This is
+ * rounded up to a whole number of words so that raw frames stay aligned.
+ */
+#define LOGFMT_HEADER_LEN ((sizeof(BlockHeader) + 1) & ~1)
+
+/**
+ * @struct IndexEntry
+ * @brief A summary of one block of the data file, as kept in an index block
+ * after the header. All fields are little endian.
+ * @var IndexEntry::seq
+ * The BlockHeader::seq of the block.
+ * @var IndexEntry::time
+ * The BlockHeader::time of the block, in milliseconds.
+ * @var IndexEntry::min
+ * The least logged value of each ADC channel in the block, or 0xFFFF (with
+ * IndexEntry::max as 0) if the channel wasn't logged in it.
+ * @var IndexEntry::max
+ * The greatest logged value of each ADC channel in the block.
+ */
+typedef struct IndexEntry
+{
+    uint32_t seq;
+    uint32_t time;
+    uint16_t min[ADC_CHANNELS];
+    uint16_t max[ADC_CHANNELS];
+} IndexEntry;
+
+/**
+ * The number of entries in an index block, which is as many as fit after its
+ * header. Every (LOGFMT_INDEX_ENTRIES + 1)th sector of a segment is an index
+ * of the sectors before it, so the host can work this out from any header.
+ */
+#define LOGFMT_INDEX_ENTRIES \
+    ((DATAFILE_SECTOR - LOGFMT_HEADER_LEN) / sizeof(IndexEntry))
+
+/**
+ * @struct StatsRecord
+ * @brief The statistics of a data file, as kept in its summary block after
+ * the header. All fields are little endian, and all values are in the units
+ * logged for their channels.
+ * @var StatsRecord::frames
+ * The number of frames in the data file.
+ * @var StatsRecord::samples
+ * The number of logged values of the current channel.
+ * @var StatsRecord::current_sum
+ * The sum of the current channel about StatsRecord::current_zero, for the
+ * mean current.
+ * @var StatsRecord::current_sq
+ * The sum of the squares of the current channel about
+ * StatsRecord::current_zero.
+ * @var StatsRecord::energy
+ * The sum of the voltage channel times the current channel about
+ * StatsRecord::current_zero, over each logged value of the current channel,
+ * which is the energy integral in units of one frame of the current channel.
+ * @var StatsRecord::current_rms
+ * The RMS of the current channel about StatsRecord::current_zero.
+ * @var StatsRecord::current_zero
+ * The value of the current channel at no current (STATS_CURRENT_ZERO).
+ * @var StatsRecord::voltage
+ * The ADC channel that is the voltage (STATS_VOLTAGE).
+ * @var StatsRecord::current
+ * The ADC channel that is the current (STATS_CURRENT).
+ * @var StatsRecord::min
+ * The least logged value of each ADC channel, or 0xFFFF (with
+ * StatsRecord::max as 0) if the channel was never logged.
+ * @var StatsRecord::max
+ * The greatest logged value of each ADC channel.
+ * @var StatsRecord::accel_min
+ * The least logged value of each accelerometer axis.
+ * @var StatsRecord::accel_max
+ * The greatest logged value of each accelerometer axis.
+ */
+typedef struct StatsRecord
+{
+    uint32_t frames;
+    uint32_t samples;
+    int64_t current_sum;
+    uint64_t current_sq;
+    int64_t energy;
+    uint16_t current_rms;
+    uint16_t current_zero;
+    uint8_t voltage;
+    uint8_t current;
+    uint16_t min[ADC_CHANNELS];
+    uint16_t max[ADC_CHANNELS];
+    int8_t accel_min[ACCEL_CHANNELS];
+    int8_t accel_max[ACCEL_CHANNELS];
+} StatsRecord;
+
+/**
+ * A function that is handed each frame of a block by logfmt_frames(), in the
+ * same form as logfmt_put() was given it.
+ */
+typedef void (*LogfmtFrameFn)(const uint16_t *frame, uint16_t adc_mask,
+        uint8_t accel_mask);
+
+/**
+ * The tag at the start of each frame in the packed format (see LOG_PACKED).
+ * A padding tag means that the rest of the block is unused.
+ */
+#define LOGFMT_TAG_PAD      0x00
+#define LOGFMT_TAG_ABS      0x01
+#define LOGFMT_TAG_DELTA    0x02
+
+/**
+ * The largest possible frame in the packed format, being a tag, every ADC
+ * channel at up to 16 bits and every accelerometer axis as a byte.
+ */
+#define LOGFMT_PACKED_MAX (1 + 2 * ADC_CHANNELS + ACCEL_CHANNELS)
+
+void logfmt_reset(void);
+uint8_t logfmt_check(const char *block, uint16_t session);
+void logfmt_seal(char *block, uint16_t n, uint16_t session);
+char* logfmt_reserve(RingBuffer *rb, uint16_t n);
+uint8_t logfmt_put(RingBuffer *rb, volatile uint16_t *frame, uint8_t staged,
+        uint16_t adc_mask, uint8_t accel_mask, uint8_t len);
+void logfmt_finish(RingBuffer *rb);
+uint8_t logfmt_summary(RingBuffer *rb, const StatsRecord *rec);
+uint16_t logfmt_frames(const char *block, LogfmtFrameFn fn);
+void logfmt_index_start(char *index, const char *block);
+void logfmt_index_add(char *index, uint8_t i, const char *block);
+
+#endif /* __LOGFMT_H__ */
+
+/**
+ * @}
+ */
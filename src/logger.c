@@ -2,10 +2,24 @@
  * Handles the main logger functionality of the device, including the
  * configuration of all required peripherals for the logging service.
  *
- * Logging data into the SD buffer is interrupt controlled so that precise
- * timing may be maintained. Other functionality such as updating the LCD
+ * Sampling is paced entirely in hardware so that precise timing may be
+ * maintained: the sampling timer starts each ADC conversion run and the DMA
+ * moves the results straight into the next frame of the SD buffer. The CPU is
+ * only interrupted at the end of each run to file the frame away and re-arm
+ * the ADC, see logger_frame_isr(). Other functionality such as updating the LCD
  * screen and opening, flushing and closing of files is up to an infinite loop
- * such that it can be easily interrupted by higher priority tasks.
+ * such that it can be easily interrupted by higher priority tasks. The loop
+ * sleeps in LPM0 whenever it has nothing to do, and is woken by the interrupts
+ * that give it work: a full sector in the SD buffer, the LCD update tick or a
+ * button press.
+ *
+ * Logging starts at power up (see LOG_AUTOSTART), without waiting for the SD
+ * card. The frames go into the SD buffer from the first one, whilst the loop
+ * finds, mounts and opens the card a step at a time (see card_service()), so
+ * nothing is waited for with a delay and a card that is missing or playing up
+ * never holds up sampling. A card that is taken out, or stops working, is
+ * given up on and the loop starts looking for one again, with the frames from
+ * then on going into a new data file once it's back.
  *
  * @file logger.c
  * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
@@ -25,30 +39,41 @@
 #include "system.h"
 #include "typedefs.h"
 #include "mmc.h"
-
-/**
- * Quick facility to get the used value of a ring buffer
- * @param b A pointer to the buffer which we wish to query
- */
-#define rb_getused_m(b) ((b->tail==b->head) ? 0:(b->head - b->tail + b->len) % b->len)
-
-/**
- * Quick facility to get the free value of a ring buffer
- * @param b A pointer to the buffer which we wish to query
- */
-#define rb_getfree_m(b) ((b->tail==b->head) ? b->len : (b->tail - b->head + b->len) % b->len)
-
-/**
- * Reset a ring buffer to its original empty state
- * @param b A pointer to the buffer which we wish to query
- */
-#define rb_reset_m(b) do {b->tail = b->head = 0} while (0)
+#include "datafile.h"
+#include "store.h"
+#include "logfmt.h"
+#include "profile.h"
+#include "usb.h"
+#include "telemetry.h"
+#include "rtc.h"
+#include "stats.h"
 
 static volatile uint32_t time;
 static volatile uint8_t logger_running, file_open;
 static char s[UART_BUF_LEN];
-static char ringbuf[SD_RINGBUF_LEN];
-static char writebuf[512];
+
+/// Set by the frame ISR once it is putting frames into the SD buffer, and
+/// cleared by the foreground when they are finished with, so that the next
+/// frame starts a new data file (see buffer_start())
+static volatile uint8_t buffering;
+
+/// Where the card is in being brought up, see card_service()
+#define CARD_OUT    0   ///< There is no card, or it needs setting up again
+#define CARD_FOUND  1   ///< A card has been found but isn't mounted yet
+#define CARD_READY  2   ///< The card is mounted, the data file can be opened
+static uint8_t card_state;
+
+/// The clock_time() of the last step taken by card_service()
+static clock_time_t card_time;
+
+/// The number of sector writes in a row that have failed
+static uint8_t write_fails;
+
+/// The memory behind the SD ring buffer. This is declared as words so that
+/// frames, which the DMA writes a word at a time, are always aligned. It is
+/// in the USB RAM and the bottom of main RAM (see memory.x), and isn't cleared
+/// at start up.
+static uint16_t ringbuf[SD_RINGBUF_LEN / 2] RINGBUF_SECTION;
 
 /// A RingBuffer that we will use to buffer sets of samples that are to be
 /// moved to the SD card
@@ -58,11 +83,90 @@ static RingBuffer sdbuf;
 /// into the SD transaction buffer.
 static volatile SampleBuffer sb;
 
+/// The frame that the ADC results of the current conversion run are being
+/// transferred into. This is either a slot in the SD ring buffer or, if there
+/// is no contiguous room for one, the staging buffer.
+static volatile uint16_t *frame;
+
+/// The ADC channels (bit n set for SampleBuffer::adc[n]) in the current frame
+static uint16_t frame_adc_mask;
+
+/// The number of ADC words, accelerometer axes (bit n set for
+/// SampleBuffer::accel[n]) and total words in the current frame.
+static uint8_t frame_adc, frame_accel, frame_len;
+
+/// Somewhere to put a frame that can't be converted in place in the ring
+/// buffer, either because there's no room or it is to be packed
+static uint16_t stage[ADC_CHANNELS + ACCEL_CHANNELS];
+
+/// Somewhere to throw away a conversion result that isn't due to be logged
+static uint16_t discard;
+
+#if ADC_DECIMATED
+/// The rate divisor for each ADC channel, and the number of frames until each
+/// is next due
+static const uint8_t adc_divs[ADC_CHANNELS] = LOG_ADC_DIVS;
+static uint16_t adc_due[ADC_CHANNELS];
+#endif
+
+#if ACCEL_DECIMATED
+/// The same for each accelerometer axis
+static const uint8_t accel_divs[ACCEL_CHANNELS] = LOG_ACCEL_DIVS;
+static uint16_t accel_due[ACCEL_CHANNELS];
+#endif
+
+#if LOG_TRIGGER
+/// The number of frames still to be written since the last trigger, zero
+/// whilst waiting for a trigger
+static uint32_t post_left;
+
+/// The SD ring buffer head at the end of the last frame to be written to the
+/// card, the sectors after this are only kept as pre-trigger history
+static volatile uint16_t save_end;
+
+/// Set once there has been a trigger in this data file, so that a file with
+/// nothing saved in it isn't given a summary block either
+static volatile uint8_t triggered;
+
+/// Set by button S2 to trigger on the next frame
+static volatile uint8_t trigger_manual;
+
+/// The last logged value of each ADC channel, for the slope trigger
+static uint16_t trig_prev[ADC_CHANNELS];
+
+/// Bit n is set once ADC channel n has been logged in this data file
+static uint16_t trig_valid;
+
+static void trigger_reset(void);
+static uint8_t trigger_check(void);
+#endif
+
+static FRESULT card_mount(void);
+static void card_service(RingBuffer *sdbuf);
+static uint8_t card_due(void);
+static void card_lost(void);
+static void buffer_start(void);
+static void schedule_reset(void);
+static void frame_arm(void);
+static uint8_t sectors_due(RingBuffer *sdbuf);
+static uint8_t logger_pending(RingBuffer *sdbuf, clock_time_t lcd_time);
+
+#if USB_OFFLOAD
+/// Set once the card has been offloaded over USB, until we're unplugged
+static uint8_t usb_done;
+
+/// Set whilst the card is offloaded over USB, when S1 only asks for logging
+/// to be started (see PORT1_ISR())
+static volatile uint8_t usb_active;
+
+/// Set by S1 whilst usb_active, to start logging once the USB module has
+/// given the SD buffer back
+static volatile uint8_t usb_start;
+#endif
+
 /// A FATFS filesystem object which we use to handle files and
 /// directories on the SD Card.
 FATFS FatFs;
-/// A pointer to the data file.
-FIL fil;
 /// Stores the current size of the data file.
 DWORD fsz;
 
@@ -70,18 +174,24 @@ DWORD fsz;
  * Set up the hardware for logging functionality, including the configuration
  * of required peripherals such as the ADC and Accelerometer.
  *
- * Timer A1 (TA1) is configured to interrupt at the log frequency (1kHz), the
- * interrupt service routine (ISR) is TIMER1_A0_ISR() also found in this file
- * (please see that function's documentation for details of what is done in the
- * ISR).
- *
- * @todo Calculate TAxCCR0 value based on F_CPU instead of hard-coding.
+ * Timer A0 (TA0) is configured to run at the log frequency (LOG_RATE), with its
+ * CCR1 output triggering an ADC conversion run at the start of every period.
+ * There is no timer interrupt, the DMA interrupts at the end of each run
+ * instead and logger_frame_isr() is called (please see that function's
+ * documentation for details of what is done in the ISR).
  */
 void logger_init(void)
 {
     // Initialise the ADC with the sample buffer `sb`
     adc_init(&sb);
-    Cma3000_init(&sb);
+    if(Cma3000_init(&sb))
+        uart_debug("[WARN] No accelerometer");
+
+    // Initialise the ring buffer for SD transfers
+    sdbuf.buffer = (char *)ringbuf;
+    sdbuf.head = sdbuf.tail = sdbuf.overflow = 0;
+    sdbuf.len = SD_RINGBUF_LEN;
+    sdbuf.mask = sdbuf.len - 1;
 
     // Enable LEDs and turn them off (P1.0, P8.1, P8.2)
     P1DIR |= _BV(0);
@@ -110,14 +220,17 @@ void logger_init(void)
     S2_PORT_IFG &= ~S2_PIN;
     S2_PORT_IE |= S2_PIN;
 
-    // Set up 16 bit timer TIMER1 to interrupt at the log frequency
-    TA1CCR0 = 24999;
+    // Set up 16 bit timer TIMER0 to run at the log frequency
+    TA0CCR0 = LOG_TIMER_PERIOD - 1;
 
-    // Clock from SMCLK with no divider, use "up" mode, use interrupts
-    TA1CTL |= TASSEL_2 | TACLR;
+    // The CCR1 output is reset halfway through each period and set again at
+    // the end of it (reset/set mode), each rising edge starts an ADC run
+    TA0CCR1 = TA0CCR0 >> 1;
+    TA0CCTL1 = OUTMOD_7;
 
-    // Enable interrupts on CCR0
-    TA1CCTL0 |= CCIE;
+    // Clock from SMCLK with no divider, "up" mode is selected when logging
+    TA0CTL |= TASSEL_2 | TACLR;
+    frame = stage;
 
     // Enable interrupts (if they're not already)
     eint();
@@ -126,6 +239,9 @@ void logger_init(void)
     Dogs102x6_clearRow(1);
     Dogs102x6_stringDraw(1, 0, "Logging: OFF", DOGS102x6_DRAW_NORMAL);
     logger_running = 0;
+#if LOG_AUTOSTART
+    logger_enable();
+#endif
 
     // Start the logging service (actual logging starts later)!
     start_logger(&sdbuf);
@@ -133,12 +249,18 @@ void logger_init(void)
 
 
 /**
- * Update the LCD with the current status of the logger, including buffer
- * usage, data file size and SD card utilisation.
+ * Update the LCD with the current status of the logger, including whether it
+ * is logging, buffer usage, data file size and SD card utilisation.
  *
- * @note This should not be called too regularly on the MSP-EXP430 board due to
- * the SD card and LCD panel being on the same SPI bus and will cause slowdown
- * of SD transactions.
+ * This only draws into the LCD frame buffer, and rows that haven't changed are
+ * left alone. The start_logger() loop sends the changed rows out with
+ * Dogs102x6_flush() whilst the SD card isn't busy, since the SD card and LCD
+ * panel are on the same SPI bus on the MSP-EXP430 board. The free space comes
+ * from datafile_free(), so the card itself is not read, and is only shown
+ * whilst the card is mounted (as a question mark until it has been counted
+ * in the background). Once logging has stopped, some of the rows show the
+ * summary of the data file that was closed instead, if there is one (see
+ * stats_show()).
  *
  * @param buf A pointer to the RingBuffer which we are monitoring.
  */
@@ -146,31 +268,74 @@ void update_lcd(RingBuffer *buf)
 {
     FATFS *fs;
     fs = &FatFs;
-    DWORD fre_clust, fre_sect, tot_sect;
-
-    /* Get volume information and free clusters of drive 1 */
-    f_getfree("", &fre_clust, &fs);
+    DWORD fre_sect, tot_sect;
+#if PROFILE
+    Probe p;
+#endif
 
-    /* Get total sectors and free sectors */
-    tot_sect = (fs->n_fatent - 2) * fs->csize;
-    fre_sect = fre_clust * fs->csize;
+    if(card_state == CARD_READY)
+    {
+        /* Get total sectors and free sectors */
+        tot_sect = (fs->n_fatent - 2) * fs->csize;
+        fre_sect = datafile_free();
 
-    /* Print the free space (assuming 512 bytes/sector) */
-    sprintf(s, "%lu/%luMB (%lu%%)", (tot_sect-fre_sect)/2000, 
-            tot_sect/2000, (100 - (100*fre_sect)/tot_sect));
-    Dogs102x6_clearRow(4);
-    Dogs102x6_stringDraw(4, 0, s, DOGS102x6_DRAW_NORMAL);
+        /* Print the free space (assuming 512 bytes/sector), which is only
+         * known once the FAT has been counted */
+        if(fre_sect == 0xFFFFFFFF)
+        {
+            sprintf(s, "?/%luMB", tot_sect/2000);
+        } else {
+            fre_sect *= fs->csize;
+            sprintf(s, "%lu/%luMB (%lu%%)", (tot_sect-fre_sect)/2000, 
+                    tot_sect/2000, (100 - (100*fre_sect)/tot_sect));
+        }
+        lcd_row(4, s);
+    } else {
+        lcd_row(4, "No card");
+    }
 
-    // Show bytes in buffer
-    sprintf(s, "Buffer: %u%%", (100*rb_getused_m(buf))/buf->len);
-    Dogs102x6_clearRow(2);
-    Dogs102x6_stringDraw(2, 0, s, DOGS102x6_DRAW_NORMAL);
+    // Show whether we're logging, which until the data file is open is only
+    // into the SD buffer
+    if(!logger_running)
+        lcd_row(1, "Logging: OFF");
+    else if(!file_open)
+        lcd_row(1, "Logging: WAIT");
+#if LOG_TRIGGER
+    else
+        lcd_row(1, post_left ? "Logging: TRIG" : "Logging: ARMED");
+#else
+    else
+        lcd_row(1, "Logging: ON");
+#endif
 
     // Show size of file
-    fsz = f_size(&fil);
-    sprintf(s, "File: %lukb", (unsigned long)fsz/1000);
-    Dogs102x6_clearRow(3);
-    Dogs102x6_stringDraw(3, 0, s, DOGS102x6_DRAW_NORMAL);
+    fsz = datafile_size();
+    sprintf(s, "File %u: %lukb", datafile_segment(), (unsigned long)fsz/1000);
+    lcd_row(3, s);
+
+#if STATS
+    if(logger_running || !stats_show())
+#endif
+    {
+        // Show bytes in buffer
+        sprintf(s, "Buffer: %lu%%", (100UL * rb_getused_m(buf)) / buf->len);
+        lcd_row(2, s);
+
+#if PROFILE
+        // Show the most that the buffer has held and the longest write, along
+        // with the longest time that the card has kept us waiting
+        profile_get(PROF_SD_WRITE, &p);
+        sprintf(s, "Peak %lu%% wr %lums",
+                (100UL * profile_peak()) / buf->len, PROF_US(p.max) / 1000);
+        lcd_row(5, s);
+        profile_get(PROF_WAIT_READY, &p);
+        sprintf(s, "Card busy %lums", PROF_US(p.max) / 1000);
+        lcd_row(6, s);
+#elif STATS
+        lcd_row(5, "");
+        lcd_row(6, "");
+#endif
+    }
 
     // Monitor buffer overflow
     if(buf->overflow)
@@ -178,14 +343,38 @@ void update_lcd(RingBuffer *buf)
 }
 
 /**
- * Set up the SD card and the FATFS filesystem handler before commencing the
- * logging service.
+ * Run the logging service, bringing up the SD card and the FATFS filesystem
+ * handler as it goes.
  *
  * The controls regularly moving blocks of data from the SD buffer to the card
  * using sd_write(), which is done when the SD buffer size has reached at least
- * the sector size such that we write as quickly as possible. It also calls for
+ * the sector size such that we write as quickly as possible. If the card has
+ * fallen behind, the backlog goes in batches of several sectors (see
+ * sectors_due()). It also calls for
  * LCD display updates (with update_lcd()) and handling opening/closing of the
- * data file when logging starts/stops.
+ * data file when logging starts/stops. The LCD is drawn in its frame buffer and
+ * the changed rows are sent out one at a time, only whilst there isn't a
+ * sector waiting to be written, so the LCD never holds up the card.
+ *
+ * The card is found, mounted and the data file opened by card_service(), a
+ * step at a time with CARD_RETRY_PERIOD between attempts that fail, so the
+ * loop never waits for a card that isn't there. Logging (into the SD buffer)
+ * carries on regardless, and if the buffer fills up before the file is open
+ * the later frames are dropped, as they would be by a slow card. Stopping
+ * logging before then throws the frames away.
+ *
+ * Between these the CPU sleeps in LPM0 rather than polling. The DMA interrupt
+ * only wakes us when a sector has been completed (see logger_frame_isr()), the
+ * system tick wakes us every LCD_UPDATE_PERIOD and the S1 interrupt wakes us
+ * when logging is started or stopped. The UART wakes us when a line has been
+ * received, which may set the RTC (see rtc_command()) or the accelerometer
+ * mode (see Cma3000_command()).
+ *
+ * Whilst logging is stopped, plugging into a USB host offloads the card to it
+ * (see usb.c) until we're unplugged, the host ejects the card or S1 is
+ * pressed. The card is then mounted again, since the host may have changed
+ * it. The USB module's buffers are in the SD buffer, so S1 only stops the
+ * offload, and logging is started here once the USB module has been stopped.
  *
  * @param sdbuf A pointer to the SD card buffer. This is a RingBuffer that we
  * will use to buffer incoming samples before they are logged to the SD card,
@@ -194,112 +383,426 @@ void update_lcd(RingBuffer *buf)
 void start_logger(RingBuffer* sdbuf)
 {   
     FRESULT fr;
+    clock_time_t lcd_time;
+    uint8_t n;
 
-    // Initialise the ring buffer for SD transfers
-    sdbuf->buffer = ringbuf;
-    sdbuf->head = sdbuf->tail = sdbuf->overflow = 0;
-    sdbuf->len = SD_RINGBUF_LEN;
-    sdbuf->mask = sdbuf->len - 1;
-
-    // Wait for an SD card to be inserted
-    while(!detectCard())
-    {
-        _delay_ms(250);
-        lcd_debug("Insert SD Card");
-    }
-    lcd_debug("");
-
-    fr = f_mount(0, &FatFs);
-    while( fr != FR_OK )
-    {
-        sprintf(s, "Mount fail: %d", fr);
-        uart_debug(s);
-        _delay_ms(100);
-        fr = f_mount(0, &FatFs);
-    }
-
-    // Now we can begin updating the LCD
+    // From here on the LCD is only drawn into the frame buffer and flushed out
+    // when the SD card is idle
+    Dogs102x6_refresh(DOGS102x6_DRAW_ON_REFRESH);
+    card_state = CARD_OUT;
+    card_time = clock_time() - CARD_POLL_PERIOD;
     update_lcd(sdbuf);
+    lcd_time = clock_time();
+    clock_set_wakeup(LCD_UPDATE_PERIOD);
 
     while(1)
     {
-        // If we just started logging then open the file
-        if(logger_running && !file_open)
+        // Bring up the card and open the data file, or check that the card is
+        // still there
+        if(card_due())
+            card_service(sdbuf);
+
+        // If we just stopped logging then close the file
+        if(!logger_running && buffering)
         {
-            fr = f_open(&fil, "data.log", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
-            while( fr != FR_OK )
+            if(file_open)
             {
-                _delay_ms(500);
-                sprintf(s, "Open fail: %d", fr);
-                uart_debug(s);
-                fr = f_open(&fil, "data.log", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+#if LOG_TRIGGER
+                // Only write out up to the end of the last post-trigger
+                // window, as sectors_due() would have, and throw away the
+                // pre-trigger history after it. The last block is padded out
+                // first so that only whole sectors are left.
+                logfmt_finish(sdbuf);
+                while(rb_getused_m(sdbuf) >= DATAFILE_SECTOR
+                        && (int16_t)(save_end - sdbuf->tail) > 0)
+                    sd_write(sdbuf, DATAFILE_SECTOR);
+                ringbuf_consume(sdbuf, rb_getused_m(sdbuf));
+#else
+                // Write any remaining data to the disk, one sector at a time
+                while(rb_getused_m(sdbuf) > DATAFILE_SECTOR)
+                    sd_write(sdbuf, DATAFILE_SECTOR);
+#endif
+#if STATS
+                // The frame ISR has stopped putting frames in, so the last
+                // block can be padded out and followed by the summary, once
+                // the last frames are in the statistics
+                logfmt_finish(sdbuf);
+                if(rb_getused_m(sdbuf))
+                    sd_write(sdbuf, rb_getused_m(sdbuf));
+#if LOG_TRIGGER
+                // Leave the file empty if nothing was ever saved
+                if(triggered && stats_finish(sdbuf))
+                    lcd_debug("No summary");
+#else
+                if(stats_finish(sdbuf))
+                    lcd_debug("No summary");
+#endif
+#endif
+                if(rb_getused_m(sdbuf))
+                    sd_write(sdbuf, rb_getused_m(sdbuf));
+                if(store_sync())
+                    lcd_debug("sync fail");
+
+                // Close the file, if that fails the card is set up again and
+                // the file is recovered when it's mounted
+                fr = store_close();
+                if(fr)
+                {
+                    sprintf(s, "close fail: %d", fr);
+                    uart_debug(s);
+                    card_lost();
+                }
+                if(store_dropped())
+                {
+                    sprintf(s, "%lu blocks not mirrored",
+                            (unsigned long)store_dropped());
+                    uart_debug(s);
+                }
+#if PROFILE
+                profile_dump();
+#endif
+            } else {
+                lcd_debug("Not saved, no SD");
             }
-            sdbuf->overflow = 0;
-            lcd_debug("");
-            file_open = 1;
+            file_open = 0;
+            buffering = 0;
+            lcd_time = clock_time() - LCD_UPDATE_PERIOD;
         }
 
-        // If we just stopped logging then close the file
-        if(!logger_running && file_open)
+#if USB_OFFLOAD
+        // Hand the card to the host if we've been plugged into one whilst not
+        // logging, but only once for each time that we're plugged in
+        if(!logger_running && !buffering)
         {
-            // Write any remaining data to the disk
-            sd_write(sdbuf, writebuf, &fil, rb_getused_m(sdbuf));
-            if(f_sync(&fil))
-                lcd_debug("sync fail");
-
-            // Close the file
-            fr = f_close(&fil);
-            while(fr != FR_OK)
+            if(!usb_vbus())
             {
-                sprintf(s, "close fail: %d", fr);
-                lcd_debug(s);
-                fr = f_close(&fil);
-                _delay_ms(100);
+                usb_done = 0;
+            } else if(!usb_done) {
+                usb_done = 1;
+                lcd_debug("USB offload");
+                while(Dogs102x6_flush());
+
+                // Finish recovering the last session first, so that the
+                // host sees the whole of it
+                if(card_state == CARD_READY)
+                    while(datafile_service());
+                f_mount(0, NULL);
+                usb_start = 0;
+                usb_active = 1;
+                usb_offload(&usb_start);
+                usb_active = 0;
+
+                // The host may have changed anything on the card
+                lcd_debug("");
+                card_state = CARD_OUT;
+                card_time = clock_time() - CARD_POLL_PERIOD;
+                lcd_time = clock_time() - LCD_UPDATE_PERIOD;
+
+                // Start logging if S1 stopped the offload, now that the SD
+                // buffer is ours again
+                if(usb_start && !logger_running)
+                    logger_enable();
             }
-            file_open = 0;
+        }
+#endif
+
+        // Write the sectors that are ready to the SD card, giving up on the
+        // card if it keeps failing
+        if((n = sectors_due(sdbuf)))
+        {
+            if(sd_write(sdbuf, n * DATAFILE_SECTOR) == FR_OK)
+                write_fails = 0;
+            else if(++write_fails >= CARD_WRITE_FAILS)
+                card_lost();
         }
 
-        // Use the fast getused() ring buffer function since we care about
-        // speed. Write one sector to the SD card.
-        if((rb_getused_m(sdbuf) > 512) && file_open && logger_running)
-            sd_write(sdbuf, writebuf, &fil, 512);
+        // Set the RTC if we've been sent the time over the UART, or the
+        // accelerometer mode between data files
+        if(uart_getline(s) && !rtc_command(s))
+            Cma3000_command(s, buffering);
 
-        // Update the LCD once every 200ms
-        if((clock_time() % 200) == 0)
+        // Update the LCD once every LCD_UPDATE_PERIOD
+        if((clock_time() - lcd_time) >= LCD_UPDATE_PERIOD)
+        {
+            lcd_time = clock_time();
             update_lcd(sdbuf);
+            rtc_service();
+        }
+
+        // If the card is idle then send the next changed row to the LCD, and
+        // get on with the background work on the card, such as preparing the
+        // next segment of the data file
+        if(!sectors_due(sdbuf))
+        {
+            Dogs102x6_flush();
+            if(card_state == CARD_READY)
+                datafile_service();
+        }
+
+        // Sleep until there's something to do. Interrupts are disabled whilst
+        // we check, and LPM0 and GIE are set in a single instruction, so that
+        // a wakeup in between can't be missed
+        dint();
+        if(logger_pending(sdbuf, lcd_time))
+            eint();
+        else
+            __bis_SR_register(LPM0_bits + GIE);
+    }
+}
+
+/**
+ * Take the next step in bringing up the card, being to find it, then to mount
+ * it and then, once we're logging, to open the data file. Whilst it's mounted
+ * and we're not logging, check that it's still there. If a step fails we go
+ * back to finding the card, which sets it up again from scratch, so a card
+ * that has been swapped or has played up is dealt with in the same way as one
+ * that was never there.
+ *
+ * Finding the card can still take a while, since the card takes time to start
+ * up, but the frames carry on going into the SD buffer in the meantime.
+ * Mounting it and opening the data file only read the directory, everything
+ * else is done in the background (see datafile_service()).
+ *
+ * @param sdbuf A pointer to the SD card buffer.
+ */
+static void card_service(RingBuffer *sdbuf)
+{
+    FRESULT fr;
+
+    card_time = clock_time();
+    switch(card_state)
+    {
+        case CARD_OUT:
+            if(!detectCard())
+            {
+                lcd_debug("Insert SD Card");
+                break;
+            }
+            card_state = CARD_FOUND;
+            card_time = clock_time() - CARD_POLL_PERIOD;
+            break;
+
+        case CARD_FOUND:
+            fr = card_mount();
+            if(fr)
+            {
+                sprintf(s, "Mount fail: %d", fr);
+                lcd_debug(s);
+                card_state = CARD_OUT;
+                break;
+            }
+            lcd_debug("");
+            card_state = CARD_READY;
+            card_time = clock_time() - CARD_POLL_PERIOD;
+            break;
+
+        case CARD_READY:
+            if(!buffering || !logger_running)
+            {
+                if(!detectCard())
+                    card_lost();
+                break;
+            }
+
+            fr = store_open();
+            if(fr)
+            {
+                sprintf(s, "Open fail: %d", fr);
+                lcd_debug(s);
+                card_state = CARD_OUT;
+                break;
+            }
+#if TELEMETRY
+            telemetry_session(datafile_session());
+#endif
+#if STATS
+            stats_reset();
+#endif
+            // Only frames dropped from here on are shown as an overflow, those
+            // dropped whilst waiting for the card are in the block headers as
+            // usual
+            sdbuf->overflow = 0;
+            write_fails = 0;
+            lcd_debug("");
+            file_open = 1;
+            break;
     }
 }
 
 /**
- * Write n bytes from a ring buffer to an SD card controlled by fatfs.
+ * Check whether card_service() has a step to take. Until the data file is
+ * open this is whenever a retry is due, or straight away once the card is
+ * mounted and we're logging. Whilst not logging, it's time to check that a
+ * mounted card is still there every CARD_POLL_PERIOD.
+ *
+ * @returns Non-zero if card_service() should be called.
+ */
+static uint8_t card_due(void)
+{
+    clock_time_t since = clock_time() - card_time;
+
+    if(file_open)
+        return 0;
+    if(card_state == CARD_READY)
+        return (buffering && logger_running) || since >= CARD_POLL_PERIOD;
+    return since >= CARD_RETRY_PERIOD;
+}
+
+/**
+ * Give up on the card, after it has been taken out or has stopped working.
+ * The data file can't be closed, but its segments are recovered when the card
+ * is next mounted (see datafile.c). The frames in the SD buffer for it are
+ * lost, and if we're logging the frame ISR starts the next data file from the
+ * next frame, which is opened once there's a card again.
+ */
+static void card_lost(void)
+{
+    lcd_debug("Card lost");
+    datafile_abandon();
+    f_mount(0, NULL);
+    file_open = 0;
+    buffering = 0;
+    card_state = CARD_OUT;
+    card_time = clock_time();
+}
+
+/**
+ * Mount the card and find the last session on it. The last session is then
+ * recovered, in case it was cut short, and the free space is counted, both in
+ * the background.
+ *
+ * @returns The FatFs result code of mounting the card.
+ */
+static FRESULT card_mount(void)
+{
+    FRESULT fr;
+
+    fr = f_mount(0, &FatFs);
+    if(fr)
+        return fr;
+    return datafile_init();
+}
+
+/**
+ * Check whether the start_logger() loop has any work to do, such that it
+ * must not go to sleep.
+ *
+ * @param sdbuf A pointer to the SD card buffer.
+ * @param lcd_time The clock time of the last LCD update.
+ * @returns Non-zero if there is a sector to write, the data file needs to be
+ * closed, card_service() has a step to take, the LCD is due to be updated or
+ * has changes to send, or there is background work to do on the card.
+ */
+static uint8_t logger_pending(RingBuffer *sdbuf, clock_time_t lcd_time)
+{
+    if(!logger_running && buffering)
+        return 1;
+    if(card_due())
+        return 1;
+    if(sectors_due(sdbuf))
+        return 1;
+    if(Dogs102x6_dirty())
+        return 1;
+    if(card_state == CARD_READY && datafile_busy())
+        return 1;
+    return (clock_time() - lcd_time) >= LCD_UPDATE_PERIOD;
+}
+
+/**
+ * Check how many sectors in the SD buffer should be written to the card now,
+ * being those that are complete, up to STORE_BATCH of them and without
+ * wrapping around the end of the buffer, so that they can be written in one
+ * go. Use the fast getused() ring buffer function since we care about speed.
+ *
+ * In trigger mode, a sector that is only being kept as pre-trigger history is
+ * not written, and the oldest sectors are thrown away once there are more
+ * than LOG_PRE_SECTORS of them (this is safe since we are the consumer).
+ *
+ * @param sdbuf A pointer to the SD card buffer.
+ * @returns The number of sectors that should be written with sd_write().
+ */
+static uint8_t sectors_due(RingBuffer *sdbuf)
+{
+    uint16_t used, sector;
+    uint8_t n = 0;
+
+    if(!file_open || !logger_running)
+        return 0;
+
+    used = rb_getused_m(sdbuf);
+    sector = sdbuf->tail;
+    while(n < STORE_BATCH && used >= DATAFILE_SECTOR)
+    {
+#if LOG_TRIGGER
+        // A sector only needs writing if some of it comes before the end of
+        // the last frame to be saved
+        if((int16_t)(save_end - sector) <= 0)
+            break;
+#endif
+        n++;
+        used -= DATAFILE_SECTOR;
+        sector += DATAFILE_SECTOR;
+        if(!(sector & sdbuf->mask))
+            break;
+    }
+
+#if LOG_TRIGGER
+    if(!n)
+    {
+        while(rb_getused_m(sdbuf) >= (LOG_PRE_SECTORS + 1) * DATAFILE_SECTOR)
+            ringbuf_consume(sdbuf, DATAFILE_SECTOR);
+    }
+#endif
+    return n;
+}
+
+/**
+ * Write n bytes from a ring buffer to the data file on the SD card, and to
+ * anywhere else that it is mirrored to (see store.c).
+ *
+ * The data is not copied out of the ring buffer, instead we hand the card a
+ * pointer straight into the ring buffer using ringbuf_peek() and only give the
+ * space back to the producer (with ringbuf_consume()) once the write has
+ * completed.
  *
  * We turn on the red LED on the board during an SD write transaction such that
  * the user can monitor the frequency and duration of writes. This is
  * particularly helpful in watching for SD clock stretching which often causes
  * buffer overflow.
  *
- * @note n should always be at least one sector (typically 512 bytes), hence
- * the RingBuffer rb. Doing otherwise will work but will likely cause
- * significant slowdown. The calling function can use the rb_getused_m() macro
- * to determine when there is one sector's worth (or more) of data in the
- * buffer and then call sd_write().
+ * @note n should always be a whole number of sectors (DATAFILE_SECTOR bytes)
+ * other than for the final write to a file, and no more than STORE_BATCH of
+ * them. Since the buffer length is a multiple of the sector size and the tail
+ * is sector aligned, a sector can never wrap around the end of the buffer,
+ * though a run of them can. The calling function can use sectors_due() to
+ * find how many sectors can be written in one go.
+ *
+ * The CRC in each block's header is filled in first (see logfmt_seal()), now
+ * that the producer has finished with the block. Once the card has the
+ * blocks, their frames are taken into the statistics of the data file (see
+ * stats.c) before the room is given back, unless the write failed.
  *
  * @param rb A pointer to the ring buffer from which we will read the required
  * data.
- * @param writebuf A short buffer where we can temporarily place a single
- * before before writing it to the card.
  * @param n The number of bytes to be written to the card.
- * @param fil A pointer to the file to which we want to write.
  * @return FRESULT The fatfs result code for the write operation.
  */
-FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n)
+FRESULT sd_write(RingBuffer *rb, uint16_t n)
 {
     FRESULT fr;
-    UINT bw;
+    char *sector;
+    uint16_t i;
+    PROFILE_START(t);
+
+    if(n > STORE_BATCH * DATAFILE_SECTOR || ringbuf_peek(rb, &sector) < n)
+        return FR_INT_ERR;
+
+    for(i = 0; i < n; i += DATAFILE_SECTOR)
+        logfmt_seal(sector + i, (n - i < DATAFILE_SECTOR) ? n - i
+                : DATAFILE_SECTOR, datafile_session());
 
-    ringbuf_read(rb, writebuf, n);
     P1OUT |= _BV(0);
-    fr = f_write(fil, writebuf, n, &bw);
+    fr = store_write(sector, n);
     
     if(fr)
     {
@@ -307,15 +810,24 @@ FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n)
         lcd_debug(s);
     }
     P1OUT &= ~_BV(0);
+    PROFILE_END(PROF_SD_WRITE, t);
+
+#if STATS
+    if(fr == FR_OK)
+        stats_blocks(sector, n);
+#endif
+    ringbuf_consume(rb, n);
     return fr;
 }
 
 /**
- * Write n bytes to a RingBuffer.
+ * Write n bytes to a RingBuffer. This must only be called by the single
+ * producer for the buffer.
  *
  * This is done via a fast memcpy operation and as such, there is logic in this
  * function to transparently handle the copy even if we're wrapping over the
- * boundary of the ring buffer.
+ * boundary of the ring buffer. The head is only moved on once all of the data
+ * is in the buffer, so the consumer never sees a partially written block.
  *
  * @param buf A pointer to the ring buffer we want to write to
  * @param data A pointer to the data to be written
@@ -324,11 +836,7 @@ FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n)
  */
 uint8_t ringbuf_write(RingBuffer *buf, char* data, uint16_t n)
 {
-    uint16_t rem;
-
-    // Check we're not writing more than the buffer can hold
-    if(n >= buf->len)
-        return 1;
+    uint16_t head, idx, rem;
 
     // Make sure there's enough free space in the buffer for our data
     if(rb_getfree_m(buf) < n)
@@ -337,135 +845,454 @@ uint8_t ringbuf_write(RingBuffer *buf, char* data, uint16_t n)
         return 1;
     }
 
+    head = buf->head;
+    idx = head & buf->mask;
+    rem = buf->len - idx;
+
     // We can do a single memcpy as long as we don't wrap around the buffer
-    if(buf->head + n < buf->len)
+    if(n <= rem)
     {
-        // We won't wrap, we can quickly memcpy
-        memcpy(buf->buffer + buf->head, data, n);
-        buf->head = (buf->head + n) & buf->mask;
+        memcpy(buf->buffer + idx, data, n);
     } else {
         // We're going to wrap, copy in 2 blocks
-        // Copy the first (SD_BUF_LEN - buf->head) bytes
-        rem = buf->len - buf->head;
-        memcpy(buf->buffer + buf->head, data, rem);
-        buf->head = (buf->head + rem) & buf->mask;
-        // Copy the remaining bytes
-        memcpy(buf->buffer + buf->head, data + rem, n - rem);
-        buf->head = (buf->head + (n-rem)) & buf->mask;
+        memcpy(buf->buffer + idx, data, rem);
+        memcpy(buf->buffer, data + rem, n - rem);
     }
+
+    // Publish the new data to the consumer
+    buf->head = head + n;
     return 0;
 }
 
 /**
- * Read n bytes from a ring buffer.
+ * Read n bytes from a ring buffer. This must only be called by the single
+ * consumer for the buffer.
  *
  * This is done via a fast memcpy operation and as such, there is logic in this
  * function to transparently handle the copy even if we're wrapping over the
  * boundary of the ring buffer.
  *
- * @param buf A pointer to the ring buffer we want to write to
+ * @param buf A pointer to the ring buffer we want to read from
  * @param read_buffer Copy data into this array
  * @param n The number of bytes to be read from the ring buffer
  * @returns 0 for success, non-0 for failure
  */
 uint8_t ringbuf_read(RingBuffer *buf, char* read_buffer, uint16_t n)
 {
-    uint16_t rem;
-
-    // We can't read more data than the buffer holds!
-    if(n >= buf->len)
-        return 1;
+    uint16_t tail, idx, rem, used;
 
     // We can't read more bytes than the buffer currently contains
-    if(n > rb_getused_m(buf))
-        n = rb_getused_m(buf);
+    used = rb_getused_m(buf);
+    if(n > used)
+        n = used;
 
-    if(buf->tail + n < buf->len)
+    tail = buf->tail;
+    idx = tail & buf->mask;
+    rem = buf->len - idx;
+
+    if(n <= rem)
     {
         // We won't wrap, we can quickly memcpy
-        memcpy(read_buffer, buf->buffer + buf->tail, n);
-        buf->tail = (buf->tail + n) & buf->mask;
+        memcpy(read_buffer, buf->buffer + idx, n);
     } else {
         // We're going to wrap, copy in 2 blocks
-        // Copy the first (SD_BUF_LEN - buf->head) bytes
-        rem = buf->len - buf->tail;
-        memcpy(read_buffer, buf->buffer + buf->tail, rem);
-        buf->tail = (buf->tail + rem) & buf->mask;
-        // Copy the remaining bytes
-        memcpy(read_buffer + rem, buf->buffer + buf->tail, n - rem);
-        buf->tail = (buf->tail + (n-rem)) & buf->mask;
+        memcpy(read_buffer, buf->buffer + idx, rem);
+        memcpy(read_buffer + rem, buf->buffer, n - rem);
     }
+
+    // Give the space back to the producer
+    buf->tail = tail + n;
     return 0;
 }
 
 /**
- * Enable TA1 to begin logging by setting mode control to "up" mode,
+ * Get a pointer to the unread data at the tail of a ring buffer without
+ * copying it or removing it from the buffer. This must only be called by the
+ * single consumer for the buffer.
+ *
+ * The data remains owned by the consumer until it is released with
+ * ringbuf_consume(), the producer will not overwrite it in the meantime.
+ *
+ * @param buf A pointer to the ring buffer we want to read from
+ * @param data Set to point at the next unread byte in the buffer
+ * @returns The number of bytes that can be read contiguously from data, which
+ * stops short of the end of the buffer if the unread data wraps around.
+ */
+uint16_t ringbuf_peek(RingBuffer *buf, char **data)
+{
+    uint16_t idx, used, rem;
+
+    used = rb_getused_m(buf);
+    idx = buf->tail & buf->mask;
+    rem = buf->len - idx;
+
+    *data = buf->buffer + idx;
+    return (used < rem) ? used : rem;
+}
+
+/**
+ * Get a pointer to n bytes of free space at the head of a ring buffer, such
+ * that the producer can fill it in place (for example by DMA) rather than
+ * copying data in with ringbuf_write(). This must only be called by the
+ * single producer for the buffer.
+ *
+ * The data is not seen by the consumer until it is published with
+ * ringbuf_commit().
+ *
+ * @param buf A pointer to the ring buffer we want to write to
+ * @param n The number of bytes required
+ * @returns A pointer to n contiguous free bytes, or NULL if there is not
+ * enough free space or the space would wrap around the end of the buffer.
+ */
+char* ringbuf_reserve(RingBuffer *buf, uint16_t n)
+{
+    uint16_t idx;
+
+    idx = buf->head & buf->mask;
+    if(rb_getfree_m(buf) < n || (buf->len - idx) < n)
+        return NULL;
+
+    return buf->buffer + idx;
+}
+
+/**
+ * Publish n bytes at the head of a ring buffer to the consumer, after they
+ * have been filled in place using ringbuf_reserve().
+ *
+ * @param buf A pointer to the ring buffer
+ * @param n The number of bytes to publish, which must not be more than was
+ * reserved
+ */
+void ringbuf_commit(RingBuffer *buf, uint16_t n)
+{
+    buf->head += n;
+}
+
+/**
+ * Release n bytes from the tail of a ring buffer back to the producer,
+ * typically after they have been dealt with in place using ringbuf_peek().
+ *
+ * @param buf A pointer to the ring buffer
+ * @param n The number of bytes to release, which must not be more than the
+ * buffer currently contains
+ */
+void ringbuf_consume(RingBuffer *buf, uint16_t n)
+{
+    buf->tail += n;
+}
+
+/**
+ * Enable TA0 to begin logging by setting mode control to "up" mode,
  * counter counts to TAxCCR0.
  *
  * The flag variable logger_running is asserted such that the start_logger()
  * loop notices that logging has started as should open the data file if it has
- * not already done so.  We also write to the LCD to show that logging has been
- * started.
+ * not already done so, and shows on the LCD that logging has been started.
+ *
+ * Until the frame ISR has started putting frames into the SD buffer, frames
+ * are converted into the staging buffer and discarded (see
+ * logger_frame_isr()), so we arm the first run to go there. If the last
+ * session hasn't been finished with yet, it simply carries on.
+ *
  * @note logger_running is asserted before the timer is enabled.
  */
 void logger_enable(void)
 {
     // Stop any timer activity
-    TA1CTL &= ~MC_3;
+    TA0CTL &= ~MC_3;
+    if(!buffering)
+    {
+        schedule_reset();
+        frame_arm();
+    }
 
-    Dogs102x6_clearRow(1);
-    Dogs102x6_stringDraw(1, 0, "Logging: ON", DOGS102x6_DRAW_NORMAL);
     logger_running = 1;
 
     // Start the timer
-    TA1CTL |= MC_1;
+    TA0CTL |= MC_1;
 }
 
 /**
- * Disable TA1 to halt logging by setting mode control to STOP.
+ * Disable TA0 to halt logging by setting mode control to STOP.
  *
  * The flag logger_running is deasserted so that the start_logger() loop
- * notices and cleanly flushes and closes the data file.  We also write to the
- * LCD to show that logging has stopped.
+ * notices and cleanly flushes and closes the data file, and shows on the LCD
+ * that logging has stopped.
  *
  * @note logger_running is deasserted after the timer is stopped.
  */
 void logger_disable(void)
 {
     // Clear bits 4 and 5
-    TA1CTL &= ~MC_3;
+    TA0CTL &= ~MC_3;
     logger_running = 0;
-    Dogs102x6_clearRow(1);
-    Dogs102x6_stringDraw(1, 0, "Logging: OFF", DOGS102x6_DRAW_NORMAL);
 }
 
 /**
- * Interrupt service routine for Timer A1 (TA1), where we should log one block
- * of data.
- *
- * We do this by copying the current SampleBuffer into the RingBuffer used for
- * SD transactions. There is no processing of the data since it is too slow --
- * this is left to post-processing on a desktop machine. We then trigger the
- * next conversion runs for the ADC and accelerometer such that next time we
- * enter this ISR, new data will be in the SampleBuffer sb.
+ * Start putting frames into an empty SD buffer, from the first frame of a
+ * new data file. This is only called from the frame ISR, so the producer
+ * isn't putting frames into the buffer, and the consumer doesn't touch it
+ * until the file is open.
  */
-interrupt(TIMER1_A0_VECTOR) TIMER1_A0_ISR(void)
+static void buffer_start(void)
 {
-    // Write the contents of the sample buffer (sb) to the SD buffer
-    if(file_open)
+    rb_reset_m(&sdbuf);
+    sdbuf.overflow = 0;
+    logfmt_reset();
+#if TELEMETRY
+    telemetry_reset();
+#endif
+#if LOG_TRIGGER
+    trigger_reset();
+#endif
+#if PROFILE
+    profile_reset();
+#endif
+    buffering = 1;
+}
+
+/**
+ * Restart the decimation scheduler such that every channel is due in the next
+ * frame to be armed. This is the first frame of each data file.
+ */
+static void schedule_reset(void)
+{
+#if ADC_DECIMATED || ACCEL_DECIMATED
+    uint8_t i;
+#endif
+
+#if ADC_DECIMATED
+    for(i = 0; i < ADC_CHANNELS; i++)
+        adc_due[i] = 1;
+#endif
+#if ACCEL_DECIMATED
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        accel_due[i] = 1;
+#endif
+}
+
+/**
+ * Advance the decimation scheduler by one frame and arm the ADC to convert
+ * the channels that are due in it.
+ *
+ * Each channel counts down the frames until it is next due, so a channel with
+ * a divisor of d is in frames 0, d, 2d... of the data file. In the raw format,
+ * the frame goes straight into its place in the ring buffer if there's room
+ * for it, otherwise (or if it is to be packed) into the staging buffer.
+ */
+static void frame_arm(void)
+{
+    uint16_t adc_mask = 0;
+#if ADC_DECIMATED || ACCEL_DECIMATED
+    uint8_t i;
+#endif
+
+    // When the channel map logs every channel in every frame, every frame is
+    // the same and there is nothing to count
+    frame_adc = frame_accel = frame_len = 0;
+#if ADC_DECIMATED
+    for(i = 0; i < ADC_CHANNELS; i++)
     {
-        ringbuf_write(&sdbuf, (char *)&sb, sizeof(SampleBuffer));
+        if(--adc_due[i] == 0)
+        {
+            adc_due[i] = adc_divs[i];
+            adc_mask |= _BV(i);
+            frame_adc++;
+        }
+    }
+#else
+    adc_mask = ADC_MASK_ALL;
+    frame_adc = ADC_CHANNELS;
+#endif
+    frame_len = frame_adc;
+#if ACCEL_DECIMATED
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+    {
+        if(--accel_due[i] == 0)
+        {
+            accel_due[i] = accel_divs[i];
+            frame_accel |= _BV(i);
+            frame_len++;
+        }
+    }
+#else
+    frame_accel = ACCEL_MASK_ALL;
+    frame_len += ACCEL_CHANNELS;
+#endif
+
+    frame_adc_mask = adc_mask;
+
+    frame = NULL;
+#if !LOG_PACKED
+    if(buffering)
+        frame = (volatile uint16_t *)logfmt_reserve(&sdbuf,
+                frame_len * sizeof(uint16_t));
+#endif
+    if(!frame)
+        frame = stage;
+
+    // A conversion run is what paces the frames, so if no ADC channel is due
+    // we convert the first and throw the result away
+    if(adc_mask)
+        adc_arm(frame, adc_mask);
+    else
+        adc_arm(&discard, _BV(0));
+}
+
+/**
+ * Called from the DMA interrupt once DMA channel 0 has moved the results of an
+ * ADC conversion run into the current frame, where we should log that frame.
+ *
+ * In the raw format, the ADC results are normally already in place in the SD
+ * ring buffer (any oversampled channels are summed in by adc_collect()), so
+ * all that remains is to add the latest readings of any accelerometer axes
+ * that are due and publish the frame to the consumer with logfmt_put(). If
+ * there was no room for the frame it was converted into the staging buffer
+ * instead and is copied in now, as it is when packing the frame. There is no
+ * processing of the data since it is too slow -- the statistics of each data
+ * file are kept in the foreground (see stats.c), and the rest is left to
+ * post-processing on a desktop machine. A decimated copy of the frames is
+ * streamed out over the UART for a dashboard (see telemetry.c).
+ *
+ * We then arm the ADC for the next run (started in hardware by the sampling
+ * timer), such that next time we get here, new data will be in the next
+ * frame. The accelerometer isn't read from here, it reads itself whenever it
+ * has new data (see accel.c).
+ *
+ * Until we start putting frames into the SD buffer, frames are discarded and
+ * the scheduler is held at the first frame of the file. Once logging has
+ * been started, the next frame starts the buffer off (see buffer_start()),
+ * whether or not the card is ready yet. A frame that finishes converting
+ * after logging has been stopped is discarded too, since the foreground may
+ * already be finishing off the data file.
+ *
+ * In trigger mode we also check each frame for a trigger before it is put
+ * into the SD buffer, and move on the end of the frames to be saved whilst we
+ * are within LOG_POST_FRAMES of the last trigger.
+ *
+ * @returns Non-zero if a sector of the ring buffer was completed and the
+ * foreground should be woken to write it to the card.
+ */
+uint8_t logger_frame_isr(void)
+{
+    uint16_t head = sdbuf.head;
+    uint8_t i, n;
+    PROFILE_START(t);
+
+    // Sum up any oversampled channels into the frame
+    adc_collect();
+
+    // Write the frame to the SD buffer
+    if(buffering && logger_running)
+    {
+        n = frame_adc;
+#if ACCEL_DECIMATED
+        for(i = 0; i < ACCEL_CHANNELS; i++)
+            if(frame_accel & _BV(i))
+                frame[n++] = sb.accel[i];
+#else
+        for(i = 0; i < ACCEL_CHANNELS; i++)
+            frame[n++] = sb.accel[i];
+#endif
+
+#if TELEMETRY
+        telemetry_frame(frame, frame_adc_mask, frame_accel);
+#endif
+#if LOG_TRIGGER
+        if(trigger_check())
+        {
+            post_left = LOG_POST_FRAMES;
+            triggered = 1;
+        }
+#endif
+        logfmt_put(&sdbuf, frame, frame == stage, frame_adc_mask,
+                frame_accel, n);
+        PROFILE_LEVEL(rb_getused_m(&sdbuf));
+#if LOG_TRIGGER
+        if(post_left)
+        {
+            post_left--;
+            save_end = sdbuf.head;
+        } else if((uint16_t)(sdbuf.head - save_end) > SD_RINGBUF_LEN) {
+            // Keep the end within a buffer length behind the head, so that
+            // comparing it against the tail can't wrap around
+            save_end = sdbuf.head - SD_RINGBUF_LEN;
+        }
+#endif
+    } else if(!buffering) {
+        schedule_reset();
+        if(logger_running)
+            buffer_start();
     }
 
     // Trigger the next conversion
-    adc_convert();
-    Cma3000_readAccelFSM();
+    frame_arm();
+
+    PROFILE_END(PROF_FRAME_ISR, t);
+
+    // Only wake the foreground once we've crossed into a new sector
+    return ((head ^ sdbuf.head) & ~(DATAFILE_SECTOR - 1)) ? 1 : 0;
+}
+
+#if LOG_TRIGGER
+/**
+ * Get ready to wait for the first trigger in a new data file. This must only
+ * be called whilst the frame ISR isn't putting frames into the SD buffer (see
+ * buffer_start()).
+ */
+static void trigger_reset(void)
+{
+    post_left = 0;
+    save_end = 0;
+    trigger_manual = 0;
+    trig_valid = 0;
+    triggered = 0;
 }
 
+/**
+ * Check whether the frame that has just been converted meets a trigger
+ * condition, being a due ADC channel at or above its level or having moved by
+ * at least its slope since it was last logged, or a press of button S2.
+ *
+ * @returns Non-zero if the frame is a trigger.
+ */
+static uint8_t trigger_check(void)
+{
+    static const uint16_t levels[ADC_CHANNELS] = LOG_TRIG_LEVELS;
+    static const uint16_t slopes[ADC_CHANNELS] = LOG_TRIG_SLOPES;
+    uint8_t i, n = 0, trig;
+    uint16_t v, d;
+
+    trig = trigger_manual;
+    trigger_manual = 0;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(!(frame_adc_mask & _BV(i)))
+            continue;
+
+        v = frame[n++];
+        if(levels[i] && v >= levels[i])
+            trig = 1;
+
+        d = (v > trig_prev[i]) ? v - trig_prev[i] : trig_prev[i] - v;
+        if(slopes[i] && (trig_valid & _BV(i)) && d >= slopes[i])
+            trig = 1;
+        trig_prev[i] = v;
+        trig_valid |= _BV(i);
+    }
+
+    return trig;
+}
+#endif
+
 /**
  * Interrupt vector for button S1 which is used for enabled and disabling
  * logging. We should debounce the button press using
  * the system ticks timer, and then enable or disable logging as required.
+ * The foreground is woken so that it can open or close the data file. Whilst
+ * the card is offloaded over USB, logging is left for the foreground to start
+ * once the USB module has let go of the SD buffer (see start_logger()).
  */
 interrupt(PORT1_VECTOR) PORT1_ISR(void)
 {
@@ -475,20 +1302,43 @@ interrupt(PORT1_VECTOR) PORT1_ISR(void)
         time = clock_time();
         if(logger_running)
             logger_disable();
+#if USB_OFFLOAD
+        else if(usb_active)
+            usb_start = 1;
+#endif
         else
             logger_enable();
+        __bic_SR_register_on_exit(LPM0_bits);
     }
 
 }
 
 /**
- * Interrupt vector for button S2
+ * Interrupt vector for port 2, being button S2, which is a manual trigger in
+ * trigger mode (see LOG_TRIGGER) and is debounced in the same way as S1, and
+ * the accelerometer's data ready line on P2.5 (ACCEL_INT), which starts a
+ * read of the new data.
  */
 interrupt(PORT2_VECTOR) PORT2_ISR(void)
 {
-    if(P2IV & P2IV_P2IFG2)
+    static clock_time_t s2_time;
+
+    switch(P2IV)
     {
-        ;
+        case P2IV_P2IFG2:
+            if((clock_time() - s2_time) > 250)
+            {
+                s2_time = clock_time();
+#if LOG_TRIGGER
+                trigger_manual = 1;
+#endif
+            }
+            break;
+        case P2IV_P2IFG5:
+            Cma3000_readAccelFSM();
+            break;
+        default:
+            break;
     }
 }
 
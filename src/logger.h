@@ -17,6 +17,7 @@
 #include <legacymsp430.h>
 #include "typedefs.h"
 #include "ff.h"
+#include "channels.h"
 
 #define S1_PORT_OUT P1OUT
 #define S1_PORT_REN P1REN
@@ -33,29 +34,86 @@
 #define S2_PIN _BV(2)
 
 /**
- * Ring buffer length for the SD card, should be a multiple of 2 of the
- * sector size (512 bytes)
+ * Ring buffer length for the SD card. This must be a power of 2 and a multiple
+ * of the sector size (512 bytes), such that every sector in the buffer is
+ * contiguous and the indices can be masked instead of taken modulo the length.
+ *
+ * The buffer sits at the bottom of RAM, starting in the USB RAM and running
+ * on into main RAM when it is longer than 2K (see memory.x). RAM for
+ * everything else (including the stack) is 10K less the length, so it can be
+ * up to 4K with STORE_INDEX set (whose index block and block summaries need
+ * the room, see store.c), or 8K without. It must be at least 2K with
+ * USB_OFFLOAD set, since the USB module's buffers are in the USB RAM (see
+ * usb.h), or 512 bytes without. The Makefile sets this from RINGBUF, since
+ * the linker needs it too.
  */
-#define SD_RINGBUF_LEN 2048
+#ifndef SD_RINGBUF_LEN
+#define SD_RINGBUF_LEN 4096
+#endif
 
 /**
  * The ring buffer mask value. This is automatically calculated.
  */
 #define SD_RINGBUF_MASK (SD_RINGBUF_LEN - 1)
 
+#if (SD_RINGBUF_LEN & SD_RINGBUF_MASK) || (SD_RINGBUF_LEN % 512)
+#error "SD_RINGBUF_LEN must be a power of 2 and a multiple of 512"
+#endif
+
+#if SD_RINGBUF_LEN > 8192
+#error "SD_RINGBUF_LEN leaves too little RAM, it can be at most 8192"
+#endif
+
+/**
+ * Put a variable in the ring buffer's own section at the bottom of RAM (see
+ * memory.x). This is only done for the MSP430 since a host build has no such
+ * section.
+ */
+#ifdef __MSP430__
+#define RINGBUF_SECTION __attribute__((section(".ringbuf")))
+#else
+#define RINGBUF_SECTION
+#endif
+
+/**
+ * The period at which the LCD status display is updated, in ms. The
+ * foreground is woken by the system tick at this rate while it is otherwise
+ * asleep.
+ */
+#define LCD_UPDATE_PERIOD 200
+
+/**
+ * How long to wait before trying again when the card can't be found, mounted
+ * or have the data file opened on it, and how often to check that the card is
+ * still there whilst not logging, in ms. The card is given up on once
+ * CARD_WRITE_FAILS sector writes in a row have failed.
+ */
+#define CARD_RETRY_PERIOD 500
+#define CARD_POLL_PERIOD 1000
+#define CARD_WRITE_FAILS 3
+
 /**
  * @struct RingBuffer
- * A ring buffer which can be attached to given (preallocated) memory area.
+ * A single producer, single consumer ring buffer which can be attached to a
+ * given (preallocated) memory area.
+ *
+ * The head and tail are free running counters which are only masked when the
+ * buffer is indexed, so the number of used bytes is simply (head - tail) and a
+ * full buffer can be told apart from an empty one. The producer (an ISR) only
+ * ever writes the head and the consumer only ever writes the tail, each being
+ * a single 16 bit store, so neither side needs to disable interrupts.
+ *
  * @var RingBuffer::buffer
  * A pointer to the start of the character buffer to be used by this ring 
  * buffer.
  * @var RingBuffer::head
- * A pointer to the head of the ring buffer (the next free byte available
- * for writing).
+ * The total number of bytes written to the ring buffer (modulo 2^16), the head
+ * is the next free byte available for writing.
  * @var RingBuffer::tail
- * A pointer to the tail of the ring buffer (the next unread byte)
+ * The total number of bytes read from the ring buffer (modulo 2^16), the tail
+ * is the next unread byte.
  * @var RingBuffer::len
- * The length of the ring buffer
+ * The length of the ring buffer, which must be a power of 2.
  * @var RingBuffer::mask
  * This value is a ring buffer intrinsic and is automatically generated.
  * @var RingBuffer::overflow
@@ -65,25 +123,116 @@
 typedef struct RingBuffer
 {
     char* buffer;
-    uint16_t head, tail, len, mask;
-    uint8_t overflow;
+    volatile uint16_t head, tail;
+    uint16_t len, mask;
+    volatile uint8_t overflow;
 } RingBuffer;
 
 /**
- * The number of ADC channels that we will sample from. It is vital that this
- * is correctly set such that the DMA system will work properly.
+ * Quick facility to get the used value of a ring buffer
+ * @param b A pointer to the buffer which we wish to query
+ */
+#define rb_getused_m(b) ((uint16_t)((b)->head - (b)->tail))
+
+/**
+ * Quick facility to get the free value of a ring buffer
+ * @param b A pointer to the buffer which we wish to query
+ */
+#define rb_getfree_m(b) ((uint16_t)((b)->len - rb_getused_m(b)))
+
+/**
+ * Reset a ring buffer to its original empty state. This must only be done
+ * whilst the producer is not writing to the buffer.
+ * @param b A pointer to the buffer which we wish to reset
+ */
+#define rb_reset_m(b) do { (b)->tail = (b)->head = 0; } while (0)
+
+/**
+ * The frequency at which frames are taken, in Hz. This is the highest rate at
+ * which any channel can be logged, and may be overridden from the Makefile.
+ * All of the due ADC channels must be converted within one period.
+ */
+#ifndef LOG_RATE
+#define LOG_RATE 1000UL
+#endif
+
+/**
+ * The period of the sampling timer in SMCLK cycles. This is automatically
+ * calculated from F_CPU.
+ */
+#define LOG_TIMER_PERIOD (F_CPU / LOG_RATE)
+
+#if LOG_TIMER_PERIOD > 65536UL
+#error "LOG_RATE is too low for the 16 bit sampling timer"
+#endif
+
+/**
+ * Set non-zero to write frames to the card in the packed format rather than
+ * the raw format (see logfmt.c). Packed frames are roughly half the size but
+ * have to be encoded by the CPU rather than converted in place by the DMA.
+ */
+#ifndef LOG_PACKED
+#define LOG_PACKED 0
+#endif
+
+/**
+ * Set non-zero to allow delta frames in the packed format, where each ADC
+ * channel is stored as the change since the previous frame in the block.
  */
-#define ADC_CHANNELS 7
+#ifndef LOG_DELTA
+#define LOG_DELTA 1
+#endif
 
 /**
- * The number of accelerometer channels (typically 3) to be sampled from. This
- * must be set correctly such that the DMA transfer system will work correctly.
+ * Set non-zero to start logging at power up rather than waiting for S1, so
+ * that nothing is missed after the vehicle is switched on. The frames are
+ * kept in the SD ring buffer until the card is ready (see start_logger()).
  */
-#define ACCEL_CHANNELS 3
+#ifndef LOG_AUTOSTART
+#define LOG_AUTOSTART 1
+#endif
+
+/**
+ * Set non-zero to log in trigger mode rather than continuously. In trigger
+ * mode, the latest LOG_PRE_SECTORS sectors of frames are held in the SD ring
+ * buffer and thrown away as they get old, until a trigger condition is met
+ * (see the level and slope of each channel in channels.h) or button S2 is
+ * pressed. The frames before the trigger and for LOG_POST_FRAMES frames after
+ * it are then written to the card, and the logger waits for the next trigger.
+ */
+#ifndef LOG_TRIGGER
+#define LOG_TRIGGER 0
+#endif
+
+/**
+ * The number of whole sectors of frames from before a trigger that are
+ * written to the card. At least two sectors more than this must fit into the
+ * SD ring buffer.
+ */
+#ifndef LOG_PRE_SECTORS
+#define LOG_PRE_SECTORS 2
+#endif
+
+#if LOG_TRIGGER && ((LOG_PRE_SECTORS + 2) * 512 > SD_RINGBUF_LEN)
+#error "LOG_PRE_SECTORS is too large for SD_RINGBUF_LEN"
+#endif
+
+/**
+ * The number of frames written to the card after a trigger. Another trigger
+ * during this time starts the count again.
+ */
+#ifndef LOG_POST_FRAMES
+#define LOG_POST_FRAMES LOG_RATE
+#endif
 
 /**
  * @struct SampleBuffer
  * @brief A structure to contain one 'set' of samples from the vehicle.
+ *
+ * A frame on the card holds only the channels that are due in that frame
+ * (see channels.h), in the same order as this structure. The first frame of
+ * a file holds every channel. Frames are grouped into sector sized blocks,
+ * see logfmt.c for the layout.
  * @var SampleBuffer::adc
  * Storage for the ADC channels
  * @var SampleBuffer::accel
@@ -97,9 +246,14 @@ typedef struct SampleBuffer
 
 void logger_init(void);
 void start_logger(RingBuffer* sdbuf);
-FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n);
+FRESULT sd_write(RingBuffer *rb, uint16_t n);
 uint8_t ringbuf_write(RingBuffer* buf, char* data, uint16_t n);
 uint8_t ringbuf_read(RingBuffer *buf, char* read_buffer, uint16_t n);
+uint16_t ringbuf_peek(RingBuffer *buf, char **data);
+void ringbuf_consume(RingBuffer *buf, uint16_t n);
+char* ringbuf_reserve(RingBuffer *buf, uint16_t n);
+void ringbuf_commit(RingBuffer *buf, uint16_t n);
+uint8_t logger_frame_isr(void);
 void update_lcd(RingBuffer *buf);
 void logger_enable(void);
 void logger_disable(void);
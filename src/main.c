@@ -11,9 +11,15 @@
  * There are six analogue channels broken out on the development board, plus a
  * user potentiometer. Additionally, there is a CMA3000 3-axis accelerometer
  * which is capable of running at up to 400Hz. The analogue channels (including
- * the pot) are sampled and logged at 1kHz. The accelerometer is also logged at
- * this frequency though analysis of the output will confirm that its value
- * only changes at 400Hz.
+ * the pot) are sampled and logged at 1kHz by default. The accelerometer is
+ * read whenever it has new data, at 400Hz and in its 2g range by default
+ * (ACCEL_RATE, ACCEL_RANGE, which can also be changed over the UART), and
+ * each frame logs its latest reading. The frame rate (LOG_RATE) can be set in
+ * logger.h, and the channels that are logged, with a rate divisor for each
+ * such that slowly changing channels don't waste space on the card, are
+ * listed in the channel map in channels.h.
+ * In trigger mode (LOG_TRIGGER) only the frames around each trigger, such as a
+ * channel passing a level or button S2 being pressed, are written to the card.
  *
  * \section software Software Architecture
  * The software documented here is written specifically for the project, but
@@ -23,32 +29,57 @@
  * source files where they were used as the basis for the code.
  *
  * The main functionality for the datalogger is in the Logger module. The
- * overall architecture overview is that we set up a timer to interrupt at the
- * log frequency, which collects available data and puts it into a buffer ready
- * to be transferred to the SD card. It then invalidates the data and triggers
- * another conversion run such that on the next interrupt, the new data will be
- * ready.
+ * overall architecture overview is that we set up a timer running at the log
+ * frequency which triggers each ADC conversion run in hardware, and the DMA
+ * moves the results straight into a buffer ready to be transferred to the SD
+ * card. At the end of each run a short interrupt adds the accelerometer data,
+ * publishes the frame and arms the ADC and DMA for the next one. The
+ * foreground only runs to write each completed sector to the card and to
+ * update the display, and otherwise sleeps in LPM0.
  *
  * A software controlled RingBuffer is used to store data before it is
  * transferred to the SD card, and a full ring buffer implementation can be
  * found in the Logger module. This is generic and can be used in other
  * projects. The size of this buffer is controlled by SD_RINGBUF_LEN, and
  * should be as large as possible for best performance but should never be
- * smaller than the sector size (usually 512 bytes for FAT16).
+ * smaller than the sector size (usually 512 bytes for FAT16). Sectors leave
+ * the buffer through the Store module (see store.c), which writes them to the
+ * data file on the card and can mirror them to the UART (STORE_UART) for a
+ * laptop to capture as well. On the card it also puts in an index block
+ * every few sectors (STORE_INDEX), summarising the blocks before it, so that
+ * evlog can go straight to a time or an event in a long file.
  *
  * The peripherals are controlled by separate modules, see ADC, Accelerometer,
  * UART particularly. Documentation for how these are configured can be found
  * in the relevant source files; here it suffices to note that CPU time is
- * minimised by use of DMA in the case of the ADC and an interrupt controlled
- * finite state machine (FSM) in the case of the accelerometer. The UART is
- * principally for debugging purposes and is not set up for speed (it currently
- * busy-waits during transmits) and as such, should not be used in production
- * runs of the firmware builds.
+ * minimised by use of hardware triggering and DMA in the case of the ADC and
+ * an interrupt controlled finite state machine (FSM) in the case of the
+ * accelerometer. The UART runs at UART_BAUD (460800 by default) from an
+ * interrupt driven queue, so neither the debug output nor the telemetry ever
+ * waits for it. Whilst logging, a decimated copy of the frames is streamed
+ * out over it in small checksummed packets (see telemetry.c), at TELEM_RATE,
+ * for a dashboard on a laptop. It needs a USB serial adapter on P4.4/P4.5 that
+ * can keep up with the baud rate.
+ *
+ * Logging starts as soon as the board is powered (see LOG_AUTOSTART) and the
+ * frames are held in the SD buffer whilst the card is found and mounted in
+ * the background, so the start of a run isn't lost. S1 stops and starts it.
+ * A card can be taken out and put back without a reset, a new data file is
+ * started on it.
+ *
+ * The RTC keeps the wall clock time, which is set over the UART (see rtc.c),
+ * so files get real times and every block in the data file says when it was
+ * logged to the microsecond. Logs from several loggers can then be lined up
+ * on the host.
  *
  * The onboard peripherals, perticularly the CPU core clock and system wall
  * clock timer are controlled by the System module, relevant documentation is
  * contained within.
  *
+ * The Profile module times the interrupt handlers and the SD card writes, and
+ * keeps the high water mark of the SD buffer. The worst cases are shown on the
+ * LCD and the full histograms are sent over the UART when logging stops.
+ *
  * \section build Building the Firmware
  * A Makefile is provided to build the firmware using the GNU mspgcc toolchain.
  * Builds of this toolchain are available for Windows, OS X and Linux though on
@@ -60,6 +91,20 @@
  * object files, dependency list files and binaries) can be done using $ make
  * clean.
  *
+ * SD cards can be qualified before being used in the vehicle with the
+ * benchmark firmware (see bench.c), which is built with $ make bench into its
+ * own build directory and flashed with $ make flash-bench. The results are
+ * reported over the UART.
+ *
+ * A configuration (frame rate, SD buffer size and log format) can be tried
+ * against simulated good, typical and poor SD cards on a PC before it is
+ * flashed, by running $ make run in the sim directory (see sim.c). This needs
+ * only gcc, and reports the frames that would have been dropped.
+ *
+ * The data files can be copied off without taking the SD card out by plugging
+ * the board into a PC over USB whilst it isn't logging, when the card appears
+ * as a USB drive (see usb.c).
+ *
  * \section author Authorship
  * Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>. Please get in
  * touch with any questions or comments.
@@ -82,14 +127,18 @@
 #include "adc.h"
 #include "system.h"
 #include "logger.h"
+#include "profile.h"
+#include "bench.h"
+#include "rtc.h"
 
 #include "HAL_SDCard.h"
 #include "ff.h"
 
 /**
  * Kill the watchdog timer to prevent it firing, then set up the system clock
- * followed by onboard peripherals. Wait for all systems to be ready before
- * starting the datalogger.
+ * followed by onboard peripherals and start the datalogger. Nothing here waits
+ * for a peripheral that is slow to start (the 32kHz crystal, the SD card), so
+ * logging starts within a few ms of power up.
  */
 int main(void)
 {
@@ -99,13 +148,14 @@ int main(void)
     // Set up the system clock and any required peripherals
     sys_clock_init();
     clock_init();
+#if PROFILE
+    profile_init();
+#endif
     uart_init();
+    rtc_init();
     Dogs102x6_init();
     Dogs102x6_backlightInit();
 
-    // Wait for peripherals to boot
-    _delay_ms(100);
- 
     // Test that minicom/term is behaving
     uart_debug("Hello world");
 
@@ -115,8 +165,13 @@ int main(void)
     Dogs102x6_clearScreen();
     Dogs102x6_stringDraw(0, 0, "=== EV LOGGER ===", DOGS102x6_DRAW_INVERT);
 
+#if BENCH
+    // Benchmark the SD card instead of logging
+    bench_run();
+#else
     // Wait for periphs to boot and start logging
     logger_init();
+#endif
      
     // We should never get to this point
     while(1);
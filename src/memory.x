@@ -0,0 +1,63 @@
+/*
+ * Memory map for the MSP430F5529, used in place of the one that comes with
+ * mspgcc (the linker finds this one first since the Makefile links with -L.).
+ *
+ * It is the same as the stock map, except that the 2K of USB RAM (which we
+ * don't use for USB) and the 8K of main RAM, which sit next to each other,
+ * are taken as one 10K block. The SD ring buffer (see logger.c) goes at the
+ * bottom of it in the ringbuf region, filling the USB RAM first and then
+ * running on into main RAM, and everything else goes in the ram region above
+ * it as usual. The stack still starts at the top of main RAM.
+ *
+ * The length of the ring buffer is __ringbuf_len, which the Makefile sets from
+ * RINGBUF along with SD_RINGBUF_LEN so that the two always agree. It can be
+ * up to 4K, or 8K if the index is left out (INDEX=0), as the rest of the
+ * logger's RAM has to fit in what is left (see logger.h).
+ *
+ * Jon Sowman 2014
+ * <jon@jonsowman.com>
+ */
+
+__ringbuf_len = DEFINED(__ringbuf_len) ? __ringbuf_len : 0x0800;
+
+MEMORY {
+  sfr              : ORIGIN = 0x0000, LENGTH = 0x0010 /* END=0x0010, size 16 */
+  peripheral_8bit  : ORIGIN = 0x0010, LENGTH = 0x00f0 /* END=0x0100, size 240 */
+  peripheral_16bit : ORIGIN = 0x0100, LENGTH = 0x0100 /* END=0x0200, size 256 */
+  bsl              : ORIGIN = 0x1000, LENGTH = 0x0800 /* END=0x1800, size 2K as 4 512-byte segments */
+  infomem          : ORIGIN = 0x1800, LENGTH = 0x0200 /* END=0x1a00, size 512 as 4 128-byte segments */
+  infod            : ORIGIN = 0x1800, LENGTH = 0x0080 /* END=0x1880, size 128 */
+  infoc            : ORIGIN = 0x1880, LENGTH = 0x0080 /* END=0x1900, size 128 */
+  infob            : ORIGIN = 0x1900, LENGTH = 0x0080 /* END=0x1980, size 128 */
+  infoa            : ORIGIN = 0x1980, LENGTH = 0x0080 /* END=0x1a00, size 128 */
+  ringbuf (w)      : ORIGIN = 0x1c00, LENGTH = __ringbuf_len
+  ram (wx)         : ORIGIN = 0x1c00 + __ringbuf_len, LENGTH = 0x2800 - __ringbuf_len /* END=0x4400 */
+  rom (rx)         : ORIGIN = 0x4400, LENGTH = 0xbb80 /* END=0xff80, size 47K */
+  vectors          : ORIGIN = 0xff80, LENGTH = 0x0080 /* END=0x10000, size 128 as 64 2-byte words */
+  far_rom          : ORIGIN = 0x00010000, LENGTH = 0x00014400 /* END=0x00024400, size 81K */
+  /* The USB RAM is now part of ringbuf and ram, the others are absent */
+  usbram (wx)      : ORIGIN = 0x1c00, LENGTH = 0x0000
+  ram2 (wx)        : ORIGIN = 0x0000, LENGTH = 0x0000
+  ram_mirror (wx)  : ORIGIN = 0x0000, LENGTH = 0x0000
+}
+REGION_ALIAS("REGION_TEXT", rom);
+REGION_ALIAS("REGION_DATA", ram);
+REGION_ALIAS("REGION_FAR_ROM", far_rom);
+PROVIDE (__info_segment_size = 0x80);
+PROVIDE (__infod = 0x1800);
+PROVIDE (__infoc = 0x1880);
+PROVIDE (__infob = 0x1900);
+PROVIDE (__infoa = 0x1980);
+
+/*
+ * The ring buffer isn't cleared or initialised at start up, since the logger
+ * resets it before it is used.
+ */
+SECTIONS {
+  .ringbuf (NOLOAD) :
+  {
+    *(.ringbuf)
+  } > ringbuf
+}
+ASSERT(SIZEOF(.ringbuf) == __ringbuf_len,
+        "The ring buffer doesn't match RINGBUF, rebuild with make clean")
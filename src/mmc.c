@@ -13,6 +13,8 @@
 
 #include "diskio.h"             /* Common include file for FatFs and disk I/O layer */
 #include "HAL_SDCard.h"         /* MSP-EXP430F5529 specific SD Card driver */
+#include "profile.h"            /* Latency instrumentation (PROFILE_START/END) */
+#include "rtc.h"                /* Wall clock time for get_fattime() */
 
 /*-------------------------------------------------------------------------*/
 /* Platform dependent macros and functions needed to be modified           */
@@ -34,19 +36,8 @@ BYTE INS = 1;    // KLQ
 /*-------------------------------------------------------------------------*/
 DWORD get_fattime(void)
 {
-	DWORD tmr;
-
-    // TODO: Customize to use the MSP430 RTC
-
-	/* Pack date and time into a DWORD variable */
-	tmr =	  (((DWORD)2001 - 80) << 25)    // rtcYear
-			| ((DWORD)9 << 21)              // rtcMon
-			| ((DWORD)11 << 16)             // rtcMday
-			| (WORD)(4 << 11)               // rtcHour
-			| (WORD)(30 << 5)               // rtcMin
-			| (WORD)(0 >> 1);               // rtcSec
-
-	return tmr;
+	/* The date and time are packed by the RTC module (see rtc.c) */
+	return rtc_fattime();
 }
 
 /*--------------------------------------------------------------------------
@@ -61,6 +52,7 @@ DWORD get_fattime(void)
 #define CMD9	(9)			/* SEND_CSD */
 #define CMD10	(10)		/* SEND_CID */
 #define CMD12	(12)		/* STOP_TRANSMISSION */
+#define CMD13	(13)		/* SEND_STATUS */
 #define ACMD13	(0x80+13)	/* SD_STATUS (SDC) */
 #define CMD16	(16)		/* SET_BLOCKLEN */
 #define CMD17	(17)		/* READ_SINGLE_BLOCK */
@@ -87,6 +79,15 @@ DSTATUS Stat = STA_NOINIT;	/* Disk status */
 static
 BYTE CardType;			/* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
 
+static
+BYTE StreamMode;		/* Sequential writes continue an open-ended CMD25 (CTRL_STREAM) */
+
+static
+BYTE StreamOpen;		/* A WRITE_MULTIPLE_BLOCK session is in progress */
+
+static
+DWORD StreamSect;		/* Next sector (LBA) expected by the open session */
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -117,6 +118,34 @@ void rcvr_mmc (
 }
 
 
+/*-----------------------------------------------------------------------*/
+/* Transmit/receive a data block to/from the MMC using DMA               */
+/*-----------------------------------------------------------------------*/
+/* Interrupts stay enabled while the block is on the wire and the CPU    */
+/* sleeps until the DMA has finished, so that the sampling ISRs are not  */
+/* held off for the duration of a sector transfer.                       */
+
+static
+void xmit_mmc_dma (
+	const BYTE* buff,               /* Data to be sent */
+	UINT bc                         /* Number of bytes to send */
+)
+{
+    SDCard_sendFrameDMA((uint8_t *)buff, bc);
+    SDCard_waitDMA();
+}
+
+static
+void rcvr_mmc_dma (
+	BYTE *buff,	/* Pointer to read buffer */
+	UINT bc		/* Number of bytes to receive */
+)
+{
+    SDCard_readFrameDMA(buff, bc);
+    SDCard_waitDMA();
+}
+
+
 /*-----------------------------------------------------------------------*/
 /* Wait for card ready                                                   */
 /*-----------------------------------------------------------------------*/
@@ -126,15 +155,17 @@ int wait_ready (void)    /* 1:OK, 0:Timeout */
 {
     BYTE d;
     UINT tmr;
+    PROFILE_START(t);
 
 
     for (tmr = 5000; tmr; tmr--) {    /* Wait for ready in timeout of 500ms */
         rcvr_mmc(&d, 1);
-        if (d == 0xFF) return 1;
+        if (d == 0xFF) break;
         DLY_US(100);
     }
+    PROFILE_END(PROF_WAIT_READY, t);
 
-    return 0;
+    return tmr ? 1 : 0;
 }
 
 
@@ -192,7 +223,7 @@ int rcvr_datablock (    /* 1:OK, 0:Failed */
     }
     if (d[0] != 0xFE) return 0;        /* If not valid data token, retutn with error */
 
-    rcvr_mmc(buff, btr);            /* Receive the data block into buffer */
+    rcvr_mmc_dma(buff, btr);        /* Receive the data block into buffer */
     rcvr_mmc(d, 2);                    /* Discard CRC */
 
     return 1;                        /* Return with success */
@@ -218,7 +249,7 @@ int xmit_datablock (    /* 1:OK, 0:Failed */
     d[0] = token;
     xmit_mmc(d, 1);                /* Xmit a token */
     if (token != 0xFD) {        /* Is it data token? */
-        xmit_mmc(buff, 512);    /* Xmit the 512 byte data block to MMC */
+        xmit_mmc_dma(buff, 512);    /* Xmit the 512 byte data block to MMC */
         rcvr_mmc(d, 2);            /* Dummy CRC (FF,FF) */
         rcvr_mmc(d, 1);            /* Receive data response */
         if ((d[0] & 0x1F) != 0x05)    /* If not accepted, return with error */
@@ -230,6 +261,22 @@ int xmit_datablock (    /* 1:OK, 0:Failed */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Terminate an open-ended multiple block write                          */
+/*-----------------------------------------------------------------------*/
+
+static
+void stream_stop (void)
+{
+    if (!StreamOpen) return;
+    StreamOpen = 0;
+
+    CS_L();
+    xmit_datablock(0, 0xFD);        /* STOP_TRAN token, card goes busy afterwards */
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Send a command packet to MMC                                          */
 /*-----------------------------------------------------------------------*/
@@ -243,6 +290,8 @@ BYTE send_cmd (        /* Returns command response (bit7==1:Send failed)*/
     BYTE n, d, buf[6];
 
 
+    stream_stop();        /* Any command ends an open-ended write session */
+
     if (cmd & 0x80) {    /* ACMD<n> is the command sequense of CMD55-CMD<n> */
         cmd &= 0x7F;
         n = send_cmd(CMD55, 0);
@@ -338,6 +387,7 @@ DSTATUS disk_initialize (
     DSTATUS s;
 
 
+    StreamOpen = 0;             /* A (re)initialised card has no session open */
     INIT_PORT();                /* Initialize control port */
 
     DLY_US(100);
@@ -446,12 +496,37 @@ DRESULT disk_write (
 )
 {
     DSTATUS s;
+    PROFILE_START(t);
 
 
     s = disk_status(drv);
     if (s & STA_NOINIT) return RES_NOTRDY;
     if (s & STA_PROTECT) return RES_WRPRT;
     if (!count) return RES_PARERR;
+
+    if (StreamMode) {    /* Streaming (open-ended) multiple block write */
+        if (StreamOpen && sector == StreamSect) {
+            CS_L();                            /* Continue the current session */
+        } else if (send_cmd(CMD25, (CardType & CT_BLOCK) ? sector : sector * 512) == 0) {
+            StreamOpen = 1;                    /* Started a new session, no ACMD23 */
+        } else {
+            deselect();
+            PROFILE_END(PROF_DISK_WRITE, t);
+            return RES_ERROR;
+        }
+        do {
+            if (!xmit_datablock(buff, 0xFC)) break;
+            buff += 512; sector++;
+        } while (--count);
+        if (count)                             /* Abandon the session on error */
+            stream_stop();
+        StreamSect = sector;
+        deselect();        /* Release the bus while the card programs the block */
+        PROFILE_END(PROF_DISK_WRITE, t);
+
+        return count ? RES_ERROR : RES_OK;
+    }
+
     if (!(CardType & CT_BLOCK)) sector *= 512;    /* Convert LBA to byte address if needed */
 
     if (count == 1) {    /* Single block write */
@@ -471,6 +546,7 @@ DRESULT disk_write (
         }
     }
     deselect();
+    PROFILE_END(PROF_DISK_WRITE, t);
 
     return count ? RES_ERROR : RES_OK;
 }
@@ -498,6 +574,7 @@ DRESULT disk_ioctl (
     res = RES_ERROR;
     switch (ctrl) {
         case CTRL_SYNC :        /* Make sure that no pending write process */
+            stream_stop();
             if (select()) {
                 deselect();
                 res = RES_OK;
@@ -523,6 +600,19 @@ DRESULT disk_ioctl (
             res = RES_OK;
             break;
 
+        case CTRL_STREAM :        /* Enable/disable streaming writes (BYTE) */
+            StreamMode = *(BYTE*)buff;
+            if (!StreamMode) stream_stop();
+            res = RES_OK;
+            break;
+
+        case CTRL_STATUS :        /* Wait for the last write and check the card status */
+            if (send_cmd(CMD13, 0) == 0) {    /* (send_cmd() waits for the card to be ready) */
+                rcvr_mmc(&n, 1);            /* Second byte of the R2 response */
+                if (n == 0) res = RES_OK;    /* No write, ECC or card errors */
+            }
+            break;
+
         default:
             res = RES_PARERR;
     }
@@ -0,0 +1,232 @@
+/**
+ * Measures how long the interrupt handlers and the SD card writes take, so
+ * that the cause of a buffer overflow can be tracked down, SD cards can be
+ * compared and the SD buffer can be sized.
+ *
+ * Timer A2 runs freely from SMCLK divided by 8 (3.125MHz), and counts its
+ * overflows in an interrupt to give a 32 bit time. Each timed piece of code
+ * (a probe, see PROF_*) takes the time with PROFILE_START() as it is entered
+ * and PROFILE_END() as it leaves, and the difference is added to a log scale
+ * histogram for that probe along with the longest time seen. The high water
+ * mark of the SD buffer is also kept, see PROFILE_LEVEL().
+ *
+ * The statistics are reset when a data file is opened, and can be seen on
+ * the LCD (see update_lcd()) or dumped over the UART with profile_dump(),
+ * which is done when the data file is closed.
+ *
+ * The wait_ready() and disk_write() times are for the whole call, so include
+ * any time spent in interrupt handlers in the meantime. Setting PROFILE to 0
+ * removes all of this.
+ *
+ * @file profile.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Profile
+ * @{
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "profile.h"
+#include "system.h"
+#include "uart.h"
+
+#if PROFILE
+
+/// The statistics for each probe
+static Probe probes[PROF_PROBES];
+
+/// The names of the probes for profile_dump(), in the order of PROF_*
+static const char * const names[PROF_PROBES] = {
+    "tick isr", "accel isr", "frame isr",
+    "sd_write", "disk_write", "wait_ready", "block crc", "stats"
+};
+
+/// The number of times that timer A2 has overflowed (modulo 2^16)
+static volatile uint16_t prof_hi;
+
+/// The most bytes that have been used in the SD buffer
+static volatile uint16_t peak;
+
+/**
+ * Start timer A2 running freely from SMCLK divided by 8, with an interrupt
+ * on each overflow, and clear the statistics.
+ */
+void profile_init(void)
+{
+    prof_hi = 0;
+    profile_reset();
+
+    // Clock from SMCLK divided by 8, use "continuous" mode, interrupt on
+    // overflow
+    TA2CTL = TASSEL_2 | ID_3 | MC_2 | TACLR | TAIE;
+}
+
+/**
+ * Clear the statistics for all of the probes and the SD buffer high water
+ * mark. This may be called from an ISR.
+ */
+void profile_reset(void)
+{
+    uint16_t gie = __read_status_register() & GIE;
+
+    __disable_interrupt();
+    memset(probes, 0, sizeof(probes));
+    peak = 0;
+    __bis_SR_register(gie);
+}
+
+/**
+ * Get the current time from the profiling timer.
+ *
+ * This can be called with interrupts disabled (such as from an ISR), in
+ * which case an overflow that hasn't been counted yet is spotted from the
+ * timer's interrupt flag. The timer must not be left running for more than
+ * half a period (10ms) with interrupts disabled.
+ *
+ * @returns The time in timer ticks.
+ */
+prof_time_t profile_now(void)
+{
+    uint16_t hi, lo;
+    uint8_t wrap;
+
+    // Read until the overflow count doesn't change under us
+    do {
+        hi = prof_hi;
+        lo = TA2R;
+        wrap = (TA2CTL & TAIFG) && lo < 0x8000;
+    } while(hi != prof_hi);
+
+    if(wrap)
+        hi++;
+    return ((prof_time_t)hi << 16) | lo;
+}
+
+/**
+ * Record the time taken by one run of a probe. This must only be called for a
+ * given probe from one context (either foreground or a single ISR).
+ *
+ * @param id The probe, one of PROF_*.
+ * @param t The time taken in timer ticks.
+ */
+void profile_record(uint8_t id, prof_time_t t)
+{
+    Probe *p = &probes[id];
+    uint16_t w;
+    uint8_t i = 0;
+
+    p->count++;
+    if(t > p->max)
+        p->max = t;
+
+    // Find floor(log2(t)), a 16 bit word at a time since this is called from
+    // ISRs and 32 bit shifts are slow
+    w = (uint16_t)t;
+    if(t >> 16)
+    {
+        w = (uint16_t)(t >> 16);
+        i = 16;
+    }
+    while(w >>= 1)
+        i++;
+    if(i >= PROF_BUCKETS)
+        i = PROF_BUCKETS - 1;
+
+    if(p->hist[i] != 0xFFFF)
+        p->hist[i]++;
+}
+
+/**
+ * Record the number of bytes used in the SD buffer, from the producer after
+ * it has added to the buffer.
+ *
+ * @param used The number of bytes in the buffer.
+ */
+void profile_level(uint16_t used)
+{
+    if(used > peak)
+        peak = used;
+}
+
+/**
+ * Take a copy of the statistics for a probe, which can't change part way
+ * through being copied. This may be called with interrupts disabled.
+ *
+ * @param id The probe, one of PROF_*.
+ * @param p Where to copy the statistics to.
+ */
+void profile_get(uint8_t id, Probe *p)
+{
+    uint16_t gie = __read_status_register() & GIE;
+
+    __disable_interrupt();
+    memcpy(p, &probes[id], sizeof(Probe));
+    __bis_SR_register(gie);
+}
+
+/**
+ * Get the high water mark of the SD buffer.
+ *
+ * @returns The most bytes that have been in the SD buffer since the last
+ * reset.
+ */
+uint16_t profile_peak(void)
+{
+    return peak;
+}
+
+/**
+ * Write the statistics for every probe out over the UART, followed by the SD
+ * buffer high water mark. Only the histogram buckets with something in them
+ * are listed, each with the time (in microseconds) that it goes up to. This
+ * is more than the UART queue holds, so it busy-waits for the UART after each
+ * line (see uart_flush()) and shouldn't be done whilst logging.
+ */
+void profile_dump(void)
+{
+    Probe p;
+    char s[UART_BUF_LEN];
+    uint8_t id, i;
+
+    for(id = 0; id < PROF_PROBES; id++)
+    {
+        profile_get(id, &p);
+        sprintf(s, "%s: %lu runs, max %luus", names[id], p.count,
+                PROF_US(p.max));
+        uart_debug(s);
+        uart_flush();
+
+        for(i = 0; i < PROF_BUCKETS; i++)
+        {
+            if(!p.hist[i])
+                continue;
+            if(i == PROF_BUCKETS - 1)
+                sprintf(s, "  >=%luus: %u", PROF_US(1UL << i), p.hist[i]);
+            else
+                sprintf(s, "  <%luus: %u", PROF_US(2UL << i), p.hist[i]);
+            uart_debug(s);
+            uart_flush();
+        }
+    }
+
+    sprintf(s, "sdbuf peak: %u bytes", peak);
+    uart_debug(s);
+}
+
+/**
+ * Interrupt service routine for timer A2, which only counts its overflows.
+ */
+interrupt(TIMER2_A1_VECTOR) TIMER2_A1_ISR(void)
+{
+    // Reading TA2IV clears the flag
+    if(TA2IV == TA2IV_TAIFG)
+        prof_hi++;
+}
+
+#endif /* PROFILE */
+
+/**
+ * @}
+ */
@@ -0,0 +1,112 @@
+/**
+ * Profile header.
+ *
+ * @file profile.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Profile
+ * @{
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <msp430.h>
+#include "typedefs.h"
+
+/**
+ * Set non-zero to build in the latency instrumentation. When zero, all of
+ * the PROFILE_ macros compile to nothing and timer A2 is left alone. It is
+ * off unless the Makefile is given PROFILE=1, other than for the benchmark
+ * and the sim, which always have it.
+ */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+/**
+ * The pieces of code that are timed, each having its own histogram
+ */
+#define PROF_TICK_ISR   0   ///< The system tick ISR, TIMER1_A0_ISR()
+#define PROF_ACCEL_ISR  1   ///< The accelerometer SPI ISR, USCI_A0_ISR()
+#define PROF_FRAME_ISR  2   ///< The end of frame ISR, logger_frame_isr()
+#define PROF_SD_WRITE   3   ///< Writing sectors from the SD buffer, sd_write()
+#define PROF_DISK_WRITE 4   ///< Writing sectors to the card, disk_write()
+#define PROF_WAIT_READY 5   ///< Waiting for the card to be ready, wait_ready()
+#define PROF_BLOCK_CRC  6   ///< The CRC of a block, logfmt_seal()
+#define PROF_STATS      7   ///< The statistics of written blocks, stats_blocks()
+#define PROF_PROBES     8
+
+/**
+ * The number of histogram buckets for each probe. Bucket i counts the times
+ * that took between 2^i and 2^(i+1) - 1 timer ticks (bucket 0 also counts
+ * zero), and the last bucket counts everything longer than that.
+ */
+#define PROF_BUCKETS 22
+
+/**
+ * Convert a number of timer ticks to microseconds, rounding up. Timer A2 runs
+ * from SMCLK divided by 8, so there are 3.125 ticks per microsecond.
+ */
+#define PROF_US(t) \
+    (((t) * 8UL + (F_CPU / 1000000UL) - 1) / (F_CPU / 1000000UL))
+
+/**
+ * A time from the profiling timer, in ticks
+ */
+typedef uint32_t prof_time_t;
+
+/**
+ * @struct Probe
+ * @brief The statistics collected for one piece of timed code.
+ * @var Probe::count
+ * The number of times that the code has run.
+ * @var Probe::max
+ * The longest time that the code has taken, in timer ticks.
+ * @var Probe::hist
+ * The log scale histogram of the times, see PROF_BUCKETS. The counts stick at
+ * 65535 rather than wrapping.
+ */
+typedef struct Probe
+{
+    uint32_t count;
+    prof_time_t max;
+    uint16_t hist[PROF_BUCKETS];
+} Probe;
+
+#if PROFILE
+/**
+ * Take the time at the start of a timed piece of code, into a new variable t
+ */
+#define PROFILE_START(t) prof_time_t t = profile_now()
+
+/**
+ * Record the time since PROFILE_START(t) against the given probe
+ */
+#define PROFILE_END(id, t) profile_record((id), profile_now() - (t))
+
+/**
+ * Record the number of bytes used in the SD buffer, keeping the high water
+ * mark
+ */
+#define PROFILE_LEVEL(used) profile_level(used)
+#else
+#define PROFILE_START(t)
+#define PROFILE_END(id, t)
+#define PROFILE_LEVEL(used)
+#endif
+
+void profile_init(void);
+void profile_reset(void);
+prof_time_t profile_now(void);
+void profile_record(uint8_t id, prof_time_t t);
+void profile_level(uint16_t used);
+void profile_get(uint8_t id, Probe *p);
+uint16_t profile_peak(void);
+void profile_dump(void);
+
+#endif /* __PROFILE_H__ */
+
+/**
+ * @}
+ */
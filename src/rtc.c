@@ -0,0 +1,251 @@
+/**
+ * Keeps the wall clock time with the RTC_A calendar, running from the 32768Hz
+ * crystal on XT1, so that files on the card have real times and every block
+ * in the data file can be placed in wall clock time (see logfmt.c).
+ *
+ * The RTC loses the time at power up, so it is set over the UART with a line
+ * holding 'T' and the time in seconds since 1970 UTC, for example from a
+ * laptop with
+ *   echo T$(date -u +%s) > /dev/ttyUSB0
+ * Until then it runs from RTC_DEFAULT, and the block headers say that the
+ * time isn't known.
+ *
+ * The calendar is read only by a debugger. Working out a time from the
+ * calendar is slow, and its registers can't be read in the few ms around
+ * each tick. So we keep the time in seconds as well, counted up by the RTC
+ * interrupt once a second just after the calendar ticks. The interrupt also
+ * takes the system time (to the microsecond) at the tick. Paired up in an
+ * RtcStamp, these give a wall clock time for any system time, which is
+ * quick enough to do in the frame ISR.
+ *
+ * @file rtc.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup RTC
+ * @{
+ */
+
+#include <stdlib.h>
+
+#include "rtc.h"
+#include "uart.h"
+
+/// How long XT1 has to start before we warn that it hasn't, in ms
+#define RTC_XT1_TIMEOUT 1000
+
+/// The wall clock time at the last tick, and the system time at that tick
+static volatile RtcStamp now;
+
+/// Set once the RTC has been set to a real time
+static volatile uint8_t valid;
+
+/// Set until XT1 has started, and the clock_time() when it was turned on
+static uint8_t xt1_starting;
+static clock_time_t xt1_time;
+
+static void calendar(uint32_t wall, uint16_t *year, uint8_t *mon,
+        uint8_t *day);
+
+/**
+ * Start XT1 and the RTC calendar, from RTC_DEFAULT. This needs the system
+ * tick to be running (see clock_init()).
+ *
+ * XT1 can take up to a second to start, which we don't wait for, so that
+ * logging can start straight away. Until it has started ACLK, and so the RTC,
+ * runs from REFO, which is only good to a few percent. rtc_service() looks
+ * after it from then on.
+ */
+void rtc_init(void)
+{
+    // Start XT1 on P5.4/P5.5 at full drive, which is turned down once it has
+    // started
+    P5SEL |= (1 << 4) | (1 << 5);
+    UCSCTL6 &= ~(XT1OFF | XTS);
+    UCSCTL6 |= XCAP_3 | XT1DRIVE_3;
+    UCSCTL7 &= ~XT1LFOFFG;
+    SFRIFG1 &= ~OFIFG;
+    xt1_starting = 1;
+    xt1_time = clock_time();
+
+    // ACLK is XT1CLK from reset (see sys_clock_init()), which the calendar
+    // always runs from, interrupting once a second when the time has ticked
+    RTCCTL01 = RTCMODE | RTCHOLD | RTCRDYIE;
+    rtc_set(RTC_DEFAULT);
+    valid = 0;
+}
+
+/**
+ * Check whether XT1 has started, which is shown by its fault flag staying
+ * clear, and if so turn its drive down. ACLK only goes back to XT1 from REFO
+ * once the flag has been cleared, so it is cleared again until then. This
+ * should be called from the foreground every few hundred ms, so that the flag
+ * has had time to be set again if XT1 still isn't running.
+ */
+void rtc_service(void)
+{
+    if(!xt1_starting)
+        return;
+    if(!(UCSCTL7 & XT1LFOFFG))
+    {
+        UCSCTL6 &= ~XT1DRIVE_3;
+        xt1_starting = 0;
+        return;
+    }
+    UCSCTL7 &= ~XT1LFOFFG;
+    SFRIFG1 &= ~OFIFG;
+    if(clock_time() - xt1_time >= RTC_XT1_TIMEOUT)
+    {
+        uart_debug("[WARN] XT1 failed, RTC is on REFO");
+        xt1_starting = 0;
+    }
+}
+
+/**
+ * Set the wall clock time. The calendar is held whilst it is set and its
+ * prescalers are cleared, so that it ticks exactly a second later.
+ *
+ * @param wall The time in seconds since 1970 UTC.
+ */
+void rtc_set(uint32_t wall)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    uint16_t year;
+    uint8_t mon, day;
+
+    calendar(wall, &year, &mon, &day);
+
+    __disable_interrupt();
+    RTCCTL01 |= RTCHOLD;
+    RT0PS = 0;
+    RT1PS = 0;
+    RTCSEC = wall % 60;
+    RTCMIN = (wall / 60) % 60;
+    RTCHOUR = (wall / 3600) % 24;
+    RTCDOW = (wall / 86400 + 4) % 7;
+    RTCDAY = day;
+    RTCMON = mon;
+    RTCYEAR = year;
+    RTCCTL01 &= ~(RTCHOLD | RTCRDYIFG);
+
+    now.wall = wall;
+    now.time = clock_time_us((uint16_t *)&now.us);
+    valid = 1;
+    __bis_SR_register(gie);
+}
+
+/**
+ * Get the wall clock time at the last tick, along with the system time at the
+ * tick. This may be called from an ISR.
+ *
+ * @param stamp Where to put the time, RtcStamp::wall is 0 if the RTC hasn't
+ * been set.
+ */
+void rtc_stamp(RtcStamp *stamp)
+{
+    uint16_t gie = __read_status_register() & GIE;
+
+    __disable_interrupt();
+    stamp->wall = valid ? now.wall : 0;
+    stamp->time = now.time;
+    stamp->us = now.us;
+    __bis_SR_register(gie);
+}
+
+/**
+ * Get the current time in the FatFs format, for get_fattime().
+ *
+ * @returns The local time, packed with the year from 1980 in bits 31-25, the
+ * month in 24-21, the day in 20-16, the hour in 15-11, the minute in 10-5 and
+ * the seconds / 2 in 4-0.
+ */
+DWORD rtc_fattime(void)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    uint32_t wall;
+    uint16_t year;
+    uint8_t mon, day;
+
+    __disable_interrupt();
+    wall = now.wall;
+    __bis_SR_register(gie);
+
+    calendar(wall, &year, &mon, &day);
+    return ((DWORD)(year - 1980) << 25)
+        | ((DWORD)mon << 21)
+        | ((DWORD)day << 16)
+        | (((wall / 3600) % 24) << 11)
+        | (((wall / 60) % 60) << 5)
+        | ((wall % 60) >> 1);
+}
+
+/**
+ * Handle a line received over the UART if it sets the time, see above.
+ *
+ * @param line The line, without its terminator.
+ * @returns Non-zero if the line set the time.
+ */
+uint8_t rtc_command(char *line)
+{
+    char *end;
+    uint32_t wall;
+
+    if(line[0] != 'T')
+        return 0;
+    wall = strtoul(line + 1, &end, 10);
+    if(end == line + 1 || *end || wall < RTC_DEFAULT)
+    {
+        uart_debug("[WARN] Bad time");
+        return 0;
+    }
+    rtc_set(wall);
+    uart_debug("RTC set");
+    return 1;
+}
+
+/**
+ * Turn a time into a date in the Gregorian calendar.
+ *
+ * @param wall The time in seconds since 1970.
+ * @param year Where to put the year.
+ * @param mon Where to put the month, from 1.
+ * @param day Where to put the day of the month, from 1.
+ */
+static void calendar(uint32_t wall, uint16_t *year, uint8_t *mon,
+        uint8_t *day)
+{
+    uint32_t days, yoe, doy, mp;
+
+    // Count the days from 1st March 2000, so that the leap day is the last
+    // day of a year, then split them into 400 year cycles (there is only one
+    // before 2106, when the seconds run out)
+    days = wall / 86400 - 11017;
+    yoe = days % 146097;
+    yoe = (yoe - yoe / 1460 + yoe / 36524 - yoe / 146096) / 365;
+    doy = days % 146097 - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *mon = mp < 10 ? mp + 3 : mp - 9;
+    *year = 2000 + days / 146097 * 400 + yoe + (*mon <= 2);
+}
+
+/**
+ * Interrupt service routine for the RTC, which counts the seconds and takes
+ * the system time at each tick.
+ */
+interrupt(RTC_VECTOR) RTC_ISR(void)
+{
+    switch(RTCIV)
+    {
+        case RTC_RTCRDYIFG:
+            now.wall++;
+            now.time = clock_time_us((uint16_t *)&now.us);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * @}
+ */
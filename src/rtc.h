@@ -0,0 +1,55 @@
+/**
+ * RTC header.
+ *
+ * @file rtc.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup RTC
+ * @{
+ */
+
+#ifndef __RTC_H__
+#define __RTC_H__
+
+#include "typedefs.h"
+#include "integer.h"
+#include "system.h"
+
+/**
+ * The time that the RTC starts from at power up, until it is set, in seconds
+ * since 1970 (1st January 2014, midnight UTC). This is only used for the file
+ * times on the card, block headers say that the time isn't known instead.
+ */
+#define RTC_DEFAULT 1388534400UL
+
+/**
+ * @struct RtcStamp
+ * @brief The wall clock time at a tick of the RTC, and the system time at
+ * that tick, such that any system time can be turned into a wall clock time.
+ * @var RtcStamp::wall
+ * The time of the tick in seconds since 1970 UTC, or 0 if the RTC hasn't
+ * been set.
+ * @var RtcStamp::time
+ * The clock_time() at the tick, in milliseconds.
+ * @var RtcStamp::us
+ * The microseconds into that millisecond at the tick.
+ */
+typedef struct RtcStamp
+{
+    uint32_t wall;
+    clock_time_t time;
+    uint16_t us;
+} RtcStamp;
+
+void rtc_init(void);
+void rtc_service(void);
+void rtc_set(uint32_t wall);
+void rtc_stamp(RtcStamp *stamp);
+DWORD rtc_fattime(void);
+uint8_t rtc_command(char *line);
+
+#endif /* __RTC_H__ */
+
+/**
+ * @}
+ */
@@ -0,0 +1,244 @@
+/**
+ * Keeps statistics of each data file as it is logged, so that a summary of a
+ * trip can be had without pulling the whole file through the parser: the
+ * range of every channel, the RMS and mean of the pack current, the energy
+ * integral of the pack voltage times the current, and the peaks of each
+ * accelerometer axis. The voltage and current are the ADC channels chosen
+ * with STATS_VOLTAGE and STATS_CURRENT.
+ *
+ * Nothing is added to the frame ISR for this, bar counting the frames in each
+ * block (see logfmt.c). The frames are gone through in the foreground
+ * instead, as each sector of the SD buffer is written to the card (see
+ * sd_write() in logger.c). The sector is still in the buffer then, and is
+ * only given back to the producer afterwards. The MSP430 has no FPU, so
+ * everything is kept in integers in the units that are logged: a frame costs
+ * a few 16 bit multiplies and 64 bit adds, and the sums can't overflow over
+ * anything like the length of a trip. The voltage is held from the last
+ * frame that it was logged in, for the energy of each current sample.
+ *
+ * When the data file is closed, the statistics go into a summary block at
+ * the end of it (see StatsRecord in logfmt.h), which evlog prints, and are
+ * shown on the LCD whilst logging is stopped, scaled with STATS_VOLTAGE_UV
+ * and STATS_CURRENT_UA. In trigger mode they only cover the frames that were
+ * saved.
+ *
+ * @file stats.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Stats
+ * @{
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "HAL_Dogs102x6.h"
+#include "stats.h"
+#include "logfmt.h"
+#include "accel.h"
+#include "profile.h"
+
+/// The statistics of the data file so far
+static StatsRecord rec;
+
+/// The last logged value of the voltage channel
+static uint16_t volt;
+
+/// Set once the summary of the last data file has been made
+static uint8_t ready;
+
+/// The accelerometer range in g when the data file was started, since the
+/// mode may be changed again once logging has stopped
+static uint8_t accel_range;
+
+static void stats_frame(const uint16_t *frame, uint16_t adc_mask,
+        uint8_t accel_mask);
+static uint16_t isqrt(uint32_t x);
+
+/**
+ * Start the statistics of a new data file, before any of its sectors have
+ * been written to the card.
+ */
+void stats_reset(void)
+{
+    uint16_t rate;
+
+    memset(&rec, 0, sizeof(rec));
+    memset(rec.min, 0xFF, sizeof(rec.min));
+    memset(rec.accel_min, 0x7F, sizeof(rec.accel_min));
+    memset(rec.accel_max, 0x80, sizeof(rec.accel_max));
+    rec.current_zero = STATS_CURRENT_ZERO;
+    rec.voltage = STATS_VOLTAGE;
+    rec.current = STATS_CURRENT;
+    volt = 0;
+    ready = 0;
+    Cma3000_getMode(&accel_range, &rate);
+}
+
+/**
+ * Take the frames of some blocks that have just been written to the card
+ * into the statistics.
+ *
+ * @param blocks A pointer to the blocks, in the SD ring buffer.
+ * @param n The number of bytes, as for sd_write().
+ */
+void stats_blocks(const char *blocks, uint16_t n)
+{
+    uint16_t i;
+    PROFILE_START(t);
+
+    for(i = 0; i < n; i += DATAFILE_SECTOR)
+        logfmt_frames(blocks + i, stats_frame);
+    PROFILE_END(PROF_STATS, t);
+}
+
+/**
+ * Put the summary block into the SD ring buffer, once every sector before it
+ * has been written out (so that all of the frames are in the statistics).
+ *
+ * @param rb A pointer to the SD ring buffer.
+ * @returns 0 for success, non-0 if there wasn't room for the block.
+ */
+uint8_t stats_finish(RingBuffer *rb)
+{
+    rec.current_rms = isqrt(rec.samples ? rec.current_sq / rec.samples : 0);
+    if(logfmt_summary(rb, &rec))
+        return 1;
+    ready = 1;
+    return 0;
+}
+
+/**
+ * Show the summary of the last data file on the LCD, on the rows that show the
+ * buffer and the profile whilst logging (2, 5 and 6): the range of the
+ * voltage, the RMS current, the energy and the largest acceleration on any
+ * axis.
+ *
+ * @returns Non-zero if the summary was shown, or zero if there is no summary
+ * to show.
+ */
+uint8_t stats_show(void)
+{
+    static const uint8_t divs[ADC_CHANNELS] = LOG_ADC_DIVS;
+    char s[40];
+    uint32_t lo, hi, amps;
+    int64_t joules;
+    uint16_t mg;
+    uint8_t i;
+    int16_t peak = 0;
+
+    if(!ready || !rec.frames)
+        return 0;
+
+    // Millivolts and milliamps
+    lo = (uint64_t)rec.min[STATS_VOLTAGE] * STATS_VOLTAGE_UV / 1000;
+    hi = (uint64_t)rec.max[STATS_VOLTAGE] * STATS_VOLTAGE_UV / 1000;
+    amps = (uint64_t)rec.current_rms * STATS_CURRENT_UA / 1000;
+    sprintf(s, "V %lu.%lu-%lu.%luV", lo / 1000, (lo % 1000) / 100,
+            hi / 1000, (hi % 1000) / 100);
+    lcd_row(2, s);
+    sprintf(s, "I %lu.%luA rms", amps / 1000, (amps % 1000) / 100);
+    lcd_row(5, s);
+
+    // Each current sample stands for its divisor's worth of frames
+    joules = rec.energy * divs[STATS_CURRENT] / LOG_RATE;
+    joules = joules * STATS_VOLTAGE_UV / 1000000 * STATS_CURRENT_UA / 1000000;
+
+    // The accelerometer gives 56 counts per g in its 2g range
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+    {
+        if(rec.accel_max[i] > peak)
+            peak = rec.accel_max[i];
+        if(-rec.accel_min[i] > peak)
+            peak = -rec.accel_min[i];
+    }
+    mg = (uint32_t)peak * accel_range * 1000 / 112;
+    sprintf(s, "E %ldJ %u.%02ug", (long)joules, mg / 1000, (mg % 1000) / 10);
+    lcd_row(6, s);
+    return 1;
+}
+
+/**
+ * Take one frame into the statistics.
+ *
+ * @param frame The frame, being the due ADC channels followed by the due
+ * accelerometer axes, one word each.
+ * @param adc_mask The ADC channels in the frame.
+ * @param accel_mask The accelerometer axes in the frame.
+ */
+static void stats_frame(const uint16_t *frame, uint16_t adc_mask,
+        uint8_t accel_mask)
+{
+    uint16_t v, cur = 0;
+    int16_t c;
+    int8_t a;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(!(adc_mask & _BV(i)))
+            continue;
+        v = *frame++;
+        if(v < rec.min[i])
+            rec.min[i] = v;
+        if(v > rec.max[i])
+            rec.max[i] = v;
+        if(i == STATS_VOLTAGE)
+            volt = v;
+        if(i == STATS_CURRENT)
+            cur = v;
+    }
+
+    // Logged values are at most 14 bits, so these all fit in 32 bits before
+    // they are added up
+    if(adc_mask & _BV(STATS_CURRENT))
+    {
+        c = (int16_t)(cur - STATS_CURRENT_ZERO);
+        rec.samples++;
+        rec.current_sum += c;
+        rec.current_sq += (uint32_t)((int32_t)c * c);
+        rec.energy += (int32_t)volt * c;
+    }
+
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+    {
+        if(!(accel_mask & _BV(i)))
+            continue;
+        a = (int8_t)*frame++;
+        if(a < rec.accel_min[i])
+            rec.accel_min[i] = a;
+        if(a > rec.accel_max[i])
+            rec.accel_max[i] = a;
+    }
+    rec.frames++;
+}
+
+/**
+ * Find the integer square root of a number, a bit at a time.
+ *
+ * @param x The number.
+ * @returns The largest integer whose square is no more than x.
+ */
+static uint16_t isqrt(uint32_t x)
+{
+    uint32_t r = 0, bit = 1UL << 30;
+
+    while(bit > x)
+        bit >>= 2;
+    while(bit)
+    {
+        if(x >= r + bit)
+        {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint16_t)r;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,69 @@
+/**
+ * Stats header.
+ *
+ * @file stats.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Stats
+ * @{
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "typedefs.h"
+#include "logger.h"
+
+/**
+ * Set non-zero to keep statistics of the frames of each data file as they go
+ * to the card, and to end the file with a summary block of them (see
+ * stats.c).
+ */
+#ifndef STATS
+#define STATS 1
+#endif
+
+/**
+ * The ADC channels that are the pack voltage and the pack current, by their
+ * number in the channel map. A map for a vehicle would set these to its
+ * channels, such as ADC_CH_PACK_V.
+ */
+#ifndef STATS_VOLTAGE
+#define STATS_VOLTAGE 0
+#endif
+#ifndef STATS_CURRENT
+#define STATS_CURRENT (ADC_CHANNELS > 1)
+#endif
+
+/**
+ * The value of the current channel when no current is flowing, such as half
+ * scale for a hall effect sensor that reads in both directions. The current
+ * statistics are all of the current about this level.
+ */
+#ifndef STATS_CURRENT_ZERO
+#define STATS_CURRENT_ZERO 0
+#endif
+
+/**
+ * The size of one unit of the voltage and current channels, in microvolts and
+ * microamps, for showing the summary on the LCD. This is only used on the LCD,
+ * the summary block is left in the units logged. By default these are the
+ * volts at the pin for a 12 bit channel.
+ */
+#ifndef STATS_VOLTAGE_UV
+#define STATS_VOLTAGE_UV 806
+#endif
+#ifndef STATS_CURRENT_UA
+#define STATS_CURRENT_UA 806
+#endif
+
+void stats_reset(void);
+void stats_blocks(const char *blocks, uint16_t n);
+uint8_t stats_finish(RingBuffer *rb);
+uint8_t stats_show(void);
+
+#endif /* __STATS_H__ */
+
+/**
+ * @}
+ */
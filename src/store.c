@@ -0,0 +1,258 @@
+/**
+ * Stores the blocks of the data file in each of the places that they go to,
+ * such that the logger loop only deals with blocks and not with where they
+ * end up.
+ *
+ * Each place is a StoreSink, with its own way of starting a data file,
+ * writing blocks to it, syncing it and ending it. Every block is mirrored to
+ * every sink, in the order of the table below. The first sink is always the
+ * data file on the card (see datafile.c), which is where a block must get to.
+ * Its results are the ones that are passed back, so that a card that stops
+ * working is noticed as before. Any other sink is lossy: it is handed the
+ * blocks one at a time, and those it can't take are counted and dropped
+ * rather than holding up the card.
+ *
+ * Blocks are written in batches of up to STORE_BATCH sectors (see
+ * sectors_due() in logger.c). The data file writes a batch that lands inside
+ * its preallocated chain in a single disk_write() (see datafile_write()).
+ *
+ * With STORE_UART set, blocks are also streamed out over the UART, for a
+ * laptop that is logging alongside the card on a test rig. Each block is
+ * sent as STORE_UART_SYNC0, STORE_UART_SYNC1, its length as a little endian
+ * word, then the block itself, all queued in one go so that debug output
+ * can't land in the middle of it. The host finds blocks by these bytes and
+ * checks them against the CRC in their headers (see capture.py). The UART
+ * runs at about twice the rate of the raw format at 1kHz, so a block is only
+ * dropped if the queue is backed up by the debug output or the telemetry.
+ *
+ * With STORE_INDEX set, the data file on the card is also given an index, so
+ * that the host can find its way around a long file without decoding all of
+ * it (see evlog.c). Every (LOGFMT_INDEX_ENTRIES + 1)th sector of each segment
+ * is an index block, holding an IndexEntry for each of the sectors before it
+ * back to the last index: its sequence number and time, and the range of
+ * each ADC channel in it (see logfmt.c). Since the index blocks are at fixed
+ * places, an entry doesn't need to say where its block is, and the host can
+ * read just the index blocks from a file of any length. The sectors after
+ * the last index block of a segment have no index, and are simply decoded.
+ * An index block has the header of the first block that it covers, with
+ * LOGFMT_FLAG_INDEX set, so it is sealed and recovered just like any other
+ * block. Only the card has the index, lossy sinks are given just the blocks.
+ *
+ * The board only has the one card slot, so there is no second card or flash
+ * as yet, but one would be another sink in the table.
+ *
+ * @file store.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Store
+ * @{
+ */
+
+#include <stddef.h>
+
+#include "store.h"
+#include "datafile.h"
+#include "logfmt.h"
+#include "uart.h"
+
+#if STORE_UART && (UART_TXBUF_LEN < 2 * DATAFILE_SECTOR)
+#error "UART_TXBUF_LEN must hold two blocks to stream them (STORE_UART)"
+#endif
+
+#if STORE_INDEX && (SD_RINGBUF_LEN > 4096)
+#error "SD_RINGBUF_LEN can be at most 4096 with STORE_INDEX set"
+#endif
+
+static FRESULT card_write(const char *buf, uint16_t n);
+#if STORE_UART
+static FRESULT uart_sink_write(const char *buf, uint16_t n);
+#endif
+
+/// The sinks, the first of which must be the data file on the card
+static const StoreSink sinks[] = {
+    {"card", datafile_open, datafile_write, datafile_sync, datafile_close, 0},
+#if STORE_UART
+    {"uart", NULL, uart_sink_write, NULL, NULL, 1},
+#endif
+};
+
+/// The number of sinks
+#define STORE_SINKS (sizeof(sinks) / sizeof(sinks[0]))
+
+/// The number of blocks that lossy sinks have dropped in this data file
+static uint32_t dropped;
+
+#if STORE_INDEX
+/// The number of sectors from one index block to the next
+#define STORE_INDEX_PERIOD (LOGFMT_INDEX_ENTRIES + 1)
+
+/// The index block being filled in for the card, in words so that its header
+/// is aligned
+static uint16_t index_block[DATAFILE_SECTOR / 2];
+#endif
+
+/**
+ * Start a new data file in every sink. The card is opened first, and if it
+ * fails then nothing else is.
+ *
+ * @returns The FatFs result code from opening the data file on the card.
+ */
+FRESULT store_open(void)
+{
+    FRESULT fr;
+    uint8_t i;
+
+    dropped = 0;
+    fr = sinks[0].open();
+    if(fr)
+        return fr;
+    for(i = 1; i < STORE_SINKS; i++)
+        if(sinks[i].open)
+            sinks[i].open();
+    return FR_OK;
+}
+
+/**
+ * Write n bytes of blocks to every sink.
+ *
+ * @param buf A pointer to the blocks, which must be whole sectors.
+ * @param n The number of bytes, which is a whole number of blocks other than
+ * for the final write to the file.
+ * @returns The FatFs result code for the write to the card.
+ */
+FRESULT store_write(const char *buf, uint16_t n)
+{
+    FRESULT fr;
+    uint16_t i, len;
+    uint8_t s;
+
+    fr = card_write(buf, n);
+    for(s = 1; s < STORE_SINKS; s++)
+    {
+        for(i = 0; i < n; i += DATAFILE_SECTOR)
+        {
+            len = (n - i < DATAFILE_SECTOR) ? n - i : DATAFILE_SECTOR;
+            if(sinks[s].write(buf + i, len))
+                dropped++;
+        }
+    }
+    return fr;
+}
+
+/**
+ * Sync every sink.
+ *
+ * @returns The FatFs result code for syncing the card.
+ */
+FRESULT store_sync(void)
+{
+    uint8_t i;
+
+    for(i = 1; i < STORE_SINKS; i++)
+        if(sinks[i].sync)
+            sinks[i].sync();
+    return sinks[0].sync();
+}
+
+/**
+ * End the data file in every sink.
+ *
+ * @returns The FatFs result code for closing the data file on the card.
+ */
+FRESULT store_close(void)
+{
+    uint8_t i;
+
+    for(i = 1; i < STORE_SINKS; i++)
+        if(sinks[i].close)
+            sinks[i].close();
+    return sinks[0].close();
+}
+
+/**
+ * Get the number of blocks that lossy sinks have dropped.
+ *
+ * @returns The number of blocks dropped since the data file was started.
+ */
+uint32_t store_dropped(void)
+{
+    return dropped;
+}
+
+/**
+ * Write n bytes of blocks to the card, putting in the index blocks (see
+ * above) if STORE_INDEX is set. The blocks are written in as few pieces as
+ * the index blocks between them allow.
+ *
+ * @param buf A pointer to the blocks.
+ * @param n The number of bytes, as for store_write().
+ * @returns The FatFs result code for the first write that failed, or FR_OK.
+ */
+static FRESULT card_write(const char *buf, uint16_t n)
+{
+#if STORE_INDEX
+    FRESULT fr;
+    DWORD pos;
+    uint16_t i, len;
+    uint8_t slot;
+
+    while(n)
+    {
+        // Where the next sector goes is only known once the next segment has
+        // been started, if it is due
+        pos = datafile_position();
+        slot = pos % STORE_INDEX_PERIOD;
+        if(slot == STORE_INDEX_PERIOD - 1)
+        {
+            logfmt_seal((char *)index_block, DATAFILE_SECTOR,
+                    datafile_session());
+            fr = sinks[0].write((char *)index_block, DATAFILE_SECTOR);
+            if(fr)
+                return fr;
+            continue;
+        }
+
+        len = (STORE_INDEX_PERIOD - 1 - slot) * DATAFILE_SECTOR;
+        if(len > n)
+            len = n;
+        for(i = 0; i < len; i += DATAFILE_SECTOR, slot++)
+        {
+            if(!slot)
+                logfmt_index_start((char *)index_block, buf + i);
+            logfmt_index_add((char *)index_block, slot, buf + i);
+        }
+        fr = sinks[0].write(buf, len);
+        if(fr)
+            return fr;
+        buf += len;
+        n -= len;
+    }
+    return FR_OK;
+#else
+    return sinks[0].write(buf, n);
+#endif
+}
+
+#if STORE_UART
+/**
+ * Queue a block to be sent out over the UART, see above.
+ *
+ * @param buf A pointer to the block.
+ * @param n The length of the block.
+ * @returns FR_OK, or FR_DENIED if there wasn't room for it in the queue.
+ */
+static FRESULT uart_sink_write(const char *buf, uint16_t n)
+{
+    char head[4];
+
+    head[0] = STORE_UART_SYNC0;
+    head[1] = STORE_UART_SYNC1;
+    head[2] = n & 0xFF;
+    head[3] = n >> 8;
+    return uart_write_pair(head, sizeof(head), buf, n) ? FR_DENIED : FR_OK;
+}
+#endif
+
+/**
+ * @}
+ */
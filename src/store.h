@@ -0,0 +1,90 @@
+/**
+ * Store header.
+ *
+ * @file store.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Store
+ * @{
+ */
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include "typedefs.h"
+#include "ff.h"
+
+/**
+ * The most sectors that are handed to the sinks in one go. Whilst the card
+ * keeps up there is only ever one sector ready, but after a stall the backlog
+ * is written out in batches of up to this many, which saves a call through
+ * FatFs and the disk layer for each sector.
+ */
+#ifndef STORE_BATCH
+#define STORE_BATCH 4
+#endif
+
+/**
+ * Set non-zero to write an index block into every (LOGFMT_INDEX_ENTRIES + 1)th
+ * sector of the data file on the card, summarising the blocks before it so
+ * that the host can seek through the file (see store.c). This takes the RAM
+ * that an SD ring buffer longer than 4096 bytes would need (see logger.h).
+ */
+#ifndef STORE_INDEX
+#define STORE_INDEX 1
+#endif
+
+/**
+ * Set non-zero to mirror every block to the UART as well as writing it to the
+ * card (see store.c). The UART queue must then hold at least two blocks.
+ */
+#ifndef STORE_UART
+#define STORE_UART 0
+#endif
+
+/**
+ * The bytes at the start of each block sent to the UART, followed by the
+ * length of the block as a little endian word.
+ */
+#define STORE_UART_SYNC0 0xEB
+#define STORE_UART_SYNC1 0x91
+
+/**
+ * @struct StoreSink
+ * @brief Somewhere that the blocks of the data file are stored. Any of the
+ * functions other than write may be NULL if there is nothing for it to do.
+ * @var StoreSink::name
+ * The name of the sink, for debug output.
+ * @var StoreSink::open
+ * Start a new data file.
+ * @var StoreSink::write
+ * Write n bytes, which are whole blocks other than at the end of the file.
+ * @var StoreSink::sync
+ * Make sure that everything written so far would survive a loss of power.
+ * @var StoreSink::close
+ * End the data file.
+ * @var StoreSink::lossy
+ * Set if the sink may drop blocks, such that its failures are counted
+ * rather than reported.
+ */
+typedef struct StoreSink
+{
+    const char *name;
+    FRESULT (*open)(void);
+    FRESULT (*write)(const char *buf, uint16_t n);
+    FRESULT (*sync)(void);
+    FRESULT (*close)(void);
+    uint8_t lossy;
+} StoreSink;
+
+FRESULT store_open(void);
+FRESULT store_write(const char *buf, uint16_t n);
+FRESULT store_sync(void);
+FRESULT store_close(void);
+uint32_t store_dropped(void);
+
+#endif /* __STORE_H__ */
+
+/**
+ * @}
+ */
@@ -21,26 +21,33 @@
 #include <in430.h>
 #include "HAL_PMM.h"
 #include "system.h"
+#include "logger.h"
+#include "profile.h"
 
 /** Current clock time */
 static volatile clock_time_t ticks;
 
+/** The period of the wakeup tick (0 for none), and the ticks until it's due */
+static volatile clock_time_t wake_period, wake_count;
+
 /**
- * Use timer A0 to set up a system clock ticking at 1ms intervals.
+ * Use timer A1 to set up a system clock ticking at 1ms intervals. Timer A0 is
+ * left for the logger, since only its CCR1 output can trigger the ADC.
  */
 void clock_init(void)
 {
     // Reset the local tick counter and set function ptrs to null
     ticks = 0;
+    wake_period = 0;
 
     // Count to 24999 (25000 actual counts)
-    TA0CCR0 = 24999;
+    TA1CCR0 = 24999;
 
     // Clock from SMCLK with no divider, use "up" mode, use interrupts
-    TA0CTL |= TASSEL_2 | MC_1 | TACLR;
+    TA1CTL |= TASSEL_2 | MC_1 | TACLR;
 
     // CCR0 interrupt enable
-    TA0CCTL0 |= CCIE;
+    TA1CCTL0 |= CCIE;
 
     // Enable global interrupts (macro from legacymsp430.h) and return
     eint();
@@ -67,10 +74,9 @@ void sys_clock_init(void)
     // Setting SCG0 disables the FLL on the F5529
     __bis_status_register(SCG0);
 
-    // Enable XT2 (4MHz xtal attached to XT2) and disable XT1 (LF & HF)
+    // Enable XT2 (4MHz xtal attached to XT2), XT1 is left to the RTC (see
+    // rtc.c) which starts it
     UCSCTL6 &= ~XT2OFF;
-    UCSCTL6 |= XT1OFF;
-    _BIS_SR(OSCOFF); // Disable LFXT1
 
     // Wait for XT2 to stabilise
     do {
@@ -104,7 +110,7 @@ void sys_clock_init(void)
     } while( UCSCTL7 & DCOFFG );
 
     // At this point, DCOCLK is a 25MHz stabilised reference
-    // So set MCLK and SMCLK to use this
+    // So set MCLK and SMCLK to use this, ACLK stays on XT1 for the RTC
     UCSCTL4 = SELS_3 | SELM_3;
 }
 
@@ -117,6 +123,46 @@ clock_time_t clock_time(void)
     return ticks;
 }
 
+/**
+ * Return the current system time to the microsecond, from the system tick
+ * and how far timer A1 has counted towards the next one. If the timer has
+ * wrapped but its interrupt hasn't run yet (as in another ISR), the tick is
+ * counted here.
+ * @param us Where to put the microseconds into the current millisecond.
+ * @returns The current clock time in milliseconds.
+ */
+clock_time_t clock_time_us(uint16_t *us)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    clock_time_t t;
+    uint16_t r;
+
+    __disable_interrupt();
+    t = ticks;
+    r = TA1R;
+    if(TA1CCTL0 & CCIFG)
+    {
+        t++;
+        r = TA1R;
+    }
+    __bis_SR_register(gie);
+
+    *us = r / (F_CPU / 1000000UL);
+    return t;
+}
+
+/**
+ * Have the system tick wake the CPU from LPM0 every period milliseconds, such
+ * that a foreground loop sleeping until its next event can also do periodic
+ * work (such as updating a display). Any other tick returns to sleep.
+ * @param period The wakeup period in ms, or 0 to stop waking the CPU.
+ */
+void clock_set_wakeup(clock_time_t period)
+{
+    wake_count = period;
+    wake_period = period;
+}
+
 /**
  * Delay for the provided number of milliseconds. We use the __delay_cycles()
  * function which consists of putting NOPs into the CPU pipeline for the
@@ -136,9 +182,46 @@ void _delay_ms(clock_time_t delay)
  * Interrupt service routine for the system ticks counter.
  * Note that the interrupt() macro is from legacymsp430.h.
  */
-interrupt(TIMER0_A0_VECTOR) TIMER0_A0_ISR(void)
+interrupt(TIMER1_A0_VECTOR) TIMER1_A0_ISR(void)
 {
+    PROFILE_START(t);
+
     ticks++;
+
+    if(wake_period && --wake_count == 0)
+    {
+        wake_count = wake_period;
+        __bic_SR_register_on_exit(LPM0_bits);
+    }
+
+    PROFILE_END(PROF_TICK_ISR, t);
+}
+
+/**
+ * Interrupt service routine for the DMA controller.
+ *
+ * DMA channel 0 interrupts at the end of every ADC conversion run, the logger
+ * then files the frame away and tells us whether the foreground should be
+ * woken.
+ *
+ * Drivers that use DMA (such as the SD card driver) enable DMAIE on the
+ * channel they are waiting for and sleep in LPM0 until the transfer has
+ * completed. All we need to do here is acknowledge the interrupt and wake the
+ * CPU, the waiting code then checks its own channel.
+ */
+interrupt(DMA_VECTOR) DMA_ISR(void)
+{
+    // Reading DMAIV clears the highest priority pending interrupt flag
+    switch(DMAIV)
+    {
+        case DMAIV_DMA0IFG:
+            if(logger_frame_isr())
+                __bic_SR_register_on_exit(LPM0_bits);
+            break;
+        default:
+            __bic_SR_register_on_exit(LPM0_bits);
+            break;
+    }
 }
 
 /**
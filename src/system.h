@@ -25,6 +25,8 @@ typedef uint32_t clock_time_t;
 void clock_init(void);
 void sys_clock_init(void);
 clock_time_t clock_time(void);
+clock_time_t clock_time_us(uint16_t *us);
+void clock_set_wakeup(clock_time_t period);
 void _delay_ms(uint32_t delay);
 
 #endif /* __SYSTEM_H__ */
@@ -0,0 +1,242 @@
+/**
+ * Streams the latest readings out over the UART whilst logging, so that they
+ * can be watched live on a laptop. The data file is still the record, this is
+ * only a decimated view of it and packets are dropped if the UART can't keep
+ * up.
+ *
+ * Every frame that is logged updates a copy of the latest reading of each
+ * channel, since a frame only holds the channels that are due in it (see
+ * channels.h). Every TELEM_DIV'th frame the copy is sent out, so every
+ * channel is in every packet whatever its divisor.
+ *
+ * A packet is laid out as follows, with all fields little endian:
+ *
+ *   TELEM_SYNC0, TELEM_SYNC1   (2 bytes)
+ *   length of the payload      (1 byte)
+ *   type, TELEM_*              (1 byte)
+ *   sequence number            (1 byte, counting every packet sent or not)
+ *   payload                    (length bytes)
+ *   checksum                   (2 bytes, Fletcher-16 of length to payload)
+ *
+ * The debug output goes out over the same UART as plain text, between the
+ * packets, so the host finds a packet by looking for the sync bytes and then
+ * checking the checksum.
+ *
+ * A TELEM_START packet is sent when logging starts and every second after
+ * that, so that a host can join at any time. Its payload is the session
+ * number (2 bytes, 0 until the data file has been opened), LOG_RATE (4
+ * bytes), TELEM_DIV (2 bytes), the number of ADC channels and of
+ * accelerometer axes (a byte each), then the bits in each ADC reading (a byte
+ * per channel).
+ *
+ * A TELEM_FRAME packet has the number of the frame in the data file (4
+ * bytes), the ADC channels and the accelerometer axes which have been updated
+ * since the last one was sent (2 and 1 bytes, bit n for channel n), the
+ * latest reading of each ADC channel (2 bytes each) and of each accelerometer
+ * axis (1 byte each, signed).
+ *
+ * @file telemetry.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Telemetry
+ * @{
+ */
+
+#include <string.h>
+
+#include "telemetry.h"
+#include "adc.h"
+
+#if TELEMETRY
+
+/// The latest reading of each channel
+static SampleBuffer latest;
+
+/// The channels which have been updated since the last packet was sent
+static uint16_t fresh_adc;
+static uint8_t fresh_accel;
+
+/// The number of frames since the data file was opened, and until the next
+/// one is sent
+static uint32_t frames;
+static uint16_t countdown;
+
+/// The number of TELEM_FRAME packets until a TELEM_START is due
+static uint16_t start_due;
+
+/// The session number of the data file
+static uint16_t telem_session;
+
+/// The sequence number of the next packet
+static uint8_t seq;
+
+/// Where the next packet is put together
+static char packet[TELEM_OVERHEAD + (TELEM_START_LEN > TELEM_FRAME_LEN ?
+        TELEM_START_LEN : TELEM_FRAME_LEN)];
+
+static void send(uint8_t type, uint8_t len);
+static void send_start(void);
+static char *put16(char *p, uint16_t v);
+static char *put32(char *p, uint32_t v);
+
+/**
+ * Get ready to stream a new data file, whose session number isn't known until
+ * the file has been opened (see telemetry_session()). This must only be called
+ * whilst the frame ISR isn't calling telemetry_frame().
+ */
+void telemetry_reset(void)
+{
+    memset((void *)&latest, 0, sizeof(latest));
+    fresh_adc = fresh_accel = 0;
+    frames = 0;
+    countdown = 0;
+    start_due = 0;
+    telem_session = 0;
+}
+
+/**
+ * Set the session number that is sent in each TELEM_START packet, once the
+ * data file has been opened. Until then it is 0.
+ *
+ * @param session The session number of the data file.
+ */
+void telemetry_session(uint16_t session)
+{
+    telem_session = session;
+}
+
+/**
+ * Take the readings from a frame that has just been logged, and send out the
+ * latest readings if they are due. This is called from the frame ISR and
+ * doesn't wait for anything.
+ *
+ * @param frame The frame, as raw words in the order of the SampleBuffer.
+ * @param adc_mask The ADC channels in the frame (bit n for channel n).
+ * @param accel_mask The accelerometer axes in the frame (bit n for axis n).
+ */
+void telemetry_frame(volatile uint16_t *frame, uint16_t adc_mask,
+        uint8_t accel_mask)
+{
+    char *p;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+        if(adc_mask & _BV(i))
+            latest.adc[i] = *frame++;
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        if(accel_mask & _BV(i))
+            latest.accel[i] = *frame++;
+    fresh_adc |= adc_mask;
+    fresh_accel |= accel_mask;
+
+    if(countdown--)
+    {
+        frames++;
+        return;
+    }
+    countdown = TELEM_DIV - 1;
+
+    if(!start_due--)
+    {
+        start_due = TELEM_RATE - 1;
+        send_start();
+    }
+
+    // The payload goes after the sync bytes, length, type and sequence number
+    p = put32(packet + 5, frames++);
+    p = put16(p, fresh_adc);
+    *p++ = fresh_accel;
+    for(i = 0; i < ADC_CHANNELS; i++)
+        p = put16(p, latest.adc[i]);
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        *p++ = latest.accel[i];
+    send(TELEM_FRAME, TELEM_FRAME_LEN);
+    fresh_adc = fresh_accel = 0;
+}
+
+/**
+ * Put together and send a TELEM_START packet.
+ */
+static void send_start(void)
+{
+    char *p;
+    uint8_t i;
+
+    p = put16(packet + 5, telem_session);
+    p = put32(p, LOG_RATE);
+    p = put16(p, TELEM_DIV);
+    *p++ = ADC_CHANNELS;
+    *p++ = ACCEL_CHANNELS;
+    for(i = 0; i < ADC_CHANNELS; i++)
+        *p++ = adc_bits(i);
+    send(TELEM_START, TELEM_START_LEN);
+}
+
+/**
+ * Fill in the header and checksum of the packet in packet[], whose payload
+ * is already in place, and queue it up on the UART. If there isn't room for
+ * it then it is dropped, and the gap in the sequence numbers shows it.
+ *
+ * @param type The type of the packet, TELEM_*.
+ * @param len The length of the payload in bytes.
+ */
+static void send(uint8_t type, uint8_t len)
+{
+    uint16_t a = 0, b = 0;
+    uint8_t i;
+
+    packet[0] = TELEM_SYNC0;
+    packet[1] = TELEM_SYNC1;
+    packet[2] = len;
+    packet[3] = type;
+    packet[4] = seq++;
+
+    // Fletcher-16 over the length, type, sequence number and payload, with
+    // the modulo done by subtraction since there's no hardware divider
+    for(i = 2; i < len + 5; i++)
+    {
+        a += (uint8_t)packet[i];
+        if(a >= 255)
+            a -= 255;
+        b += a;
+        if(b >= 255)
+            b -= 255;
+    }
+    packet[len + 5] = a;
+    packet[len + 6] = b;
+
+    uart_write(packet, len + TELEM_OVERHEAD);
+}
+
+/**
+ * Write a 16 bit value little endian.
+ *
+ * @param p Where to write it.
+ * @param v The value.
+ * @returns The byte after it.
+ */
+static char *put16(char *p, uint16_t v)
+{
+    *p++ = v & 0xFF;
+    *p++ = v >> 8;
+    return p;
+}
+
+/**
+ * Write a 32 bit value little endian.
+ *
+ * @param p Where to write it.
+ * @param v The value.
+ * @returns The byte after it.
+ */
+static char *put32(char *p, uint32_t v)
+{
+    p = put16(p, v & 0xFFFF);
+    return put16(p, v >> 16);
+}
+
+#endif /* TELEMETRY */
+
+/**
+ * @}
+ */
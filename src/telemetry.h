@@ -0,0 +1,82 @@
+/**
+ * Telemetry header.
+ *
+ * @file telemetry.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup Telemetry
+ * @{
+ */
+
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include "typedefs.h"
+#include "logger.h"
+#include "uart.h"
+
+/**
+ * Set non-zero to stream the latest readings out over the UART whilst
+ * logging, for a dashboard (see telemetry.c).
+ */
+#ifndef TELEMETRY
+#define TELEMETRY 1
+#endif
+
+/**
+ * The rate at which readings are sent in Hz. Every LOG_RATE/TELEM_RATE'th
+ * frame is sent, so this should divide LOG_RATE.
+ */
+#ifndef TELEM_RATE
+#define TELEM_RATE 50UL
+#endif
+
+/**
+ * The number of frames for each one that is sent.
+ */
+#define TELEM_DIV (LOG_RATE / TELEM_RATE)
+
+/**
+ * The two bytes which start every packet.
+ */
+#define TELEM_SYNC0 0xEB
+#define TELEM_SYNC1 0x90
+
+/**
+ * The packet types. A TELEM_START packet describes the readings and a
+ * TELEM_FRAME packet has a set of them.
+ */
+#define TELEM_START 0x01
+#define TELEM_FRAME 0x02
+
+/**
+ * The bytes in a packet besides the payload: the sync bytes, the length,
+ * type and sequence number, and the checksum.
+ */
+#define TELEM_OVERHEAD 7
+
+/**
+ * The length of the payload of each type of packet.
+ */
+#define TELEM_START_LEN (10 + ADC_CHANNELS)
+#define TELEM_FRAME_LEN (7 + 2 * ADC_CHANNELS + ACCEL_CHANNELS)
+
+#if TELEMETRY
+#if TELEM_DIV < 1 || TELEM_DIV > 65535
+#error "TELEM_RATE must be from LOG_RATE/65535 to LOG_RATE"
+#endif
+#if (TELEM_OVERHEAD + TELEM_FRAME_LEN) * TELEM_RATE * 10 > UART_BAUD / 2
+#error "TELEM_RATE would take more than half of the UART, lower it"
+#endif
+#endif
+
+void telemetry_reset(void);
+void telemetry_session(uint16_t session);
+void telemetry_frame(volatile uint16_t *frame, uint16_t adc_mask,
+        uint8_t accel_mask);
+
+#endif /* __TELEMETRY_H__ */
+
+/**
+ * @}
+ */
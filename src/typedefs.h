@@ -18,9 +18,15 @@
  */
 #define _BV(x) (1<<x)
 
+#ifdef __MSP430__
 typedef unsigned char uint8_t;
 typedef unsigned int uint16_t;
 typedef long int32_t;
 typedef unsigned long uint32_t;
+#else
+// Host builds (see sim/) take the types from the C library, where int and
+// long aren't 16 and 32 bits
+#include <stdint.h>
+#endif
 
 #endif /* __TYPEDEFS_H__ */
@@ -1,10 +1,23 @@
 /**
  * Configure and initialise the USCI in UART (universal async receiver
- * transmitter) mode, principally for the purposes of debugging.
+ * transmitter) mode, for debugging and for streaming telemetry to a laptop.
  *
  * We also provide functionality for transmitting a C-string (null terminated)
  * over the UART to facilitate easy debugging.
  *
+ * Nothing here waits for the UART. Everything to be sent is put in a queue
+ * (a RingBuffer), which the USCI interrupt sends out a byte at a time. The
+ * queue has two producers, the foreground (debug output, and blocks of the
+ * data file if they are mirrored to the UART, see store.c) and the frame ISR
+ * (telemetry, see telemetry.c), so each write to it is done with interrupts
+ * disabled. A write which doesn't fit is dropped whole, such that the output
+ * is made up only of whole lines and packets. All 3 DMA channels are taken by
+ * the ADC and the SD card, so there is none to send the queue with.
+ *
+ * Lines received (such as to set the RTC, see rtc.c) are collected by the
+ * same interrupt, one at a time, for the foreground to pick up with
+ * uart_getline().
+ *
  * @file uart.c
  * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
  * @copyright Jon Sowman 2014, All Rights Reserved
@@ -14,14 +27,37 @@
 
 #include <string.h>
 #include "uart.h"
+#include "logger.h"
+#include "system.h"
+
+#if UART_TXBUF_LEN & (UART_TXBUF_LEN - 1)
+#error "UART_TXBUF_LEN must be a power of 2"
+#endif
+
+/// The memory behind the transmit queue
+static char txmem[UART_TXBUF_LEN];
+
+/// The transmit queue, which is emptied by the USCI interrupt
+static RingBuffer txbuf;
+
+/// The line being received, its length, and whether it has been ended but
+/// not yet picked up
+static char rxline[UART_BUF_LEN];
+static volatile uint8_t rxlen, rxready;
 
 /**
- * Set up the UCSI for UART operation at 9600 baud. The baud rate
- * generator is currently hard coded for 25MHz SMCLK.
- * @todo Fix this to calculate BRR values from F_CPU.
+ * Set up the UCSI for UART operation at UART_BAUD, with the baud rate
+ * generator in oversampling mode and the divisor worked out from F_CPU.
  */
 void uart_init(void)
 {
+    txbuf.buffer = txmem;
+    txbuf.len = UART_TXBUF_LEN;
+    txbuf.mask = UART_TXBUF_LEN - 1;
+    txbuf.overflow = 0;
+    rb_reset_m(&txbuf);
+    rxlen = rxready = 0;
+
     P4SEL |= (1 << 4) | (1 << 5);
 
     // Make sure the USCI is in reset state
@@ -30,45 +66,175 @@ void uart_init(void)
     // Clock the USCI from SMCLK
     UCA1CTL1 |= UCSSEL_2;
 
-    // Baud rate should be 9600 at 25MHz (see datasheet for these)
-    // UCOS16 = 0
-    UCA1BR0 = 2603 & 0xFF;
-    UCA1BR1 = 2603 >> 8;
-    UCA1MCTL = UCBRS_2;
+    // Divide SMCLK by UART_DIV, oversampling by 16
+    UCA1BR0 = (UART_DIV / 16) & 0xFF;
+    UCA1BR1 = (UART_DIV / 16) >> 8;
+    UCA1MCTL = ((UART_DIV % 16) << 4) | UCOS16;
 
     // Finally, release the USCI reset logic to enable the peripheral
     UCA1CTL1 &= ~UCSWRST;
 
-    // Enable interrupts from the UCSI
+    // Interrupt on every byte received, and on transmit only whilst there's
+    // something to send (see _uart_start())
     UCA1IE |= UCRXIE;
 }
 
 /**
- * Takes a char pointer, transmit data over the UART until we find a 
- * null character.
- * @param string A char pointer to the string to transmit
- * @todo This should time out instead of busy-wait forever.
+ * Start the USCI interrupt sending out the transmit queue, if it isn't
+ * already. This must be called with interrupts disabled.
  */
-static void _uart_tx(char* string)
+static void _uart_start(void)
 {
-    while(*string)
-    {
-        while(!(UCA1IFG & UCTXIFG));
-        UCA1TXBUF = *string++;
-    }
+    UCA1IE |= UCTXIE;
 }
 
 /**
- * Send a CRLF terminated string to the debug output (to avoid storing
- * the terminators in RAM all the time).
+ * Queue up a CRLF terminated string for the debug output (to avoid storing
+ * the terminators in RAM all the time). This doesn't wait, so if the queue
+ * is too full for the whole line then it is dropped.
  * @param string A char pointer to the string to transmit.
  */
 void uart_debug(char* string)
 {
-    if(strlen(string) >= UART_BUF_LEN)
-        uart_debug("[WARN] UART BUF_OVF");
-    _uart_tx(string);
-    _uart_tx("\r\n");
+    uint16_t gie = __read_status_register() & GIE;
+    uint16_t n = strlen(string);
+
+    __disable_interrupt();
+    if(rb_getfree_m(&txbuf) >= n + 2)
+    {
+        ringbuf_write(&txbuf, string, n);
+        ringbuf_write(&txbuf, "\r\n", 2);
+        _uart_start();
+    } else {
+        txbuf.overflow = 1;
+    }
+    __bis_SR_register(gie);
+}
+
+/**
+ * Queue up a block of binary data to be sent, all of it or none of it. This
+ * doesn't wait, and may be called from an ISR.
+ * @param data A pointer to the data to send.
+ * @param n The number of bytes to send.
+ * @returns 0 if the data was queued, or 1 if there wasn't room for it.
+ */
+uint8_t uart_write(char* data, uint16_t n)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    uint8_t full;
+
+    __disable_interrupt();
+    full = ringbuf_write(&txbuf, data, n);
+    if(!full)
+        _uart_start();
+    __bis_SR_register(gie);
+    return full;
+}
+
+/**
+ * Queue up a header and the data that goes with it, to be sent one straight
+ * after the other, all of it or none of it. This doesn't wait, and may be
+ * called from an ISR.
+ * @param head A pointer to the header.
+ * @param hn The number of bytes in the header.
+ * @param data A pointer to the data to send after it.
+ * @param n The number of bytes of data.
+ * @returns 0 if both were queued, or 1 if there wasn't room for them.
+ */
+uint8_t uart_write_pair(char* head, uint16_t hn, const char* data, uint16_t n)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    uint8_t full = 1;
+
+    __disable_interrupt();
+    if(rb_getfree_m(&txbuf) >= hn + n)
+    {
+        ringbuf_write(&txbuf, head, hn);
+        ringbuf_write(&txbuf, (char *)data, n);
+        _uart_start();
+        full = 0;
+    } else {
+        txbuf.overflow = 1;
+    }
+    __bis_SR_register(gie);
+    return full;
+}
+
+/**
+ * Wait until everything queued so far has been handed to the USCI, for when
+ * there is more to print than will fit in the queue (see profile_dump()).
+ * This busy-waits, and must be called with interrupts enabled.
+ */
+void uart_flush(void)
+{
+    while(rb_getused_m(&txbuf));
+}
+
+/**
+ * Get the last line received, if it has ended (with CR or LF) since the last
+ * call. Anything received before the line is picked up is lost.
+ * @param line Where to put the line, without its terminator, which must have
+ * room for UART_BUF_LEN characters.
+ * @returns The length of the line, or 0 if there isn't one.
+ */
+uint8_t uart_getline(char* line)
+{
+    uint8_t n;
+
+    if(!rxready)
+        return 0;
+    n = rxlen;
+    memcpy(line, rxline, n);
+    line[n] = '\0';
+    rxlen = 0;
+    rxready = 0;
+    return n;
+}
+
+/**
+ * Interrupt service routine for USCI_A1, which sends the next byte of the
+ * transmit queue each time the transmit buffer is empty. Reading UCA1IV
+ * clears UCTXIFG, so once the queue is empty it is set again for when
+ * _uart_start() next enables the interrupt.
+ *
+ * Received bytes are put into the line buffer, and the CPU is woken once the
+ * line has ended so that the foreground can pick it up. Lines too long for
+ * the buffer are cut short.
+ */
+interrupt(USCI_A1_VECTOR) USCI_A1_ISR(void)
+{
+    char c;
+
+    switch(UCA1IV)
+    {
+        case USCI_UCRXIFG:
+            c = UCA1RXBUF;
+            if(rxready)
+                break;
+            if(c == '\r' || c == '\n')
+            {
+                if(rxlen)
+                {
+                    rxready = 1;
+                    __bic_SR_register_on_exit(LPM0_bits);
+                }
+            } else if(rxlen < UART_BUF_LEN - 1) {
+                rxline[rxlen++] = c;
+            }
+            break;
+        case USCI_UCTXIFG:
+            if(rb_getused_m(&txbuf))
+            {
+                UCA1TXBUF = txbuf.buffer[txbuf.tail & txbuf.mask];
+                txbuf.tail++;
+            } else {
+                UCA1IE &= ~UCTXIE;
+                UCA1IFG |= UCTXIFG;
+            }
+            break;
+        default:
+            break;
+    }
 }
 
 /**
@@ -39,8 +39,46 @@
  */
 #define UART_BUF_LEN 50
 
+/**
+ * The baud rate, which is divided down from SMCLK (F_CPU) in oversampling
+ * mode. The divisor must be at least 16 and the rate it gives must be within
+ * 1% of this. The MCU can go faster than most USB serial adapters, so this is
+ * set for a common one rather than the 1.5M the USCI can manage at 25MHz.
+ */
+#ifndef UART_BAUD
+#define UART_BAUD 460800UL
+#endif
+
+/**
+ * The divisor from SMCLK to the baud rate, to the nearest whole number. In
+ * oversampling mode the top of this goes in UCBRx and the bottom 4 bits are
+ * the first stage modulation in UCBRFx.
+ */
+#define UART_DIV ((F_CPU + UART_BAUD / 2) / UART_BAUD)
+
+#if UART_DIV < 16
+#error "UART_BAUD is too high, SMCLK must be at least 16 times the baud rate"
+#endif
+#if (100 * F_CPU / UART_DIV > 101 * UART_BAUD) || \
+    (100 * F_CPU / UART_DIV < 99 * UART_BAUD)
+#error "UART_BAUD can't be made within 1% from F_CPU"
+#endif
+
+/**
+ * The length in bytes of the queue that is sent out from the UART interrupt,
+ * which must be a power of 2. It is shared by the debug output and the
+ * telemetry (see telemetry.c), and anything that doesn't fit is dropped.
+ */
+#ifndef UART_TXBUF_LEN
+#define UART_TXBUF_LEN 512
+#endif
+
 void uart_init(void);
 void uart_debug(char* string);
+uint8_t uart_write(char* data, uint16_t n);
+uint8_t uart_write_pair(char* head, uint16_t hn, const char* data, uint16_t n);
+uint8_t uart_getline(char* line);
+void uart_flush(void);
 
 #endif /* __UART_H__ */
 
@@ -0,0 +1,977 @@
+/**
+ * Offloads the SD card over USB, as a mass storage device, so that the data
+ * files can be copied off at USB speeds without taking the card out.
+ *
+ * The logger calls usb_offload() when it's plugged into a host whilst not
+ * logging (see start_logger()), and the card is then the host's until the
+ * logger is unplugged, the host ejects it, or S1 is pressed to start logging
+ * again (which gives up the command in progress, see usb_poll()). Logging
+ * only starts once the USB module has been stopped. The host sees a single logical unit speaking the SCSI transparent
+ * command set over the bulk only transport, whose sectors are read and
+ * written through disk_read() and disk_write() in mmc.c, so FatFs must let go
+ * of the card first. The host should eject the card before S1 is pressed,
+ * since it may still have writes cached.
+ *
+ * This is a small driver for the USB module of the F5529 rather than TI's USB
+ * developers package. There is nothing else for the CPU to do, so it polls
+ * the module with its interrupts left disabled, seeing to control requests
+ * on endpoint 0 whilst it waits for the bulk endpoints (endpoint 1 in each
+ * direction). The 48MHz USB clock comes from the PLL, running from the 4MHz
+ * XT2 crystal that the system clock already uses (see sys_clock_init()).
+ *
+ * The USB module's buffers and endpoint configuration are in the USB RAM,
+ * which is ordinary RAM to the rest of the logger and holds the start of the
+ * SD ring buffer (see memory.x). It is lent to the USB module only whilst
+ * logging is stopped, and the sector being transferred is kept there too.
+ *
+ * @file usb.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup USB
+ * @{
+ */
+
+#include <msp430.h>
+#include <msp430f5529.h>
+#include <string.h>
+
+#include "usb.h"
+#include "diskio.h"
+#include "mmc.h"
+#include "system.h"
+
+#if USB_OFFLOAD
+
+/**
+ * Bits in the configuration and byte count of each endpoint
+ */
+#define EPCNF_USBIE     0x04
+#define EPCNF_STALL     0x08
+#define EPCNF_TOGGLE    0x20
+#define EPCNF_UBME      0x80
+#define EPBCNT_NAK      0x80
+
+/**
+ * @struct UsbEdb
+ * @brief The configuration of endpoints 1-7 in the USB RAM. Only the X buffer
+ * is used.
+ */
+typedef struct UsbEdb
+{
+    uint8_t cnf;
+    uint8_t bbax;
+    uint8_t bctx;
+    uint8_t spare[2];
+    uint8_t bbay;
+    uint8_t bcty;
+    uint8_t sizxy;
+} UsbEdb;
+
+/**
+ * The layout of the USB RAM, the fixed parts are from the USB buffer memory
+ * map in the family user's guide, and the rest is ours to lay out
+ */
+#define USB_RAM         0x1C00
+#define EP0_OUT_BUF     ((volatile uint8_t *)0x2370)
+#define EP0_IN_BUF      ((volatile uint8_t *)0x2378)
+#define SETUP_BLOCK     ((volatile uint8_t *)0x2380)
+#define OEP1            ((volatile UsbEdb *)0x2388)
+#define IEP1            ((volatile UsbEdb *)0x23C8)
+#define EP1_OUT_ADDR    0x1C00
+#define EP1_IN_ADDR     0x1C40
+#define SECTOR_ADDR     0x1C80
+
+#define EP1_OUT_BUF     ((volatile uint8_t *)EP1_OUT_ADDR)
+#define EP1_IN_BUF      ((volatile uint8_t *)EP1_IN_ADDR)
+#define SECTOR_BUF      ((uint8_t *)SECTOR_ADDR)
+
+/**
+ * The largest packets on endpoint 0 and on the bulk endpoints
+ */
+#define EP0_SIZE        8
+#define EP1_SIZE        64
+
+/**
+ * The value of USBKEYPID that locks the USB configuration registers again
+ */
+#define USBKEY_LOCK     0x9600
+
+/**
+ * The signatures of the command block wrapper and command status wrapper of
+ * the bulk only transport, and the status in the latter
+ */
+#define CBW_SIGNATURE   0x43425355UL
+#define CSW_SIGNATURE   0x53425355UL
+#define CSW_PASSED      0x00
+#define CSW_FAILED      0x01
+
+/**
+ * The result of a command that was cut short by a bus reset, a bulk only
+ * reset or the logger being unplugged, which gets no status
+ */
+#define CMD_ABORTED     0xFF
+
+/**
+ * SCSI sense keys and additional sense codes, the latter with their
+ * qualifier in the low byte
+ */
+#define SENSE_NONE              0x00
+#define SENSE_NOT_READY         0x02
+#define SENSE_MEDIUM_ERROR      0x03
+#define SENSE_ILLEGAL_REQUEST   0x05
+#define SENSE_DATA_PROTECT      0x07
+#define ASC_NONE                0x0000
+#define ASC_READ_ERROR          0x1100
+#define ASC_WRITE_ERROR         0x0C00
+#define ASC_INVALID_COMMAND     0x2000
+#define ASC_LBA_OUT_OF_RANGE    0x2100
+#define ASC_WRITE_PROTECTED     0x2700
+#define ASC_NO_MEDIUM           0x3A00
+
+static const uint8_t device_desc[] = {
+    18, 0x01,                       // Device descriptor
+    0x00, 0x02,                     // USB 2.0
+    0x00, 0x00, 0x00,               // Class is given by the interface
+    EP0_SIZE,
+    USB_VID & 0xFF, USB_VID >> 8,
+    USB_PID & 0xFF, USB_PID >> 8,
+    0x00, 0x01,                     // Device release 1.00
+    1, 2, 3,                        // Manufacturer, product, serial strings
+    1                               // One configuration
+};
+
+static const uint8_t config_desc[] = {
+    9, 0x02,                        // Configuration descriptor
+    32, 0,                          // Total length of all four descriptors
+    1, 1, 0,                        // One interface, configuration 1
+    0x80, 50,                       // Bus powered, up to 100mA
+    9, 0x04,                        // Interface descriptor
+    0, 0, 2,                        // Interface 0 with two endpoints
+    0x08, 0x06, 0x50,               // Mass storage, SCSI, bulk only
+    0,
+    7, 0x05,                        // Endpoint descriptor
+    0x01, 0x02, EP1_SIZE, 0, 0,     // Endpoint 1 OUT, bulk
+    7, 0x05,                        // Endpoint descriptor
+    0x81, 0x02, EP1_SIZE, 0, 0      // Endpoint 1 IN, bulk
+};
+
+static const char *const strings[] = {
+    "University of Southampton",
+    "EV Logger",
+};
+
+/// The response to INQUIRY: a removable direct access device
+static const uint8_t inquiry[36] = {
+    0x00, 0x80, 0x04, 0x02, 31, 0, 0, 0,
+    'E', 'V', 'L', 'o', 'g', 'g', 'e', 'r',
+    'S', 'D', ' ', 'C', 'a', 'r', 'd', ' ',
+    'O', 'f', 'f', 'l', 'o', 'a', 'd', ' ',
+    '1', '.', '0', '0'
+};
+
+/// Set once the host has selected the configuration
+static uint8_t configured;
+
+/// Set when a bus reset or bulk only reset cuts the current command short
+static uint8_t aborted;
+
+/// Set once the host has ejected the card
+static uint8_t ejected;
+
+/// The rest of the data stage of a control read on endpoint 0
+static const uint8_t *ep0_data;
+static uint16_t ep0_left;
+static uint8_t ep0_zlp, ep0_busy;
+
+/// Room for a string descriptor or a status to be sent on endpoint 0
+static uint8_t ep0_buf[2 + 2 * 32];
+
+/// The sense data for the last command that failed
+static uint8_t sense_key;
+static uint16_t sense_asc;
+
+/// The number of sectors on the card
+static DWORD sectors;
+
+/// What's left of the data stage of the current command, in bytes, and
+/// whether a short packet has already ended it
+static uint32_t residue;
+static uint8_t short_sent;
+
+/// The flag to stop at, see usb_offload()
+static volatile uint8_t *stop_at;
+
+static void usb_enable(void);
+static void usb_disable(void);
+static void usb_reset(void);
+static uint8_t usb_poll(void);
+static void ep0_setup(void);
+static void ep0_send(void);
+static void msc_command(void);
+static uint8_t msc_scsi(const uint8_t *cb, uint8_t dir_in);
+
+/**
+ * Check whether the logger is plugged into a host, that is whether there is
+ * a voltage on VBUS.
+ *
+ * @returns Non-zero if VBUS is present.
+ */
+uint8_t usb_vbus(void)
+{
+    return (USBPWRCTL & USBBGVBV) ? 1 : 0;
+}
+
+/**
+ * Offload the SD card to the host over USB, until the logger is unplugged,
+ * the host ejects the card or stop becomes non-zero (which is checked whilst
+ * waiting on the host, so that the command in progress is given up rather
+ * than finished). FatFs must not be using the card, and the SD ring buffer,
+ * whose memory is used by the USB module, must not be in use until this has
+ * returned.
+ *
+ * @param stop A flag to stop at, which may be set from an ISR.
+ */
+void usb_offload(volatile uint8_t *stop)
+{
+    stop_at = stop;
+    sense_key = SENSE_NONE;
+    sense_asc = ASC_NONE;
+    ejected = 0;
+    if(((disk_status(0) & STA_NOINIT) && disk_initialize(0))
+            || disk_ioctl(0, GET_SECTOR_COUNT, &sectors) != RES_OK)
+        sectors = 0;
+
+    usb_enable();
+    while(usb_vbus() && !ejected && !*stop)
+        msc_command();
+    usb_disable();
+
+    // Don't leave the card in the middle of a multiple block write
+    disk_ioctl(0, CTRL_SYNC, NULL);
+}
+
+/**
+ * Power up the USB module, start the PLL and connect to the host.
+ */
+static void usb_enable(void)
+{
+    USBKEYPID = USBKEY;
+
+    // Power the PHY from VBUS and hand it the PU.0 and PU.1 pins
+    USBPWRCTL |= VUSBEN | SLDOEN;
+    _delay_ms(2);
+    USBPHYCTL = PUSEL;
+
+    // Run the PLL from the 4MHz XT2 and wait for it to lock, that is until
+    // it stops flagging that it's out of lock
+    USBPLLDIVB = USBPLL_SETCLK_4_0;
+    USBPLLCTL = UPFDEN | UPLLEN;
+    do
+    {
+        USBPLLIR = 0;
+        _delay_ms(1);
+    } while(USBPLLIR);
+
+    USBCNF |= USB_EN;
+    usb_reset();
+
+    // Pull D+ up to tell the host that we're here
+    USBCNF |= PUR_EN;
+    USBKEYPID = USBKEY_LOCK;
+}
+
+/**
+ * Disconnect from the host and stop the USB module.
+ */
+static void usb_disable(void)
+{
+    USBKEYPID = USBKEY;
+    USBCNF &= ~PUR_EN;
+    USBCNF &= ~USB_EN;
+    USBPLLCTL &= ~UPLLEN;
+    USBKEYPID = USBKEY_LOCK;
+    configured = 0;
+}
+
+/**
+ * Go back to the default state after a bus reset: address 0, with only
+ * endpoint 0 enabled.
+ */
+static void usb_reset(void)
+{
+    USBCTL = 0;
+    USBFUNADR = 0;
+    configured = 0;
+    aborted = 1;
+    ep0_busy = 0;
+
+    USBIEPCNF_0 = EPCNF_UBME | EPCNF_USBIE;
+    USBOEPCNF_0 = EPCNF_UBME | EPCNF_USBIE;
+    USBIEPCNT_0 = EPBCNT_NAK;
+    USBOEPCNT_0 = EPBCNT_NAK;
+    IEP1->cnf = 0;
+    OEP1->cnf = 0;
+
+    USBIFG = 0;
+    USBCTL = FEN;
+}
+
+/**
+ * Set up endpoint 1 in each direction for the bulk only transport, with the
+ * OUT endpoint ready for a packet and the IN endpoint empty.
+ */
+static void ep1_init(void)
+{
+    OEP1->bbax = (EP1_OUT_ADDR - USB_RAM) >> 3;
+    OEP1->bctx = 0;
+    OEP1->sizxy = EP1_SIZE;
+    OEP1->cnf = EPCNF_UBME;
+
+    IEP1->bbax = (EP1_IN_ADDR - USB_RAM) >> 3;
+    IEP1->bctx = EPBCNT_NAK;
+    IEP1->sizxy = EP1_SIZE;
+    IEP1->cnf = EPCNF_UBME;
+}
+
+/**
+ * See to the USB module once, handling any bus reset or control request.
+ * This is called whilst waiting on the bulk endpoints.
+ *
+ * @returns Non-zero if the current command is to be given up, since the
+ * host has reset the bus or the transport, the logger has been unplugged or
+ * we've been asked to stop (see usb_offload()).
+ */
+static uint8_t usb_poll(void)
+{
+    if(USBIFG & RSTRIFG)
+        usb_reset();
+    if(USBIFG & SETUPIFG)
+        ep0_setup();
+
+    // Carry on the data stage of a control read once each packet has gone
+    if(ep0_busy && (USBIEPCNT_0 & EPBCNT_NAK))
+        ep0_send();
+
+    if(!usb_vbus() || *stop_at)
+        aborted = 1;
+    return aborted || !configured;
+}
+
+/**
+ * Start the data stage of a control read on endpoint 0, which is sent from
+ * usb_poll() a packet at a time.
+ *
+ * @param data The data to send, which must stay put until it has gone.
+ * @param len The length of the data.
+ * @param max The most that the host asked for.
+ */
+static void ep0_reply(const uint8_t *data, uint16_t len, uint16_t max)
+{
+    if(len > max)
+        len = max;
+    ep0_data = data;
+    ep0_left = len;
+    // A transfer that is shorter than asked for must end in a short packet
+    ep0_zlp = len < max && !(len % EP0_SIZE);
+    ep0_busy = 1;
+
+    // Be ready for the status stage whenever the host moves on to it
+    USBOEPCNT_0 = 0;
+    ep0_send();
+}
+
+/**
+ * Send the next packet of a control read.
+ */
+static void ep0_send(void)
+{
+    uint8_t i, n;
+
+    if(!ep0_left && !ep0_zlp)
+    {
+        ep0_busy = 0;
+        return;
+    }
+
+    n = ep0_left < EP0_SIZE ? ep0_left : EP0_SIZE;
+    for(i = 0; i < n; i++)
+        EP0_IN_BUF[i] = *ep0_data++;
+    ep0_left -= n;
+    if(n < EP0_SIZE)
+        ep0_zlp = 0;
+    USBIEPCNT_0 = n;
+}
+
+/**
+ * Finish a control request that has no data stage, with an empty packet.
+ */
+static void ep0_ack(void)
+{
+    USBIEPCNT_0 = 0;
+}
+
+/**
+ * Refuse a control request.
+ */
+static void ep0_stall(void)
+{
+    USBIEPCNF_0 |= EPCNF_STALL;
+    USBOEPCNF_0 |= EPCNF_STALL;
+}
+
+/**
+ * Get the configuration of a bulk endpoint by its address.
+ *
+ * @returns The configuration, or NULL if there is no such endpoint.
+ */
+static volatile UsbEdb *ep_get(uint8_t addr)
+{
+    if(addr == 0x81)
+        return IEP1;
+    if(addr == 0x01)
+        return OEP1;
+    return NULL;
+}
+
+/**
+ * Make a string descriptor in ep0_buf.
+ *
+ * @param idx The index of the string, 0 being the list of languages.
+ * @returns The length of the descriptor, or 0 if there is no such string.
+ */
+static uint8_t string_desc(uint8_t idx)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const uint8_t *tlv;
+    uint8_t i, n = 0;
+    const char *p;
+    char serial[17];
+
+    if(idx == 0)
+    {
+        // US English only
+        ep0_buf[2] = 0x09;
+        ep0_buf[3] = 0x04;
+        n = 1;
+    } else if(idx <= sizeof(strings) / sizeof(strings[0])) {
+        for(p = strings[idx - 1]; *p; p++, n++)
+        {
+            ep0_buf[2 + 2 * n] = *p;
+            ep0_buf[3 + 2 * n] = 0;
+        }
+    } else if(idx == 3) {
+        // The serial number is the lot, wafer and position of the die, from
+        // the die record in the device descriptor table, so each logger has
+        // its own
+        strcpy(serial, "000000000000");
+        for(tlv = (const uint8_t *)0x1A08; tlv < (const uint8_t *)0x1B00
+                && tlv[0] != 0xFF; tlv += 2 + tlv[1])
+        {
+            if(tlv[0] == 0x08 && tlv[1] >= 8)
+            {
+                for(i = 0; i < 8; i++)
+                {
+                    serial[2 * i] = hex[tlv[2 + i] >> 4];
+                    serial[2 * i + 1] = hex[tlv[2 + i] & 0x0F];
+                }
+                serial[16] = '\0';
+                break;
+            }
+        }
+        for(p = serial; *p; p++, n++)
+        {
+            ep0_buf[2 + 2 * n] = *p;
+            ep0_buf[3 + 2 * n] = 0;
+        }
+    } else {
+        return 0;
+    }
+
+    ep0_buf[0] = 2 + 2 * n;
+    ep0_buf[1] = 0x03;
+    return ep0_buf[0];
+}
+
+/**
+ * Handle a setup packet on endpoint 0, being one of the standard requests
+ * that a device must support or one of the two bulk only class requests.
+ */
+static void ep0_setup(void)
+{
+    volatile UsbEdb *ep;
+    uint8_t type, req, n;
+    uint16_t value, index, length;
+
+    type = SETUP_BLOCK[0];
+    req = SETUP_BLOCK[1];
+    value = SETUP_BLOCK[2] | (SETUP_BLOCK[3] << 8);
+    index = SETUP_BLOCK[4] | (SETUP_BLOCK[5] << 8);
+    length = SETUP_BLOCK[6] | (SETUP_BLOCK[7] << 8);
+
+    // A new request ends whatever the last one was doing
+    ep0_busy = 0;
+    USBIEPCNF_0 &= ~EPCNF_STALL;
+    USBOEPCNF_0 &= ~EPCNF_STALL;
+    if(type & 0x80)
+        USBCTL |= DIR;
+    else
+        USBCTL &= ~DIR;
+    USBIFG &= ~SETUPIFG;
+
+    if((type & 0x60) == 0x20)
+    {
+        // Mass storage class requests, to the interface
+        if(req == 0xFE && type == 0xA1)
+        {
+            // Get max LUN, there is only LUN 0
+            ep0_buf[0] = 0;
+            ep0_reply(ep0_buf, 1, length);
+        } else if(req == 0xFF && type == 0x21) {
+            // Bulk only mass storage reset, give up the current command and
+            // wait for the next
+            aborted = 1;
+            ep0_ack();
+        } else {
+            ep0_stall();
+        }
+        return;
+    }
+    if(type & 0x60)
+    {
+        ep0_stall();
+        return;
+    }
+
+    switch(req)
+    {
+        case 0x00:
+            // Get status, which is only ever the halt of an endpoint
+            ep0_buf[0] = ep0_buf[1] = 0;
+            ep = ep_get(index);
+            if((type & 0x1F) == 0x02 && ep && (ep->cnf & EPCNF_STALL))
+                ep0_buf[0] = 1;
+            ep0_reply(ep0_buf, 2, length);
+            break;
+        case 0x01:
+        case 0x03:
+            // Clear or set the halt of an endpoint, clearing it also resets
+            // its data toggle
+            ep = ep_get(index);
+            if((type & 0x1F) != 0x02 || value != 0 || !ep)
+            {
+                ep0_stall();
+                break;
+            }
+            if(req == 0x01)
+                ep->cnf &= ~(EPCNF_STALL | EPCNF_TOGGLE);
+            else
+                ep->cnf |= EPCNF_STALL;
+            ep0_ack();
+            break;
+        case 0x05:
+            // Set address, the module takes it on after the status stage
+            USBFUNADR = value & 0x7F;
+            ep0_ack();
+            break;
+        case 0x06:
+            // Get descriptor
+            switch(value >> 8)
+            {
+                case 0x01:
+                    ep0_reply(device_desc, sizeof(device_desc), length);
+                    break;
+                case 0x02:
+                    ep0_reply(config_desc, sizeof(config_desc), length);
+                    break;
+                case 0x03:
+                    n = string_desc(value & 0xFF);
+                    if(n)
+                        ep0_reply(ep0_buf, n, length);
+                    else
+                        ep0_stall();
+                    break;
+                default:
+                    ep0_stall();
+                    break;
+            }
+            break;
+        case 0x08:
+            // Get configuration
+            ep0_buf[0] = configured;
+            ep0_reply(ep0_buf, 1, length);
+            break;
+        case 0x09:
+            // Set configuration
+            if(value > 1)
+            {
+                ep0_stall();
+                break;
+            }
+            configured = value;
+            if(configured)
+                ep1_init();
+            else
+                IEP1->cnf = OEP1->cnf = 0;
+            aborted = 1;
+            ep0_ack();
+            break;
+        case 0x0A:
+            // Get interface, there are no alternate settings
+            ep0_buf[0] = 0;
+            ep0_reply(ep0_buf, 1, length);
+            break;
+        case 0x0B:
+            // Set interface
+            if(value)
+                ep0_stall();
+            else
+                ep0_ack();
+            break;
+        default:
+            ep0_stall();
+            break;
+    }
+}
+
+/**
+ * Send a packet to the host on the bulk IN endpoint, once the last one has
+ * gone (and the endpoint isn't halted).
+ *
+ * @returns 0 for success, non-0 if the command was given up.
+ */
+static uint8_t bulk_send(const uint8_t *data, uint8_t n)
+{
+    uint8_t i;
+
+    // Give up as soon as we're asked to stop, even if the host is keeping up
+    // and we would never have to wait for it
+    if(*stop_at)
+        return 1;
+    while(!(IEP1->bctx & EPBCNT_NAK) || (IEP1->cnf & EPCNF_STALL))
+        if(usb_poll())
+            return 1;
+    for(i = 0; i < n; i++)
+        EP1_IN_BUF[i] = data[i];
+    IEP1->bctx = n;
+    return 0;
+}
+
+/**
+ * Receive a packet from the host on the bulk OUT endpoint.
+ *
+ * @param data Room for EP1_SIZE bytes.
+ * @param n Set to the length of the packet.
+ * @returns 0 for success, non-0 if the command was given up.
+ */
+static uint8_t bulk_recv(uint8_t *data, uint8_t *n)
+{
+    uint8_t i;
+
+    // As for bulk_send()
+    if(*stop_at)
+        return 1;
+    while(!(OEP1->bctx & EPBCNT_NAK))
+        if(usb_poll())
+            return 1;
+    *n = OEP1->bctx & 0x7F;
+    for(i = 0; i < *n; i++)
+        data[i] = EP1_OUT_BUF[i];
+    OEP1->bctx = 0;
+    return 0;
+}
+
+/**
+ * Send data to the host in the data stage of a command, up to what it asked
+ * for.
+ *
+ * @returns 0 for success, non-0 if the command was given up.
+ */
+static uint8_t msc_in(const uint8_t *data, uint16_t len)
+{
+    uint8_t n;
+
+    if(len > residue)
+        len = residue;
+    while(len)
+    {
+        n = len < EP1_SIZE ? len : EP1_SIZE;
+        if(bulk_send(data, n))
+            return 1;
+        if(n < EP1_SIZE)
+            short_sent = 1;
+        data += n;
+        len -= n;
+        residue -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receive data from the host in the data stage of a command.
+ *
+ * @returns 0 for success, non-0 if the command was given up.
+ */
+static uint8_t msc_out(uint8_t *data, uint16_t len)
+{
+    uint8_t n;
+
+    while(len && residue)
+    {
+        if(bulk_recv(data, &n))
+            return 1;
+        if(n > len)
+            n = len;
+        data += n;
+        len -= n;
+        residue -= n;
+    }
+    return 0;
+}
+
+/**
+ * Fail the current command, with the given sense data for REQUEST SENSE.
+ */
+static uint8_t msc_fail(uint8_t key, uint16_t asc)
+{
+    sense_key = key;
+    sense_asc = asc;
+    return CSW_FAILED;
+}
+
+/**
+ * Wait for the next command block wrapper from the host, carry out its
+ * command and send back the command status wrapper.
+ */
+static void msc_command(void)
+{
+    uint8_t cbw[EP1_SIZE], csw[13], n, status;
+    uint32_t length;
+
+    // Wait for a command, seeing to endpoint 0 in the meantime
+    while(!configured || !(OEP1->bctx & EPBCNT_NAK))
+    {
+        aborted = 0;
+        usb_poll();
+        if(!usb_vbus() || *stop_at)
+            return;
+    }
+    aborted = 0;
+    if(bulk_recv(cbw, &n))
+        return;
+
+    // A command that isn't valid can't be answered, so halt both endpoints
+    // until the host resets the transport
+    if(n != 31 || ((uint32_t)cbw[0] | ((uint32_t)cbw[1] << 8)
+                | ((uint32_t)cbw[2] << 16) | ((uint32_t)cbw[3] << 24))
+            != CBW_SIGNATURE || cbw[13] != 0)
+    {
+        IEP1->cnf |= EPCNF_STALL;
+        OEP1->cnf |= EPCNF_STALL;
+        return;
+    }
+
+    length = (uint32_t)cbw[8] | ((uint32_t)cbw[9] << 8)
+        | ((uint32_t)cbw[10] << 16) | ((uint32_t)cbw[11] << 24);
+    residue = length;
+    short_sent = 0;
+    status = msc_scsi(cbw + 15, cbw[12] & 0x80);
+    if(status == CMD_ABORTED)
+        return;
+
+    // Halt the endpoint if the data stage was cut short without the host
+    // knowing, it clears the halt and then reads the status
+    if(residue)
+    {
+        if(cbw[12] & 0x80)
+        {
+            if(!short_sent)
+                IEP1->cnf |= EPCNF_STALL;
+        } else {
+            OEP1->cnf |= EPCNF_STALL;
+        }
+    }
+
+    csw[0] = CSW_SIGNATURE & 0xFF;
+    csw[1] = (CSW_SIGNATURE >> 8) & 0xFF;
+    csw[2] = (CSW_SIGNATURE >> 16) & 0xFF;
+    csw[3] = CSW_SIGNATURE >> 24;
+    memcpy(csw + 4, cbw + 4, 4);
+    csw[8] = residue & 0xFF;
+    csw[9] = (residue >> 8) & 0xFF;
+    csw[10] = (residue >> 16) & 0xFF;
+    csw[11] = residue >> 24;
+    csw[12] = status;
+    bulk_send(csw, sizeof(csw));
+}
+
+/**
+ * Carry out a SCSI command, including its data stage.
+ *
+ * @param cb The command block.
+ * @param dir_in Non-zero if the host expects data from us.
+ * @returns CSW_PASSED or CSW_FAILED, or CMD_ABORTED if the command was given
+ * up.
+ */
+static uint8_t msc_scsi(const uint8_t *cb, uint8_t dir_in)
+{
+    uint8_t buf[18];
+    uint32_t lba, last;
+    uint16_t count;
+    uint8_t n, err = 0;
+    BYTE stream;
+
+    // Anything that needs the card fails if there isn't one
+    if(cb[0] != 0x12 && cb[0] != 0x03 && (!detectCard() || !sectors))
+        return msc_fail(SENSE_NOT_READY, ASC_NO_MEDIUM);
+
+    lba = ((uint32_t)cb[2] << 24) | ((uint32_t)cb[3] << 16)
+        | ((uint32_t)cb[4] << 8) | cb[5];
+    count = (cb[7] << 8) | cb[8];
+
+    switch(cb[0])
+    {
+        case 0x00:
+            // TEST UNIT READY
+            break;
+        case 0x03:
+            // REQUEST SENSE, in the fixed format
+            memset(buf, 0, sizeof(buf));
+            buf[0] = 0x70;
+            buf[2] = sense_key;
+            buf[7] = 10;
+            buf[12] = sense_asc >> 8;
+            buf[13] = sense_asc & 0xFF;
+            sense_key = SENSE_NONE;
+            sense_asc = ASC_NONE;
+            if(msc_in(buf, cb[4] < sizeof(buf) ? cb[4] : sizeof(buf)))
+                return CMD_ABORTED;
+            return CSW_PASSED;
+        case 0x12:
+            // INQUIRY
+            if(msc_in(inquiry, cb[4] < sizeof(inquiry) ? cb[4] :
+                        sizeof(inquiry)))
+                return CMD_ABORTED;
+            break;
+        case 0x1A:
+        case 0x5A:
+            // MODE SENSE (6) and (10), with no pages, just whether the card
+            // can be written
+            memset(buf, 0, 8);
+            if(cb[0] == 0x1A)
+            {
+                buf[0] = 3;
+                buf[2] = USB_WRITABLE ? 0x00 : 0x80;
+                n = 4;
+            } else {
+                buf[1] = 6;
+                buf[3] = USB_WRITABLE ? 0x00 : 0x80;
+                n = 8;
+            }
+            if(msc_in(buf, n))
+                return CMD_ABORTED;
+            break;
+        case 0x1B:
+            // START STOP UNIT, the host ejects the card by stopping it
+            if((cb[4] & 0x03) == 0x02)
+                ejected = 1;
+            break;
+        case 0x1E:
+            // PREVENT ALLOW MEDIUM REMOVAL, which we can't
+            break;
+        case 0x23:
+            // READ FORMAT CAPACITIES, as a formatted card
+            memset(buf, 0, 12);
+            buf[3] = 8;
+            buf[4] = sectors >> 24;
+            buf[5] = sectors >> 16;
+            buf[6] = sectors >> 8;
+            buf[7] = sectors;
+            buf[8] = 0x02;
+            buf[10] = 512 >> 8;
+            if(msc_in(buf, 12))
+                return CMD_ABORTED;
+            break;
+        case 0x25:
+            // READ CAPACITY (10): the last sector and the sector size
+            last = sectors - 1;
+            buf[0] = last >> 24;
+            buf[1] = last >> 16;
+            buf[2] = last >> 8;
+            buf[3] = last;
+            buf[4] = buf[5] = buf[7] = 0;
+            buf[6] = 512 >> 8;
+            if(msc_in(buf, 8))
+                return CMD_ABORTED;
+            break;
+        case 0x28:
+            // READ (10)
+            if(!dir_in)
+                return msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+            if(lba + count > sectors)
+                return msc_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+            while(count--)
+            {
+                if(disk_read(0, SECTOR_BUF, lba++, 1) != RES_OK)
+                    return msc_fail(SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+                if(msc_in(SECTOR_BUF, 512))
+                    return CMD_ABORTED;
+            }
+            break;
+        case 0x2A:
+            // WRITE (10), a run of sectors is written as one multiple block
+            // write (see CTRL_STREAM)
+            if(!USB_WRITABLE)
+                return msc_fail(SENSE_DATA_PROTECT, ASC_WRITE_PROTECTED);
+            if(dir_in)
+                return msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+            if(lba + count > sectors)
+                return msc_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+            stream = 1;
+            disk_ioctl(0, CTRL_STREAM, &stream);
+            while(count--)
+            {
+                if(msc_out(SECTOR_BUF, 512))
+                {
+                    err = CMD_ABORTED;
+                    break;
+                }
+                if(disk_write(0, SECTOR_BUF, lba++, 1) != RES_OK)
+                {
+                    err = CSW_FAILED;
+                    break;
+                }
+            }
+            // Ending the multiple block write only sends the stop token, so
+            // wait for the card to finish programming and then ask it whether
+            // the sectors were written before the host is told that they were
+            stream = 0;
+            if(disk_ioctl(0, CTRL_STREAM, &stream) != RES_OK && !err)
+                err = CSW_FAILED;
+            if(disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK && !err)
+                err = CSW_FAILED;
+            if(disk_ioctl(0, CTRL_STATUS, NULL) != RES_OK && !err)
+                err = CSW_FAILED;
+            if(err == CMD_ABORTED)
+                return CMD_ABORTED;
+            if(err)
+                return msc_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+            break;
+        case 0x2F:
+            // VERIFY (10), there's nothing to check against
+            break;
+        case 0x35:
+            // SYNCHRONIZE CACHE (10)
+            if(disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK)
+                return msc_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+            break;
+        default:
+            return msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+    }
+    return CSW_PASSED;
+}
+
+#endif /* USB_OFFLOAD */
+
+/**
+ * @}
+ */
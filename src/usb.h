@@ -0,0 +1,60 @@
+/**
+ * USB header.
+ *
+ * @file usb.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup USB
+ * @{
+ */
+
+#ifndef __USB_H__
+#define __USB_H__
+
+#include "typedefs.h"
+#include "logger.h"
+
+/**
+ * Set non-zero to offload the SD card over USB as a mass storage device
+ * whenever the logger is plugged into a host and isn't logging (see usb.c).
+ */
+#ifndef USB_OFFLOAD
+#define USB_OFFLOAD 1
+#endif
+
+/**
+ * Set non-zero to let the host write to the card, such as to delete old
+ * sessions, or zero to make it read only.
+ */
+#ifndef USB_WRITABLE
+#define USB_WRITABLE 1
+#endif
+
+/**
+ * The vendor and product IDs. These are TI's IDs for the mass storage
+ * examples in its USB developers package, so a fleet should use its own.
+ */
+#ifndef USB_VID
+#define USB_VID 0x2047
+#endif
+#ifndef USB_PID
+#define USB_PID 0x0317
+#endif
+
+/**
+ * The USB module keeps its buffers in the USB RAM, which is the first 2K of
+ * the SD ring buffer (see memory.x), so it can only be lent to the USB module
+ * if it is entirely the ring buffer's and only whilst logging is stopped.
+ */
+#if USB_OFFLOAD && (SD_RINGBUF_LEN < 2048)
+#error "USB_OFFLOAD needs the USB RAM, so SD_RINGBUF_LEN must be at least 2048"
+#endif
+
+uint8_t usb_vbus(void);
+void usb_offload(volatile uint8_t *stop);
+
+#endif /* __USB_H__ */
+
+/**
+ * @}
+ */